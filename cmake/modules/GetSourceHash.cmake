@@ -0,0 +1,20 @@
+# CMake project that writes a hash of the sources in a directory to a header.
+#
+# Input variables:
+#   SOURCE_DIR  - The directory whose .cpp and .h files are hashed
+#   NAME        - The macro to define to the hash
+#   HEADER_FILE - The header file to write
+file(GLOB sources ${SOURCE_DIR}/*.cpp ${SOURCE_DIR}/*.h)
+list(SORT sources)
+set(hashes "")
+foreach(source ${sources})
+  get_filename_component(name ${source} NAME)
+  file(MD5 ${source} hash)
+  set(hashes "${hashes}${name} ${hash}\n")
+endforeach()
+string(MD5 hash "${hashes}")
+file(WRITE ${HEADER_FILE}.txt "#define ${NAME} \"${hash}\"\n")
+
+# Copy the file only if it has changed.
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different
+  ${HEADER_FILE}.txt ${HEADER_FILE})
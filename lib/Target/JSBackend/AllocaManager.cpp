@@ -11,12 +11,14 @@
 //
 // The AllocaManager computes a frame layout, assigning every static alloca an
 // offset. It does alloca liveness analysis in order to reuse stack memory,
-// using lifetime intrinsics.
+// using lifetime intrinsics. Allocas whose live ranges do not overlap may be
+// given overlapping frame offsets, in whole or in part.
 //
 //===----------------------------------------------------------------------===//
 
 #define DEBUG_TYPE "allocamanager"
 #include "AllocaManager.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/IntrinsicInst.h"
@@ -29,6 +31,20 @@
 using namespace llvm;
 
 STATISTIC(NumAllocas, "Number of allocas eliminated");
+STATISTIC(NumFrameBytes, "Number of bytes in static stack frames");
+STATISTIC(NumFrameBytesSaved, "Number of stack frame bytes saved by sharing");
+
+// Place larger allocas first, as they are the hardest to fit into gaps, and
+// the more aligned ones first among those of a size.
+int AllocaManager::PackSort(const PackItem *l, const PackItem *r) {
+  if (l->Size > r->Size) return -1;
+  if (l->Size < r->Size) return 1;
+  if (l->Alignment > r->Alignment) return -1;
+  if (l->Alignment < r->Alignment) return 1;
+  if (l->Index < r->Index) return -1;
+  if (l->Index > r->Index) return 1;
+  return 0;
+}
 
 // Return the size of the given alloca.
 uint64_t AllocaManager::getSize(const AllocaInst *AI) {
@@ -96,6 +112,22 @@ int AllocaManager::AllocaSort(const AllocaInfo *li, const AllocaInfo *ri) {
   return 0;
 }
 
+// Return the alignment to give the given alloca in the frame.
+uint64_t AllocaManager::getFrameAlignment(const AllocaInfo &Info) {
+  uint64_t Alignment = Info.getAlignment();
+
+  // For backwards compatibility, align every power-of-two multiple alloca to
+  // its greatest power-of-two factor, up to 8 bytes. In particular, cube2hash
+  // is known to depend on this.
+  // TODO: Consider disabling this and making people fix their code.
+  if (uint64_t Size = Info.getSize()) {
+    uint64_t P2 = uint64_t(1) << countTrailingZeros(Size);
+    Alignment = std::max(Alignment, std::min(P2, uint64_t(8)));
+  }
+
+  return Alignment;
+}
+
 // Collect allocas
 void AllocaManager::collectMarkedAllocas() {
   NamedRegionTimer Timer("Collect Marked Allocas", "AllocaManager",
@@ -283,7 +315,10 @@ void AllocaManager::computeInterBlockLiveness() {
   }
 }
 
-// Determine overlapping liveranges within blocks.
+// Determine overlapping liveranges within blocks. An alloca is live from the
+// start of a block it is live into, or from its lifetime start, until its
+// lifetime end or the end of the block, so two allocas conflict exactly when
+// one of them becomes live while the other is.
 void AllocaManager::computeIntraBlockLiveness() {
   NamedRegionTimer Timer("Compute intra-block liveness", "AllocaManager",
                          TimePassesIsEnabled);
@@ -292,7 +327,11 @@ void AllocaManager::computeIntraBlockLiveness() {
 
   BitVector Current(AllocaCount);
 
-  AllocaCompatibility.resize(AllocaCount, BitVector(AllocaCount, true));
+  AllocaConflicts.resize(AllocaCount);
+
+  // Blocks whose conflicts have been recorded. All the allocas live at the end
+  // of such a block conflict with each other already.
+  SmallPtrSet<const BasicBlock *, 32> Visited;
 
   for (Function::const_iterator I = F->begin(), E = F->end(); I != E; ++I) {
     const BasicBlock *BB = I;
@@ -300,8 +339,21 @@ void AllocaManager::computeIntraBlockLiveness() {
 
     Current = BLI.LiveIn;
 
-    for (int i = Current.find_first(); i >= 0; i = Current.find_next(i)) {
-      AllocaCompatibility[i].reset(Current);
+    // The allocas live into the block conflict with each other, but usually
+    // they were all live out of a predecessor too, and then we know.
+    bool Known = false;
+    for (const_pred_iterator PI = pred_begin(BB), PE = pred_end(BB);
+         PI != PE && !Known; ++PI) {
+      Known = Visited.count(*PI) &&
+              !Current.test(BlockLiveness[*PI].LiveOut);
+    }
+    if (!Known) {
+      for (int i = Current.find_first(); i >= 0; i = Current.find_next(i)) {
+        for (int j = Current.find_next(i); j >= 0; j = Current.find_next(j)) {
+          AllocaConflicts[i].push_back(j);
+          AllocaConflicts[j].push_back(i);
+        }
+      }
     }
 
     for (BasicBlock::const_iterator BI = BB->begin(), BE = BB->end();
@@ -313,11 +365,12 @@ void AllocaManager::computeIntraBlockLiveness() {
       if (Callee == LifetimeStart) {
         if (const AllocaInst *AI = getAllocaFromIntrinsic(CI)) {
           size_t AIndex = Allocas[AI];
+          // Starting again while live doesn't extend the live range.
+          if (Current.test(AIndex)) continue;
           // We conflict with everything else that's currently live.
-          AllocaCompatibility[AIndex].reset(Current);
-          // Everything else that's currently live conflicts with us.
           for (int i = Current.find_first(); i >= 0; i = Current.find_next(i)) {
-            AllocaCompatibility[i].reset(AIndex);
+            AllocaConflicts[i].push_back(AIndex);
+            AllocaConflicts[AIndex].push_back(i);
           }
           // We're now live.
           Current.set(AIndex);
@@ -330,71 +383,111 @@ void AllocaManager::computeIntraBlockLiveness() {
         }
       }
     }
+
+    Visited.insert(BB);
+  }
+
+  // The same two allocas may conflict in many blocks.
+  for (size_t i = 0; i != AllocaCount; ++i) {
+    SmallVectorImpl<unsigned> &Conflicts = AllocaConflicts[i];
+    array_pod_sort(Conflicts.begin(), Conflicts.end());
+    Conflicts.erase(std::unique(Conflicts.begin(), Conflicts.end()),
+                    Conflicts.end());
   }
 }
 
-// Decide which allocas will represent which other allocas, and if so what their
-// size and alignment will need to be.
-void AllocaManager::computeRepresentatives() {
-  NamedRegionTimer Timer("Compute Representatives", "AllocaManager",
-                         TimePassesIsEnabled);
+// Give the allocas with lifetime markers frame offsets of at least Base, one
+// at a time in the given order. Each is placed at the lowest offset where it
+// doesn't overlap any alloca already placed that it conflicts with, so an
+// alloca can share memory with part of a larger one, or with several smaller
+// ones. Return the end of the highest one.
+uint64_t AllocaManager::packAllocas(const PackOrder &Order, uint64_t Base,
+                                    SmallVectorImpl<uint64_t> &Offsets) {
+  size_t AllocaCount = AllocasByIndex.size();
+
+  Offsets.resize(AllocaCount);
+  BitVector Placed(AllocaCount);
+  SmallVector<std::pair<uint64_t, uint64_t>, 16> Taken;
+  uint64_t End = Base;
+
+  for (PackOrder::const_iterator I = Order.begin(), E = Order.end();
+       I != E; ++I) {
+    // Find the ranges of the frame we must stay out of, in order.
+    const SmallVectorImpl<unsigned> &Conflicts = AllocaConflicts[I->Index];
+    Taken.clear();
+    for (SmallVectorImpl<unsigned>::const_iterator CI = Conflicts.begin(),
+         CE = Conflicts.end(); CI != CE; ++CI) {
+      if (!Placed.test(*CI)) continue;
+      uint64_t Start = Offsets[*CI];
+      Taken.push_back(std::make_pair(Start,
+                                     Start + AllocasByIndex[*CI].getSize()));
+    }
+    array_pod_sort(Taken.begin(), Taken.end());
+
+    // Take the first gap that is big enough.
+    uint64_t Offset = RoundUpToAlignment(Base, I->Alignment);
+    for (SmallVectorImpl<std::pair<uint64_t, uint64_t> >::const_iterator
+         TI = Taken.begin(), TE = Taken.end(); TI != TE; ++TI) {
+      if (Offset + I->Size <= TI->first) break;
+      Offset = std::max(Offset, RoundUpToAlignment(TI->second, I->Alignment));
+    }
 
-  for (size_t i = 0, e = AllocasByIndex.size(); i != e; ++i) {
-    // If we've already represented this alloca with another, don't visit it.
-    if (AllocasByIndex[i].isForwarded()) continue;
-    if (i > size_t(INT_MAX)) continue;
+    Offsets[I->Index] = Offset;
+    Placed.set(I->Index);
+    End = std::max(End, Offset + I->Size);
+  }
 
-    // Find compatible allocas. This is a simple greedy algorithm.
-    for (int j = int(i); ; ) {
-      assert(j >= int(i));
-      j = AllocaCompatibility[i].find_next(j);
-      assert(j != int(i));
-      if (j < 0) break;
-      if (!AllocaCompatibility[j][i]) continue;
+  return End;
+}
 
-      DEBUG(dbgs() << "Allocas: "
-                      "Representing "
-                   << AllocasByIndex[j].getInst()->getName() << " "
-                      "with "
-                   << AllocasByIndex[i].getInst()->getName() << "\n");
-      ++NumAllocas;
+// Give each alloca with lifetime markers a frame offset of at least Base, and
+// return the end of the highest one. Largest first usually packs best, but
+// when allocas of similar sizes are live one after another, as in unrolled or
+// inlined code, going in program order does, so try both.
+uint64_t AllocaManager::computeMarkedOffsets(uint64_t Base) {
+  NamedRegionTimer Timer("Compute Marked Offsets", "AllocaManager",
+                         TimePassesIsEnabled);
 
-      assert(!AllocasByIndex[j].isForwarded());
+  size_t AllocaCount = AllocasByIndex.size();
 
-      AllocasByIndex[i].mergeSize(AllocasByIndex[j].getSize());
-      AllocasByIndex[i].mergeAlignment(AllocasByIndex[j].getAlignment());
-      AllocasByIndex[j].forward(i);
+  PackOrder Order;
+  Order.reserve(AllocaCount);
+  for (size_t i = 0; i != AllocaCount; ++i) {
+    PackItem Item;
+    Item.Size = AllocasByIndex[i].getSize();
+    Item.Alignment = getFrameAlignment(AllocasByIndex[i]);
+    Item.Index = i;
+    Order.push_back(Item);
+  }
 
-      AllocaCompatibility[i] &= AllocaCompatibility[j];
-      AllocaCompatibility[j].reset();
-    }
+  // AllocasByIndex is in entry block order, which is usually program order.
+  SmallVector<uint64_t, 32> InOrderOffsets;
+  uint64_t InOrderEnd = packAllocas(Order, Base, InOrderOffsets);
+
+  array_pod_sort(Order.begin(), Order.end(), PackSort);
+  uint64_t End = packAllocas(Order, Base, AllocaOffsets);
+
+  if (InOrderEnd < End) {
+    AllocaOffsets.swap(InOrderOffsets);
+    End = InOrderEnd;
   }
+  return End;
 }
 
 void AllocaManager::computeFrameOffsets() {
   NamedRegionTimer Timer("Compute Frame Offsets", "AllocaManager",
                          TimePassesIsEnabled);
 
-  // Walk through the entry block and collect all the allocas, including the
-  // ones with no lifetime markers that we haven't looked at yet. We walk in
-  // reverse order so that we can set the representative allocas as those that
-  // dominate the others as we go.
+  // Walk through the entry block and collect the allocas with no lifetime
+  // markers. They are live everywhere, so they go at the bottom of the frame,
+  // and the allocas with lifetime markers are packed in above them.
   const BasicBlock *EntryBB = &F->getEntryBlock();
   for (BasicBlock::const_iterator BI = EntryBB->begin(), BE = EntryBB->end();
        BI != BE; ++BI) {
     const AllocaInst *AI = dyn_cast<AllocaInst>(BI);
     if (!AI || !AI->isStaticAlloca()) continue;
 
-    AllocaMap::const_iterator I = Allocas.find(AI);
-    if (I != Allocas.end()) {
-      // An alloca with lifetime markers. Emit the record we've crafted for it,
-      // if we've chosen to keep it as a representative.
-      const AllocaInfo &Info = AllocasByIndex[I->second];
-      if (!Info.isForwarded()) {
-        SortedAllocas.push_back(Info);
-      }
-    } else {
-      // An alloca with no lifetime markers.
+    if (!Allocas.count(AI)) {
       SortedAllocas.push_back(getInfo(AI));
     }
   }
@@ -407,17 +500,8 @@ void AllocaManager::computeFrameOffsets() {
   for (SmallVectorImpl<AllocaInfo>::const_iterator I = SortedAllocas.begin(),
        E = SortedAllocas.end(); I != E; ++I) {
     const AllocaInfo &Info = *I;
-    uint64_t NewOffset = RoundUpToAlignment(CurrentOffset, Info.getAlignment());
-
-    // For backwards compatibility, align every power-of-two multiple alloca to
-    // its greatest power-of-two factor, up to 8 bytes. In particular, cube2hash
-    // is known to depend on this.
-    // TODO: Consider disabling this and making people fix their code.
-    if (uint64_t Size = Info.getSize()) {
-      uint64_t P2 = uint64_t(1) << countTrailingZeros(Size);
-      unsigned CompatAlign = unsigned(std::min(P2, uint64_t(8)));
-      NewOffset = RoundUpToAlignment(NewOffset, CompatAlign);
-    }
+    uint64_t NewOffset = RoundUpToAlignment(CurrentOffset,
+                                            getFrameAlignment(Info));
 
     const AllocaInst *AI = Info.getInst();
     StaticAllocas[AI] = StaticAllocation(AI, NewOffset);
@@ -425,33 +509,54 @@ void AllocaManager::computeFrameOffsets() {
     CurrentOffset = NewOffset + Info.getSize();
   }
 
-  // Add allocas that were represented by other allocas to the StaticAllocas map
-  // so that our clients can look them up.
-  for (unsigned i = 0, e = AllocasByIndex.size(); i != e; ++i) {
-    const AllocaInfo &Info = AllocasByIndex[i];
-    if (!Info.isForwarded()) continue;
-    size_t j = Info.getForwardedID();
-    assert(!AllocasByIndex[j].isForwarded());
-
-    StaticAllocaMap::const_iterator I =
-      StaticAllocas.find(AllocasByIndex[j].getInst());
-    assert(I != StaticAllocas.end());
-
-    std::pair<StaticAllocaMap::const_iterator, bool> Pair =
-      StaticAllocas.insert(std::make_pair(AllocasByIndex[i].getInst(),
-                                          I->second));
-    assert(Pair.second); (void)Pair;
+  // Note what the frame would take if nothing shared memory, for reporting.
+  uint64_t UnsharedOffset = CurrentOffset;
+  for (SmallVectorImpl<AllocaInfo>::const_iterator I = AllocasByIndex.begin(),
+       E = AllocasByIndex.end(); I != E; ++I) {
+    UnsharedOffset = RoundUpToAlignment(UnsharedOffset, getFrameAlignment(*I)) +
+                     I->getSize();
+  }
+
+  if (!AllocasByIndex.empty()) {
+    CurrentOffset = computeMarkedOffsets(CurrentOffset);
+
+    // Allocas given the same offset are all represented by the first of them
+    // in the entry block, which dominates the rest.
+    DenseMap<uint64_t, const AllocaInst *> Representatives;
+    for (size_t i = 0, e = AllocasByIndex.size(); i != e; ++i) {
+      const AllocaInst *AI = AllocasByIndex[i].getInst();
+      uint64_t Offset = AllocaOffsets[i];
+      const AllocaInst *Rep =
+        Representatives.insert(std::make_pair(Offset, AI)).first->second;
+      DEBUG(dbgs() << "Allocas: "
+                      "Placing "
+                   << AI->getName() << " "
+                      "at " << Offset << "\n");
+      if (Rep != AI) {
+        DEBUG(dbgs() << "Allocas: "
+                        "Representing "
+                     << AI->getName() << " "
+                        "with "
+                     << Rep->getName() << "\n");
+        ++NumAllocas;
+      }
+      StaticAllocas[AI] = StaticAllocation(Rep, Offset);
+    }
   }
 
   // Record the final frame size. Keep the stack pointer 16-byte aligned.
   FrameSize = CurrentOffset;
   FrameSize = RoundUpToAlignment(FrameSize, 16);
+  UnsharedFrameSize = RoundUpToAlignment(UnsharedOffset, 16);
+  NumFrameBytes += FrameSize;
+  NumFrameBytesSaved += UnsharedFrameSize - FrameSize;
 
   DEBUG(dbgs() << "Allocas: "
                   "Statically allocated frame size is " << FrameSize << "\n");
 }
 
-AllocaManager::AllocaManager() : MaxAlignment(0) {
+AllocaManager::AllocaManager()
+  : FrameSize(0), UnsharedFrameSize(0), MaxAlignment(0) {
 }
 
 void AllocaManager::analyze(const Function &Func, const DataLayout &Layout,
@@ -459,7 +564,8 @@ void AllocaManager::analyze(const Function &Func, const DataLayout &Layout,
   NamedRegionTimer Timer("AllocaManager", TimePassesIsEnabled);
   assert(Allocas.empty());
   assert(AllocasByIndex.empty());
-  assert(AllocaCompatibility.empty());
+  assert(AllocaConflicts.empty());
+  assert(AllocaOffsets.empty());
   assert(BlockLiveness.empty());
   assert(StaticAllocas.empty());
   assert(SortedAllocas.empty());
@@ -489,13 +595,12 @@ void AllocaManager::analyze(const Function &Func, const DataLayout &Layout,
       computeInterBlockLiveness();
       computeIntraBlockLiveness();
       BlockLiveness.clear();
-
-      computeRepresentatives();
-      AllocaCompatibility.clear();
     }
   }
 
   computeFrameOffsets();
+  AllocaConflicts.clear();
+  AllocaOffsets.clear();
   SortedAllocas.clear();
   Allocas.clear();
   AllocasByIndex.clear();
@@ -53,13 +53,7 @@ class AllocaManager {
   typedef DenseMap<const AllocaInst *, size_t> AllocaMap;
   AllocaMap Allocas;
 
-  // Information about an alloca. Note that the size and alignment may vary
-  // from what's in the actual AllocaInst when an alloca is also representing
-  // another with perhaps greater size and/or alignment needs.
-  //
-  // When an alloca is represented by another, its AllocaInfo is marked as
-  // "forwarded", at which point it no longer holds a size and alignment, but
-  // the index of the representative AllocaInfo.
+  // Information about an alloca.
   class AllocaInfo {
     const AllocaInst *Inst;
     uint64_t Size;
@@ -70,49 +64,34 @@ class AllocaManager {
       : Inst(I), Size(S), Alignment(A) {
       assert(I != NULL);
       assert(A != 0);
-      assert(!isForwarded());
-    }
-
-    bool isForwarded() const { return Alignment == 0; }
-
-    size_t getForwardedID() const {
-      assert(isForwarded());
-      return static_cast<size_t>(Size);
-    }
-
-    void forward(size_t i) {
-      assert(!isForwarded());
-      Alignment = 0;
-      Size = i;
-      assert(isForwarded());
-      assert(getForwardedID() == i);
     }
 
     const AllocaInst *getInst() const { return Inst; }
 
-    uint64_t getSize() const { assert(!isForwarded()); return Size; }
-    unsigned getAlignment() const { assert(!isForwarded()); return Alignment; }
-
-    void mergeSize(uint64_t S) {
-      assert(!isForwarded());
-      Size = std::max(Size, S);
-      assert(!isForwarded());
-    }
-    void mergeAlignment(unsigned A) {
-      assert(A != 0);
-      assert(!isForwarded());
-      Alignment = std::max(Alignment, A);
-      assert(!isForwarded());
-    }
+    uint64_t getSize() const { return Size; }
+    unsigned getAlignment() const { return Alignment; }
   };
   typedef SmallVector<AllocaInfo, 32> AllocaVec;
   AllocaVec AllocasByIndex;
 
-  // For each alloca, which allocas can it safely represent? Allocas are
-  // identified by AllocasByIndex index.
-  // TODO: Vector-of-vectors isn't the fastest data structure possible here.
-  typedef SmallVector<BitVector, 32> AllocaCompatibilityVec;
-  AllocaCompatibilityVec AllocaCompatibility;
+  // For each alloca, the allocas whose live ranges overlap its own, identified
+  // by AllocasByIndex index, sorted. Within a block a live range is an
+  // interval, so this is a union of interval graphs; it has an edge for each
+  // pair of allocas that are live at the same time somewhere, and no others.
+  typedef SmallVector<SmallVector<unsigned, 4>, 32> AllocaConflictVec;
+  AllocaConflictVec AllocaConflicts;
+
+  // The frame offset chosen for each alloca, by AllocasByIndex index.
+  SmallVector<uint64_t, 32> AllocaOffsets;
+
+  // An alloca with lifetime markers, in the order in which they are given
+  // frame offsets.
+  struct PackItem {
+    uint64_t Size;
+    uint64_t Alignment;
+    unsigned Index;
+  };
+  typedef SmallVector<PackItem, 32> PackOrder;
 
   // This is for allocas that will eventually be sorted.
   SmallVector<AllocaInfo, 32> SortedAllocas;
@@ -128,18 +107,23 @@ class AllocaManager {
   typedef DenseMap<const AllocaInst *, StaticAllocation> StaticAllocaMap;
   StaticAllocaMap StaticAllocas;
   uint64_t FrameSize;
+  uint64_t UnsharedFrameSize;
 
   uint64_t getSize(const AllocaInst *AI);
   unsigned getAlignment(const AllocaInst *AI);
   AllocaInfo getInfo(const AllocaInst *AI);
   const AllocaInst *getAllocaFromIntrinsic(const CallInst *CI);
   static int AllocaSort(const AllocaInfo *l, const AllocaInfo *r);
+  static int PackSort(const PackItem *l, const PackItem *r);
+  static uint64_t getFrameAlignment(const AllocaInfo &Info);
 
   void collectMarkedAllocas();
   void collectBlocks();
   void computeInterBlockLiveness();
   void computeIntraBlockLiveness();
-  void computeRepresentatives();
+  uint64_t packAllocas(const PackOrder &Order, uint64_t Base,
+                       SmallVectorImpl<uint64_t> &Offsets);
+  uint64_t computeMarkedOffsets(uint64_t Base);
   void computeFrameOffsets();
 
   unsigned MaxAlignment;
@@ -169,6 +153,9 @@ public:
   /// Return the total frame size for all static allocas and associated padding.
   uint64_t getFrameSize() const { return FrameSize; }
 
+  /// Return what the frame size would be if no allocas shared stack memory.
+  uint64_t getUnsharedFrameSize() const { return UnsharedFrameSize; }
+
   /// Return the largest alignment seen.
   unsigned getMaxAlignment() const { return MaxAlignment; }
 };
@@ -4,7 +4,7 @@
 //
 
 typedef std::string (JSWriter::*CallHandler)(const Instruction*, std::string Name, int NumArgs);
-typedef std::map<std::string, CallHandler> CallHandlerMap;
+typedef llvm::StringMap<CallHandler> CallHandlerMap;
 CallHandlerMap CallHandlers;
 
 // Definitions
@@ -14,12 +14,14 @@ unsigned getNumArgOperands(const Instruction *I) {
 }
 
 const Value *getActuallyCalledValue(const Instruction *I) {
+  if (ForcedCallee) return ForcedCallee;
   const Value *CV = ImmutableCallSite(I).getCalledValue();
 
   // if the called value is a bitcast of a function, then we just call it directly, properly
   // for example, extern void x() in C will turn into void x(...) in LLVM IR, then the IR bitcasts
   // it to the proper form right before the call. this both causes an unnecessary indirect
-  // call, and it is done with the wrong type. TODO: don't even put it into the function table
+  // call, and it is done with the wrong type. such a function is only put in the function
+  // table if its address is taken elsewhere
   if (const Function *F = dyn_cast<const Function>(CV->stripPointerCasts())) {
     CV = F;
   }
@@ -95,7 +97,7 @@ DEF_CALL_HANDLER(__default__, {
   if (Invoke) {
     // add first param
     if (F) {
-      text += utostr(getFunctionIndex(F)); // convert to function pointer
+      text += getFunctionIndexStr(F); // convert to function pointer
     } else {
       text += getValueAsCastStr(CV); // already a function pointer
     }
@@ -158,11 +160,22 @@ DEF_CALL_HANDLER(emscripten_landingpad, {
 DEF_CALL_HANDLER(emscripten_resume, {
   return "___resumeException(" + getValueAsCastStr(CI->getOperand(0)) + ")";
 })
+DEF_CALL_HANDLER(llvm_eh_typeid_for, {
+  // ___cxa_find_matching_catch returns the typeinfo of the matching clause
+  // as the selector, so the type id of a typeinfo is its address, and catch
+  // clauses can be told apart without leaving asm.js
+  return getAssign(CI) + getValueAsCastStr(CI->getOperand(0));
+})
 
 // setjmp support
 
 DEF_CALL_HANDLER(emscripten_prep_setjmp, {
-  return getAdHocAssign("_setjmpTable", Type::getInt32Ty(CI->getContext())) + "STACKTOP; " + getStackBump(4 * 2 * (MaxSetjmps+1)) +
+  // the table has room for as many setjmps as LowerEmSetjmp says, plus an end marker
+  unsigned Size = MaxSetjmps;
+  if (CI->getNumOperands() > 1) { // the last operand is the callee
+    if (unsigned Known = cast<ConstantInt>(CI->getOperand(0))->getZExtValue()) Size = Known;
+  }
+  return getAdHocAssign("_setjmpTable", Type::getInt32Ty(CI->getContext())) + "STACKTOP; " + getStackBump(4 * 2 * (Size+1)) +
          "HEAP32[_setjmpTable>>2]=0";
 })
 DEF_CALL_HANDLER(emscripten_setjmp, {
@@ -282,48 +295,74 @@ DEF_CALL_HANDLER(llvm_nacl_atomic_store_i32, {
 
 #define UNROLL_LOOP_MAX 8
 #define WRITE_LOOP_MAX 128
+#define COPY_BIG_MIN 4096 // from this size on, a native HEAPU8.set() copy beats a loop (see emscripten_memcpy_big)
+
+// Inline code for copying Len bytes from the memcpy or memmove CI, in units of
+// up to Align bytes, front to back, or back to front if Backward. Going back
+// to front is only done unrolled; when that is too long, returns "".
+std::string getMemcpyCode(const Instruction *CI, unsigned Len, unsigned Align, bool Backward) {
+  if (Align > 4) Align = 4;
+  else if (Align == 0) Align = 1; // align 0 means 1 in memcpy and memset (unlike other places where it means 'default/4')
+  if (Align == 1 && Len > 1 && WarnOnUnaligned) {
+    errs() << "emcc: warning: unaligned memcpy in  " << CI->getParent()->getParent()->getName() << ":" << *CI << " (compiler's fault?)\n";
+  }
+  unsigned Pos = 0;
+  std::vector<std::string> Parts;
+  std::string Dest = getValueAsStr(CI->getOperand(0));
+  std::string Src = getValueAsStr(CI->getOperand(1));
+  while (Len > 0) {
+    // handle as much as we can in the current alignment
+    unsigned CurrLen = Align*(Len/Align);
+    unsigned Factor = CurrLen/Align;
+    if (Factor <= UNROLL_LOOP_MAX) {
+      // unroll
+      for (unsigned Offset = 0; Offset < CurrLen; Offset += Align) {
+        std::string Add = "+" + utostr(Pos + Offset);
+        Parts.push_back(";" + getHeapAccess(Dest + Add, Align) + "=" + getHeapAccess(Src + Add, Align) + "|0");
+      }
+    } else {
+      if (Backward) return "";
+      // emit a loop
+      UsedVars["dest"] = UsedVars["src"] = UsedVars["stop"] = Type::getInt32Ty(TheModule->getContext());
+      Parts.push_back("dest=" + Dest + "+" + utostr(Pos) + "|0; src=" + Src + "+" + utostr(Pos) + "|0; stop=dest+" + utostr(CurrLen) + "|0; do { " + getHeapAccess("dest", Align) + "=" + getHeapAccess("src", Align) + "|0; dest=dest+" + utostr(Align) + "|0; src=src+" + utostr(Align) + "|0; } while ((dest|0) < (stop|0))");
+    }
+    Pos += CurrLen;
+    Len -= CurrLen;
+    Align /= 2;
+  }
+  if (Backward) std::reverse(Parts.begin(), Parts.end());
+  std::string Ret;
+  for (unsigned i = 0; i < Parts.size(); i++) Ret += Parts[i];
+  return Ret;
+}
+
+// Whether a memmove from Src to Dest can copy front to back, that is, the
+// two do not overlap, or Dest is below Src. Sets Known to whether we know
+// either way.
+bool canMoveForward(const Value *Dest, const Value *Src, bool &Known) {
+  int64_t DestOffset, SrcOffset;
+  const Value *DestBase = GetPointerBaseWithConstantOffset(Dest, DestOffset, DL);
+  const Value *SrcBase = GetPointerBaseWithConstantOffset(Src, SrcOffset, DL);
+  Known = true;
+  if (DestBase == SrcBase) return DestOffset <= SrcOffset;
+  // distinct objects never overlap
+  if ((isa<AllocaInst>(DestBase) || isa<GlobalVariable>(DestBase)) &&
+      (isa<AllocaInst>(SrcBase) || isa<GlobalVariable>(SrcBase))) return true;
+  Known = false;
+  return false;
+}
 
 DEF_CALL_HANDLER(llvm_memcpy_p0i8_p0i8_i32, {
   if (CI) {
     ConstantInt *AlignInt = dyn_cast<ConstantInt>(CI->getOperand(3));
-    if (AlignInt) {
-      ConstantInt *LenInt = dyn_cast<ConstantInt>(CI->getOperand(2));
-      if (LenInt) {
-        // we can emit inline code for this
-        unsigned Len = LenInt->getZExtValue();
-        if (Len <= WRITE_LOOP_MAX) {
-          unsigned Align = AlignInt->getZExtValue();
-          if (Align > 4) Align = 4;
-          else if (Align == 0) Align = 1; // align 0 means 1 in memcpy and memset (unlike other places where it means 'default/4')
-          if (Align == 1 && Len > 1 && WarnOnUnaligned) {
-            errs() << "emcc: warning: unaligned memcpy in  " << CI->getParent()->getParent()->getName() << ":" << *CI << " (compiler's fault?)\n";
-          }
-          unsigned Pos = 0;
-          std::string Ret;
-          std::string Dest = getValueAsStr(CI->getOperand(0));
-          std::string Src = getValueAsStr(CI->getOperand(1));
-          while (Len > 0) {
-            // handle as much as we can in the current alignment
-            unsigned CurrLen = Align*(Len/Align);
-            unsigned Factor = CurrLen/Align;
-            if (Factor <= UNROLL_LOOP_MAX) {
-              // unroll
-              for (unsigned Offset = 0; Offset < CurrLen; Offset += Align) {
-                std::string Add = "+" + utostr(Pos + Offset);
-                Ret += ";" + getHeapAccess(Dest + Add, Align) + "=" + getHeapAccess(Src + Add, Align) + "|0";
-              }
-            } else {
-              // emit a loop
-              UsedVars["dest"] = UsedVars["src"] = UsedVars["stop"] = Type::getInt32Ty(TheModule->getContext());
-              Ret += "dest=" + Dest + "+" + utostr(Pos) + "|0; src=" + Src + "+" + utostr(Pos) + "|0; stop=dest+" + utostr(CurrLen) + "|0; do { " + getHeapAccess("dest", Align) + "=" + getHeapAccess("src", Align) + "|0; dest=dest+" + utostr(Align) + "|0; src=src+" + utostr(Align) + "|0; } while ((dest|0) < (stop|0))";
-            }
-            Pos += CurrLen;
-            Len -= CurrLen;
-            Align /= 2;
-          }
-          return Ret;
-        }
-      }
+    ConstantInt *LenInt = dyn_cast<ConstantInt>(CI->getOperand(2));
+    if (AlignInt && LenInt && LenInt->getZExtValue() <= WRITE_LOOP_MAX) {
+      // we can emit inline code for this
+      return getMemcpyCode(CI, LenInt->getZExtValue(), AlignInt->getZExtValue(), false);
+    }
+    if (LenInt && LenInt->getZExtValue() >= COPY_BIG_MIN) {
+      Declares.insert("emscripten_memcpy_big");
+      return CH___default__(CI, "_emscripten_memcpy_big", 3) + "|0";
     }
   }
   Declares.insert("memcpy");
@@ -381,11 +420,33 @@ DEF_CALL_HANDLER(llvm_memset_p0i8_i32, {
       }
     }
   }
+  // Unlike large copies (see COPY_BIG_MIN), large fills are left to _memset: it
+  // already stores 4 bytes at a time, so inlining a loop would only save the
+  // call, and there is no native fill to import (TypedArray.fill() is ES6 and
+  // not in the engines we target).
   Declares.insert("memset");
   return CH___default__(CI, "_memset", 3) + "|0";
 })
 
 DEF_CALL_HANDLER(llvm_memmove_p0i8_p0i8_i32, {
+  if (CI) {
+    ConstantInt *AlignInt = dyn_cast<ConstantInt>(CI->getOperand(3));
+    ConstantInt *LenInt = dyn_cast<ConstantInt>(CI->getOperand(2));
+    if (AlignInt && LenInt && LenInt->getZExtValue() <= WRITE_LOOP_MAX) {
+      // if we know which way the two overlap, we can copy in that direction inline
+      bool Known;
+      bool Forward = canMoveForward(CI->getOperand(0), CI->getOperand(1), Known);
+      if (Known) {
+        std::string Code = getMemcpyCode(CI, LenInt->getZExtValue(), AlignInt->getZExtValue(), !Forward);
+        if (!Code.empty()) return Code;
+      }
+    }
+    if (LenInt && LenInt->getZExtValue() >= COPY_BIG_MIN) {
+      // HEAPU8.set() copies correctly even when the two overlap
+      Declares.insert("emscripten_memcpy_big");
+      return CH___default__(CI, "_emscripten_memcpy_big", 3) + "|0";
+    }
+  }
   Declares.insert("memmove");
   return CH___default__(CI, "_memmove", 3) + "|0";
 })
@@ -541,6 +602,61 @@ DEF_BUILTIN_HANDLER(emscripten_int32x4_greaterThanOrEqual, SIMD_int32x4_greaterT
 DEF_BUILTIN_HANDLER(emscripten_int32x4_select, SIMD_int32x4_select);
 DEF_BUILTIN_HANDLER(emscripten_int32x4_fromFloat32x4Bits, SIMD_int32x4_fromFloat32x4Bits);
 DEF_BUILTIN_HANDLER(emscripten_int32x4_fromFloat32x4, SIMD_int32x4_fromFloat32x4);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_equal, SIMD_int8x16_equal);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_notEqual, SIMD_int8x16_notEqual);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_lessThan, SIMD_int8x16_lessThan);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_lessThanOrEqual, SIMD_int8x16_lessThanOrEqual);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_greaterThan, SIMD_int8x16_greaterThan);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_greaterThanOrEqual, SIMD_int8x16_greaterThanOrEqual);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_select, SIMD_int8x16_select);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_addSaturate, SIMD_int8x16_addSaturate);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_subSaturate, SIMD_int8x16_subSaturate);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_unsignedAddSaturate, SIMD_int8x16_unsignedAddSaturate);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_unsignedSubSaturate, SIMD_int8x16_unsignedSubSaturate);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_equal, SIMD_int16x8_equal);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_notEqual, SIMD_int16x8_notEqual);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_lessThan, SIMD_int16x8_lessThan);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_lessThanOrEqual, SIMD_int16x8_lessThanOrEqual);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_greaterThan, SIMD_int16x8_greaterThan);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_greaterThanOrEqual, SIMD_int16x8_greaterThanOrEqual);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_select, SIMD_int16x8_select);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_addSaturate, SIMD_int16x8_addSaturate);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_subSaturate, SIMD_int16x8_subSaturate);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_unsignedAddSaturate, SIMD_int16x8_unsignedAddSaturate);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_unsignedSubSaturate, SIMD_int16x8_unsignedSubSaturate);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_equal, SIMD_float64x2_equal);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_notEqual, SIMD_float64x2_notEqual);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_lessThan, SIMD_float64x2_lessThan);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_lessThanOrEqual, SIMD_float64x2_lessThanOrEqual);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_greaterThan, SIMD_float64x2_greaterThan);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_greaterThanOrEqual, SIMD_float64x2_greaterThanOrEqual);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_select, SIMD_float64x2_select);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_min, SIMD_float64x2_min);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_max, SIMD_float64x2_max);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_abs, SIMD_float64x2_abs);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_sqrt, SIMD_float64x2_sqrt);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_fromInt32x4, SIMD_float64x2_fromInt32x4);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_fromFloat32x4, SIMD_float64x2_fromFloat32x4);
+DEF_BUILTIN_HANDLER(emscripten_float32x4_fromFloat64x2, SIMD_float32x4_fromFloat64x2);
+DEF_BUILTIN_HANDLER(emscripten_int32x4_fromFloat64x2, SIMD_int32x4_fromFloat64x2);
+DEF_BUILTIN_HANDLER(emscripten_int32x4_fromInt8x16Bits, SIMD_int32x4_fromInt8x16Bits);
+DEF_BUILTIN_HANDLER(emscripten_int32x4_fromInt16x8Bits, SIMD_int32x4_fromInt16x8Bits);
+DEF_BUILTIN_HANDLER(emscripten_int32x4_fromFloat64x2Bits, SIMD_int32x4_fromFloat64x2Bits);
+DEF_BUILTIN_HANDLER(emscripten_float32x4_fromInt8x16Bits, SIMD_float32x4_fromInt8x16Bits);
+DEF_BUILTIN_HANDLER(emscripten_float32x4_fromInt16x8Bits, SIMD_float32x4_fromInt16x8Bits);
+DEF_BUILTIN_HANDLER(emscripten_float32x4_fromFloat64x2Bits, SIMD_float32x4_fromFloat64x2Bits);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_fromInt32x4Bits, SIMD_int8x16_fromInt32x4Bits);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_fromInt16x8Bits, SIMD_int8x16_fromInt16x8Bits);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_fromFloat32x4Bits, SIMD_int8x16_fromFloat32x4Bits);
+DEF_BUILTIN_HANDLER(emscripten_int8x16_fromFloat64x2Bits, SIMD_int8x16_fromFloat64x2Bits);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_fromInt32x4Bits, SIMD_int16x8_fromInt32x4Bits);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_fromInt8x16Bits, SIMD_int16x8_fromInt8x16Bits);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_fromFloat32x4Bits, SIMD_int16x8_fromFloat32x4Bits);
+DEF_BUILTIN_HANDLER(emscripten_int16x8_fromFloat64x2Bits, SIMD_int16x8_fromFloat64x2Bits);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_fromInt32x4Bits, SIMD_float64x2_fromInt32x4Bits);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_fromInt8x16Bits, SIMD_float64x2_fromInt8x16Bits);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_fromInt16x8Bits, SIMD_float64x2_fromInt16x8Bits);
+DEF_BUILTIN_HANDLER(emscripten_float64x2_fromFloat32x4Bits, SIMD_float64x2_fromFloat32x4Bits);
 
 // Setups
 
@@ -554,6 +670,7 @@ void setupCallHandlers() {
   SETUP_CALL_HANDLER(emscripten_postinvoke);
   SETUP_CALL_HANDLER(emscripten_landingpad);
   SETUP_CALL_HANDLER(emscripten_resume);
+  SETUP_CALL_HANDLER(llvm_eh_typeid_for);
   SETUP_CALL_HANDLER(emscripten_prep_setjmp);
   SETUP_CALL_HANDLER(emscripten_setjmp);
   SETUP_CALL_HANDLER(emscripten_longjmp);
@@ -617,6 +734,61 @@ void setupCallHandlers() {
   SETUP_CALL_HANDLER(emscripten_float32x4_fromInt32x4);
   SETUP_CALL_HANDLER(emscripten_int32x4_fromFloat32x4Bits);
   SETUP_CALL_HANDLER(emscripten_int32x4_fromFloat32x4);
+  SETUP_CALL_HANDLER(emscripten_int8x16_equal);
+  SETUP_CALL_HANDLER(emscripten_int8x16_notEqual);
+  SETUP_CALL_HANDLER(emscripten_int8x16_lessThan);
+  SETUP_CALL_HANDLER(emscripten_int8x16_lessThanOrEqual);
+  SETUP_CALL_HANDLER(emscripten_int8x16_greaterThan);
+  SETUP_CALL_HANDLER(emscripten_int8x16_greaterThanOrEqual);
+  SETUP_CALL_HANDLER(emscripten_int8x16_select);
+  SETUP_CALL_HANDLER(emscripten_int8x16_addSaturate);
+  SETUP_CALL_HANDLER(emscripten_int8x16_subSaturate);
+  SETUP_CALL_HANDLER(emscripten_int8x16_unsignedAddSaturate);
+  SETUP_CALL_HANDLER(emscripten_int8x16_unsignedSubSaturate);
+  SETUP_CALL_HANDLER(emscripten_int16x8_equal);
+  SETUP_CALL_HANDLER(emscripten_int16x8_notEqual);
+  SETUP_CALL_HANDLER(emscripten_int16x8_lessThan);
+  SETUP_CALL_HANDLER(emscripten_int16x8_lessThanOrEqual);
+  SETUP_CALL_HANDLER(emscripten_int16x8_greaterThan);
+  SETUP_CALL_HANDLER(emscripten_int16x8_greaterThanOrEqual);
+  SETUP_CALL_HANDLER(emscripten_int16x8_select);
+  SETUP_CALL_HANDLER(emscripten_int16x8_addSaturate);
+  SETUP_CALL_HANDLER(emscripten_int16x8_subSaturate);
+  SETUP_CALL_HANDLER(emscripten_int16x8_unsignedAddSaturate);
+  SETUP_CALL_HANDLER(emscripten_int16x8_unsignedSubSaturate);
+  SETUP_CALL_HANDLER(emscripten_float64x2_equal);
+  SETUP_CALL_HANDLER(emscripten_float64x2_notEqual);
+  SETUP_CALL_HANDLER(emscripten_float64x2_lessThan);
+  SETUP_CALL_HANDLER(emscripten_float64x2_lessThanOrEqual);
+  SETUP_CALL_HANDLER(emscripten_float64x2_greaterThan);
+  SETUP_CALL_HANDLER(emscripten_float64x2_greaterThanOrEqual);
+  SETUP_CALL_HANDLER(emscripten_float64x2_select);
+  SETUP_CALL_HANDLER(emscripten_float64x2_min);
+  SETUP_CALL_HANDLER(emscripten_float64x2_max);
+  SETUP_CALL_HANDLER(emscripten_float64x2_abs);
+  SETUP_CALL_HANDLER(emscripten_float64x2_sqrt);
+  SETUP_CALL_HANDLER(emscripten_float64x2_fromInt32x4);
+  SETUP_CALL_HANDLER(emscripten_float64x2_fromFloat32x4);
+  SETUP_CALL_HANDLER(emscripten_float32x4_fromFloat64x2);
+  SETUP_CALL_HANDLER(emscripten_int32x4_fromFloat64x2);
+  SETUP_CALL_HANDLER(emscripten_int32x4_fromInt8x16Bits);
+  SETUP_CALL_HANDLER(emscripten_int32x4_fromInt16x8Bits);
+  SETUP_CALL_HANDLER(emscripten_int32x4_fromFloat64x2Bits);
+  SETUP_CALL_HANDLER(emscripten_float32x4_fromInt8x16Bits);
+  SETUP_CALL_HANDLER(emscripten_float32x4_fromInt16x8Bits);
+  SETUP_CALL_HANDLER(emscripten_float32x4_fromFloat64x2Bits);
+  SETUP_CALL_HANDLER(emscripten_int8x16_fromInt32x4Bits);
+  SETUP_CALL_HANDLER(emscripten_int8x16_fromInt16x8Bits);
+  SETUP_CALL_HANDLER(emscripten_int8x16_fromFloat32x4Bits);
+  SETUP_CALL_HANDLER(emscripten_int8x16_fromFloat64x2Bits);
+  SETUP_CALL_HANDLER(emscripten_int16x8_fromInt32x4Bits);
+  SETUP_CALL_HANDLER(emscripten_int16x8_fromInt8x16Bits);
+  SETUP_CALL_HANDLER(emscripten_int16x8_fromFloat32x4Bits);
+  SETUP_CALL_HANDLER(emscripten_int16x8_fromFloat64x2Bits);
+  SETUP_CALL_HANDLER(emscripten_float64x2_fromInt32x4Bits);
+  SETUP_CALL_HANDLER(emscripten_float64x2_fromInt8x16Bits);
+  SETUP_CALL_HANDLER(emscripten_float64x2_fromInt16x8Bits);
+  SETUP_CALL_HANDLER(emscripten_float64x2_fromFloat32x4Bits);
 
   SETUP_CALL_HANDLER(abs);
   SETUP_CALL_HANDLER(labs);
@@ -672,8 +844,31 @@ void setupCallHandlers() {
   SETUP_CALL_HANDLER(llvm_exp_f64);
 }
 
+// Call the functions a function pointer can point to directly, if we know
+// them (see findKnownCallees), testing for the first if there are two.
+// Returns an empty string if we do not know them.
+std::string getDevirtualizedCall(const Instruction *CI, const Value *CV) {
+  const FunctionType *FT = cast<FunctionType>(cast<PointerType>(CV->getType())->getElementType());
+  const llvm::StringMap<std::vector<const Function*> > &Known = (Parent ? Parent : this)->KnownCallees;
+  llvm::StringMap<std::vector<const Function*> >::const_iterator I = Known.find(getFunctionSignature(FT));
+  if (I == Known.end()) return "";
+  const std::vector<const Function*> &Callees = I->getValue();
+  std::string Calls[2];
+  for (unsigned i = 0; i < Callees.size(); i++) {
+    ForcedCallee = Callees[i];
+    Calls[i] = CH___default__(CI, getJSName(Callees[i]), -1);
+  }
+  ForcedCallee = NULL;
+  if (Callees.size() == 1) return Calls[0];
+  return "if ((" + getValueAsStr(CV) + "|0) == " + getFunctionIndexStr(Callees[0]) + ") " + Calls[0] + "; else " + Calls[1];
+}
+
 std::string handleCall(const Instruction *CI) {
   const Value *CV = getActuallyCalledValue(CI);
+  if (Devirtualize && !isa<Function>(CV) && !isa<InlineAsm>(CV) && InvokeState != 1 && !isAbsolute(CV->stripPointerCasts())) {
+    std::string Call = getDevirtualizedCall(CI, CV);
+    if (!Call.empty()) return Call;
+  }
   if (const InlineAsm* IA = dyn_cast<const InlineAsm>(CV)) {
     if (IA->hasSideEffects() && IA->getAsmString() == "") {
       return "/* asm() memory 'barrier' */";
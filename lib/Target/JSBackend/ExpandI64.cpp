@@ -39,6 +39,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/CFG.h"
+#include "llvm/Support/ValueHandle.h"
 #include "llvm/Target/TargetLibraryInfo.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include <map>
@@ -75,6 +76,7 @@ namespace {
     SplitsMap Splits; // old illegal value to new insts
     PHIVec Phis;
     std::vector<PhiBlockChange> PhiBlockChanges;
+    SmallVector<WeakVH, 16> ShiftParts; // made by splitShift; the users of a shift may not need all its chunks
 
     // If the function has an illegal return or argument, create a legal version
     void ensureLegalFunc(Function *F);
@@ -87,6 +89,11 @@ namespace {
     // splits, so store the parts in Splits, for FinalizeInst.
     bool splitInst(Instruction *I);
 
+    // helpers for splitInst
+    bool isHighStillSet(Value *High, Instruction *I);
+    void splitShift(Instruction *I, unsigned Opcode, unsigned Shifts, const ChunksVec &LeftChunks, ChunksVec &Chunks);
+    Value *splitMultiply(IRBuilder<> &Builder, Value *A, Value *B, Value *&High);
+
     // For an illegal value, returns the split out chunks
     // representing the low and high parts, that splitInst
     // generated.
@@ -313,6 +320,114 @@ void ExpandI64::removeIllegalFunc(Function *F) {
   }
 }
 
+// Whether High was read by getHigh32 from the high bits of the result of a
+// call, and nothing could have changed them since then, up to I. Returning
+// the result of a call then needs no setHigh32.
+bool ExpandI64::isHighStillSet(Value *High, Instruction *I) {
+  CallInst *Read = dyn_cast<CallInst>(High);
+  if (!Read || Read->getCalledFunction() != GetHigh || Read->getParent() != I->getParent()) return false;
+  for (BasicBlock::iterator Iter = Read; &*Iter != I; ++Iter) {
+    // calls of illegal types are being replaced, or are intrinsics (see okToRemainIllegal)
+    if ((isa<CallInst>(Iter) || isa<InvokeInst>(Iter)) && isLegalInstruction(Iter) &&
+        !isa<IntrinsicInst>(Iter) && !(isa<CallInst>(Iter) && cast<CallInst>(Iter)->getCalledFunction() == GetHigh)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Shifts the chunks of the first operand of I by a constant number of bits,
+// the way Opcode (LShr, AShr or Shl) does.
+void ExpandI64::splitShift(Instruction *I, unsigned Opcode, unsigned Shifts, const ChunksVec &LeftChunks, ChunksVec &Chunks) {
+  Type *i32 = Type::getInt32Ty(I->getContext());
+  Value *Zero  = Constant::getNullValue(i32);
+  unsigned Num = getNumChunks(I->getType());
+  unsigned Fraction = Shifts % 32;
+  Constant *Frac = ConstantInt::get(i32, Fraction);
+  Constant *Comp = ConstantInt::get(i32, 32 - Fraction);
+  Instruction::BinaryOps ShiftOp, Reverse;
+  unsigned ShiftChunks, Dir;
+  Value *TopFiller = Zero;
+  if (Opcode == Instruction::Shl) {
+    ShiftOp = Instruction::Shl;
+    Reverse = Instruction::LShr;
+    ShiftChunks = -(Shifts/32);
+    Dir = -1;
+  } else {
+    ShiftOp = Instruction::LShr;
+    Reverse = Instruction::Shl;
+    ShiftChunks = Shifts/32;
+    Dir = 1;
+    if (Opcode == Instruction::AShr) {
+      Value *Cond = CopyDebug(new ICmpInst(I, ICmpInst::ICMP_SLT, LeftChunks[LeftChunks.size()-1], Zero), I);
+      TopFiller = CopyDebug(SelectInst::Create(Cond, ConstantInt::get(i32, -1), Zero, "", I), I);
+      ShiftParts.push_back(Cond);
+      ShiftParts.push_back(TopFiller);
+    }
+  }
+  for (unsigned i = 0; i < Num; i++) {
+    Value *L;
+    if (i + ShiftChunks < LeftChunks.size()) {
+      L = LeftChunks[i + ShiftChunks];
+    } else {
+      L = TopFiller;
+    }
+
+    Value *H;
+    if (i + ShiftChunks + Dir < LeftChunks.size()) {
+      H = LeftChunks[i + ShiftChunks + Dir];
+    } else {
+      H = TopFiller;
+    }
+
+    // shifted the fractional amount
+    if (Frac != Zero && L != Zero) {
+      if (Fraction == 32) {
+        L = Zero;
+      } else {
+        L = CopyDebug(BinaryOperator::Create(ShiftOp, L, Frac, "", I), I);
+        ShiftParts.push_back(L);
+      }
+    }
+    // shifted the complement-fractional amount to the other side
+    if (Comp != Zero && H != Zero) {
+      if (Fraction == 0) {
+        H = Zero;
+      } else {
+        H = CopyDebug(BinaryOperator::Create(Reverse, H, Comp, "", I), I);
+        ShiftParts.push_back(H);
+      }
+    }
+
+    // Or the parts together. Since we may have zero, try to fold it away.
+    if (Value *V = SimplifyBinOp(Instruction::Or, L, H, DL)) {
+      Chunks.push_back(V);
+    } else {
+      Chunks.push_back(CopyDebug(BinaryOperator::Create(Instruction::Or, L, H, "", I), I));
+      ShiftParts.push_back(Chunks.back());
+    }
+  }
+}
+
+// Multiplies A and B, returning the low 32 bits of the product and setting
+// High to the high 32 bits. Math_imul only gives the low 32 bits of a
+// product, so this multiplies 16-bit pieces, whose products fit in 32 bits.
+Value *ExpandI64::splitMultiply(IRBuilder<> &Builder, Value *A, Value *B, Value *&High) {
+  Type *i32 = A->getType();
+  Constant *Mask = ConstantInt::get(i32, 0xffff);
+  Constant *Sixteen = ConstantInt::get(i32, 16);
+  Value *AL = Builder.CreateAnd(A, Mask), *AH = Builder.CreateLShr(A, Sixteen);
+  Value *BL = Builder.CreateAnd(B, Mask), *BH = Builder.CreateLShr(B, Sixteen);
+  Value *LL = Builder.CreateMul(AL, BL), *LH = Builder.CreateMul(AL, BH);
+  Value *HL = Builder.CreateMul(AH, BL), *HH = Builder.CreateMul(AH, BH);
+  // bits 16 to 47 of the product, with the carry into the high half in its top bits
+  Value *Mid = Builder.CreateAdd(Builder.CreateAdd(Builder.CreateLShr(LL, Sixteen), Builder.CreateAnd(LH, Mask)),
+                                 Builder.CreateAnd(HL, Mask));
+  High = Builder.CreateAdd(Builder.CreateAdd(HH, Builder.CreateLShr(LH, Sixteen)),
+                           Builder.CreateAdd(Builder.CreateLShr(HL, Sixteen), Builder.CreateLShr(Mid, Sixteen)));
+  return Builder.CreateOr(Builder.CreateShl(Mid, Sixteen), Builder.CreateAnd(LL, Mask));
+}
+
 bool ExpandI64::splitInst(Instruction *I) {
   Type *i32 = Type::getInt32Ty(I->getContext());
   Type *i32P = i32->getPointerTo();
@@ -473,9 +588,11 @@ bool ExpandI64::splitInst(Instruction *I) {
       assert(I->getOperand(0)->getType() == i64);
       ChunksVec InputChunks = getChunks(I->getOperand(0));
       ensureFuncs();
-      SmallVector<Value *, 1> Args;
-      Args.push_back(InputChunks[1]);
-      CopyDebug(CallInst::Create(SetHigh, Args, "", I), I);
+      if (!isHighStillSet(InputChunks[1], I)) {
+        SmallVector<Value *, 1> Args;
+        Args.push_back(InputChunks[1]);
+        CopyDebug(CallInst::Create(SetHigh, Args, "", I), I);
+      }
       CopyDebug(ReturnInst::Create(I->getContext(), InputChunks[0], I), I);
       break;
     }
@@ -492,47 +609,63 @@ bool ExpandI64::splitInst(Instruction *I) {
       ChunksVec LeftChunks = getChunks(I->getOperand(0));
       ChunksVec RightChunks = getChunks(I->getOperand(1));
       unsigned Num = getNumChunks(I->getType());
-      if (Num == 2) {
-        ensureFuncs();
+      ConstantInt *CI = dyn_cast<ConstantInt>(I->getOperand(1));
+      if (CI && I->isShift()) {
+        splitShift(I, I->getOpcode(), CI->getZExtValue(), LeftChunks, Chunks);
+      } else if (CI && I->getOpcode() == Instruction::UDiv && CI->getValue().isPowerOf2()) {
+        splitShift(I, Instruction::LShr, CI->getValue().logBase2(), LeftChunks, Chunks);
+      } else if (CI && I->getOpcode() == Instruction::URem && CI->getValue().isPowerOf2()) {
+        // keep the low bits
+        unsigned Bits = CI->getValue().logBase2();
+        for (unsigned i = 0; i < Num; i++) {
+          if (Bits >= 32*(i+1)) {
+            Chunks.push_back(LeftChunks[i]);
+          } else if (Bits <= 32*i) {
+            Chunks.push_back(Zero);
+          } else {
+            Constant *Mask = ConstantInt::get(i32, (1U << (Bits - 32*i)) - 1);
+            Chunks.push_back(CopyDebug(BinaryOperator::Create(Instruction::And, LeftChunks[i], Mask, "", I), I));
+          }
+        }
+      } else {
+        assert(Num == 2);
+        IRBuilder<> Builder(I);
+        Builder.SetCurrentDebugLocation(I->getDebugLoc());
         Value *Low = NULL, *High = NULL;
         Function *F = NULL;
         switch (I->getOpcode()) {
-          case Instruction::Add:  F = Add;  break;
-          case Instruction::Sub:  F = Sub;  break;
-          case Instruction::Mul:  F = Mul;  break;
+          case Instruction::Add: {
+            // carry out of the low half if its sum wrapped around
+            Low = Builder.CreateAdd(LeftChunks[0], RightChunks[0]);
+            Value *Carry = Builder.CreateZExt(Builder.CreateICmpULT(Low, LeftChunks[0]), i32);
+            High = Builder.CreateAdd(Builder.CreateAdd(LeftChunks[1], RightChunks[1]), Carry);
+            break;
+          }
+          case Instruction::Sub: {
+            Low = Builder.CreateSub(LeftChunks[0], RightChunks[0]);
+            Value *Borrow = Builder.CreateZExt(Builder.CreateICmpULT(LeftChunks[0], RightChunks[0]), i32);
+            High = Builder.CreateSub(Builder.CreateSub(LeftChunks[1], RightChunks[1]), Borrow);
+            break;
+          }
+          case Instruction::Mul: {
+            // the cross products only matter for their low 32 bits
+            Low = splitMultiply(Builder, LeftChunks[0], RightChunks[0], High);
+            High = Builder.CreateAdd(High, Builder.CreateAdd(Builder.CreateMul(LeftChunks[0], RightChunks[1]),
+                                                             Builder.CreateMul(LeftChunks[1], RightChunks[0])));
+            break;
+          }
           case Instruction::SDiv: F = SDiv; break;
           case Instruction::UDiv: F = UDiv; break;
           case Instruction::SRem: F = SRem; break;
           case Instruction::URem: F = URem; break;
           case Instruction::AShr: F = AShr; break;
-          case Instruction::LShr: {
-            if (ConstantInt *CI = dyn_cast<ConstantInt>(I->getOperand(1))) {
-              unsigned Shifts = CI->getZExtValue();
-              if (Shifts == 32) {
-                Low = LeftChunks[1];
-                High = Zero;
-                break;
-              }
-            }
-            F = LShr;
-            break;
-          }
-          case Instruction::Shl: {
-            if (ConstantInt *CI = dyn_cast<ConstantInt>(I->getOperand(1))) {
-              const APInt &Shifts = CI->getValue();
-              if (Shifts == 32) {
-                Low = Zero;
-                High = LeftChunks[0];
-                break;
-              }
-            }
-            F = Shl;
-            break;
-          }
+          case Instruction::LShr: F = LShr; break;
+          case Instruction::Shl:  F = Shl;  break;
           default: assert(0);
         }
         if (F) {
           // use a library call, no special optimization was found
+          ensureFuncs();
           SmallVector<Value *, 4> Args;
           Args.push_back(LeftChunks[0]);
           Args.push_back(LeftChunks[1]);
@@ -543,71 +676,6 @@ bool ExpandI64::splitInst(Instruction *I) {
         }
         Chunks.push_back(Low);
         Chunks.push_back(High);
-      } else {
-        // more than 64 bits. handle simple shifts for lshr and shl
-        assert(I->getOpcode() == Instruction::LShr || I->getOpcode() == Instruction::AShr || I->getOpcode() == Instruction::Shl);
-        ConstantInt *CI = cast<ConstantInt>(I->getOperand(1));
-        unsigned Shifts = CI->getZExtValue();
-        unsigned Fraction = Shifts % 32;
-        Constant *Frac = ConstantInt::get(i32, Fraction);
-        Constant *Comp = ConstantInt::get(i32, 32 - Fraction);
-        Instruction::BinaryOps Opcode, Reverse;
-        unsigned ShiftChunks, Dir;
-        Value *TopFiller = Zero;
-        if (I->getOpcode() == Instruction::Shl) {
-          Opcode = Instruction::Shl;
-          Reverse = Instruction::LShr;
-          ShiftChunks = -(Shifts/32);
-          Dir = -1;
-        } else {
-          Opcode = Instruction::LShr;
-          Reverse = Instruction::Shl;
-          ShiftChunks = Shifts/32;
-          Dir = 1;
-          if (I->getOpcode() == Instruction::AShr) {
-            Value *Cond = CopyDebug(new ICmpInst(I, ICmpInst::ICMP_SLT, LeftChunks[LeftChunks.size()-1], Zero), I);
-            TopFiller = CopyDebug(SelectInst::Create(Cond, ConstantInt::get(i32, -1), Zero, "", I), I);
-          }
-        }
-        for (unsigned i = 0; i < Num; i++) {
-          Value *L;
-          if (i + ShiftChunks < LeftChunks.size()) {
-            L = LeftChunks[i + ShiftChunks];
-          } else {
-            L = Zero;
-          }
-
-          Value *H;
-          if (i + ShiftChunks + Dir < LeftChunks.size()) {
-            H = LeftChunks[i + ShiftChunks + Dir];
-          } else {
-            H = TopFiller;
-          }
-
-          // shifted the fractional amount
-          if (Frac != Zero && L != Zero) {
-            if (Fraction == 32) {
-              L = Zero;
-            } else {
-              L = CopyDebug(BinaryOperator::Create(Opcode, L, Frac, "", I), I);
-            }
-          }
-          // shifted the complement-fractional amount to the other side
-          if (Comp != Zero && H != Zero) {
-            if (Fraction == 0) {
-              H = TopFiller;
-            } else {
-              H = CopyDebug(BinaryOperator::Create(Reverse, H, Comp, "", I), I);
-            }
-          }
-
-          // Or the parts together. Since we may have zero, try to fold it away.
-          if (Value *V = SimplifyBinOp(Instruction::Or, L, H, DL)) {
-            Chunks.push_back(V);
-          } else {
-            Chunks.push_back(CopyDebug(BinaryOperator::Create(Instruction::Or, L, H, "", I), I));
-          }
-        }
       }
       break;
     }
@@ -1128,6 +1196,17 @@ bool ExpandI64::runOnModule(Module &M) {
       D->eraseFromParent();
     }
 
+    // Now that the users of the shifts have taken the chunks they need, drop
+    // the rest, which the backend would still emit as statements. Parts are
+    // popped after their users, so a whole unused chunk goes in one sweep.
+    while (!ShiftParts.empty()) {
+      Value *V = ShiftParts.pop_back_val();
+      Instruction *Part = dyn_cast_or_null<Instruction>(V);
+      if (Part && isInstructionTriviallyDead(Part)) {
+        Part->eraseFromParent();
+      }
+    }
+
     // Apply basic block changes to phis, now that phis are all processed (and illegal phis erased)
     for (unsigned i = 0; i < PhiBlockChanges.size(); i++) {
       PhiBlockChange &Change = PhiBlockChanges[i];
@@ -18,9 +18,14 @@
 #include "MCTargetDesc/JSBackendMCTargetDesc.h"
 #include "AllocaManager.h"
 #include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Assembly/AssemblyAnnotationWriter.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/PostOrderIterator.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/Config/config.h"
 #include "llvm/IR/Constants.h"
@@ -31,24 +36,37 @@
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Operator.h"
+#include "llvm/IR/TypeFinder.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Atomic.h"
+#include "llvm/Support/CFG.h"
 #include "llvm/Support/CallSite.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/FormattedStream.h"
 #include "llvm/Support/GetElementPtrTypeIterator.h"
 #include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/DebugInfo.h"
 #include <algorithm>
 #include <cstdio>
 #include <map>
 #include <set> // TODO: unordered_set?
+#if LLVM_ENABLE_THREADS != 0 && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
 using namespace llvm;
 
 #include <OptPasses.h>
 #include <Relooper.h>
+#include "JSBackendSourceHash.inc"
 
 #ifdef NDEBUG
 #undef assert
@@ -73,6 +91,11 @@ WarnOnUnaligned("emscripten-warn-unaligned",
                 cl::desc("Warns about unaligned loads and stores (which can negatively affect performance)"),
                 cl::init(false));
 
+static cl::opt<bool>
+ReportFrameSizes("emscripten-report-frame-sizes",
+                 cl::desc("Reports the static stack frame size of each function, and what it would be if no allocas shared stack memory"),
+                 cl::init(false));
+
 static cl::opt<int>
 ReservedFunctionPointers("emscripten-reserved-function-pointers",
                          cl::desc("Number of reserved slots in function tables for functions to be added at runtime (see emscripten RESERVED_FUNCTION_POINTERS option)"),
@@ -98,6 +121,66 @@ GlobalBase("emscripten-global-base",
            cl::desc("Where global variables start out in memory (see emscripten GLOBAL_BASE option)"),
            cl::init(8));
 
+enum MemoryInitFormat {
+  MEMORY_INIT_ARRAY,
+  MEMORY_INIT_BASE64,
+  MEMORY_INIT_FILE
+};
+
+static cl::opt<MemoryInitFormat>
+MemoryInit("emscripten-memory-init",
+           cl::desc("How to emit the initial contents of static memory"),
+           cl::values(clEnumValN(MEMORY_INIT_ARRAY, "array", "an allocate() call with an array of bytes, in the code (default)"),
+                      clEnumValN(MEMORY_INIT_BASE64, "base64", "base64 in the metadata"),
+                      clEnumValN(MEMORY_INIT_FILE, "file", "a binary file (see -emscripten-memory-init-file), referred to by the metadata"),
+                      clEnumValEnd),
+           cl::init(MEMORY_INIT_ARRAY));
+
+static cl::opt<std::string>
+MemoryInitFile("emscripten-memory-init-file",
+               cl::desc("File to write the memory initializer to, with -emscripten-memory-init=file"),
+               cl::init(""));
+
+static cl::opt<unsigned>
+MemoryInitGap("emscripten-memory-init-gap",
+              cl::desc("Leaves runs of at least this many zero bytes out of a base64 or file memory initializer, splitting it into segments (0 only leaves out the zeros at the end)"),
+              cl::init(0));
+
+static cl::opt<bool>
+ZeroSection("emscripten-zero-section",
+            cl::desc("Places zero-initialized globals after all other static data, where they are never emitted, and reports that region as \"zeroSection\" in the metadata"),
+            cl::init(false));
+
+static cl::opt<bool>
+CompactFunctionTables("emscripten-compact-function-tables",
+                      cl::desc("Emits each function table in the metadata as its size followed by its runs of entries, [size, [index, name, ...], ...], instead of as JS code that spells out every empty slot"),
+                      cl::init(false));
+
+static cl::opt<bool>
+FoldExpressions("emscripten-fold-expressions",
+                cl::desc("Folds single-use expressions into their user within a block, instead of assigning each to a local"),
+                cl::init(false));
+
+static cl::opt<bool>
+Registerize("emscripten-registerize",
+            cl::desc("Lets values of the same type share a local when they are never live at the same time, like emscripten's registerize pass"),
+            cl::init(false));
+
+static cl::opt<bool>
+Devirtualize("emscripten-devirtualize",
+             cl::desc("Calls a function pointer directly when only one or two functions of its signature have their address taken, instead of through the function table"),
+             cl::init(false));
+
+static cl::opt<unsigned>
+CodegenThreads("emscripten-codegen-threads",
+               cl::desc("Number of threads to emit function bodies on (0 or 1 emits them serially; the output is the same either way)"),
+               cl::init(0));
+
+static cl::opt<std::string>
+CodegenCache("emscripten-codegen-cache",
+             cl::desc("Directory in which to cache the code of each function, so that functions that did not change since an earlier run are not emitted again"),
+             cl::init(""));
+
 
 extern "C" void LLVMInitializeJSBackendTarget() {
   // Register the target.
@@ -116,12 +199,77 @@ namespace {
   const char *const SIMDLane = "XYZW";
   const char *const simdLane = "xyzw";
 
-  typedef std::map<const Value*,std::string> ValueMap;
+  // The SIMD.js types that vectors are represented as. Vectors of i1, which
+  // compares produce, are masks of the integer type with as many lanes.
+  enum SIMDType {
+    SIMD_INT32X4,
+    SIMD_FLOAT32X4,
+    SIMD_INT8X16,
+    SIMD_INT16X8,
+    SIMD_FLOAT64X2,
+    NUM_SIMD_TYPES
+  };
+  const char *const SIMDTypeNames[NUM_SIMD_TYPES] = { "int32x4", "float32x4", "int8x16", "int16x8", "float64x2" };
+  const unsigned SIMDTypeLanes[NUM_SIMD_TYPES] = { 4, 4, 16, 8, 2 };
+
+  SIMDType getSIMDType(VectorType *VT) {
+    Type *ElemTy = VT->getElementType();
+    if (ElemTy->isIntegerTy()) {
+      unsigned Bits = ElemTy->getIntegerBitWidth();
+      unsigned Lanes = VT->getNumElements();
+      if (Bits == 8 || (Bits == 1 && Lanes == 16)) return SIMD_INT8X16;
+      if (Bits == 16 || (Bits == 1 && Lanes == 8)) return SIMD_INT16X8;
+      return SIMD_INT32X4;
+    }
+    return ElemTy->isDoubleTy() ? SIMD_FLOAT64X2 : SIMD_FLOAT32X4;
+  }
+
+  std::string getSIMDName(VectorType *VT) {
+    return std::string("SIMD_") + SIMDTypeNames[getSIMDType(VT)];
+  }
+
+  // The name of VT's type in conversions to other types, as in fromInt8x16.
+  std::string getSIMDConversionName(VectorType *VT) {
+    std::string Name = SIMDTypeNames[getSIMDType(VT)];
+    Name[0] = toupper(Name[0]);
+    return Name;
+  }
+
+  // The suffix of the load or store of VT, which may use only the first lanes
+  // of its type, or NULL if there is none.
+  const char *getSIMDPartialAccess(VectorType *VT) {
+    static const char *const PartialAccess[4] = { "X", "XY", "XYZ", "" };
+    unsigned NumElements = VT->getNumElements();
+    unsigned Lanes = SIMDTypeLanes[getSIMDType(VT)];
+    if (NumElements == Lanes) return "";
+    if (Lanes > 4 || NumElements < 1 || NumElements > Lanes) return NULL;
+    return PartialAccess[NumElements - 1];
+  }
+
+  // Delimits a function index placeholder in code emitted on a worker thread.
+  const char FunctionIndexMarker = '\1';
+
+  // The asm.js types of locals, which values can share with -emscripten-registerize
+  enum LocalClass {
+    LOCAL_INT, // integers and pointers
+    LOCAL_DOUBLE, // also floats, unless -emscripten-precise-f32
+    LOCAL_FLOAT,
+    LOCAL_INT32X4,
+    LOCAL_FLOAT32X4,
+    LOCAL_INT8X16,
+    LOCAL_INT16X8,
+    LOCAL_FLOAT64X2,
+    NUM_LOCAL_CLASSES,
+    LOCAL_NONE = NUM_LOCAL_CLASSES
+  };
+
+  typedef DenseMap<const Value*,std::string> ValueMap;
+  typedef DenseMap<const Value*,const std::string*> ValueNameMap; // names are interned, see getJSName
   typedef std::set<std::string> NameSet;
   typedef std::vector<unsigned char> HeapData;
   typedef std::pair<unsigned, unsigned> Address;
-  typedef std::map<std::string, Type *> VarMap;
-  typedef std::map<std::string, Address> GlobalAddressMap;
+  typedef llvm::StringMap<Type *> VarMap; // unordered; declared sorted by name
+  typedef llvm::StringMap<Address> GlobalAddressMap;
   typedef std::vector<std::string> FunctionTable;
   typedef std::map<std::string, FunctionTable> FunctionTableMap;
   typedef std::map<std::string, std::string> StringMap;
@@ -130,44 +278,105 @@ namespace {
   typedef std::map<const Function*, BlockIndexMap> BlockAddressMap;
   typedef std::map<const BasicBlock*, Block*> LLVMToRelooperMap;
 
+  /// TableAccess - A use of the module-wide function tables made while
+  /// emitting a function on a worker thread: either a request for the index
+  /// of F, or, when F is null, a request that the table for signature Sig exist.
+  struct TableAccess {
+    const Function *F;
+    std::string Sig;
+  };
+
+  /// EmittedFunction - The JS for one function emitted on a worker thread,
+  /// together with its effects on module-wide state, which are merged back in
+  /// module order so that the result is the same as emitting serially.
+  struct EmittedFunction {
+    const Function *F;
+    bool OnMainThread; // uses block addresses, which are numbered module-wide
+    std::string CacheKey; // empty if not cached, see computeCacheKeys
+    bool Cached; // the code and effects below were loaded from the cache
+    std::string Code; // function indices are placeholders, see getFunctionIndexStr
+    std::vector<TableAccess> TableAccesses;
+    NameSet Declares;
+    NameSet Externals;
+    std::string CantValidate;
+    unsigned UsesSIMD;
+  };
+
+  /// PhiBlock - The phis at the top of a block, and the values they take
+  /// coming from each predecessor, gathered once for all the edges into it.
+  struct PhiBlock {
+    std::vector<const PHINode*> Phis;
+    DenseMap<const BasicBlock*, unsigned> Rows; // predecessor -> row of Values
+    std::vector<const Value*> Values; // one row of Phis.size() per predecessor
+  };
+  typedef DenseMap<const BasicBlock*, PhiBlock*> PhiBlockMap;
+
   /// JSWriter - This class is the main chunk of code that converts an LLVM
   /// module to JavaScript.
   class JSWriter : public ModulePass {
     formatted_raw_ostream &Out;
     const Module *TheModule;
     unsigned UniqueNum;
-    unsigned NextFunctionIndex; // used with NoAliasingFunctionPointers
-    ValueMap ValueNames;
+    unsigned NextFunctionIndex; // the next free slot after all ranges, with NoAliasingFunctionPointers (see getUnaliasedIndex)
+    llvm::StringMap<unsigned> ReservedGapsUsed; // sig -> odd slots between reserved ones used so far
+    llvm::StringMap<std::pair<unsigned, unsigned> > UnaliasedRanges; // sig -> next free and end of its range of slots, see layoutUnaliasedTables
+    llvm::StringMap<std::vector<const Function*> > KnownCallees; // sig -> every function a call through a pointer can reach, see findKnownCallees
+    const Function *ForcedCallee; // the callee of the devirtualized call being emitted, see getDevirtualizedCall
+    ValueNameMap ValueNames;
+    llvm::StringMap<std::string> JSNames; // interned names for ValueNames, which stay put as it grows
     VarMap UsedVars;
     AllocaManager Allocas;
     HeapData GlobalData8;
     HeapData GlobalData32;
     HeapData GlobalData64;
+    unsigned ZeroDataSize; // bytes in the zero section, see ZeroSection
     GlobalAddressMap GlobalAddresses;
+    GlobalAddressMap MergedConstants; // bucket and bytes of a mergeable constant -> its address, see processConstants
     NameSet Externals; // vars
     NameSet Declares; // funcs
     StringMap Redirects; // library function redirects actually used, needed for wrapper funcs in tables
     std::string PostSets;
     NameIntMap NamedGlobals; // globals that we export as metadata to JS, so it can access them by name
-    std::map<std::string, unsigned> IndexedFunctions; // name -> index
+    llvm::StringMap<unsigned> IndexedFunctions; // name -> index
     FunctionTableMap FunctionTables; // sig => list of functions
     std::vector<std::string> GlobalInitializers;
     std::vector<std::string> Exports; // additional exports
     BlockAddressMap BlockAddresses;
 
     std::string CantValidate;
-    bool UsesSIMD;
+    unsigned UsesSIMD; // bit i is set when SIMDType i is used
     int InvokeState; // cycles between 0, 1 after preInvoke, 2 after call, 0 again after postInvoke. hackish, no argument there.
     CodeGenOpt::Level OptLevel;
     DataLayout *DL;
 
+    // Set when this writer emits functions on a worker thread for another
+    // writer, which owns the module-wide state (global addresses, function
+    // tables). Table accesses are then recorded for the parent to replay.
+    JSWriter *Parent;
+    std::vector<TableAccess> TableAccesses;
+
+    std::set<const Instruction*> FoldedInsts; // emitted as part of their single user, see findFoldedExpressions
+    ValueMap FoldedExprs; // the code of the folded instructions emitted so far
+    const Instruction *FoldingInst; // the instruction whose code is being generated for folding, if any
+
+    PhiBlockMap PhiBlocks; // the blocks of the current function with phis, see getPhiCode
+
+    std::string BlockCode; // scratch space for the code of the current block
+    BumpPtrAllocator BlockArena; // holds the code of the blocks of the current function, for the relooper
+    OutputBuffer RelooperOutput; // reused for every function this writer emits
+
     #include "CallHandlers.h"
 
   public:
     static char ID;
     JSWriter(formatted_raw_ostream &o, CodeGenOpt::Level OptLevel)
-      : ModulePass(ID), Out(o), UniqueNum(0), NextFunctionIndex(0), CantValidate(""), UsesSIMD(false), InvokeState(0),
-        OptLevel(OptLevel) {}
+      : ModulePass(ID), Out(o), UniqueNum(0), NextFunctionIndex(0), ForcedCallee(NULL), ZeroDataSize(0), CantValidate(""), UsesSIMD(0), InvokeState(0),
+        OptLevel(OptLevel), Parent(NULL), FoldingInst(NULL) {}
+    JSWriter(formatted_raw_ostream &o, JSWriter *Parent)
+      : ModulePass(ID), Out(o), TheModule(Parent->TheModule), UniqueNum(0), NextFunctionIndex(0), ForcedCallee(NULL), ZeroDataSize(0), CantValidate(""), UsesSIMD(0), InvokeState(0),
+        OptLevel(Parent->OptLevel), DL(Parent->DL), Parent(Parent), FoldingInst(NULL) {
+      setupCallHandlers();
+    }
 
     virtual const char *getPassName() const { return "JavaScript backend"; }
 
@@ -189,12 +398,14 @@ namespace {
 
   private:
     void printCommaSeparated(const HeapData v);
+    void printMemoryInitializer();
 
     // parsing of constants has two phases: calculate, and then emit
-    void parseConstant(const std::string& name, const Constant* CV, bool calculate);
+    void parseConstant(const std::string& name, const Constant* CV, unsigned Bits, bool calculate);
 
     #define MEM_ALIGN 8
     #define MEM_ALIGN_BITS 64
+    #define ZERO_SECTION_BITS 0 // in place of the alignment bits of an Address in the zero section
     #define STACK_ALIGN 16
     #define STACK_ALIGN_BITS 128
 
@@ -205,28 +416,52 @@ namespace {
       return "((" + x + "+" + utostr(STACK_ALIGN-1) + ")&-" + utostr(STACK_ALIGN) + ")";
     }
 
-    HeapData *allocateAddress(const std::string& Name, unsigned Bits = MEM_ALIGN_BITS) {
-      assert(Bits == 64); // FIXME when we use optimal alignments
-      HeapData *GlobalData = NULL;
+    // Static data is laid out as GlobalData64, then GlobalData32, then
+    // GlobalData8, each holding the globals that need that alignment (in bits;
+    // 8 means none), so that only globals in the same one pad each other.
+    HeapData *getGlobalData(unsigned Bits) {
       switch (Bits) {
-        case 8:  GlobalData = &GlobalData8;  break;
-        case 32: GlobalData = &GlobalData32; break;
-        case 64: GlobalData = &GlobalData64; break;
+        case 8:  return &GlobalData8;
+        case 32: return &GlobalData32;
+        case 64: return &GlobalData64;
         default: llvm_unreachable("Unsupported data element size");
       }
+    }
+    // the alignment bits of the part of static data that GV goes in
+    unsigned getGlobalAlignBits(const GlobalVariable *GV) {
+      unsigned Alignment = GV->getAlignment();
+      if (!Alignment) Alignment = DL->getABITypeAlignment(GV->getType()->getElementType());
+      if (Alignment >= 8) return 64; // more than 8 is not supported, see MEM_ALIGN
+      if (Alignment >= 2) return 32;
+      return 8;
+    }
+
+    HeapData *allocateAddress(const std::string& Name, unsigned Bits = MEM_ALIGN_BITS) {
+      HeapData *GlobalData = getGlobalData(Bits);
       while (GlobalData->size() % (Bits/8) != 0) GlobalData->push_back(0);
       GlobalAddresses[Name] = Address(GlobalData->size(), Bits);
       return GlobalData;
     }
 
+    void allocateZeroAddress(const std::string& Name, unsigned Bytes, unsigned Bits) {
+      ZeroDataSize = RoundUpToAlignment(ZeroDataSize, Bits/8);
+      GlobalAddresses[Name] = Address(ZeroDataSize, ZERO_SECTION_BITS);
+      ZeroDataSize += Bytes;
+    }
+
+    // the absolute address of the zero section, which follows all other static data
+    unsigned getZeroSectionAddress() {
+      return GlobalBase + RoundUpToAlignment(GlobalData64.size() + GlobalData32.size() + GlobalData8.size(), MEM_ALIGN);
+    }
+
     // return the absolute offset of a global
     unsigned getGlobalAddress(const std::string &s) {
+      if (Parent) return Parent->getGlobalAddress(s);
       GlobalAddressMap::const_iterator I = GlobalAddresses.find(s);
       if (I == GlobalAddresses.end()) {
         report_fatal_error("cannot find global address " + Twine(s));
       }
       Address a = I->second;
-      assert(a.second == 64); // FIXME when we use optimal alignments
       unsigned Ret;
       switch (a.second) {
         case 64:
@@ -240,6 +475,9 @@ namespace {
         case 8:
           Ret = a.first + GlobalBase + GlobalData64.size() + GlobalData32.size();
           break;
+        case ZERO_SECTION_BITS:
+          Ret = a.first + getZeroSectionAddress();
+          break;
         default:
           report_fatal_error("bad global address " + Twine(s) + ": "
                              "count=" + Twine(a.first) + " "
@@ -247,7 +485,7 @@ namespace {
       }
       return Ret;
     }
-    // returns the internal offset inside the proper block: GlobalData8, 32, 64
+    // returns the internal offset inside the proper block: GlobalData8, 32, 64 (see getGlobalData)
     unsigned getRelativeGlobalAddress(const std::string &s) {
       GlobalAddressMap::const_iterator I = GlobalAddresses.find(s);
       if (I == GlobalAddresses.end()) {
@@ -266,10 +504,12 @@ namespace {
         }
       } else if (VectorType *VT = dyn_cast<VectorType>(T)) {
         checkVectorType(VT);
-        if (VT->getElementType()->isIntegerTy()) {
-          return 'I';
-        } else {
-          return 'F';
+        switch (getSIMDType(VT)) {
+          case SIMD_INT32X4: return 'I';
+          case SIMD_FLOAT32X4: return 'F';
+          case SIMD_INT8X16: return 'B';
+          case SIMD_INT16X8: return 'S';
+          default: return 'D';
         }
       } else {
         return 'i';
@@ -285,28 +525,60 @@ namespace {
       return Ret;
     }
     FunctionTable& ensureFunctionTable(const FunctionType *FT) {
-      FunctionTable &Table = FunctionTables[getFunctionSignature(FT)];
-      unsigned MinSize = ReservedFunctionPointers ? 2*(ReservedFunctionPointers+1) : 1; // each reserved slot must be 2-aligned
+      return ensureFunctionTable(getFunctionSignature(FT));
+    }
+    FunctionTable& ensureFunctionTable(const std::string &Sig) {
+      if (Parent) {
+        TableAccess Access = { NULL, Sig };
+        TableAccesses.push_back(Access);
+      }
+      FunctionTable &Table = FunctionTables[Sig];
+      unsigned MinSize = getReservedTableSize();
       while (Table.size() < MinSize) Table.push_back("0");
       return Table;
     }
+    // the slots at the start of every table: the null pointer, and the
+    // reserved ones at 2, 4, .., 2*ReservedFunctionPointers (each reserved
+    // slot must be 2-aligned), with free odd slots between them
+    unsigned getReservedTableSize() {
+      return ReservedFunctionPointers ? 2*(ReservedFunctionPointers+1) : 1;
+    }
+    // the next index for a function of signature Sig with
+    // NoAliasingFunctionPointers. Slots are counted from the odd ones between
+    // reserved slots, which no function of any signature has yet, to the end.
+    unsigned getUnaliasedIndex(const std::string &Sig) {
+      unsigned Slot;
+      llvm::StringMap<std::pair<unsigned, unsigned> >::iterator Range = UnaliasedRanges.find(Sig);
+      if (Range != UnaliasedRanges.end() && Range->second.first < Range->second.second) {
+        Slot = Range->second.first++;
+      } else {
+        Slot = NextFunctionIndex++;
+      }
+      unsigned Gaps = getReservedTableSize()/2;
+      return Slot < Gaps ? 2*Slot+1 : getReservedTableSize() + (Slot - Gaps);
+    }
     unsigned getFunctionIndex(const Function *F) {
+      assert(!Parent && "function indices are assigned by the parent writer");
       const std::string &Name = getJSName(F);
-      if (IndexedFunctions.find(Name) != IndexedFunctions.end()) return IndexedFunctions[Name];
+      llvm::StringMap<unsigned>::const_iterator Indexed = IndexedFunctions.find(Name);
+      if (Indexed != IndexedFunctions.end()) return Indexed->second;
       std::string Sig = getFunctionSignature(F->getFunctionType(), &Name);
-      FunctionTable& Table = ensureFunctionTable(F->getFunctionType());
+      FunctionTable& Table = ensureFunctionTable(Sig);
+      unsigned Index;
+      unsigned &GapsUsed = ReservedGapsUsed[Sig];
       if (NoAliasingFunctionPointers) {
-        while (Table.size() < NextFunctionIndex) Table.push_back("0");
+        Index = getUnaliasedIndex(Sig);
+      } else if (2*GapsUsed+1 < getReservedTableSize()) {
+        Index = 2*(GapsUsed++)+1; // fill the odd slots between reserved ones first
+      } else {
+        unsigned Alignment = F->getAlignment() || 1; // XXX this is wrong, it's always 1. but, that's fine in the ARM-like ABI we have which allows unaligned functions.
+                                                     //     the one risk is if someone forces a function to be aligned, and relies on that.
+        while (Table.size() % Alignment) Table.push_back("0");
+        Index = Table.size();
       }
-      unsigned Alignment = F->getAlignment() || 1; // XXX this is wrong, it's always 1. but, that's fine in the ARM-like ABI we have which allows unaligned functions.
-                                                   //     the one risk is if someone forces a function to be aligned, and relies on that.
-      while (Table.size() % Alignment) Table.push_back("0");
-      unsigned Index = Table.size();
-      Table.push_back(Name);
+      if (Table.size() <= Index) Table.resize(Index+1, "0");
+      Table[Index] = Name;
       IndexedFunctions[Name] = Index;
-      if (NoAliasingFunctionPointers) {
-        NextFunctionIndex = Index+1;
-      }
 
       // invoke the callHandler for this, if there is one. the function may only be indexed but never called directly, and we may need to do things in the handler
       CallHandlerMap::const_iterator CH = CallHandlers.find(Name);
@@ -316,6 +588,14 @@ namespace {
 
       return Index;
     }
+    // Return the index of F as text to emit. A worker does not know the index
+    // yet, so it emits a placeholder that the parent fills in when merging.
+    std::string getFunctionIndexStr(const Function *F) {
+      if (!Parent) return utostr(getFunctionIndex(F));
+      TableAccess Access = { F, "" };
+      TableAccesses.push_back(Access);
+      return FunctionIndexMarker + utostr(TableAccesses.size()-1) + FunctionIndexMarker;
+    }
 
     unsigned getBlockAddress(const Function *F, const BasicBlock *BB) {
       BlockIndexMap& Blocks = BlockAddresses[F];
@@ -384,11 +664,25 @@ namespace {
       // LLVM represents the results of vector comparison as vectors of i1. We
       // represent them as vectors of integers the size of the vector elements
       // of the compare that produced them.
-      assert(VT->getElementType()->getPrimitiveSizeInBits() == 32 ||
-             VT->getElementType()->getPrimitiveSizeInBits() == 1);
-      assert(VT->getBitWidth() <= 128);
-      assert(VT->getNumElements() <= 4);
-      UsesSIMD = true;
+      Type *ElemTy = VT->getElementType();
+      unsigned Lanes = VT->getNumElements();
+      bool Valid;
+      if (ElemTy->isIntegerTy(1)) {
+        Valid = Lanes <= 4 || Lanes == 8 || Lanes == 16;
+      } else if (ElemTy->isIntegerTy(8) || ElemTy->isIntegerTy(16)) {
+        Valid = Lanes * ElemTy->getIntegerBitWidth() == 128;
+      } else if (ElemTy->isDoubleTy()) {
+        Valid = Lanes <= 2;
+      } else {
+        Valid = ElemTy->getPrimitiveSizeInBits() == 32 && Lanes <= 4;
+      }
+      if (!Valid) {
+        std::string Name;
+        raw_string_ostream NameStream(Name);
+        NameStream << *VT;
+        error("no SIMD.js type for " + NameStream.str());
+      }
+      UsesSIMD |= 1 << getSIMDType(VT);
     }
 
     std::string ensureCast(std::string S, Type *T, AsmCast sign) {
@@ -423,7 +717,10 @@ namespace {
     std::string getHeapAccess(const std::string& Name, unsigned Bytes, bool Integer=true);
     std::string getPtrUse(const Value* Ptr);
     std::string getConstant(const Constant*, AsmCast sign=ASM_SIGNED);
-    std::string getConstantVector(Type *ElementType, std::string x, std::string y, std::string z, std::string w);
+    std::string getConstantVector(const Constant *CV);
+    std::string getZeroVector(VectorType *VT);
+    std::string getSIMDExtractLane(VectorType *VT, const std::string &V, unsigned Index);
+    std::string getSIMDReplaceLane(VectorType *VT, const std::string &V, unsigned Index, const std::string &X);
     std::string getValueAsStr(const Value*, AsmCast sign=ASM_SIGNED);
     std::string getValueAsCastStr(const Value*, AsmCast sign=ASM_SIGNED);
     std::string getValueAsParenStr(const Value*);
@@ -431,6 +728,7 @@ namespace {
 
     const std::string &getJSName(const Value* val);
 
+    const PhiBlock &getPhiBlock(const BasicBlock *BB);
     std::string getPhiCode(const BasicBlock *From, const BasicBlock *To);
 
     void printAttributes(const AttributeSet &PAL, const std::string &name);
@@ -440,15 +738,25 @@ namespace {
     std::string getAdHocAssign(const StringRef &, Type *);
     std::string getAssign(const Instruction *I);
     std::string getAssignIfNeeded(const Value *V);
-    std::string getCast(const StringRef &, Type *, AsmCast sign=ASM_SIGNED);
-    std::string getParenCast(const StringRef &, Type *, AsmCast sign=ASM_SIGNED);
+    std::string getCast(const Twine &, Type *, AsmCast sign=ASM_SIGNED);
+    std::string getParenCast(const Twine &, Type *, AsmCast sign=ASM_SIGNED);
     std::string getDoubleToInt(const StringRef &);
     std::string getIMul(const Value *, const Value *);
+    std::string getIMulByConstant(const std::string &, unsigned);
     std::string getLoad(const Instruction *I, const Value *P, Type *T, unsigned Alignment, char sep=';');
     std::string getStore(const Instruction *I, const Value *P, Type *T, const std::string& VS, unsigned Alignment, char sep=';');
     std::string getStackBump(unsigned Size);
     std::string getStackBump(const std::string &Size);
 
+    bool isNaturallyAligned(const Value *P, unsigned Alignment);
+    bool isSimpleExpression(const Instruction *I);
+    bool canFoldExpression(const Instruction *I);
+    bool canFoldInto(const Instruction *User);
+    void findFoldedExpressions(const BasicBlock *BB);
+    void foldExpression(const Instruction *I);
+    void getLocalUses(const User *U, SmallVectorImpl<const Instruction*> &Uses);
+    void registerize(const Function *F);
+    const char *copyToBlockArena(const std::string &S);
     void addBlock(const BasicBlock *BB, Relooper& R, LLVMToRelooperMap& LLVMToRelooper);
     void printFunctionBody(const Function *F);
     void generateInsertElementExpression(const InsertElementInst *III, raw_string_ostream& Code);
@@ -464,6 +772,8 @@ namespace {
     std::string getOpName(const Value*);
 
     void processConstants();
+    void layoutUnaliasedTables();
+    void findKnownCallees();
 
     // nativization
 
@@ -479,6 +789,19 @@ namespace {
     // main entry point
 
     void printModuleBody();
+
+    // deferred function emission
+
+    void prepareForThreads();
+    void printFunctionsDeferred(unsigned NumThreads);
+    void mergeEmittedFunction(const EmittedFunction &EF);
+    static void *emitFunctionsOnThread(void *Queue);
+
+    // codegen cache
+
+    void computeCacheKeys(std::vector<EmittedFunction> &Functions);
+    bool loadCachedFunction(EmittedFunction &EF);
+    void storeCachedFunction(const EmittedFunction &EF);
   };
 } // end anonymous namespace.
 
@@ -575,79 +898,113 @@ void JSWriter::error(const std::string& msg) {
   report_fatal_error(msg);
 }
 
-std::string JSWriter::getPhiCode(const BasicBlock *From, const BasicBlock *To) {
-  // FIXME this is all quite inefficient, and also done once per incoming to each phi
+const PhiBlock &JSWriter::getPhiBlock(const BasicBlock *BB) {
+  PhiBlock *&PB = PhiBlocks[BB];
+  if (PB) return *PB;
+  PB = new PhiBlock;
+  for (BasicBlock::const_iterator I = BB->begin(); isa<PHINode>(I); ++I) {
+    PB->Phis.push_back(cast<PHINode>(I));
+  }
+  unsigned NumPhis = PB->Phis.size();
+  for (unsigned i = 0; i < NumPhis; i++) {
+    const PHINode *P = PB->Phis[i];
+    for (unsigned j = 0, e = P->getNumIncomingValues(); j < e; j++) {
+      std::pair<DenseMap<const BasicBlock*, unsigned>::iterator, bool> Row =
+        PB->Rows.insert(std::make_pair(P->getIncomingBlock(j), (unsigned)PB->Rows.size()));
+      if (Row.second) PB->Values.resize(PB->Values.size() + NumPhis, NULL);
+      PB->Values[Row.first->second * NumPhis + i] = P->getIncomingValue(j);
+    }
+  }
+  return *PB;
+}
 
-  // Find the phis, and generate assignments and dependencies
-  std::set<std::string> PhiVars;
-  for (BasicBlock::const_iterator I = To->begin(), E = To->end();
-       I != E; ++I) {
-    const PHINode* P = dyn_cast<PHINode>(I);
-    if (!P) break;
-    PhiVars.insert(getJSName(P));
+namespace {
+  /// PhiCopy - One of the copies into the locals of the phis of a block that
+  /// are made, in parallel as far as the phis are concerned, along an edge.
+  struct PhiCopy {
+    const PHINode *Phi;
+    std::string Value;
+    int Reads; // the copy whose local this one reads, or -1
+    unsigned Readers; // the number of copies not yet made that read this one's local
+    bool Done;
+  };
+}
+
+// Lowers the phis of To on the edge from From to a sequence of copies. A copy
+// can be made once nothing still needs the old value of its local, and what is
+// left after making all those forms cycles, each of which is broken with one
+// $phi temporary. Locals are told apart by their interned names, which sees
+// through -emscripten-registerize sharing a local between a phi and a value.
+std::string JSWriter::getPhiCode(const BasicBlock *From, const BasicBlock *To) {
+  if (!isa<PHINode>(To->begin())) return "";
+  const PhiBlock &PB = getPhiBlock(To);
+  DenseMap<const BasicBlock*, unsigned>::const_iterator Row = PB.Rows.find(From);
+  if (Row == PB.Rows.end()) return "";
+  unsigned NumPhis = PB.Phis.size();
+  const Value *const *Incoming = &PB.Values[Row->second * NumPhis];
+
+  SmallVector<PhiCopy, 16> Copies;
+  SmallVector<const Value*, 16> Sources;
+  SmallDenseMap<const std::string*, unsigned, 16> CopyOfLocal;
+  for (unsigned i = 0; i < NumPhis; i++) {
+    if (!Incoming[i]) continue;
+    const PHINode *P = PB.Phis[i];
+    // Strip pointer casts, since normal expression translation also strips
+    // them, and we want to see the same thing so that we can detect any
+    // resulting dependencies.
+    const Value *V = Incoming[i]->stripPointerCasts();
+    const std::string *Local = &getJSName(P);
+    if (isa<Instruction>(V) && &getJSName(V) == Local) continue; // the phi itself, or a value sharing its local
+    CopyOfLocal[Local] = Copies.size();
+    PhiCopy Copy = { P, getValueAsStr(V), -1, 0, false };
+    Copies.push_back(Copy);
+    Sources.push_back(V);
   }
-  typedef std::map<std::string, std::string> StringMap;
-  StringMap assigns; // variable -> assign statement
-  std::map<std::string, const Value*> values; // variable -> Value
-  StringMap deps; // variable -> dependency
-  StringMap undeps; // reverse: dependency -> variable
-  for (BasicBlock::const_iterator I = To->begin(), E = To->end();
-       I != E; ++I) {
-    const PHINode* P = dyn_cast<PHINode>(I);
-    if (!P) break;
-    int index = P->getBasicBlockIndex(From);
-    if (index < 0) continue;
-    // we found it
-    const std::string &name = getJSName(P);
-    assigns[name] = getAssign(P);
-    // Get the operand, and strip pointer casts, since normal expression
-    // translation also strips pointer casts, and we want to see the same
-    // thing so that we can detect any resulting dependencies.
-    const Value *V = P->getIncomingValue(index)->stripPointerCasts();
-    values[name] = V;
-    std::string vname = getValueAsStr(V);
-    if (const Instruction *VI = dyn_cast<const Instruction>(V)) {
-      if (VI->getParent() == To && PhiVars.find(vname) != PhiVars.end()) {
-        deps[name] = vname;
-        undeps[vname] = name;
-      }
-    }
-  }
-  // Emit assignments+values, taking into account dependencies, and breaking cycles
-  std::string pre = "", post = "";
-  while (assigns.size() > 0) {
-    bool emitted = false;
-    for (StringMap::iterator I = assigns.begin(); I != assigns.end();) {
-      StringMap::iterator last = I;
-      std::string curr = last->first;
-      const Value *V = values[curr];
-      std::string CV = getValueAsStr(V);
-      I++; // advance now, as we may erase
-      // if we have no dependencies, or we found none to emit and are at the end (so there is a cycle), emit
-      StringMap::const_iterator dep = deps.find(curr);
-      if (dep == deps.end() || (!emitted && I == assigns.end())) {
-        if (dep != deps.end()) {
-          // break a cycle
-          std::string depString = dep->second;
-          std::string temp = curr + "$phi";
-          pre += getAdHocAssign(temp, V->getType()) + CV + ';';
-          CV = temp;
-          deps.erase(curr);
-          undeps.erase(depString);
-        }
-        post += assigns[curr] + CV + ';';
-        assigns.erase(last);
-        emitted = true;
-      }
+  if (Copies.empty()) return "";
+
+  SmallVector<unsigned, 16> Ready;
+  for (unsigned i = 0; i < Copies.size(); i++) {
+    if (!isa<Instruction>(Sources[i])) continue;
+    SmallDenseMap<const std::string*, unsigned, 16>::const_iterator Read = CopyOfLocal.find(&getJSName(Sources[i]));
+    if (Read == CopyOfLocal.end()) continue;
+    Copies[i].Reads = Read->second;
+    Copies[Read->second].Readers++;
+  }
+  for (unsigned i = 0; i < Copies.size(); i++) {
+    if (Copies[i].Readers == 0) Ready.push_back(i);
+  }
+
+  std::string Code;
+  unsigned Next = 0, Unbroken = 0;
+  while (true) {
+    for (; Next < Ready.size(); Next++) {
+      PhiCopy &Copy = Copies[Ready[Next]];
+      Code += getAssign(Copy.Phi) + Copy.Value + ';';
+      Copy.Done = true;
+      if (Copy.Reads >= 0 && --Copies[Copy.Reads].Readers == 0) Ready.push_back(Copy.Reads);
     }
+    if (Ready.size() == Copies.size()) break;
+    // Only cycles are left, in which each local is read by exactly one copy:
+    // the one before it in its cycle. Save the value of one, and read that.
+    while (Copies[Unbroken].Done) Unbroken++;
+    PhiCopy &Copy = Copies[Unbroken];
+    const std::string &Local = getJSName(Copy.Phi);
+    std::string Temp = Local + "$phi";
+    Code += getAdHocAssign(Temp, Copy.Phi->getType()) + Local + ';';
+    unsigned Reader = Unbroken;
+    while (Copies[Reader].Reads != (int)Unbroken) Reader = Copies[Reader].Reads;
+    Copies[Reader].Value = Temp;
+    Copies[Reader].Reads = -1;
+    Copy.Readers = 0;
+    Ready.push_back(Unbroken);
   }
-  return pre + post;
+  return Code;
 }
 
 const std::string &JSWriter::getJSName(const Value* val) {
-  ValueMap::const_iterator I = ValueNames.find(val);
-  if (I != ValueNames.end() && I->first == val)
-    return I->second;
+  ValueNameMap::const_iterator I = ValueNames.find(val);
+  if (I != ValueNames.end())
+    return *I->second;
 
   // If this is an alloca we've replaced with another, use the other name.
   if (const AllocaInst *AI = dyn_cast<AllocaInst>(val)) {
@@ -672,7 +1029,9 @@ const std::string &JSWriter::getJSName(const Value* val) {
     sanitizeLocal(name);
   }
 
-  return ValueNames[val] = name;
+  const std::string &Interned = JSNames.GetOrCreateValue(name, name).getValue();
+  ValueNames[val] = &Interned;
+  return Interned;
 }
 
 std::string JSWriter::getAdHocAssign(const StringRef &s, Type *t) {
@@ -681,6 +1040,7 @@ std::string JSWriter::getAdHocAssign(const StringRef &s, Type *t) {
 }
 
 std::string JSWriter::getAssign(const Instruction *I) {
+  if (I == FoldingInst) return std::string(); // the value goes straight into its user
   return getAdHocAssign(getJSName(I), I->getType());
 }
 
@@ -691,16 +1051,14 @@ std::string JSWriter::getAssignIfNeeded(const Value *V) {
   return std::string();
 }
 
-std::string JSWriter::getCast(const StringRef &s, Type *t, AsmCast sign) {
+std::string JSWriter::getCast(const Twine &s, Type *t, AsmCast sign) {
   switch (t->getTypeID()) {
     default: {
       errs() << *t << "\n";
       assert(false && "Unsupported type");
     }
     case Type::VectorTyID:
-      return (cast<VectorType>(t)->getElementType()->isIntegerTy() ?
-              "SIMD_int32x4(" + s + ")" :
-              "SIMD_float32x4(" + s + ")").str();
+      return (getSIMDName(cast<VectorType>(t)) + "(" + s + ")").str();
     case Type::FloatTyID: {
       if (PreciseF32 && !(sign & ASM_FFI_OUT)) {
         if (sign & ASM_FFI_IN) {
@@ -727,8 +1085,8 @@ std::string JSWriter::getCast(const StringRef &s, Type *t, AsmCast sign) {
   }
 }
 
-std::string JSWriter::getParenCast(const StringRef &s, Type *t, AsmCast sign) {
-  return getCast(("(" + s + ")").str(), t, sign);
+std::string JSWriter::getParenCast(const Twine &s, Type *t, AsmCast sign) {
+  return getCast("(" + s + ")", t, sign);
 }
 
 std::string JSWriter::getDoubleToInt(const StringRef &s) {
@@ -745,22 +1103,27 @@ std::string JSWriter::getIMul(const Value *V1, const Value *V2) {
   }
   // we ignore optimizing the case of multiplying two constants - optimizer would have removed those
   if (CI) {
-    std::string OtherStr = getValueAsStr(Other);
-    unsigned C = CI->getZExtValue();
-    if (C == 0) return "0";
-    if (C == 1) return OtherStr;
-    unsigned Orig = C, Shifts = 0;
-    while (C) {
-      if ((C & 1) && (C != 1)) break; // not power of 2
-      C >>= 1;
-      Shifts++;
-      if (C == 0) return OtherStr + "<<" + utostr(Shifts-1); // power of 2, emit shift
-    }
-    if (Orig < (1<<20)) return "(" + OtherStr + "*" + utostr(Orig) + ")|0"; // small enough, avoid imul
+    std::string Ret = getIMulByConstant(getValueAsStr(Other), CI->getZExtValue());
+    if (!Ret.empty()) return Ret;
   }
   return "Math_imul(" + getValueAsStr(V1) + ", " + getValueAsStr(V2) + ")|0"; // unknown or too large, emit imul
 }
 
+// Returns an empty string if the multiplication needs Math_imul.
+std::string JSWriter::getIMulByConstant(const std::string &OtherStr, unsigned C) {
+  if (C == 0) return "0";
+  if (C == 1) return OtherStr;
+  unsigned Orig = C, Shifts = 0;
+  while (C) {
+    if ((C & 1) && (C != 1)) break; // not power of 2
+    C >>= 1;
+    Shifts++;
+    if (C == 0) return OtherStr + "<<" + utostr(Shifts-1); // power of 2, emit shift
+  }
+  if (Orig < (1<<20)) return "(" + OtherStr + "*" + utostr(Orig) + ")|0"; // small enough, avoid imul
+  return std::string();
+}
+
 std::string JSWriter::getLoad(const Instruction *I, const Value *P, Type *T, unsigned Alignment, char sep) {
   std::string Assign = getAssign(I);
   unsigned Bytes = DL->getTypeAllocSize(T);
@@ -1020,7 +1383,7 @@ std::string JSWriter::getConstant(const Constant* CV, AsmCast sign) {
   if (isa<ConstantPointerNull>(CV)) return "0";
 
   if (const Function *F = dyn_cast<Function>(CV)) {
-    return utostr(getFunctionIndex(F));
+    return getFunctionIndexStr(F);
   }
 
   if (const GlobalValue *GV = dyn_cast<GlobalValue>(CV)) {
@@ -1051,11 +1414,7 @@ std::string JSWriter::getConstant(const Constant* CV, AsmCast sign) {
   } else if (isa<UndefValue>(CV)) {
     std::string S;
     if (VectorType *VT = dyn_cast<VectorType>(CV->getType())) {
-      if (VT->getElementType()->isIntegerTy()) {
-        S = "SIMD_int32x4_splat(0)";
-      } else {
-        S = "SIMD_float32x4_splat(Math_fround(0))";
-      }
+      S = getZeroVector(VT);
     } else {
       S = CV->getType()->isFloatingPointTy() ? "+0" : "0"; // XXX refactor this
       if (PreciseF32 && CV->getType()->isFloatTy() && !(sign & ASM_FFI_OUT)) {
@@ -1065,33 +1424,13 @@ std::string JSWriter::getConstant(const Constant* CV, AsmCast sign) {
     return S;
   } else if (isa<ConstantAggregateZero>(CV)) {
     if (VectorType *VT = dyn_cast<VectorType>(CV->getType())) {
-      if (VT->getElementType()->isIntegerTy()) {
-        return "SIMD_int32x4_splat(0)";
-      } else {
-        return "SIMD_float32x4_splat(Math_fround(0))";
-      }
+      return getZeroVector(VT);
     } else {
       // something like [0 x i8*] zeroinitializer, which clang can emit for landingpads
       return "0";
     }
-  } else if (const ConstantDataVector *DV = dyn_cast<ConstantDataVector>(CV)) {
-    unsigned NumElts = cast<VectorType>(DV->getType())->getNumElements();
-    Type *EltTy = cast<VectorType>(DV->getType())->getElementType();
-    Constant *Undef = UndefValue::get(EltTy);
-    return getConstantVector(EltTy,
-                             getConstant(NumElts > 0 ? DV->getElementAsConstant(0) : Undef),
-                             getConstant(NumElts > 1 ? DV->getElementAsConstant(1) : Undef),
-                             getConstant(NumElts > 2 ? DV->getElementAsConstant(2) : Undef),
-                             getConstant(NumElts > 3 ? DV->getElementAsConstant(3) : Undef));
-  } else if (const ConstantVector *V = dyn_cast<ConstantVector>(CV)) {
-    unsigned NumElts = cast<VectorType>(CV->getType())->getNumElements();
-    Type *EltTy = cast<VectorType>(CV->getType())->getElementType();
-    Constant *Undef = UndefValue::get(EltTy);
-    return getConstantVector(cast<VectorType>(V->getType())->getElementType(),
-                             getConstant(NumElts > 0 ? V->getOperand(0) : Undef),
-                             getConstant(NumElts > 1 ? V->getOperand(1) : Undef),
-                             getConstant(NumElts > 2 ? V->getOperand(2) : Undef),
-                             getConstant(NumElts > 3 ? V->getOperand(3) : Undef));
+  } else if (isa<ConstantDataVector>(CV) || isa<ConstantVector>(CV)) {
+    return getConstantVector(CV);
   } else if (const ConstantArray *CA = dyn_cast<const ConstantArray>(CV)) {
     // handle things like [i8* bitcast (<{ i32, i32, i32 }>* @_ZTISt9bad_alloc to i8*)] which clang can emit for landingpads
     assert(CA->getNumOperands() == 1);
@@ -1114,21 +1453,58 @@ std::string JSWriter::getConstant(const Constant* CV, AsmCast sign) {
   }
 }
 
-std::string JSWriter::getConstantVector(Type *ElementType, std::string x, std::string y, std::string z, std::string w) {
-  // Check for a splat.
-  if (x == y && x == z && x == w) {
-    if (ElementType->isIntegerTy()) {
-      return "SIMD_int32x4_splat(" + x + ')';
-    } else {
-      return "SIMD_float32x4_splat(Math_fround(" + x + "))";
+std::string JSWriter::getConstantVector(const Constant *CV) {
+  VectorType *VT = cast<VectorType>(CV->getType());
+  checkVectorType(VT);
+  SIMDType ST = getSIMDType(VT);
+  unsigned NumElts = VT->getNumElements();
+  Constant *Undef = UndefValue::get(VT->getElementType());
+
+  // Lanes past the end of a partial vector are undefined.
+  SmallVector<std::string, 16> Lanes;
+  bool Splat = true;
+  for (unsigned i = 0; i < SIMDTypeLanes[ST]; i++) {
+    Lanes.push_back(getConstant(i < NumElts ? CV->getAggregateElement(i) : Undef));
+    if (Lanes[i] != Lanes[0]) Splat = false;
+  }
+  if (ST == SIMD_FLOAT32X4) {
+    for (unsigned i = 0; i < Lanes.size(); i++) {
+      Lanes[i] = "Math_fround(" + Lanes[i] + ")";
     }
   }
 
-  if (ElementType->isIntegerTy()) {
-    return "SIMD_int32x4(" + x + ',' + y + ',' + z + ',' + w + ')';
-  } else {
-    return "SIMD_float32x4(Math_fround(" + x + "),Math_fround(" + y + "),Math_fround(" + z + "),Math_fround(" + w + "))";
+  if (Splat) {
+    return getSIMDName(VT) + "_splat(" + Lanes[0] + ')';
+  }
+  std::string Code = getSIMDName(VT) + "(";
+  for (unsigned i = 0; i < Lanes.size(); i++) {
+    if (i != 0) Code += ',';
+    Code += Lanes[i];
   }
+  return Code + ')';
+}
+
+std::string JSWriter::getZeroVector(VectorType *VT) {
+  switch (getSIMDType(VT)) {
+    case SIMD_FLOAT32X4: return "SIMD_float32x4_splat(Math_fround(0))";
+    case SIMD_FLOAT64X2: return "SIMD_float64x2_splat(+0)";
+    default: return getSIMDName(VT) + "_splat(0)";
+  }
+}
+
+// Types with up to four lanes name them x, y, z and w; the others number them.
+std::string JSWriter::getSIMDExtractLane(VectorType *VT, const std::string &V, unsigned Index) {
+  if (SIMDTypeLanes[getSIMDType(VT)] <= 4) {
+    return V + '.' + simdLane[Index];
+  }
+  return getSIMDName(VT) + "_extractLane(" + V + ", " + utostr(Index) + ")";
+}
+
+std::string JSWriter::getSIMDReplaceLane(VectorType *VT, const std::string &V, unsigned Index, const std::string &X) {
+  if (SIMDTypeLanes[getSIMDType(VT)] <= 4) {
+    return getSIMDName(VT) + "_with" + SIMDLane[Index] + "(" + V + ',' + X + ')';
+  }
+  return getSIMDName(VT) + "_replaceLane(" + V + ", " + utostr(Index) + ", " + X + ")";
 }
 
 std::string JSWriter::getValueAsStr(const Value* V, AsmCast sign) {
@@ -1138,6 +1514,10 @@ std::string JSWriter::getValueAsStr(const Value* V, AsmCast sign) {
   if (const Constant *CV = dyn_cast<Constant>(V)) {
     return getConstant(CV, sign);
   } else {
+    if (!FoldedExprs.empty()) {
+      ValueMap::const_iterator I = FoldedExprs.find(V);
+      if (I != FoldedExprs.end()) return I->second;
+    }
     return getJSName(V);
   }
 }
@@ -1224,18 +1604,10 @@ void JSWriter::generateInsertElementExpression(const InsertElementInst *III, raw
   if (NumInserted == NumElems) {
     if (Splat) {
       // Emit splat code.
-      if (VT->getElementType()->isIntegerTy()) {
-        Code << "SIMD_int32x4_splat(" << getValueAsStr(Splat) << ")";
-      } else {
-        Code << "SIMD_float32x4_splat(" << getValueAsStr(Splat) << ")";
-      }
+      Code << getSIMDName(VT) << "_splat(" << getValueAsStr(Splat) << ")";
     } else {
       // Emit constructor code.
-      if (VT->getElementType()->isIntegerTy()) {
-        Code << "SIMD_int32x4(";
-      } else {
-        Code << "SIMD_float32x4(";
-      }
+      Code << getSIMDName(VT) << "(";
       for (unsigned Index = 0; Index < NumElems; ++Index) {
         if (Index != 0)
           Code << ", ";
@@ -1247,15 +1619,9 @@ void JSWriter::generateInsertElementExpression(const InsertElementInst *III, raw
     // Emit a series of inserts.
     std::string Result = getValueAsStr(Base);
     for (unsigned Index = 0; Index < NumElems; ++Index) {
-      std::string with;
       if (!Operands[Index])
         continue;
-      if (VT->getElementType()->isIntegerTy()) {
-        with = "SIMD_int32x4_with";
-      } else {
-        with = "SIMD_float32x4_with";
-      }
-      Result = with + SIMDLane[Index] + "(" + Result + ',' + getValueAsStr(Operands[Index]) + ')';
+      Result = getSIMDReplaceLane(VT, Result, Index, getValueAsStr(Operands[Index]));
     }
     Code << Result;
   }
@@ -1267,12 +1633,9 @@ void JSWriter::generateExtractElementExpression(const ExtractElementInst *EEI, r
   const ConstantInt *IndexInt = dyn_cast<const ConstantInt>(EEI->getIndexOperand());
   if (IndexInt) {
     unsigned Index = IndexInt->getZExtValue();
-    assert(Index <= 3);
+    assert(Index < VT->getNumElements());
     Code << getAssignIfNeeded(EEI);
-    std::string OperandCode;
-    raw_string_ostream CodeStream(OperandCode);
-    CodeStream << getValueAsStr(EEI->getVectorOperand()) << '.' << simdLane[Index];
-    Code << getCast(CodeStream.str(), EEI->getType());
+    Code << getCast(getSIMDExtractLane(VT, getValueAsStr(EEI->getVectorOperand()), Index), EEI->getType());
     return;
   }
 
@@ -1292,11 +1655,7 @@ void JSWriter::generateShuffleVectorExpression(const ShuffleVectorInst *SVI, raw
     InsertElementInst *IEI = cast<InsertElementInst>(SVI->getOperand(0));
     if (ConstantInt *CI = dyn_cast<ConstantInt>(IEI->getOperand(2))) {
       if (CI->isZero()) {
-        if (SVI->getType()->getElementType()->isIntegerTy()) {
-          Code << "SIMD_int32x4_splat(";
-        } else {
-          Code << "SIMD_float32x4_splat(";
-        }
+        Code << getSIMDName(SVI->getType()) << "_splat(";
         Code << getValueAsStr(IEI->getOperand(1)) << ")";
         return;
       }
@@ -1308,30 +1667,17 @@ void JSWriter::generateShuffleVectorExpression(const ShuffleVectorInst *SVI, raw
   std::string B = getValueAsStr(SVI->getOperand(1));
   int OpNumElements = cast<VectorType>(SVI->getOperand(0)->getType())->getNumElements();
   int ResultNumElements = SVI->getType()->getNumElements();
-  int Mask0 = ResultNumElements > 0 ? SVI->getMaskValue(0) : -1;
-  int Mask1 = ResultNumElements > 1 ? SVI->getMaskValue(1) : -1;
-  int Mask2 = ResultNumElements > 2 ? SVI->getMaskValue(2) : -1;
-  int Mask3 = ResultNumElements > 3 ? SVI->getMaskValue(3) : -1;
-  bool swizzleA = false;
-  bool swizzleB = false;
-  if ((Mask0 < OpNumElements) && (Mask1 < OpNumElements) &&
-      (Mask2 < OpNumElements) && (Mask3 < OpNumElements)) {
-    swizzleA = true;
-  }
-  if ((Mask0 < 0 || (Mask0 >= OpNumElements && Mask0 < OpNumElements * 2)) &&
-      (Mask1 < 0 || (Mask1 >= OpNumElements && Mask1 < OpNumElements * 2)) &&
-      (Mask2 < 0 || (Mask2 >= OpNumElements && Mask2 < OpNumElements * 2)) &&
-      (Mask3 < 0 || (Mask3 >= OpNumElements && Mask3 < OpNumElements * 2))) {
-    swizzleB = true;
-  }
-  assert(!(swizzleA && swizzleB));
+  int Lanes = SIMDTypeLanes[getSIMDType(SVI->getType())];
+  bool swizzleA = true;
+  bool swizzleB = true;
+  for (int i = 0; i < ResultNumElements; ++i) {
+    int Mask = SVI->getMaskValue(i);
+    if (Mask >= OpNumElements) swizzleA = false;
+    if (Mask >= 0 && Mask < OpNumElements) swizzleB = false;
+  }
   if (swizzleA || swizzleB) {
     std::string T = (swizzleA ? A : B);
-    if (SVI->getType()->getElementType()->isIntegerTy()) {
-      Code << "SIMD_int32x4_swizzle(" << T;
-    } else {
-      Code << "SIMD_float32x4_swizzle(" << T;
-    }
+    Code << getSIMDName(SVI->getType()) << "_swizzle(" << T;
     int i = 0;
     for (; i < ResultNumElements; ++i) {
       Code << ", ";
@@ -1345,7 +1691,7 @@ void JSWriter::generateShuffleVectorExpression(const ShuffleVectorInst *SVI, raw
         Code << (Mask-OpNumElements);
       }
     }
-    for (; i < 4; ++i) {
+    for (; i < Lanes; ++i) {
       Code << ", 0";
     }
     Code << ")";
@@ -1353,11 +1699,7 @@ void JSWriter::generateShuffleVectorExpression(const ShuffleVectorInst *SVI, raw
   }
 
   // Emit a fully-general shuffle.
-  if (SVI->getType()->getElementType()->isIntegerTy()) {
-    Code << "SIMD_int32x4_shuffle(";
-  } else {
-    Code << "SIMD_float32x4_shuffle(";
-  }
+  Code << getSIMDName(SVI->getType()) << "_shuffle(";
 
   Code << A << ", " << B << ", ";
 
@@ -1368,7 +1710,7 @@ void JSWriter::generateShuffleVectorExpression(const ShuffleVectorInst *SVI, raw
       Code << ", ";
     int Mask = Indices[i];
     if (Mask >= OpNumElements)
-      Mask = Mask - OpNumElements + 4;
+      Mask = Mask - OpNumElements + Lanes;
     if (Mask < 0)
       Code << 0;
     else
@@ -1395,10 +1737,12 @@ void JSWriter::generateICmpExpression(const ICmpInst *I, raw_string_ostream& Cod
     default: I->dump(); error("invalid vector icmp"); break;
   }
 
+  std::string T = getSIMDName(cast<VectorType>(I->getOperand(0)->getType()));
+  Code << getAssignIfNeeded(I);
   if (Invert)
-    Code << "SIMD_int32x4_not(";
+    Code << T << "_not(";
 
-  Code << getAssignIfNeeded(I) << "SIMD_int32x4_" << Name << "("
+  Code << T << "_" << Name << "("
        << getValueAsStr(I->getOperand(0)) << ", " << getValueAsStr(I->getOperand(1)) << ")";
 
   if (Invert)
@@ -1406,44 +1750,47 @@ void JSWriter::generateICmpExpression(const ICmpInst *I, raw_string_ostream& Cod
 }
 
 void JSWriter::generateFCmpExpression(const FCmpInst *I, raw_string_ostream& Code) {
-  const char *Name;
+  VectorType *VT = cast<VectorType>(I->getOperand(0)->getType());
+  std::string T = getSIMDName(VT);
+  std::string A = getValueAsStr(I->getOperand(0));
+  std::string B = getValueAsStr(I->getOperand(1));
+  // float64x2 compares give a mask with two 32-bit lanes per double, which is
+  // narrowed below to the one lane per element of other <2 x i1> masks.
+  bool Narrow = getSIMDType(VT) == SIMD_FLOAT64X2;
+  std::string Logic = Narrow ? "SIMD_int32x4" : T;
+  std::string Result;
+  const char *Name = NULL;
   bool Invert = false;
   switch (cast<FCmpInst>(I)->getPredicate()) {
     case ICmpInst::FCMP_FALSE:
-      Code << "SIMD_int32x4_splat(0)";
+      Code << getAssignIfNeeded(I) << "SIMD_int32x4_splat(0)";
       return;
     case ICmpInst::FCMP_TRUE:
-      Code << "SIMD_int32x4_splat(-1)";
+      Code << getAssignIfNeeded(I) << "SIMD_int32x4_splat(-1)";
       return;
     case ICmpInst::FCMP_ONE:
-      Code << "SIMD_float32x4_and(SIMD_float32x4_and("
-              "SIMD_float32x4_equal(" << getValueAsStr(I->getOperand(0)) << ", "
-                                      << getValueAsStr(I->getOperand(0)) << "), " <<
-              "SIMD_float32x4_equal(" << getValueAsStr(I->getOperand(1)) << ", "
-                                      << getValueAsStr(I->getOperand(1)) << ")), " <<
-              "SIMD_float32x4_notEqual(" << getValueAsStr(I->getOperand(0)) << ", "
-                                         << getValueAsStr(I->getOperand(1)) << "))";
-      return;
+      Result = Logic + "_and(" + Logic + "_and(" +
+               T + "_equal(" + A + ", " + A + "), " +
+               T + "_equal(" + B + ", " + B + ")), " +
+               T + "_notEqual(" + A + ", " + B + "))";
+      break;
     case ICmpInst::FCMP_UEQ:
-      Code << "SIMD_float32x4_or(SIMD_float32x4_or("
-              "SIMD_float32x4_notEqual(" << getValueAsStr(I->getOperand(0)) << ", "
-                                         << getValueAsStr(I->getOperand(0)) << "), " <<
-              "SIMD_float32x4_notEqual(" << getValueAsStr(I->getOperand(1)) << ", "
-                                         << getValueAsStr(I->getOperand(1)) << ")), " <<
-              "SIMD_float32x4_equal(" << getValueAsStr(I->getOperand(0)) << ", "
-                                      << getValueAsStr(I->getOperand(1)) << "))";
-      return;
+      Result = Logic + "_or(" + Logic + "_or(" +
+               T + "_notEqual(" + A + ", " + A + "), " +
+               T + "_notEqual(" + B + ", " + B + ")), " +
+               T + "_equal(" + A + ", " + B + "))";
+      break;
     case FCmpInst::FCMP_ORD:
-      Code << "SIMD_float32x4_and("
-              "SIMD_float32x4_equal(" << getValueAsStr(I->getOperand(0)) << ", " << getValueAsStr(I->getOperand(0)) << "), " <<
-              "SIMD_float32x4_equal(" << getValueAsStr(I->getOperand(1)) << ", " << getValueAsStr(I->getOperand(1)) << "))";
-      return;
+      Result = Logic + "_and(" +
+               T + "_equal(" + A + ", " + A + "), " +
+               T + "_equal(" + B + ", " + B + "))";
+      break;
 
     case FCmpInst::FCMP_UNO:
-      Code << "SIMD_float32x4_or("
-              "SIMD_float32x4_notEqual(" << getValueAsStr(I->getOperand(0)) << ", " << getValueAsStr(I->getOperand(0)) << "), " <<
-              "SIMD_float32x4_notEqual(" << getValueAsStr(I->getOperand(1)) << ", " << getValueAsStr(I->getOperand(1)) << "))";
-      return;
+      Result = Logic + "_or(" +
+               T + "_notEqual(" + A + ", " + A + "), " +
+               T + "_notEqual(" + B + ", " + B + "))";
+      break;
 
     case ICmpInst::FCMP_OEQ:  Name = "equal"; break;
     case ICmpInst::FCMP_OGT:  Name = "greaterThan"; break;
@@ -1458,14 +1805,17 @@ void JSWriter::generateFCmpExpression(const FCmpInst *I, raw_string_ostream& Cod
     default: I->dump(); error("invalid vector fcmp"); break;
   }
 
-  if (Invert)
-    Code << "SIMD_int32x4_not(";
-
-  Code << getAssignIfNeeded(I) << "SIMD_float32x4_" << Name << "("
-       << getValueAsStr(I->getOperand(0)) << ", " << getValueAsStr(I->getOperand(1)) << ")";
+  if (Name) {
+    Result = T + "_" + Name + "(" + A + ", " + B + ")";
+    if (Invert)
+      Result = "SIMD_int32x4_not(" + Result + ")";
+  }
 
-  if (Invert)
-    Code << ")";
+  Code << getAssignIfNeeded(I);
+  if (Narrow)
+    Code << "SIMD_int32x4_swizzle(" << Result << ", 0, 2, 0, 0)";
+  else
+    Code << Result;
 }
 
 static const Value *getElement(const Value *V, unsigned i) {
@@ -1503,7 +1853,7 @@ void JSWriter::generateShiftExpression(const BinaryOperator *I, raw_string_ostre
     // then we can use a ByScalar shift.
     const Value *Count = I->getOperand(1);
     if (const Value *Splat = getSplatValue(Count)) {
-        Code << getAssignIfNeeded(I) << "SIMD_int32x4_";
+        Code << getAssignIfNeeded(I) << getSIMDName(cast<VectorType>(I->getType())) << "_";
         if (I->getOpcode() == Instruction::AShr)
             Code << "shiftRightArithmeticByScalar";
         else if (I->getOpcode() == Instruction::LShr)
@@ -1518,51 +1868,62 @@ void JSWriter::generateShiftExpression(const BinaryOperator *I, raw_string_ostre
     generateUnrolledExpression(I, Code);
 }
 
+static uint64_t LSBMask(unsigned numBits) {
+  return numBits >= 64 ? 0xFFFFFFFFFFFFFFFFULL : (1ULL << numBits) - 1;
+}
+
 void JSWriter::generateUnrolledExpression(const User *I, raw_string_ostream& Code) {
   VectorType *VT = cast<VectorType>(I->getType());
+  VectorType *OpVT = cast<VectorType>(I->getOperand(0)->getType());
+  Type *ElemTy = VT->getElementType();
 
   Code << getAssignIfNeeded(I);
 
-  if (VT->getElementType()->isIntegerTy()) {
-    Code << "SIMD_int32x4(";
-  } else {
-    Code << "SIMD_float32x4(";
-  }
+  Code << getSIMDName(VT) << "(";
+
+  // Lanes of int8x16 and int16x8 come out sign-extended, so unsigned
+  // operations mask them instead of just reading them as unsigned.
+  unsigned OpBits = OpVT->getScalarSizeInBits();
+  std::string UMask = OpBits < 32 ? "&" + utostr(LSBMask(OpBits)) : ">>>0";
 
   for (unsigned Index = 0; Index < VT->getNumElements(); ++Index) {
     if (Index != 0)
         Code << ", ";
-    std::string Lane = VT->getNumElements() <= 4 ?
-                       std::string(".") + simdLane[Index] :
-                       ".s" + utostr(Index);
+    std::string A = getSIMDExtractLane(OpVT, getValueAsStr(I->getOperand(0)), Index);
+    std::string B = I->getNumOperands() > 1 ?
+                    getSIMDExtractLane(OpVT, getValueAsStr(I->getOperand(1)), Index) :
+                    std::string();
     switch (Operator::getOpcode(I)) {
       case Instruction::SDiv:
-        Code << "(" << getValueAsStr(I->getOperand(0)) << Lane << "|0) / ("
-             << getValueAsStr(I->getOperand(1)) << Lane << "|0)|0";
+        Code << "(" << A << "|0) / (" << B << "|0)|0";
         break;
       case Instruction::UDiv:
-        Code << "(" << getValueAsStr(I->getOperand(0)) << Lane << ">>>0) / ("
-             << getValueAsStr(I->getOperand(1)) << Lane << ">>>0)>>>0";
+        Code << "(" << A << UMask << ") / (" << B << UMask << ")>>>0";
         break;
       case Instruction::SRem:
-        Code << "(" << getValueAsStr(I->getOperand(0)) << Lane << "|0) / ("
-             << getValueAsStr(I->getOperand(1)) << Lane << "|0)|0";
+        Code << "(" << A << "|0) / (" << B << "|0)|0";
         break;
       case Instruction::URem:
-        Code << "(" << getValueAsStr(I->getOperand(0)) << Lane << ">>>0) / ("
-             << getValueAsStr(I->getOperand(1)) << Lane << ">>>0)>>>0";
+        Code << "(" << A << UMask << ") / (" << B << UMask << ")>>>0";
         break;
       case Instruction::AShr:
-        Code << "(" << getValueAsStr(I->getOperand(0)) << Lane << "|0) >> ("
-             << getValueAsStr(I->getOperand(1)) << Lane << "|0)|0";
+        Code << "(" << A << "|0) >> (" << B << "|0)|0";
         break;
       case Instruction::LShr:
-        Code << "(" << getValueAsStr(I->getOperand(0)) << Lane << "|0) >>> ("
-             << getValueAsStr(I->getOperand(1)) << Lane << "|0)|0";
+        if (OpBits < 32) {
+          Code << "(" << A << UMask << ") >>> (" << B << "|0)|0";
+        } else {
+          Code << "(" << A << "|0) >>> (" << B << "|0)|0";
+        }
         break;
       case Instruction::Shl:
-        Code << "(" << getValueAsStr(I->getOperand(0)) << Lane << "|0) << ("
-             << getValueAsStr(I->getOperand(1)) << Lane << "|0)|0";
+        Code << "(" << A << "|0) << (" << B << "|0)|0";
+        break;
+      case Instruction::UIToFP:
+        Code << getCast("+(" + A + ">>>0)", ElemTy);
+        break;
+      case Instruction::FPToUI:
+        Code << "~~+" << A << "|0";
         break;
       default: I->dump(); error("invalid unrolled vector instr"); break;
     }
@@ -1591,6 +1952,7 @@ bool JSWriter::generateSIMDExpression(const User *I, raw_string_ostream& Code) {
         break;
       case Instruction::SExt:
         assert(cast<VectorType>(I->getOperand(0)->getType())->getElementType()->isIntegerTy(1) &&
+               getSIMDType(cast<VectorType>(I->getOperand(0)->getType())) == getSIMDType(VT) &&
                "sign-extension from vector of other than i1 not yet supported");
         // Since we represent vectors of i1 as vectors of sign extended wider integers,
         // sign extending them is a no-op.
@@ -1600,69 +1962,83 @@ bool JSWriter::generateSIMDExpression(const User *I, raw_string_ostream& Code) {
         // Since we represent vectors of i1 as vectors of sign extended wider integers,
         // selecting on them is just an elementwise select.
         if (isa<VectorType>(I->getOperand(0)->getType())) {
-          if (cast<VectorType>(I->getType())->getElementType()->isIntegerTy()) {
-            Code << getAssignIfNeeded(I) << "SIMD_int32x4_select(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << "," << getValueAsStr(I->getOperand(2)) << ")"; break;
-          } else {
-            Code << getAssignIfNeeded(I) << "SIMD_float32x4_select(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << "," << getValueAsStr(I->getOperand(2)) << ")"; break;
-          }
-          return true;
+          std::string Mask = getValueAsStr(I->getOperand(0));
+          // float64x2 selects on two 32-bit mask lanes per double.
+          if (getSIMDType(VT) == SIMD_FLOAT64X2)
+            Mask = "SIMD_int32x4_swizzle(" + Mask + ", 0, 0, 1, 1)";
+          Code << getAssignIfNeeded(I) << getSIMDName(VT) << "_select(" << Mask << "," << getValueAsStr(I->getOperand(1)) << "," << getValueAsStr(I->getOperand(2)) << ")";
+          break;
         }
         // Otherwise we have a scalar condition, so it's a ?: operator.
         return false;
-      case Instruction::FAdd: Code << getAssignIfNeeded(I) << "SIMD_float32x4_add(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
-      case Instruction::FMul: Code << getAssignIfNeeded(I) << "SIMD_float32x4_mul(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
-      case Instruction::FDiv: Code << getAssignIfNeeded(I) << "SIMD_float32x4_div(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
-      case Instruction::Add: Code << getAssignIfNeeded(I) << "SIMD_int32x4_add(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
-      case Instruction::Sub: Code << getAssignIfNeeded(I) << "SIMD_int32x4_sub(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
-      case Instruction::Mul: Code << getAssignIfNeeded(I) << "SIMD_int32x4_mul(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
-      case Instruction::And: Code << getAssignIfNeeded(I) << "SIMD_int32x4_and(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
-      case Instruction::Or:  Code << getAssignIfNeeded(I) << "SIMD_int32x4_or(" <<  getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
+      case Instruction::FAdd: Code << getAssignIfNeeded(I) << getSIMDName(VT) << "_add(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
+      case Instruction::FMul: Code << getAssignIfNeeded(I) << getSIMDName(VT) << "_mul(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
+      case Instruction::FDiv: Code << getAssignIfNeeded(I) << getSIMDName(VT) << "_div(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
+      case Instruction::Add: Code << getAssignIfNeeded(I) << getSIMDName(VT) << "_add(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
+      case Instruction::Sub: Code << getAssignIfNeeded(I) << getSIMDName(VT) << "_sub(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
+      case Instruction::Mul: Code << getAssignIfNeeded(I) << getSIMDName(VT) << "_mul(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
+      case Instruction::And: Code << getAssignIfNeeded(I) << getSIMDName(VT) << "_and(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
+      case Instruction::Or:  Code << getAssignIfNeeded(I) << getSIMDName(VT) << "_or(" <<  getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
       case Instruction::Xor:
         // LLVM represents a not(x) as -1 ^ x
         Code << getAssignIfNeeded(I);
         if (BinaryOperator::isNot(I)) {
-          Code << "SIMD_int32x4_not(" << getValueAsStr(BinaryOperator::getNotArgument(I)) << ")"; break;
+          Code << getSIMDName(VT) << "_not(" << getValueAsStr(BinaryOperator::getNotArgument(I)) << ")"; break;
         } else {
-          Code << "SIMD_int32x4_xor(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
+          Code << getSIMDName(VT) << "_xor(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")"; break;
         }
         break;
       case Instruction::FSub:
         // LLVM represents an fneg(x) as -0.0 - x.
         Code << getAssignIfNeeded(I);
         if (BinaryOperator::isFNeg(I)) {
-          Code << "SIMD_float32x4_neg(" << getValueAsStr(BinaryOperator::getFNegArgument(I)) << ")";
+          Code << getSIMDName(VT) << "_neg(" << getValueAsStr(BinaryOperator::getFNegArgument(I)) << ")";
         } else {
-          Code << "SIMD_float32x4_sub(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")";
+          Code << getSIMDName(VT) << "_sub(" << getValueAsStr(I->getOperand(0)) << "," << getValueAsStr(I->getOperand(1)) << ")";
         }
         break;
       case Instruction::BitCast: {
+        VectorType *OpVT = dyn_cast<VectorType>(I->getOperand(0)->getType());
+        if (!OpVT) {
+          I->dump(); error("bitcast to a vector from a non-vector not implemented yet");
+        }
+        checkVectorType(OpVT);
         Code << getAssignIfNeeded(I);
-        if (cast<VectorType>(I->getType())->getElementType()->isIntegerTy()) {
-          Code << "SIMD_int32x4_fromFloat32x4Bits(" << getValueAsStr(I->getOperand(0)) << ')';
+        if (getSIMDType(OpVT) == getSIMDType(VT)) {
+          Code << getValueAsStr(I->getOperand(0));
         } else {
-          Code << "SIMD_float32x4_fromInt32x4Bits(" << getValueAsStr(I->getOperand(0)) << ')';
+          Code << getSIMDName(VT) << "_from" << getSIMDConversionName(OpVT) << "Bits(" << getValueAsStr(I->getOperand(0)) << ')';
         }
         break;
       }
+      case Instruction::SIToFP:
+      case Instruction::FPToSI:
+      case Instruction::FPExt:
+      case Instruction::FPTrunc: {
+        VectorType *OpVT = cast<VectorType>(I->getOperand(0)->getType());
+        checkVectorType(OpVT);
+        Code << getAssignIfNeeded(I) << getSIMDName(VT) << "_from" << getSIMDConversionName(OpVT) << "(" << getValueAsStr(I->getOperand(0)) << ')';
+        break;
+      }
+      case Instruction::UIToFP:
+      case Instruction::FPToUI:
+        // SIMD.js only converts signed integers.
+        generateUnrolledExpression(I, Code);
+        break;
       case Instruction::Load: {
         const LoadInst *LI = cast<LoadInst>(I);
         const Value *P = LI->getPointerOperand();
         std::string PS = getValueAsStr(P);
 
         // Determine if this is a partial load.
-        static const std::string partialAccess[4] = { "X", "XY", "XYZ", "" };
-        if (VT->getNumElements() < 1 || VT->getNumElements() > 4) {
+        const char *Part = getSIMDPartialAccess(VT);
+        if (!Part) {
           error("invalid number of lanes in SIMD operation!");
           break;
         }
-        const std::string &Part = partialAccess[VT->getNumElements() - 1];
 
         Code << getAssignIfNeeded(I);
-        if (VT->getElementType()->isIntegerTy()) {
-          Code << "SIMD_int32x4_load" << Part << "(HEAPU8, " << PS << ")";
-        } else {
-          Code << "SIMD_float32x4_load" << Part << "(HEAPU8, " << PS << ")";
-        }
+        Code << getSIMDName(VT) << "_load" << Part << "(HEAPU8, " << PS << ")";
         break;
       }
       case Instruction::InsertElement:
@@ -1699,18 +2075,13 @@ bool JSWriter::generateSIMDExpression(const User *I, raw_string_ostream& Code) {
       Code << getAdHocAssign(PS, P->getType()) << getValueAsStr(P) << ';';
 
       // Determine if this is a partial store.
-      static const std::string partialAccess[4] = { "X", "XY", "XYZ", "" };
-      if (VT->getNumElements() < 1 || VT->getNumElements() > 4) {
+      const char *Part = getSIMDPartialAccess(VT);
+      if (!Part) {
         error("invalid number of lanes in SIMD operation!");
         return false;
       }
-      const std::string &Part = partialAccess[VT->getNumElements() - 1];
 
-      if (VT->getElementType()->isIntegerTy()) {
-        Code << "SIMD_int32x4_store" << Part << "(HEAPU8, " << PS << ", " << VS << ")";
-      } else {
-        Code << "SIMD_float32x4_store" << Part << "(HEAPU8, " << PS << ", " << VS << ")";
-      }
+      Code << getSIMDName(VT) << "_store" << Part << "(HEAPU8, " << PS << ", " << VS << ")";
       return true;
     } else if (Operator::getOpcode(I) == Instruction::ExtractElement) {
       generateExtractElementExpression(cast<ExtractElementInst>(I), Code);
@@ -1720,10 +2091,6 @@ bool JSWriter::generateSIMDExpression(const User *I, raw_string_ostream& Code) {
   return false;
 }
 
-static uint64_t LSBMask(unsigned numBits) {
-  return numBits >= 64 ? 0xFFFFFFFFFFFFFFFFULL : (1ULL << numBits) - 1;
-}
-
 // Generate code for and operator, either an Instruction or a ConstantExpr.
 void JSWriter::generateExpression(const User *I, raw_string_ostream& Code) {
   // To avoid emiting code and variables for the no-op pointer bitcasts
@@ -2013,7 +2380,12 @@ void JSWriter::generateExpression(const User *I, raw_string_ostream& Code) {
         if (const ConstantInt *CI = dyn_cast<ConstantInt>(Index)) {
           ConstantOffset = (uint32_t)ConstantOffset + (uint32_t)CI->getSExtValue() * ElementSize;
         } else {
-          text = "(" + text + " + (" + getIMul(Index, ConstantInt::get(Type::getInt32Ty(GEP->getContext()), ElementSize)) + ")|0)";
+          // Don't create a ConstantInt for the size here: function bodies may be
+          // emitted on several threads, and the LLVMContext is not locked.
+          std::string IndexStr = getValueAsStr(Index);
+          std::string Mul = getIMulByConstant(IndexStr, ElementSize);
+          if (Mul.empty()) Mul = "Math_imul(" + IndexStr + ", " + itostr((int32_t)ElementSize) + ")|0";
+          text = "(" + text + " + (" + Mul + ")|0)";
         }
       }
     }
@@ -2146,6 +2518,7 @@ void JSWriter::generateExpression(const User *I, raw_string_ostream& Code) {
   }
 
   if (const Instruction *Inst = dyn_cast<Instruction>(I)) {
+    if (Inst == FoldingInst) return; // just the expression
     Code << ';';
     // append debug info
     emitDebugInfo(Code, Inst);
@@ -2172,36 +2545,434 @@ static const Value *considerConditionVar(const Instruction *I) {
   return Num < 5 || Range > 10*1024 || (Range/Num) > 1024 ? NULL : SI->getCondition(); // heuristics
 }
 
+// Whether a load or store through P is aligned, so that P is used only once
+bool JSWriter::isNaturallyAligned(const Value *P, unsigned Alignment) {
+  Type *T = cast<PointerType>(P->getType())->getElementType();
+  return Alignment == 0 || DL->getTypeAllocSize(T) <= Alignment;
+}
+
+// Whether I is emitted as a single side-effect-free scalar expression, so that
+// its local is assigned only after all its operands have been read
+bool JSWriter::isSimpleExpression(const Instruction *I) {
+  Type *T = I->getType();
+  if (T->isIntegerTy() ? T->getIntegerBitWidth() > 32 : !T->isFloatingPointTy() && !T->isPointerTy()) return false;
+  switch (I->getOpcode()) {
+    default: return false;
+    case Instruction::Add:
+    case Instruction::FAdd:
+    case Instruction::Sub:
+    case Instruction::FSub:
+    case Instruction::Mul:
+    case Instruction::FMul:
+    case Instruction::UDiv:
+    case Instruction::SDiv:
+    case Instruction::FDiv:
+    case Instruction::URem:
+    case Instruction::SRem:
+    case Instruction::FRem:
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+    case Instruction::Shl:
+    case Instruction::LShr:
+    case Instruction::AShr:
+    case Instruction::ICmp:
+    case Instruction::FCmp:
+    case Instruction::GetElementPtr:
+    case Instruction::Trunc:
+    case Instruction::ZExt:
+    case Instruction::SExt:
+    case Instruction::FPTrunc:
+    case Instruction::FPExt:
+    case Instruction::FPToUI:
+    case Instruction::FPToSI:
+    case Instruction::UIToFP:
+    case Instruction::SIToFP:
+    case Instruction::PtrToInt:
+    case Instruction::IntToPtr:
+    case Instruction::Select:
+      return !I->getOperand(0)->getType()->isVectorTy();
+    case Instruction::Load: {
+      const LoadInst *LI = cast<LoadInst>(I);
+      return LI->isSimple() && isNaturallyAligned(LI->getPointerOperand(), LI->getAlignment());
+    }
+  }
+}
+
+// Whether I is a simple expression that we know how to emit without assigning
+// it to a local
+bool JSWriter::canFoldExpression(const Instruction *I) {
+  if (!I->hasOneUse() || I != I->stripPointerCasts()) return false;
+  if (const LoadInst *LI = dyn_cast<LoadInst>(I)) {
+    if (isAbsolute(LI->getPointerOperand())) return false;
+  }
+  return isSimpleExpression(I);
+}
+
+// Whether User emits each of its operands exactly once, and is emitted where
+// it appears in its block, so that a folded operand is evaluated exactly once
+// and in the same place relative to the rest of the block's code
+bool JSWriter::canFoldInto(const Instruction *User) {
+  if (User != User->stripPointerCasts() || User->getType()->isVectorTy()) return false;
+  switch (User->getOpcode()) {
+    default: return false;
+    case Instruction::Add:
+    case Instruction::FAdd:
+    case Instruction::Sub:
+    case Instruction::FSub:
+    case Instruction::Mul:
+    case Instruction::FMul:
+    case Instruction::UDiv:
+    case Instruction::SDiv:
+    case Instruction::FDiv:
+    case Instruction::URem:
+    case Instruction::SRem:
+    case Instruction::FRem:
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+    case Instruction::Shl:
+    case Instruction::LShr:
+    case Instruction::AShr:
+    case Instruction::ICmp:
+    case Instruction::GetElementPtr:
+    case Instruction::Trunc:
+    case Instruction::ZExt:
+    case Instruction::SExt:
+    case Instruction::FPTrunc:
+    case Instruction::FPExt:
+    case Instruction::FPToUI:
+    case Instruction::FPToSI:
+    case Instruction::UIToFP:
+    case Instruction::SIToFP:
+    case Instruction::PtrToInt:
+    case Instruction::IntToPtr:
+    case Instruction::BitCast:
+    case Instruction::Select:
+    case Instruction::Ret:
+      return true;
+    case Instruction::FCmp:
+      // the unordered equality and the ordered/unordered checks use each operand several times
+      switch (cast<FCmpInst>(User)->getPredicate()) {
+        case FCmpInst::FCMP_UEQ:
+        case FCmpInst::FCMP_ONE:
+        case FCmpInst::FCMP_ORD:
+        case FCmpInst::FCMP_UNO: return false;
+        default: return true;
+      }
+    case Instruction::Load: {
+      const LoadInst *LI = cast<LoadInst>(User);
+      return isNaturallyAligned(LI->getPointerOperand(), LI->getAlignment());
+    }
+    case Instruction::Store: {
+      const StoreInst *SI = cast<StoreInst>(User);
+      return !SI->getValueOperand()->getType()->isVectorTy() &&
+             isNaturallyAligned(SI->getPointerOperand(), SI->getAlignment());
+    }
+    case Instruction::Br:
+      // the condition is checked once, before any phi assignments
+      return cast<BranchInst>(User)->isConditional();
+  }
+}
+
+// Finds the instructions in BB that can be emitted as part of their single
+// user, in the same block, instead of being assigned to a local. Locals are
+// only reassigned by phis, at the end of the block, so a folded expression
+// reads the same locals where it ends up. If it reads memory, it must also
+// not move past anything that may write memory.
+void JSWriter::findFoldedExpressions(const BasicBlock *BB) {
+  std::map<const Instruction*, unsigned> Positions;
+  std::vector<unsigned> NextWrite; // for each position, where memory may next be written
+  for (BasicBlock::const_iterator I = BB->begin(), E = BB->end(); I != E; ++I) {
+    Positions[I] = NextWrite.size();
+    NextWrite.push_back(I->mayWriteToMemory() ? NextWrite.size() : UINT_MAX);
+  }
+  for (unsigned i = NextWrite.size()-1; i > 0; i--) {
+    NextWrite[i-1] = std::min(NextWrite[i-1], NextWrite[i]);
+  }
+
+  std::set<const Instruction*> ReadsMemory;
+  for (BasicBlock::const_iterator I = BB->begin(), E = BB->end(); I != E; ++I) {
+    if (!canFoldExpression(I)) continue;
+    const Instruction *User = dyn_cast<Instruction>(*I->use_begin());
+    if (!User || User->getParent() != BB || !canFoldInto(User)) continue;
+    bool Reads = isa<LoadInst>(I);
+    for (unsigned i = 0; i < I->getNumOperands(); i++) {
+      if (const Instruction *Op = dyn_cast<Instruction>(I->getOperand(i))) {
+        if (ReadsMemory.count(Op)) Reads = true;
+      }
+    }
+    unsigned Position = Positions[I];
+    if (Reads && Position+1 < NextWrite.size() && NextWrite[Position+1] < Positions[User]) continue;
+    FoldedInsts.insert(I);
+    if (Reads) ReadsMemory.insert(I);
+  }
+}
+
+void JSWriter::foldExpression(const Instruction *I) {
+  std::string Expr;
+  raw_string_ostream ExprStream(Expr);
+  FoldingInst = I;
+  generateExpression(I, ExprStream);
+  FoldingInst = NULL;
+  FoldedExprs[I] = "(" + ExprStream.str() + ")";
+}
+
+// Collects the instructions whose locals U reads where it is emitted. Folded
+// expressions read their operands where their user is emitted.
+void JSWriter::getLocalUses(const User *U, SmallVectorImpl<const Instruction*> &Uses) {
+  for (User::const_op_iterator OI = U->op_begin(), OE = U->op_end(); OI != OE; ++OI) {
+    const Value *V = *OI;
+    const Instruction *I = dyn_cast<Instruction>(V->stripPointerCasts());
+    if (!I) continue;
+    if (FoldedInsts.count(I)) {
+      getLocalUses(I, Uses);
+    } else {
+      Uses.push_back(I);
+    }
+  }
+}
+
+static LocalClass getLocalClass(Type *T) {
+  switch (T->getTypeID()) {
+    default: return LOCAL_NONE;
+    case Type::IntegerTyID: return T->getIntegerBitWidth() <= 32 ? LOCAL_INT : LOCAL_NONE;
+    case Type::PointerTyID: return LOCAL_INT;
+    case Type::FloatTyID: return PreciseF32 ? LOCAL_FLOAT : LOCAL_DOUBLE;
+    case Type::DoubleTyID: return LOCAL_DOUBLE;
+    case Type::VectorTyID:
+      switch (getSIMDType(cast<VectorType>(T))) {
+        case SIMD_INT32X4: return LOCAL_INT32X4;
+        case SIMD_FLOAT32X4: return LOCAL_FLOAT32X4;
+        case SIMD_INT8X16: return LOCAL_INT8X16;
+        case SIMD_INT16X8: return LOCAL_INT16X8;
+        default: return LOCAL_FLOAT64X2;
+      }
+  }
+}
+
+// Picks the locals of F's values before it is emitted, letting values of the
+// same type share a local when they are never live at the same time.
+//
+// In SSA form, a value live at some point is defined before it, so coloring
+// the blocks in reverse postorder, each from the top, sees every value live at
+// a definition already colored. Phis are defined at the top of their block;
+// the copies into them at the end of each predecessor are ordered by
+// getPhiCode, which sees through any sharing between phis and incoming values.
+// Other instructions may reuse the local of an operand that dies in them only
+// when they are a simple expression, which reads everything before assigning.
+void JSWriter::registerize(const Function *F) {
+  // Number the blocks, and the values that need a local
+  DenseMap<const BasicBlock*, unsigned> BlockIds;
+  std::vector<const BasicBlock*> Blocks;
+  DenseMap<const Value*, unsigned> LocalIds;
+  std::vector<const Instruction*> Locals;
+  std::vector<LocalClass> Classes;
+  std::vector<unsigned> DefBlocks;
+  for (Function::const_iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+    BlockIds[BI] = Blocks.size();
+    for (BasicBlock::const_iterator I = BI->begin(), E = BI->end(); I != E; ++I) {
+      LocalClass Class = getLocalClass(I->getType());
+      if (Class == LOCAL_NONE || isa<AllocaInst>(I) || I != I->stripPointerCasts() || FoldedInsts.count(I)) continue;
+      LocalIds[I] = Locals.size();
+      Locals.push_back(I);
+      Classes.push_back(Class);
+      DefBlocks.push_back(Blocks.size());
+    }
+    Blocks.push_back(BI);
+  }
+  if (Locals.empty()) return;
+
+  // Find the uses of each value: in a block, or at the end of one for phis
+  typedef std::pair<unsigned, unsigned> LocalUse; // local, block
+  std::vector<LocalUse> Uses, LiveOutUses;
+  SmallVector<const Instruction*, 8> Operands;
+  for (unsigned b = 0; b < Blocks.size(); b++) {
+    for (BasicBlock::const_iterator I = Blocks[b]->begin(), E = Blocks[b]->end(); I != E; ++I) {
+      if (const PHINode *P = dyn_cast<PHINode>(I)) {
+        for (unsigned i = 0; i < P->getNumIncomingValues(); i++) {
+          DenseMap<const Value*, unsigned>::const_iterator L = LocalIds.find(P->getIncomingValue(i)->stripPointerCasts());
+          if (L != LocalIds.end()) LiveOutUses.push_back(LocalUse(L->second, BlockIds[P->getIncomingBlock(i)]));
+        }
+        continue;
+      }
+      if (I != I->stripPointerCasts() || FoldedInsts.count(I)) continue;
+      Operands.clear();
+      getLocalUses(I, Operands);
+      for (unsigned i = 0; i < Operands.size(); i++) {
+        DenseMap<const Value*, unsigned>::const_iterator L = LocalIds.find(Operands[i]);
+        if (L != LocalIds.end()) Uses.push_back(LocalUse(L->second, b));
+      }
+    }
+  }
+  std::sort(Uses.begin(), Uses.end());
+  std::sort(LiveOutUses.begin(), LiveOutUses.end());
+
+  // Propagate liveness from the uses of each value back to its definition
+  std::vector<std::vector<unsigned> > LiveIn(Blocks.size()), LiveOut(Blocks.size());
+  std::vector<unsigned> LastLiveIn(Blocks.size(), UINT_MAX), LastLiveOut(Blocks.size(), UINT_MAX);
+  std::vector<unsigned> Worklist;
+  for (unsigned l = 0, i = 0, j = 0; l < Locals.size(); l++) {
+    for (; i < Uses.size() && Uses[i].first == l; i++) {
+      if (Uses[i].second != DefBlocks[l]) Worklist.push_back(Uses[i].second);
+    }
+    for (; j < LiveOutUses.size() && LiveOutUses[j].first == l; j++) {
+      unsigned b = LiveOutUses[j].second;
+      if (LastLiveOut[b] == l) continue;
+      LastLiveOut[b] = l;
+      LiveOut[b].push_back(l);
+      if (b != DefBlocks[l]) Worklist.push_back(b);
+    }
+    while (!Worklist.empty()) {
+      unsigned b = Worklist.back();
+      Worklist.pop_back();
+      if (LastLiveIn[b] == l) continue;
+      LastLiveIn[b] = l;
+      LiveIn[b].push_back(l);
+      for (const_pred_iterator PI = pred_begin(Blocks[b]), PE = pred_end(Blocks[b]); PI != PE; ++PI) {
+        unsigned p = BlockIds[*PI];
+        if (LastLiveOut[p] != l) {
+          LastLiveOut[p] = l;
+          LiveOut[p].push_back(l);
+        }
+        if (p != DefBlocks[l]) Worklist.push_back(p);
+      }
+    }
+  }
+
+  // Color the values, giving each the local of the first value of its color
+  std::vector<unsigned> Colors(Locals.size(), UINT_MAX);
+  std::vector<bool> InUse[NUM_LOCAL_CLASSES];
+  std::vector<const std::string*> ColorNames[NUM_LOCAL_CLASSES];
+  std::vector<unsigned> LastUses(Locals.size()), LastUseBlocks(Locals.size(), UINT_MAX), LiveOutBlocks(Locals.size(), UINT_MAX);
+  SmallVector<unsigned, 16> Phis, Dying;
+  ReversePostOrderTraversal<const Function*> RPOT(F);
+  for (ReversePostOrderTraversal<const Function*>::rpo_iterator BI = RPOT.begin(), BE = RPOT.end(); BI != BE; ++BI) {
+    unsigned b = BlockIds[*BI];
+    for (unsigned c = 0; c < NUM_LOCAL_CLASSES; c++) {
+      InUse[c].assign(InUse[c].size(), false);
+    }
+    for (unsigned i = 0; i < LiveIn[b].size(); i++) {
+      unsigned l = LiveIn[b][i];
+      if (Colors[l] != UINT_MAX) InUse[Classes[l]][Colors[l]] = true;
+    }
+    for (unsigned i = 0; i < LiveOut[b].size(); i++) {
+      LiveOutBlocks[LiveOut[b][i]] = b;
+    }
+    unsigned Position = 0;
+    for (BasicBlock::const_iterator I = Blocks[b]->begin(), E = Blocks[b]->end(); I != E; ++I, ++Position) {
+      if (isa<PHINode>(I) || I != I->stripPointerCasts() || FoldedInsts.count(I)) continue;
+      Operands.clear();
+      getLocalUses(I, Operands);
+      for (unsigned i = 0; i < Operands.size(); i++) {
+        DenseMap<const Value*, unsigned>::const_iterator L = LocalIds.find(Operands[i]);
+        if (L == LocalIds.end()) continue;
+        LastUses[L->second] = Position;
+        LastUseBlocks[L->second] = b;
+      }
+    }
+
+    Phis.clear();
+    Position = 0;
+    for (BasicBlock::const_iterator I = Blocks[b]->begin(), E = Blocks[b]->end(); I != E; ++I, ++Position) {
+      DenseMap<const Value*, unsigned>::const_iterator L = LocalIds.find(I);
+      bool IsLocal = L != LocalIds.end();
+      bool IsPhi = isa<PHINode>(I);
+      if (!IsPhi && !Phis.empty()) {
+        // the phis are all defined at once, so only now are the dead ones free
+        for (unsigned i = 0; i < Phis.size(); i++) {
+          unsigned l = Phis[i];
+          if (LastUseBlocks[l] != b && LiveOutBlocks[l] != b) InUse[Classes[l]][Colors[l]] = false;
+        }
+        Phis.clear();
+      }
+      if (!IsPhi && (I != I->stripPointerCasts() || FoldedInsts.count(I))) continue;
+
+      Dying.clear();
+      if (!IsPhi) {
+        Operands.clear();
+        getLocalUses(I, Operands);
+        for (unsigned i = 0; i < Operands.size(); i++) {
+          DenseMap<const Value*, unsigned>::const_iterator O = LocalIds.find(Operands[i]);
+          if (O == LocalIds.end()) continue;
+          unsigned l = O->second;
+          if (LastUseBlocks[l] == b && LastUses[l] == Position && LiveOutBlocks[l] != b) Dying.push_back(l);
+        }
+      }
+      // operands that die here are free for I itself, if it reads them all before assigning
+      bool Simple = !IsPhi && isSimpleExpression(I);
+      if (Simple) {
+        for (unsigned i = 0; i < Dying.size(); i++) InUse[Classes[Dying[i]]][Colors[Dying[i]]] = false;
+      }
+      if (IsLocal) {
+        unsigned l = L->second;
+        std::vector<bool> &Used = InUse[Classes[l]];
+        unsigned Color = std::find(Used.begin(), Used.end(), false) - Used.begin();
+        if (Color == Used.size()) {
+          Used.push_back(false);
+          ColorNames[Classes[l]].push_back(&getJSName(I));
+        }
+        Used[Color] = true;
+        Colors[l] = Color;
+        ValueNames[I] = ColorNames[Classes[l]][Color];
+      }
+      if (!Simple) {
+        for (unsigned i = 0; i < Dying.size(); i++) InUse[Classes[Dying[i]]][Colors[Dying[i]]] = false;
+      }
+      if (!IsLocal) continue;
+      if (IsPhi) {
+        Phis.push_back(L->second);
+      } else if (LastUseBlocks[L->second] != b && LiveOutBlocks[L->second] != b) {
+        InUse[Classes[L->second]][Colors[L->second]] = false; // never used
+      }
+    }
+  }
+}
+
+const char *JSWriter::copyToBlockArena(const std::string &S) {
+  char *Copy = static_cast<char*>(BlockArena.Allocate(S.size()+1, 1));
+  memcpy(Copy, S.c_str(), S.size()+1);
+  return Copy;
+}
+
 void JSWriter::addBlock(const BasicBlock *BB, Relooper& R, LLVMToRelooperMap& LLVMToRelooper) {
-  std::string Code;
-  raw_string_ostream CodeStream(Code);
+  BlockCode.clear();
+  raw_string_ostream CodeStream(BlockCode);
   for (BasicBlock::const_iterator I = BB->begin(), E = BB->end();
        I != E; ++I) {
     if (I->stripPointerCasts() == I) {
-      generateExpression(I, CodeStream);
+      if (FoldedInsts.count(I)) {
+        foldExpression(I);
+      } else {
+        generateExpression(I, CodeStream);
+      }
     }
   }
   CodeStream.flush();
   const Value* Condition = considerConditionVar(BB->getTerminator());
-  Block *Curr = new Block(Code.c_str(), Condition ? getValueAsCastStr(Condition).c_str() : NULL);
+  // The relooper references the code in the arena rather than copying it
+  Block *Curr = new Block(copyToBlockArena(BlockCode), Condition ? copyToBlockArena(getValueAsCastStr(Condition)) : NULL, false);
   LLVMToRelooper[BB] = Curr;
   R.AddBlock(Curr);
 }
 
+static bool compareVarNames(const VarMap::MapEntryTy *A, const VarMap::MapEntryTy *B) {
+  return A->getKey() < B->getKey();
+}
+
 void JSWriter::printFunctionBody(const Function *F) {
   assert(!F->isDeclaration());
 
   // Prepare relooper
-  Relooper::MakeOutputBuffer(1024*1024);
   Relooper R;
   //if (!canReloop(F)) R.SetEmulate(true);
-  R.SetAsmJSMode(1);
   Block *Entry = NULL;
   LLVMToRelooperMap LLVMToRelooper;
 
   // Create relooper blocks with their contents. TODO: We could optimize
   // indirectbr by emitting indexed blocks first, so their indexes
   // match up with the label index.
+  BlockArena.Reset(); // the previous function's relooper is gone
   for (Function::const_iterator BI = F->begin(), BE = F->end();
        BI != BE; ++BI) {
     InvokeState = 0; // each basic block begins in state 0; the previous may not have cleared it, if e.g. it had a throw in the middle and the rest of it was decapitated
@@ -2291,7 +3062,9 @@ void JSWriter::printFunctionBody(const Function *F) {
 
   // Calculate relooping and print
   R.Calculate(Entry);
-  R.Render();
+  RelooperOutput.Reserve(64*1024);
+  RelooperOutput.AsmJS = true;
+  R.Render(RelooperOutput);
 
   // Emit local variables
   UsedVars["sp"] = Type::getInt32Ty(F->getContext());
@@ -2301,8 +3074,15 @@ void JSWriter::printFunctionBody(const Function *F) {
   }
   UsedVars["label"] = Type::getInt32Ty(F->getContext());
   if (!UsedVars.empty()) {
-    unsigned Count = 0;
+    std::vector<const VarMap::MapEntryTy*> Vars;
+    Vars.reserve(UsedVars.size());
     for (VarMap::const_iterator VI = UsedVars.begin(); VI != UsedVars.end(); ++VI) {
+      Vars.push_back(&*VI);
+    }
+    std::sort(Vars.begin(), Vars.end(), compareVarNames);
+    unsigned Count = 0;
+    for (unsigned i = 0; i < Vars.size(); i++) {
+      const VarMap::MapEntryTy *VI = Vars[i];
       if (Count == 20) {
         Out << ";\n";
         Count = 0;
@@ -2312,8 +3092,8 @@ void JSWriter::printFunctionBody(const Function *F) {
         Out << ", ";
       }
       Count++;
-      Out << VI->first << " = ";
-      switch (VI->second->getTypeID()) {
+      Out << VI->getKey() << " = ";
+      switch (VI->getValue()->getTypeID()) {
         default:
           llvm_unreachable("unsupported variable initializer type");
         case Type::PointerTyID:
@@ -2329,13 +3109,15 @@ void JSWriter::printFunctionBody(const Function *F) {
         case Type::DoubleTyID:
           Out << "+0";
           break;
-        case Type::VectorTyID:
-          if (cast<VectorType>(VI->second)->getElementType()->isIntegerTy()) {
-              Out << "SIMD_int32x4(0,0,0,0)";
-          } else {
-              Out << "SIMD_float32x4(0,0,0,0)";
+        case Type::VectorTyID: {
+          VectorType *VT = cast<VectorType>(VI->getValue());
+          Out << getSIMDName(VT) << "(0";
+          for (unsigned i = 1; i < SIMDTypeLanes[getSIMDType(VT)]; i++) {
+            Out << ",0";
           }
+          Out << ")";
           break;
+        }
       }
     }
     Out << ";";
@@ -2355,40 +3137,130 @@ void JSWriter::printFunctionBody(const Function *F) {
   }
 
   // Emit (relooped) code
-  char *buffer = Relooper::GetOutputBuffer();
-  nl(Out) << buffer;
+  const char *buffer = RelooperOutput.Get();
+  nl(Out).write(buffer, RelooperOutput.Length());
 
   // Ensure a final return if necessary
   Type *RT = F->getFunctionType()->getReturnType();
   if (!RT->isVoidTy()) {
-    char *LastCurly = strrchr(buffer, '}');
+    const char *LastCurly = strrchr(buffer, '}');
     if (!LastCurly) LastCurly = buffer;
-    char *FinalReturn = strstr(LastCurly, "return ");
+    const char *FinalReturn = strstr(LastCurly, "return ");
     if (!FinalReturn) {
       Out << " return " << getParenCast(getConstant(UndefValue::get(RT)), RT, ASM_NONSPECIFIC) << ";\n";
     }
   }
 }
 
+// Whether a global's contents are all known once its address is calculated,
+// and no one can tell it apart from another global with the same contents.
+static bool isMergeableConstant(const GlobalVariable *GV) {
+  if (!GV->isConstant() || !GV->hasUnnamedAddr()) return false;
+  const Constant *C = GV->getInitializer();
+  return isa<ConstantDataSequential>(C) || isa<ConstantFP>(C) ||
+         isa<ConstantInt>(C) || isa<ConstantAggregateZero>(C);
+}
+
 void JSWriter::processConstants() {
   // First, calculate the address of each constant
   for (Module::const_global_iterator I = TheModule->global_begin(),
          E = TheModule->global_end(); I != E; ++I) {
     if (I->hasInitializer()) {
-      parseConstant(I->getName().str(), I->getInitializer(), true);
+      std::string Name = I->getName().str();
+      unsigned Bits = getGlobalAlignBits(I);
+      HeapData &GlobalData = *getGlobalData(Bits);
+      size_t Start = GlobalData.size();
+      parseConstant(Name, I->getInitializer(), Bits, true);
+      if (!isMergeableConstant(I)) continue;
+      GlobalAddressMap::iterator A = GlobalAddresses.find(Name);
+      if (A == GlobalAddresses.end() || A->second.second != Bits) continue; // not laid out here, e.g. in the zero section
+      // Identical constants share one copy: drop the one just laid out if
+      // there already is another
+      std::string Key(1, char(Bits));
+      Key.append(GlobalData.begin() + A->second.first, GlobalData.end());
+      GlobalAddressMap::const_iterator M = MergedConstants.find(Key);
+      if (M == MergedConstants.end()) {
+        MergedConstants[Key] = A->second;
+      } else {
+        GlobalData.resize(Start);
+        A->second = M->second;
+      }
     }
   }
+  // GlobalData32 follows GlobalData64, and must start aligned
+  while (GlobalData64.size() % 4 != 0) GlobalData64.push_back(0);
   // Second, allocate their contents
   for (Module::const_global_iterator I = TheModule->global_begin(),
          E = TheModule->global_end(); I != E; ++I) {
     if (I->hasInitializer()) {
-      parseConstant(I->getName().str(), I->getInitializer(), false);
+      parseConstant(I->getName().str(), I->getInitializer(), getGlobalAlignBits(I), false);
+    }
+  }
+}
+
+// With NoAliasingFunctionPointers every function has an index of its own, so
+// a table must reach as far as the last index of its signature. Give each
+// signature a range of slots (see getUnaliasedIndex) large enough for its
+// functions whose address is taken, the signatures with the fewest first, so
+// that most tables end early instead of all of them spanning every function
+// in the program. Other functions that are indexed go after all the ranges.
+void JSWriter::layoutUnaliasedTables() {
+  std::map<std::string, unsigned> Counts;
+  for (Module::const_iterator I = TheModule->begin(), E = TheModule->end(); I != E; ++I) {
+    if (I->hasAddressTaken()) Counts[getFunctionSignature(I->getFunctionType())]++;
+  }
+  std::vector<std::pair<unsigned, std::string> > Order;
+  for (std::map<std::string, unsigned>::const_iterator I = Counts.begin(), E = Counts.end(); I != E; ++I) {
+    Order.push_back(std::make_pair(I->second, I->first));
+  }
+  std::sort(Order.begin(), Order.end());
+  for (unsigned i = 0; i < Order.size(); i++) {
+    UnaliasedRanges[Order[i].second] = std::make_pair(NextFunctionIndex, NextFunctionIndex + Order[i].first);
+    NextFunctionIndex += Order[i].first;
+  }
+}
+
+// Whether V may be called other than directly, that is, whether it is used
+// as anything but the callee of a call, possibly through casts.
+static bool isAddressTaken(const Value *V) {
+  for (Value::const_use_iterator UI = V->use_begin(), UE = V->use_end(); UI != UE; ++UI) {
+    const User *U = *UI;
+    if (const ConstantExpr *CE = dyn_cast<ConstantExpr>(U)) {
+      if (CE->isCast() && !isAddressTaken(CE)) continue;
+      return true;
+    }
+    ImmutableCallSite CS(U);
+    if (!CS || !CS.isCallee(UI)) return true;
+  }
+  return false;
+}
+
+// A call through a function pointer can only reach the functions in the
+// table of its signature, which are those whose address is taken, or
+// functions added at runtime when slots are reserved for them. Where that is
+// one or two functions that are defined here, it can call them directly
+// (see getDevirtualizedCall).
+void JSWriter::findKnownCallees() {
+  if (ReservedFunctionPointers) return;
+  std::set<std::string> Unknown;
+  for (Module::const_iterator I = TheModule->begin(), E = TheModule->end(); I != E; ++I) {
+    if (!isAddressTaken(I)) continue;
+    std::string Sig = getFunctionSignature(I->getFunctionType());
+    if (Unknown.count(Sig)) continue;
+    std::vector<const Function*> &Callees = KnownCallees[Sig];
+    Callees.push_back(I);
+    if (Callees.size() > 2 || I->isDeclaration() || CallHandlers.count(getJSName(I))) {
+      KnownCallees.erase(Sig);
+      Unknown.insert(Sig);
     }
   }
 }
 
 void JSWriter::printFunction(const Function *F) {
   ValueNames.clear();
+  JSNames.clear();
+  FoldedInsts.clear();
+  FoldedExprs.clear();
 
   // Prepare and analyze function
 
@@ -2402,6 +3274,18 @@ void JSWriter::printFunction(const Function *F) {
 
   // Do alloca coloring at -O1 and higher.
   Allocas.analyze(*F, *DL, OptLevel != CodeGenOpt::None);
+  if (ReportFrameSizes && Allocas.getFrameSize()) {
+    errs() << "emcc: frame size of " << F->getName() << ": "
+           << Allocas.getFrameSize() << " bytes ("
+           << Allocas.getUnsharedFrameSize() << " without sharing)\n";
+  }
+
+  if (FoldExpressions) {
+    for (Function::const_iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+      findFoldedExpressions(BI);
+    }
+  }
+  if (Registerize) registerize(F);
 
   // Emit the function
 
@@ -2426,16 +3310,27 @@ void JSWriter::printFunction(const Function *F) {
   nl(Out);
 
   Allocas.clear();
+  DeleteContainerSeconds(PhiBlocks);
 }
 
 void JSWriter::printModuleBody() {
+  if (NoAliasingFunctionPointers) layoutUnaliasedTables();
+  if (Devirtualize) findKnownCallees();
   processConstants();
 
-  // Emit function bodies.
+  // Emit function bodies. Diagnostics are printed as functions are emitted,
+  // so keep them in order by emitting serially when they are enabled. That
+  // also bypasses the cache, as cached functions would lose their diagnostics.
   nl(Out) << "// EMSCRIPTEN_START_FUNCTIONS"; nl(Out);
-  for (Module::const_iterator I = TheModule->begin(), E = TheModule->end();
-       I != E; ++I) {
-    if (!I->isDeclaration()) printFunction(I);
+  if ((CodegenThreads > 1 || !CodegenCache.empty()) &&
+      !WarnOnUnaligned && !ReportFrameSizes && !EmscriptenAssertions &&
+      !TimePassesIsEnabled) {
+    printFunctionsDeferred(CodegenThreads > 1 ? CodegenThreads : 0);
+  } else {
+    for (Module::const_iterator I = TheModule->begin(), E = TheModule->end();
+         I != E; ++I) {
+      if (!I->isDeclaration()) printFunction(I);
+    }
   }
   Out << "function runPostSets() {\n";
   Out << " " << PostSets << "\n";
@@ -2443,20 +3338,20 @@ void JSWriter::printModuleBody() {
   PostSets = "";
   Out << "// EMSCRIPTEN_END_FUNCTIONS\n\n";
 
-  assert(GlobalData32.size() == 0 && GlobalData8.size() == 0); // FIXME when we use optimal constant alignments
-
-  // TODO fix commas
-  Out << "/* memory initializer */ allocate([";
-  printCommaSeparated(GlobalData64);
-  if (GlobalData64.size() > 0 && GlobalData32.size() + GlobalData8.size() > 0) {
-    Out << ",";
-  }
-  printCommaSeparated(GlobalData32);
-  if (GlobalData32.size() > 0 && GlobalData8.size() > 0) {
-    Out << ",";
+  if (MemoryInit == MEMORY_INIT_ARRAY) {
+    // TODO fix commas
+    Out << "/* memory initializer */ allocate([";
+    printCommaSeparated(GlobalData64);
+    if (GlobalData64.size() > 0 && GlobalData32.size() + GlobalData8.size() > 0) {
+      Out << ",";
+    }
+    printCommaSeparated(GlobalData32);
+    if (GlobalData32.size() > 0 && GlobalData8.size() > 0) {
+      Out << ",";
+    }
+    printCommaSeparated(GlobalData8);
+    Out << "], \"i8\", ALLOC_NONE, Runtime.GLOBAL_BASE);";
   }
-  printCommaSeparated(GlobalData8);
-  Out << "], \"i8\", ALLOC_NONE, Runtime.GLOBAL_BASE);";
 
   // Emit metadata for emcc driver
   Out << "\n\n// EMSCRIPTEN_METADATA\n";
@@ -2483,6 +3378,7 @@ void JSWriter::printModuleBody() {
         case Intrinsic::memmove:
         case Intrinsic::expect:
         case Intrinsic::flt_rounds:
+        case Intrinsic::eh_typeid_for:
           continue;
         }
       }
@@ -2550,17 +3446,28 @@ void JSWriter::printModuleBody() {
   Out << "\"tables\": {";
   unsigned Num = FunctionTables.size();
   for (FunctionTableMap::iterator I = FunctionTables.begin(), E = FunctionTables.end(); I != E; ++I) {
-    Out << "  \"" << I->first << "\": \"var FUNCTION_TABLE_" << I->first << " = [";
     FunctionTable &Table = I->second;
     // ensure power of two
     unsigned Size = 1;
     while (Size < Table.size()) Size <<= 1;
-    while (Table.size() < Size) Table.push_back("0");
-    for (unsigned i = 0; i < Table.size(); i++) {
-      Out << Table[i];
-      if (i < Table.size()-1) Out << ",";
+    if (CompactFunctionTables) {
+      Out << "  \"" << I->first << "\": [" << Size;
+      for (unsigned i = 0; i < Table.size(); i++) {
+        if (Table[i] == "0") continue;
+        Out << ", [" << i;
+        for (; i < Table.size() && Table[i] != "0"; i++) Out << ", \"" << Table[i] << '"';
+        Out << "]";
+      }
+      Out << "]";
+    } else {
+      Out << "  \"" << I->first << "\": \"var FUNCTION_TABLE_" << I->first << " = [";
+      while (Table.size() < Size) Table.push_back("0");
+      for (unsigned i = 0; i < Table.size(); i++) {
+        Out << Table[i];
+        if (i < Table.size()-1) Out << ",";
+      }
+      Out << "];\"";
     }
-    Out << "];\"";
     if (--Num > 0) Out << ",";
     Out << "\n";
   }
@@ -2596,6 +3503,19 @@ void JSWriter::printModuleBody() {
   Out << (UsesSIMD ? "1" : "0");
   Out << ",";
 
+  Out << "\"simdTypes\": [";
+  first = true;
+  for (unsigned i = 0; i < NUM_SIMD_TYPES; i++) {
+    if (!(UsesSIMD & (1 << i))) continue;
+    if (first) {
+      first = false;
+    } else {
+      Out << ", ";
+    }
+    Out << "\"" << SIMDTypeNames[i] << "\"";
+  }
+  Out << "],";
+
   Out << "\"namedGlobals\": {";
   first = true;
   for (NameIntMap::const_iterator I = NamedGlobals.begin(), E = NamedGlobals.end(); I != E; ++I) {
@@ -2608,20 +3528,494 @@ void JSWriter::printModuleBody() {
   }
   Out << "}";
 
+  if (ZeroSection) {
+    Out << ",";
+    Out << "\"zeroSection\": [" << getZeroSectionAddress() << ", " << ZeroDataSize << "]";
+  }
+
+  if (MemoryInit != MEMORY_INIT_ARRAY) {
+    Out << ",";
+    printMemoryInitializer();
+  }
+
   Out << "\n}\n";
 }
 
-void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool calculate) {
+// deferred function emission
+
+// Whether emitting F touches the module-wide block address numbering.
+static bool usesBlockAddresses(const Function *F) {
+  SmallPtrSet<const ConstantExpr*, 16> Visited;
+  SmallVector<const Value*, 16> Worklist;
+  for (Function::const_iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+    if (isa<IndirectBrInst>(BI->getTerminator())) return true;
+    for (BasicBlock::const_iterator II = BI->begin(), E = BI->end(); II != E; ++II) {
+      // A block address can be any operand of a constant expression operand
+      Worklist.append(II->op_begin(), II->op_end());
+      while (!Worklist.empty()) {
+        const Value *V = Worklist.pop_back_val();
+        if (isa<BlockAddress>(V)) return true;
+        if (const ConstantExpr *CE = dyn_cast<ConstantExpr>(V)) {
+          if (Visited.insert(CE)) Worklist.append(CE->op_begin(), CE->op_end());
+        }
+      }
+    }
+  }
+  return false;
+}
+
+// Create the constants that emitting C may ask the LLVMContext for.
+static void prepareConstant(const Constant *C, SmallPtrSet<const Constant*, 32> &Seen) {
+  if (isa<GlobalValue>(C) || !Seen.insert(C)) return;
+  if (VectorType *VT = dyn_cast<VectorType>(C->getType())) {
+    UndefValue::get(VT->getElementType());
+    if (const ConstantDataVector *DV = dyn_cast<ConstantDataVector>(C)) {
+      for (unsigned i = 0, e = DV->getNumElements(); i < e; ++i) {
+        DV->getElementAsConstant(i);
+      }
+    }
+  }
+  for (User::const_op_iterator OI = C->op_begin(), OE = C->op_end(); OI != OE; ++OI) {
+    if (const Constant *Op = dyn_cast<Constant>(*OI)) prepareConstant(Op, Seen);
+  }
+}
+
+// Types and constants are uniqued in the LLVMContext, and struct layouts are
+// cached in the DataLayout, all lazily and without locking. Create everything
+// that emitting a function may look up, so that worker threads only read them.
+void JSWriter::prepareForThreads() {
+  TypeFinder StructTypes;
+  StructTypes.run(*TheModule, false);
+  for (TypeFinder::iterator I = StructTypes.begin(), E = StructTypes.end(); I != E; ++I) {
+    if ((*I)->isSized()) DL->getStructLayout(*I);
+  }
+
+  SmallPtrSet<const Constant*, 32> Seen;
+  for (Module::const_iterator I = TheModule->begin(), E = TheModule->end(); I != E; ++I) {
+    if (I->isDeclaration()) continue;
+    Type *RT = I->getFunctionType()->getReturnType();
+    if (!RT->isVoidTy()) UndefValue::get(RT);
+    for (Function::const_iterator BI = I->begin(), BE = I->end(); BI != BE; ++BI) {
+      for (BasicBlock::const_iterator II = BI->begin(), IE = BI->end(); II != IE; ++II) {
+        for (User::const_op_iterator OI = II->op_begin(), OE = II->op_end(); OI != OE; ++OI) {
+          if (const Constant *C = dyn_cast<Constant>(*OI)) prepareConstant(C, Seen);
+        }
+      }
+    }
+  }
+}
+
+namespace {
+  struct WorkQueue {
+    JSWriter *Parent;
+    std::vector<EmittedFunction> *Functions;
+    volatile sys::cas_flag Next;
+  };
+}
+
+void *JSWriter::emitFunctionsOnThread(void *Arg) {
+  WorkQueue *Queue = static_cast<WorkQueue*>(Arg);
+  std::string Code;
+  raw_string_ostream CodeStream(Code);
+  formatted_raw_ostream FormattedCode(CodeStream);
+  JSWriter Worker(FormattedCode, Queue->Parent);
+  while (true) {
+    unsigned i = sys::AtomicIncrement(&Queue->Next) - 1;
+    if (i >= Queue->Functions->size()) break;
+    EmittedFunction &EF = (*Queue->Functions)[i];
+    if (EF.OnMainThread || EF.Cached) continue;
+    Worker.printFunction(EF.F);
+    FormattedCode.flush();
+    CodeStream.flush();
+    EF.Code.swap(Code);
+    EF.TableAccesses.swap(Worker.TableAccesses);
+    EF.Declares.swap(Worker.Declares);
+    EF.Externals.swap(Worker.Externals);
+    EF.CantValidate.swap(Worker.CantValidate);
+    EF.UsesSIMD = Worker.UsesSIMD;
+    Worker.UsesSIMD = 0;
+  }
+  return NULL;
+}
+
+// Emit the functions that are not in the cache, on NumThreads threads as well
+// as this one, and then merge everything in module order.
+void JSWriter::printFunctionsDeferred(unsigned NumThreads) {
+  std::vector<EmittedFunction> Functions;
+  for (Module::const_iterator I = TheModule->begin(), E = TheModule->end(); I != E; ++I) {
+    if (I->isDeclaration()) continue;
+    Functions.push_back(EmittedFunction());
+    EmittedFunction &EF = Functions.back();
+    EF.F = I;
+    EF.OnMainThread = usesBlockAddresses(I);
+    EF.Cached = false;
+    EF.UsesSIMD = 0;
+  }
+
+  if (!CodegenCache.empty()) {
+    computeCacheKeys(Functions);
+    for (unsigned i = 0; i < Functions.size(); i++) {
+      EmittedFunction &EF = Functions[i];
+      if (!EF.CacheKey.empty()) EF.Cached = loadCachedFunction(EF);
+    }
+  }
+
+  bool StartedMultithreading = false;
+  if (NumThreads > 0) {
+    prepareForThreads();
+    StartedMultithreading = !llvm_is_multithreaded() && llvm_start_multithreaded();
+  }
+
+  WorkQueue Queue = { this, &Functions, 0 };
+#if LLVM_ENABLE_THREADS != 0 && defined(HAVE_PTHREAD_H)
+  std::vector<pthread_t> Threads;
+  for (unsigned i = 0; i < NumThreads; i++) {
+    pthread_t Thread;
+    if (::pthread_create(&Thread, NULL, emitFunctionsOnThread, &Queue) != 0) break;
+    Threads.push_back(Thread);
+  }
+  for (unsigned i = 0; i < Threads.size(); i++) {
+    ::pthread_join(Threads[i], NULL);
+  }
+#endif
+  // Whatever no thread got to (if threads are unavailable) is emitted here.
+  emitFunctionsOnThread(&Queue);
+
+  if (StartedMultithreading) llvm_stop_multithreaded();
+
+  for (unsigned i = 0; i < Functions.size(); i++) {
+    const EmittedFunction &EF = Functions[i];
+    if (!EF.CacheKey.empty() && !EF.Cached) storeCachedFunction(EF);
+    if (EF.OnMainThread) {
+      printFunction(EF.F);
+    } else {
+      mergeEmittedFunction(EF);
+    }
+  }
+}
+
+// Replay a worker's table accesses in the order it made them, which is the
+// order a serial emission would have made them in, and patch the resulting
+// function indices into its code.
+void JSWriter::mergeEmittedFunction(const EmittedFunction &EF) {
+  std::vector<std::string> Indices(EF.TableAccesses.size());
+  for (unsigned i = 0; i < EF.TableAccesses.size(); i++) {
+    const TableAccess &Access = EF.TableAccesses[i];
+    if (Access.F) {
+      Indices[i] = utostr(getFunctionIndex(Access.F));
+    } else {
+      ensureFunctionTable(Access.Sig);
+    }
+  }
+  StringRef Code = EF.Code;
+  while (true) {
+    size_t Start = Code.find(FunctionIndexMarker);
+    if (Start == StringRef::npos) break;
+    size_t End = Code.find(FunctionIndexMarker, Start+1);
+    assert(End != StringRef::npos);
+    unsigned i;
+    bool Failed = Code.slice(Start+1, End).getAsInteger(10, i);
+    assert(!Failed && i < Indices.size());
+    (void)Failed;
+    Out << Code.substr(0, Start) << Indices[i];
+    Code = Code.substr(End+1);
+  }
+  Out << Code;
+
+  Declares.insert(EF.Declares.begin(), EF.Declares.end());
+  Externals.insert(EF.Externals.begin(), EF.Externals.end());
+  if (!EF.CantValidate.empty()) CantValidate = EF.CantValidate;
+  UsesSIMD |= EF.UsesSIMD;
+}
+
+// codegen cache
+
+namespace {
+  // Bump when the format of cache entries, or what goes into their keys, changes.
+  // Changes to the code we emit need no bump, as the keys include
+  // JSBACKEND_SOURCE_HASH, a hash of the backend's sources.
+  const char *const CacheFormat = "jsfn2";
+
+  /// FunctionTextRecorder - Notes where the body of each function starts and
+  /// ends in a printed module, so that a single print gives the text of every
+  /// function (printing functions one at a time is linear in the module size
+  /// for each of them).
+  class FunctionTextRecorder : public AssemblyAnnotationWriter {
+  public:
+    std::map<const Function*, std::pair<uint64_t, uint64_t> > Ranges;
+
+    virtual void emitFunctionAnnot(const Function *F, formatted_raw_ostream &OS) {
+      Ranges[F].first = OS.tell();
+    }
+    virtual void emitBasicBlockEndAnnot(const BasicBlock *BB, formatted_raw_ostream &OS) {
+      const Function *F = BB->getParent();
+      if (BB == &F->back()) Ranges[F].second = OS.tell();
+    }
+  };
+}
+
+// Metadata is numbered module-wide, so a function's references to it change
+// whenever metadata elsewhere does. Drop the numbers; what we emit from
+// metadata (debug locations) is keyed separately.
+static void hashFunctionText(MD5 &Hash, StringRef Text) {
+  std::string Normalized;
+  Normalized.reserve(Text.size());
+  bool InString = false;
+  for (size_t i = 0; i < Text.size(); i++) {
+    char C = Text[i];
+    Normalized += C;
+    if (C == '"') {
+      InString = !InString;
+    } else if (C == '!' && !InString) {
+      while (i+1 < Text.size() && isdigit(Text[i+1])) i++;
+    }
+  }
+  Hash.update(Normalized);
+}
+
+static void writeCacheString(raw_ostream &OS, StringRef S) {
+  OS << S.size() << ':' << S;
+}
+
+static bool readCacheString(StringRef &Data, StringRef &S) {
+  size_t Colon = Data.find(':');
+  if (Colon == StringRef::npos) return false;
+  size_t Size;
+  if (Data.substr(0, Colon).getAsInteger(10, Size)) return false;
+  if (Size > Data.size() - Colon - 1) return false;
+  S = Data.substr(Colon+1, Size);
+  Data = Data.substr(Colon+1+Size);
+  return true;
+}
+
+static void writeCacheNames(raw_ostream &OS, const NameSet &Names) {
+  writeCacheString(OS, utostr(Names.size()));
+  for (NameSet::const_iterator I = Names.begin(), E = Names.end(); I != E; ++I) {
+    writeCacheString(OS, *I);
+  }
+}
+
+static bool readCacheNames(StringRef &Data, NameSet &Names) {
+  StringRef Count;
+  unsigned N;
+  if (!readCacheString(Data, Count) || Count.getAsInteger(10, N)) return false;
+  for (unsigned i = 0; i < N; i++) {
+    StringRef Name;
+    if (!readCacheString(Data, Name)) return false;
+    Names.insert(Name);
+  }
+  return true;
+}
+
+static std::string getCachePath(const std::string &Key) {
+  return CodegenCache + "/" + Key;
+}
+
+// The key of a function hashes everything its code depends on: the options
+// and type layouts, which are the same for all functions, its own IR and debug
+// locations, and the globals it refers to (their names, types, and addresses).
+// Function indices do not matter, as cached code has placeholders for them.
+void JSWriter::computeCacheKeys(std::vector<EmittedFunction> &Functions) {
+  if (sys::fs::create_directories(CodegenCache)) {
+    prettyWarning() << "cannot create codegen cache directory " << CodegenCache << "\n";
+    return;
+  }
+
+  std::string Common;
+  raw_string_ostream CommonStream(Common);
+  CommonStream << CacheFormat << ' ' << JSBACKEND_SOURCE_HASH << ' ' << PACKAGE_VERSION << '\n'
+               << PreciseF32 << ' ' << ReservedFunctionPointers << ' '
+               << NoAliasingFunctionPointers << ' ' << MaxSetjmps << ' '
+               << GlobalBase << ' ' << FoldExpressions << ' ' << Registerize << ' '
+               << Devirtualize << ' ' << OptLevel << '\n'
+               << TheModule->getDataLayout() << '\n';
+  // Devirtualized calls depend on which functions have their address taken anywhere
+  for (llvm::StringMap<std::vector<const Function*> >::const_iterator I = KnownCallees.begin(), E = KnownCallees.end(); I != E; ++I) {
+    CommonStream << I->getKey();
+    for (unsigned i = 0; i < I->getValue().size(); i++) {
+      CommonStream << ' ' << I->getValue()[i]->getName();
+    }
+    CommonStream << '\n';
+  }
+  TypeFinder StructTypes;
+  StructTypes.run(*TheModule, true);
+  for (TypeFinder::iterator I = StructTypes.begin(), E = StructTypes.end(); I != E; ++I) {
+    StructType *ST = *I;
+    CommonStream << ST->getName() << ' ';
+    if (ST->isOpaque()) {
+      CommonStream << "opaque";
+    } else {
+      CommonStream << ST->isPacked();
+      for (StructType::element_iterator EI = ST->element_begin(), EE = ST->element_end(); EI != EE; ++EI) {
+        CommonStream << ' ';
+        (*EI)->print(CommonStream);
+      }
+    }
+    CommonStream << '\n';
+  }
+  CommonStream.flush();
+
+  FunctionTextRecorder Recorder;
+  std::string ModuleText;
+  raw_string_ostream ModuleStream(ModuleText);
+  TheModule->print(ModuleStream, &Recorder);
+  ModuleStream.flush();
+
+  for (unsigned i = 0; i < Functions.size(); i++) {
+    EmittedFunction &EF = Functions[i];
+    if (EF.OnMainThread) continue;
+    MD5 Hash;
+    Hash.update(Common);
+    const std::pair<uint64_t, uint64_t> &Range = Recorder.Ranges[EF.F];
+    hashFunctionText(Hash, StringRef(ModuleText).slice(Range.first, Range.second));
+
+    std::string Extra;
+    raw_string_ostream ExtraStream(Extra);
+    SmallPtrSet<const Constant*, 16> Seen;
+    std::vector<const Constant*> Worklist;
+    for (Function::const_iterator BI = EF.F->begin(), BE = EF.F->end(); BI != BE; ++BI) {
+      for (BasicBlock::const_iterator II = BI->begin(), IE = BI->end(); II != IE; ++II) {
+        emitDebugInfo(ExtraStream, II);
+        for (User::const_op_iterator OI = II->op_begin(), OE = II->op_end(); OI != OE; ++OI) {
+          const Constant *C = dyn_cast<Constant>(*OI);
+          if (C && Seen.insert(C)) Worklist.push_back(C);
+        }
+      }
+    }
+    while (!Worklist.empty()) {
+      const Constant *C = Worklist.back();
+      Worklist.pop_back();
+      if (const GlobalValue *GV = dyn_cast<GlobalValue>(C)) {
+        ExtraStream << '\n' << GV->getName() << ' ' << GV->isDeclaration() << ' ';
+        GV->getType()->print(ExtraStream);
+        if (isa<GlobalVariable>(GV) && GlobalAddresses.count(GV->getName().str())) {
+          ExtraStream << " @" << getGlobalAddress(GV->getName().str());
+        } else if (const GlobalAlias *GA = dyn_cast<GlobalAlias>(GV)) {
+          if (Seen.insert(GA->getAliasee())) Worklist.push_back(GA->getAliasee());
+        }
+        continue;
+      }
+      for (User::const_op_iterator OI = C->op_begin(), OE = C->op_end(); OI != OE; ++OI) {
+        const Constant *Op = cast<Constant>(*OI);
+        if (Seen.insert(Op)) Worklist.push_back(Op);
+      }
+    }
+    ExtraStream.flush();
+    Hash.update(Extra);
+
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    SmallString<32> Key;
+    MD5::stringifyResult(Result, Key);
+    EF.CacheKey = Key.str();
+  }
+}
+
+bool JSWriter::loadCachedFunction(EmittedFunction &EF) {
+  OwningPtr<MemoryBuffer> Buffer;
+  if (MemoryBuffer::getFile(getCachePath(EF.CacheKey), Buffer)) return false;
+  StringRef Data = Buffer->getBuffer();
+
+  // A damaged entry is just a miss; it is overwritten once the function is emitted.
+  StringRef Format, Code, CantValidate, UsesSIMD, Count;
+  unsigned SIMDTypes, N;
+  if (!readCacheString(Data, Format) || Format != CacheFormat ||
+      !readCacheString(Data, Code) || !readCacheString(Data, CantValidate) ||
+      !readCacheString(Data, UsesSIMD) || UsesSIMD.getAsInteger(10, SIMDTypes) ||
+      !readCacheString(Data, Count) || Count.getAsInteger(10, N)) {
+    return false;
+  }
+  std::vector<TableAccess> Accesses(N);
+  for (unsigned i = 0; i < N; i++) {
+    StringRef Access;
+    if (!readCacheString(Data, Access) || Access.empty()) return false;
+    if (Access[0] == 'f') {
+      Accesses[i].F = TheModule->getFunction(Access.substr(1));
+      if (!Accesses[i].F) return false;
+    } else if (Access[0] == 't') {
+      Accesses[i].F = NULL;
+      Accesses[i].Sig = Access.substr(1);
+    } else {
+      return false;
+    }
+  }
+  NameSet Declares, Externals;
+  if (!readCacheNames(Data, Declares) || !readCacheNames(Data, Externals) || !Data.empty()) {
+    return false;
+  }
+
+  EF.Code = Code;
+  EF.CantValidate = CantValidate;
+  EF.UsesSIMD = SIMDTypes;
+  EF.TableAccesses.swap(Accesses);
+  EF.Declares.swap(Declares);
+  EF.Externals.swap(Externals);
+  return true;
+}
+
+// Entries are written to a temporary file and then renamed, so that a reader
+// (perhaps another llc sharing the cache) never sees a partial one. Failing to
+// write an entry is not an error; the function is just emitted again next time.
+void JSWriter::storeCachedFunction(const EmittedFunction &EF) {
+  std::string Entry;
+  raw_string_ostream EntryStream(Entry);
+  writeCacheString(EntryStream, CacheFormat);
+  writeCacheString(EntryStream, EF.Code);
+  writeCacheString(EntryStream, EF.CantValidate);
+  writeCacheString(EntryStream, utostr(EF.UsesSIMD));
+  writeCacheString(EntryStream, utostr(EF.TableAccesses.size()));
+  for (unsigned i = 0; i < EF.TableAccesses.size(); i++) {
+    const TableAccess &Access = EF.TableAccesses[i];
+    writeCacheString(EntryStream, Access.F ? "f" + Access.F->getName().str() : "t" + Access.Sig);
+  }
+  writeCacheNames(EntryStream, EF.Declares);
+  writeCacheNames(EntryStream, EF.Externals);
+  EntryStream.flush();
+
+  std::string Path = getCachePath(EF.CacheKey);
+  SmallString<128> TempPath;
+  int FD;
+  if (sys::fs::createUniqueFile(Path + "-%%%%%%%%.tmp", FD, TempPath)) return;
+  raw_fd_ostream File(FD, true);
+  File << Entry;
+  File.close();
+  if (File.has_error()) {
+    File.clear_error();
+    sys::fs::remove(TempPath.str());
+    return;
+  }
+  if (sys::fs::rename(TempPath.str(), Path)) {
+    sys::fs::remove(TempPath.str());
+  }
+}
+
+// Whether C is all zero bytes, and so can go in the zero section
+static bool isZeroInitializer(const Constant *C) {
+  if (isa<ConstantAggregateZero>(C)) return true;
+  if (const ConstantInt *CI = dyn_cast<ConstantInt>(C)) return CI->isZero();
+  if (const ConstantFP *CFP = dyn_cast<ConstantFP>(C)) return CFP->isZero() && !CFP->isNegative();
+  if (const ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(C)) {
+    return CDS->isString() && CDS->getAsString().find_first_not_of('\0') == StringRef::npos;
+  }
+  return false;
+}
+
+void JSWriter::parseConstant(const std::string& name, const Constant* CV, unsigned Bits, bool calculate) {
   if (isa<GlobalValue>(CV))
     return;
+  if (ZeroSection && isZeroInitializer(CV)) {
+    if (calculate) {
+      allocateZeroAddress(name, DL->getTypeStoreSize(CV->getType()), Bits);
+    }
+    return;
+  }
   //errs() << "parsing constant " << name << "\n";
   // TODO: we repeat some work in both calculate and emit phases here
-  // FIXME: use the proper optimal alignments
   if (const ConstantDataSequential *CDS =
          dyn_cast<ConstantDataSequential>(CV)) {
     assert(CDS->isString());
     if (calculate) {
-      HeapData *GlobalData = allocateAddress(name);
+      HeapData *GlobalData = allocateAddress(name, Bits);
       StringRef Str = CDS->getAsString();
       for (unsigned int i = 0; i < Str.size(); i++) {
         GlobalData->push_back(Str.data()[i]);
@@ -2631,7 +4025,7 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
     APFloat APF = CFP->getValueAPF();
     if (CFP->getType() == Type::getFloatTy(CFP->getContext())) {
       if (calculate) {
-        HeapData *GlobalData = allocateAddress(name);
+        HeapData *GlobalData = allocateAddress(name, Bits);
         union flt { float f; unsigned char b[sizeof(float)]; } flt;
         flt.f = APF.convertToFloat();
         for (unsigned i = 0; i < sizeof(float); ++i) {
@@ -2640,7 +4034,7 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
       }
     } else if (CFP->getType() == Type::getDoubleTy(CFP->getContext())) {
       if (calculate) {
-        HeapData *GlobalData = allocateAddress(name);
+        HeapData *GlobalData = allocateAddress(name, Bits);
         union dbl { double d; unsigned char b[sizeof(double)]; } dbl;
         dbl.d = APF.convertToDouble();
         for (unsigned i = 0; i < sizeof(double); ++i) {
@@ -2654,11 +4048,11 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
     if (calculate) {
       union { uint64_t i; unsigned char b[sizeof(uint64_t)]; } integer;
       integer.i = *CI->getValue().getRawData();
-      unsigned BitWidth = 64; // CI->getValue().getBitWidth();
-      assert(BitWidth == 32 || BitWidth == 64);
-      HeapData *GlobalData = allocateAddress(name);
+      unsigned Bytes = DL->getTypeStoreSize(CI->getType());
+      assert(Bytes <= sizeof(uint64_t));
+      HeapData *GlobalData = allocateAddress(name, Bits);
       // assuming compiler is little endian
-      for (unsigned i = 0; i < BitWidth / 8; ++i) {
+      for (unsigned i = 0; i < Bytes; ++i) {
         GlobalData->push_back(integer.b[i]);
       }
     }
@@ -2667,11 +4061,11 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
   } else if (isa<ConstantAggregateZero>(CV)) {
     if (calculate) {
       unsigned Bytes = DL->getTypeStoreSize(CV->getType());
-      HeapData *GlobalData = allocateAddress(name);
+      HeapData *GlobalData = allocateAddress(name, Bits);
       for (unsigned i = 0; i < Bytes; ++i) {
         GlobalData->push_back(0);
       }
-      // FIXME: create a zero section at the end, avoid filling meminit with zeros
+      // With -emscripten-zero-section these are in the zero section instead, see above
     }
   } else if (const ConstantArray *CA = dyn_cast<ConstantArray>(CV)) {
     if (calculate) {
@@ -2707,7 +4101,7 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
         }
       }
     } else if (calculate) {
-      HeapData *GlobalData = allocateAddress(name);
+      HeapData *GlobalData = allocateAddress(name, Bits);
       unsigned Bytes = DL->getTypeStoreSize(CV->getType());
       for (unsigned i = 0; i < Bytes; ++i) {
         GlobalData->push_back(0);
@@ -2718,6 +4112,7 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
       assert(CS->getType()->isPacked());
       // This is the only constant where we cannot just emit everything during the first phase, 'calculate', as we may refer to other globals
       unsigned Num = CS->getNumOperands();
+      HeapData &GlobalData = *getGlobalData(Bits);
       unsigned Offset = getRelativeGlobalAddress(name);
       unsigned OffsetStart = Offset;
       unsigned Absolute = getGlobalAddress(name);
@@ -2742,16 +4137,16 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
           }
           union { unsigned i; unsigned char b[sizeof(unsigned)]; } integer;
           integer.i = Data;
-          assert(Offset+4 <= GlobalData64.size());
+          assert(Offset+4 <= GlobalData.size());
           for (unsigned i = 0; i < 4; ++i) {
-            GlobalData64[Offset++] = integer.b[i];
+            GlobalData[Offset++] = integer.b[i];
           }
         } else if (const ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(C)) {
           assert(CDS->isString());
           StringRef Str = CDS->getAsString();
-          assert(Offset+Str.size() <= GlobalData64.size());
+          assert(Offset+Str.size() <= GlobalData.size());
           for (unsigned int i = 0; i < Str.size(); i++) {
-            GlobalData64[Offset++] = Str.data()[i];
+            GlobalData[Offset++] = Str.data()[i];
           }
         } else {
           C->dump();
@@ -2776,7 +4171,7 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
     } else {
       // a global equal to a ptrtoint of some function, so a 32-bit integer for us
       if (calculate) {
-        HeapData *GlobalData = allocateAddress(name);
+        HeapData *GlobalData = allocateAddress(name, Bits);
         for (unsigned i = 0; i < 4; ++i) {
           GlobalData->push_back(0);
         }
@@ -2801,10 +4196,11 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
         Data += getConstAsOffset(V, getGlobalAddress(name));
         union { unsigned i; unsigned char b[sizeof(unsigned)]; } integer;
         integer.i = Data;
+        HeapData &GlobalData = *getGlobalData(Bits);
         unsigned Offset = getRelativeGlobalAddress(name);
-        assert(Offset+4 <= GlobalData64.size());
+        assert(Offset+4 <= GlobalData.size());
         for (unsigned i = 0; i < 4; ++i) {
-          GlobalData64[Offset++] = integer.b[i];
+          GlobalData[Offset++] = integer.b[i];
         }
       }
     }
@@ -2865,6 +4261,110 @@ void JSWriter::printCommaSeparated(const HeapData data) {
   }
 }
 
+static std::string base64Encode(StringRef Data) {
+  static const char Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string Ret;
+  Ret.reserve((Data.size() + 2) / 3 * 4);
+  size_t i = 0;
+  for (; i + 2 < Data.size(); i += 3) {
+    unsigned Word = ((unsigned char)Data[i] << 16) | ((unsigned char)Data[i+1] << 8) | (unsigned char)Data[i+2];
+    Ret += Chars[(Word >> 18) & 63];
+    Ret += Chars[(Word >> 12) & 63];
+    Ret += Chars[(Word >> 6) & 63];
+    Ret += Chars[Word & 63];
+  }
+  if (i < Data.size()) {
+    unsigned Word = (unsigned char)Data[i] << 16;
+    if (i + 1 < Data.size()) Word |= (unsigned char)Data[i+1] << 8;
+    Ret += Chars[(Word >> 18) & 63];
+    Ret += Chars[(Word >> 12) & 63];
+    Ret += i + 1 < Data.size() ? Chars[(Word >> 6) & 63] : '=';
+    Ret += '=';
+  }
+  return Ret;
+}
+
+// Quote S as a JSON string
+static std::string quoteJSONString(StringRef S) {
+  static const char Hex[] = "0123456789abcdef";
+  std::string Ret = "\"";
+  for (size_t i = 0; i < S.size(); i++) {
+    unsigned char C = S[i];
+    if (C == '"' || C == '\\') {
+      Ret += '\\';
+      Ret += C;
+    } else if (C < 0x20) {
+      Ret += "\\u00";
+      Ret += Hex[C >> 4];
+      Ret += Hex[C & 15];
+    } else {
+      Ret += C;
+    }
+  }
+  return Ret + '"';
+}
+
+// Emit the memory initializer as "memoryInitializer" in the metadata: a list
+// of [address, size] segments, and their bytes one after the other, either in
+// base64 or in a binary file. Memory starts out zeroed, so zeros at the end are
+// left out, and with -emscripten-memory-init-gap so are long runs of them in
+// between, which become gaps between segments.
+void JSWriter::printMemoryInitializer() {
+  HeapData Data(GlobalData64);
+  Data.insert(Data.end(), GlobalData32.begin(), GlobalData32.end());
+  Data.insert(Data.end(), GlobalData8.begin(), GlobalData8.end());
+
+  size_t End = Data.size();
+  while (End > 0 && Data[End-1] == 0) End--;
+  std::vector<std::pair<size_t, size_t> > Segments; // start and end in Data
+  if (MemoryInitGap > 0) {
+    size_t Start = 0;
+    for (size_t i = 0; i < End; ) {
+      if (Data[i] != 0) {
+        i++;
+        continue;
+      }
+      size_t ZerosEnd = i;
+      while (Data[ZerosEnd] == 0) ZerosEnd++; // stops before End, which follows a nonzero
+      if (ZerosEnd - i >= MemoryInitGap) {
+        if (i > Start) Segments.push_back(std::make_pair(Start, i));
+        Start = ZerosEnd;
+      }
+      i = ZerosEnd;
+    }
+    if (End > Start) Segments.push_back(std::make_pair(Start, End));
+  } else if (End > 0) {
+    Segments.push_back(std::make_pair(0, End));
+  }
+
+  std::string Bytes;
+  for (unsigned i = 0; i < Segments.size(); i++) {
+    Bytes.append((const char*)&Data[Segments[i].first], Segments[i].second - Segments[i].first);
+  }
+
+  Out << "\"memoryInitializer\": {\"segments\": [";
+  for (unsigned i = 0; i < Segments.size(); i++) {
+    if (i > 0) Out << ", ";
+    Out << "[" << (GlobalBase + Segments[i].first) << ", " << (Segments[i].second - Segments[i].first) << "]";
+  }
+  Out << "], ";
+  if (MemoryInit == MEMORY_INIT_BASE64) {
+    Out << "\"base64\": \"" << base64Encode(Bytes) << "\"";
+  } else {
+    if (MemoryInitFile.empty()) {
+      report_fatal_error("-emscripten-memory-init=file needs -emscripten-memory-init-file");
+    }
+    std::string ErrorInfo;
+    raw_fd_ostream File(MemoryInitFile.c_str(), ErrorInfo, sys::fs::F_Binary);
+    if (!ErrorInfo.empty()) {
+      report_fatal_error("cannot open memory initializer file " + Twine(MemoryInitFile) + ": " + ErrorInfo);
+    }
+    File << Bytes;
+    Out << "\"file\": " << quoteJSONString(sys::path::filename(MemoryInitFile));
+  }
+  Out << "}";
+}
+
 void JSWriter::printProgram(const std::string& fname,
                              const std::string& mName) {
   printModule(fname,mName);
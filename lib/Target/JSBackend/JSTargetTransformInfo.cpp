@@ -73,9 +73,31 @@ public:
                                           OperandValueKind Opd1Info = OK_AnyValue,
                                           OperandValueKind Opd2Info = OK_AnyValue) const;
 
+  virtual unsigned getShuffleCost(ShuffleKind Kind, Type *Tp, int Index = 0,
+                                  Type *SubTp = 0) const;
+
+  virtual unsigned getCastInstrCost(unsigned Opcode, Type *Dst, Type *Src) const;
+
+  virtual unsigned getCmpSelInstrCost(unsigned Opcode, Type *ValTy,
+                                      Type *CondTy = 0) const;
+
   virtual unsigned getVectorInstrCost(unsigned Opcode, Type *Val,
                                       unsigned Index = -1) const;
 
+  virtual unsigned getMemoryOpCost(unsigned Opcode, Type *Src,
+                                   unsigned Alignment,
+                                   unsigned AddressSpace) const;
+
+  virtual unsigned getReductionCost(unsigned Opcode, Type *Ty,
+                                    bool IsPairwiseForm) const;
+
+  virtual unsigned getIntrinsicInstrCost(Intrinsic::ID ID, Type *RetTy,
+                                         ArrayRef<Type *> Tys) const;
+
+  virtual unsigned getNumberOfParts(Type *Tp) const;
+
+  virtual unsigned getAddressComputationCost(Type *Ty, bool IsComplex) const;
+
   virtual void getUnrollingPreferences(Loop *L, UnrollingPreferences &UP) const;
 };
 
@@ -111,36 +133,66 @@ unsigned JSTTI::getRegisterBitWidth(bool Vector) const {
   return 32;
 }
 
+// The cost of something the backend cannot emit at all. The vectorizers must
+// never pick it.
+static const unsigned Nope = 65536;
+
+/// Whether Ty is a vector type that maps onto a SIMD.js type. This mirrors
+/// JSWriter::checkVectorType, which rejects everything else.
+static bool isSIMDType(Type *Ty) {
+  VectorType *VTy = dyn_cast<VectorType>(Ty);
+  if (!VTy)
+    return false;
+  Type *ElTy = VTy->getElementType();
+  unsigned NumElements = VTy->getNumElements();
+  // <N x i1> masks are represented as sign-extended wider integers.
+  if (ElTy->isIntegerTy(1))
+    return NumElements <= 4 || NumElements == 8 || NumElements == 16;
+  if (ElTy->isIntegerTy(8))
+    return NumElements == 16;
+  if (ElTy->isIntegerTy(16))
+    return NumElements == 8;
+  if (ElTy->isDoubleTy())
+    return NumElements <= 2;
+  if (ElTy->isIntegerTy(32) || ElTy->isFloatTy())
+    return NumElements <= 4;
+  return false;
+}
+
+/// The cost of emitting an operation lane by lane, the way
+/// JSWriter::generateUnrolledExpression does: each lane extracts its operands,
+/// does the scalar operation, and the results are gathered into a new vector.
+static unsigned getScalarizedCost(Type *Ty, unsigned NumOperands,
+                                  unsigned ScalarCost) {
+  unsigned NumElements = cast<VectorType>(Ty)->getNumElements();
+  return NumElements * (NumOperands + ScalarCost) + 1;
+}
+
 unsigned JSTTI::getArithmeticInstrCost(unsigned Opcode, Type *Ty,
                                        OperandValueKind Opd1Info,
                                        OperandValueKind Opd2Info) const {
-  const unsigned Nope = 65536;
-
   unsigned Cost = TargetTransformInfo::getArithmeticInstrCost(Opcode, Ty, Opd1Info, Opd2Info);
 
-  if (VectorType *VTy = dyn_cast<VectorType>(Ty)) {
-    switch (VTy->getNumElements()) {
-    case 4:
-      // SIMD.js supports int32x4 and float32x4, and we can emulate <4 x i1>.
-      if (!VTy->getElementType()->isIntegerTy(1) &&
-          !VTy->getElementType()->isIntegerTy(32) &&
-          !VTy->getElementType()->isFloatTy())
-      {
-          return Nope;
-      }
-      break;
-    default:
-      // Wait until the other types are optimized.
+  if (Ty->isVectorTy()) {
+    if (!isSIMDType(Ty))
       return Nope;
-    }
 
     switch (Opcode) {
+      case Instruction::FRem:
+        // There is no SIMD.js remainder, and we don't unroll this one.
+        return Nope;
+      case Instruction::SDiv:
+      case Instruction::UDiv:
+      case Instruction::SRem:
+      case Instruction::URem:
+        // SIMD.js has no integer division, so these are unrolled.
+        return getScalarizedCost(Ty, 2, Cost);
       case Instruction::LShr:
       case Instruction::AShr:
       case Instruction::Shl:
         // SIMD.js' shifts are currently only ByScalar.
         if (Opd2Info != OK_UniformValue && Opd2Info != OK_UniformConstantValue)
-          Cost = Cost * VTy->getNumElements() + 100;
+          return getScalarizedCost(Ty, 2, Cost);
         break;
     }
   }
@@ -148,9 +200,74 @@ unsigned JSTTI::getArithmeticInstrCost(unsigned Opcode, Type *Ty,
   return Cost;
 }
 
+unsigned JSTTI::getShuffleCost(ShuffleKind Kind, Type *Tp, int Index,
+                               Type *SubTp) const {
+  if (!isSIMDType(Tp) || (SubTp && !isSIMDType(SubTp)))
+    return Nope;
+
+  // Every shuffle is a single swizzle or shuffle.
+  return 1;
+}
+
+unsigned JSTTI::getCastInstrCost(unsigned Opcode, Type *Dst, Type *Src) const {
+  unsigned Cost = TargetTransformInfo::getCastInstrCost(Opcode, Dst, Src);
+
+  if (!Dst->isVectorTy() && !Src->isVectorTy())
+    return Cost;
+  if (!isSIMDType(Dst) || !isSIMDType(Src))
+    return Nope;
+
+  switch (Opcode) {
+    case Instruction::SExt:
+      // Masks are already sign-extended, so extending one is free; nothing
+      // else can be extended.
+      if (Src->getVectorElementType()->isIntegerTy(1) &&
+          Src->getVectorNumElements() == Dst->getVectorNumElements())
+        return 0;
+      return Nope;
+    case Instruction::BitCast:
+    case Instruction::SIToFP:
+    case Instruction::FPToSI:
+    case Instruction::FPExt:
+    case Instruction::FPTrunc:
+      // fromXBits and fromX conversions.
+      return Cost;
+    case Instruction::UIToFP:
+    case Instruction::FPToUI:
+      // SIMD.js only converts signed integers, so these are unrolled.
+      return getScalarizedCost(Dst, 1, Cost);
+    default:
+      // Truncations, zero extensions and pointer casts of vectors are not
+      // supported.
+      return Nope;
+  }
+}
+
+unsigned JSTTI::getCmpSelInstrCost(unsigned Opcode, Type *ValTy,
+                                   Type *CondTy) const {
+  unsigned Cost = TargetTransformInfo::getCmpSelInstrCost(Opcode, ValTy, CondTy);
+
+  if (!ValTy->isVectorTy())
+    return Cost;
+  if (!isSIMDType(ValTy) || (CondTy && CondTy->isVectorTy() && !isSIMDType(CondTy)))
+    return Nope;
+
+  // float64x2 compares narrow their mask to int32x4, and selects widen it
+  // again.
+  if (ValTy->getVectorElementType()->isDoubleTy() &&
+      (Opcode == Instruction::FCmp ||
+       (Opcode == Instruction::Select && CondTy && CondTy->isVectorTy())))
+    return Cost + 1;
+
+  return Cost;
+}
+
 unsigned JSTTI::getVectorInstrCost(unsigned Opcode, Type *Val, unsigned Index) const {
   unsigned Cost = TargetTransformInfo::getVectorInstrCost(Opcode, Val, Index);
 
+  if (!isSIMDType(Val))
+    return Nope;
+
   // SIMD.js' insert/extract currently only take constant indices.
   if (Index == -1u)
       return Cost + 100;
@@ -158,6 +275,72 @@ unsigned JSTTI::getVectorInstrCost(unsigned Opcode, Type *Val, unsigned Index) c
   return Cost;
 }
 
+unsigned JSTTI::getMemoryOpCost(unsigned Opcode, Type *Src, unsigned Alignment,
+                                unsigned AddressSpace) const {
+  unsigned Cost = TargetTransformInfo::getMemoryOpCost(Opcode, Src, Alignment, AddressSpace);
+
+  if (VectorType *VTy = dyn_cast<VectorType>(Src)) {
+    // SIMD.js loads and stores go through HEAPU8, so alignment doesn't
+    // matter. Partial accesses only exist for types with up to four lanes,
+    // and there is no way to load a mask.
+    Type *ElTy = VTy->getElementType();
+    if (!isSIMDType(VTy) || ElTy->isIntegerTy(1))
+      return Nope;
+    return Cost;
+  }
+
+  // Unaligned scalar accesses are split into one access per aligned piece.
+  unsigned Size = Src->getPrimitiveSizeInBits() / 8;
+  if (Alignment && Size > Alignment)
+    return Cost * (Size / Alignment) + 1;
+
+  return Cost;
+}
+
+unsigned JSTTI::getReductionCost(unsigned Opcode, Type *Ty,
+                                 bool IsPairwiseForm) const {
+  if (!isSIMDType(Ty))
+    return Nope;
+
+  // Each step halves the vector with a shuffle and an operation, and the
+  // last lane is extracted.
+  unsigned NumElements = Ty->getVectorNumElements();
+  unsigned Steps = Log2_32_Ceil(NumElements);
+  return Steps * (getShuffleCost(SK_ExtractSubvector, Ty) +
+                  getArithmeticInstrCost(Opcode, Ty)) +
+         getVectorInstrCost(Instruction::ExtractElement, Ty, 0);
+}
+
+unsigned JSTTI::getIntrinsicInstrCost(Intrinsic::ID ID, Type *RetTy,
+                                      ArrayRef<Type *> Tys) const {
+  // Intrinsics are emitted as calls to Math functions and library code,
+  // none of which take SIMD values.
+  if (RetTy->isVectorTy())
+    return Nope;
+  for (unsigned i = 0, e = Tys.size(); i != e; ++i)
+    if (Tys[i]->isVectorTy())
+      return Nope;
+
+  return TargetTransformInfo::getIntrinsicInstrCost(ID, RetTy, Tys);
+}
+
+unsigned JSTTI::getNumberOfParts(Type *Tp) const {
+  // A SIMD.js value is never split. We don't know what would happen to
+  // anything else, since it can't be emitted.
+  if (Tp->isVectorTy())
+    return isSIMDType(Tp) ? 1 : 0;
+  return TargetTransformInfo::getNumberOfParts(Tp);
+}
+
+unsigned JSTTI::getAddressComputationCost(Type *Ty, bool IsComplex) const {
+  // Addresses are plain integer arithmetic, which folds into the access. A
+  // complex vector of addresses belongs to an access that gets scalarized,
+  // and each lane's address has to be extracted first.
+  if (Ty->isVectorTy() && IsComplex)
+    return 1;
+  return TargetTransformInfo::getAddressComputationCost(Ty, IsComplex);
+}
+
 void JSTTI::getUnrollingPreferences(Loop *L, UnrollingPreferences &UP) const {
   // We generally don't want a lot of unrolling.
   UP.Partial = false;
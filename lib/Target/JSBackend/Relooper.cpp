@@ -7,8 +7,11 @@
 
 #include <string.h>
 #include <stdlib.h>
-#include <list>
+#include <algorithm>
 #include <stack>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #if EMSCRIPTEN
 #include "ministring.h"
@@ -35,58 +38,72 @@ static void PrintDebug(const char *Format, ...);
 
 #define INDENTATION 1
 
-struct Indenter {
-  static int CurrIndent;
+// OutputBuffer
 
-  static void Indent() { CurrIndent++; }
-  static void Unindent() { CurrIndent--; }
-};
+OutputBuffer::OutputBuffer() : Root(NULL), Curr(NULL), Size(0), Owned(false), CurrIndent(1), AsmJS(false) {
+}
 
-static void PrintIndented(const char *Format, ...);
-static void PutIndented(const char *String);
+OutputBuffer::~OutputBuffer() {
+  if (Owned) free(Root);
+}
 
-static char *OutputBufferRoot = NULL;
-static char *OutputBuffer = NULL;
-static int OutputBufferSize = 0;
-static int OutputBufferOwned = false;
+void OutputBuffer::Set(char *Buffer, int SizeInit) {
+  if (Owned) free(Root);
+  Root = Curr = Buffer;
+  Size = SizeInit;
+  Owned = false;
+}
+
+void OutputBuffer::Reserve(int SizeInit) {
+  if (Root && Size >= SizeInit && Owned) return;
+  if (Owned) free(Root);
+  Root = Curr = (char*)malloc(SizeInit);
+  Size = SizeInit;
+  Owned = true;
+}
 
-static int LeftInOutputBuffer() {
-  return OutputBufferSize - (OutputBuffer - OutputBufferRoot);
+void OutputBuffer::Reset() {
+  Curr = Root;
+  if (Curr) *Curr = 0;
 }
 
-static bool EnsureOutputBuffer(int Needed) { // ensures the output buffer is sufficient. returns true is no problem happened
+int OutputBuffer::Left() {
+  return Size - (Curr - Root);
+}
+
+bool OutputBuffer::Ensure(int Needed) { // ensures the output buffer is sufficient. returns true is no problem happened
   Needed++; // ensure the trailing \0 is not forgotten
-  int Left = LeftInOutputBuffer();
-  if (!OutputBufferOwned) {
+  int Left = this->Left();
+  if (!Owned) {
     assert(Needed < Left);
   } else {
     // we own the buffer, and can resize if necessary
     if (Needed >= Left) {
-      int Offset = OutputBuffer - OutputBufferRoot;
-      int TotalNeeded = OutputBufferSize + Needed - Left + 10240;
-      int NewSize = OutputBufferSize;
+      int Offset = Curr - Root;
+      int TotalNeeded = Size + Needed - Left + 10240;
+      int NewSize = Size;
       while (NewSize < TotalNeeded) NewSize = NewSize + (NewSize/2);
-      //printf("resize %d => %d\n", OutputBufferSize, NewSize);
-      OutputBufferRoot = (char*)realloc(OutputBufferRoot, NewSize);
-      assert(OutputBufferRoot);
-      OutputBuffer = OutputBufferRoot + Offset;
-      OutputBufferSize = NewSize;
+      //printf("resize %d => %d\n", Size, NewSize);
+      Root = (char*)realloc(Root, NewSize);
+      assert(Root);
+      Curr = Root + Offset;
+      Size = NewSize;
       return false;
     }
   }
   return true;
 }
 
-void PrintIndented(const char *Format, ...) {
-  assert(OutputBuffer);
-  EnsureOutputBuffer(Indenter::CurrIndent*INDENTATION);
-  for (int i = 0; i < Indenter::CurrIndent*INDENTATION; i++, OutputBuffer++) *OutputBuffer = ' ';
+void OutputBuffer::PrintIndented(const char *Format, ...) {
+  assert(Curr);
+  Ensure(CurrIndent*INDENTATION);
+  for (int i = 0; i < CurrIndent*INDENTATION; i++, Curr++) *Curr = ' ';
   int Written;
   while (1) { // write and potentially resize buffer until we have enough room
-    int Left = LeftInOutputBuffer();
+    int Left = this->Left();
     va_list Args;
     va_start(Args, Format);
-    Written = vsnprintf(OutputBuffer, Left, Format, Args);
+    Written = vsnprintf(Curr, Left, Format, Args);
     va_end(Args);
 #ifdef _MSC_VER
     // VC CRT specific: vsnprintf returns -1 on failure, other runtimes return the number of characters that would have been
@@ -98,28 +115,24 @@ void PrintIndented(const char *Format, ...) {
     }
 #endif
 
-    if (EnsureOutputBuffer(Written)) break;
+    if (Ensure(Written)) break;
   }
-  OutputBuffer += Written;
+  Curr += Written;
 }
 
-void PutIndented(const char *String) {
-  assert(OutputBuffer);
-  EnsureOutputBuffer(Indenter::CurrIndent*INDENTATION);
-  for (int i = 0; i < Indenter::CurrIndent*INDENTATION; i++, OutputBuffer++) *OutputBuffer = ' ';
-  int Needed = strlen(String)+1;
-  EnsureOutputBuffer(Needed);
-  strcpy(OutputBuffer, String);
-  OutputBuffer += strlen(String);
-  *OutputBuffer++ = '\n';
-  *OutputBuffer = 0;
+void OutputBuffer::PutIndented(const char *String) {
+  PutIndented(String, strlen(String));
 }
 
-static int AsmJS = 0;
-
-// Indenter
-
-int Indenter::CurrIndent = 1;
+void OutputBuffer::PutIndented(const char *String, int Length) {
+  assert(Curr);
+  Ensure(CurrIndent*INDENTATION + Length + 1);
+  for (int i = 0; i < CurrIndent*INDENTATION; i++, Curr++) *Curr = ' ';
+  memcpy(Curr, String, Length);
+  Curr += Length;
+  *Curr++ = '\n';
+  *Curr = 0;
+}
 
 // Branch
 
@@ -133,30 +146,123 @@ Branch::~Branch() {
   if (Code) free((void*)Code);
 }
 
-void Branch::Render(Block *Target, bool SetLabel) {
-  if (Code) PrintIndented("%s\n", Code);
-  if (SetLabel) PrintIndented("label = %d;\n", Target->Id);
+void Branch::Render(OutputBuffer &Out, Block *Target, bool SetLabel) {
+  if (Code) Out.PrintIndented("%s\n", Code);
+  if (SetLabel) Out.PrintIndented("label = %d;\n", Target->Id);
   if (Ancestor) {
     if (Type == Break || Type == Continue) {
       if (Labeled) {
-        PrintIndented("%s L%d;\n", Type == Break ? "break" : "continue", Ancestor->Id);
+        Out.PrintIndented("%s L%d;\n", Type == Break ? "break" : "continue", Ancestor->Id);
       } else {
-        PrintIndented("%s;\n", Type == Break ? "break" : "continue");
+        Out.PrintIndented("%s;\n", Type == Break ? "break" : "continue");
       }
     }
   }
 }
 
+// BlockSet
+
+static unsigned CountTrailingZeros(unsigned Word) { // Word must not be 0
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctz(Word);
+#elif defined(_MSC_VER)
+  unsigned long Index;
+  _BitScanForward(&Index, Word);
+  return Index;
+#else
+  unsigned Zeros = 0;
+  while (!(Word & 1)) {
+    Word >>= 1;
+    Zeros++;
+  }
+  return Zeros;
+#endif
+}
+
+unsigned BlockSet::FindFrom(unsigned Index) const {
+  unsigned End = Limit();
+  if (Index < Base) Index = Base;
+  if (Index >= End) return End;
+  unsigned Curr = (Index - Base) / WordBits;
+  Word Bits = Words[Curr] & (~(Word)0 << (Index % WordBits));
+  while (!Bits) {
+    if (++Curr == Words.size()) return End;
+    Bits = Words[Curr];
+  }
+  return Base + Curr*WordBits + CountTrailingZeros(Bits);
+}
+
+size_t BlockSet::count(const Block *B) const {
+  if (B->Index < Base || B->Index >= Limit()) return 0;
+  unsigned Bit = B->Index - Base;
+  return (Words[Bit / WordBits] >> (Bit % WordBits)) & 1;
+}
+
+bool BlockSet::insert(Block *B) {
+  assert(B->Siblings); // must have been added to a relooper
+  assert(!Blocks || Blocks == B->Siblings); // and all must be in the same one
+  Blocks = B->Siblings;
+  unsigned First = B->Index - B->Index % WordBits; // of the word B is in
+  if (Words.empty()) {
+    Base = First;
+    Words.push_back(0);
+  } else if (First < Base) {
+    // Grow downwards by at least as much as we have, so that inserting in
+    // descending order is not quadratic
+    unsigned Needed = (Base - First) / WordBits;
+    unsigned Grow = std::min(std::max(Needed, (unsigned)Words.size()), Base / WordBits);
+    Words.insert(Words.begin(), Grow, 0);
+    Base -= Grow * WordBits;
+  } else if (B->Index >= Limit()) {
+    Words.resize((First - Base) / WordBits + 1, 0);
+  }
+  unsigned Bit = B->Index - Base;
+  Word &Curr = Words[Bit / WordBits];
+  Word Mask = (Word)1 << (Bit % WordBits);
+  if (Curr & Mask) return false;
+  Curr |= Mask;
+  Count++;
+  return true;
+}
+
+void BlockSet::erase(const Block *B) {
+  if (!count(B)) return;
+  unsigned Bit = B->Index - Base;
+  Words[Bit / WordBits] &= ~((Word)1 << (Bit % WordBits));
+  Count--;
+}
+
 // Block
 
-Block::Block(const char *CodeInit, const char *BranchVarInit) : Parent(NULL), Id(-1), IsCheckedMultipleEntry(false) {
-  Code = strdup(CodeInit);
-  BranchVar = BranchVarInit ? strdup(BranchVarInit) : NULL;
+// Blocks may be created on several threads at once (each for its own
+// relooper), so the counter is updated atomically where we can.
+static unsigned BlockOrdinalCounter = 0;
+
+static unsigned NextBlockOrdinal() {
+#if defined(__GNUC__) || defined(__clang__)
+  return __sync_fetch_and_add(&BlockOrdinalCounter, 1);
+#elif defined(_MSC_VER)
+  return (unsigned)_InterlockedExchangeAdd((volatile long*)&BlockOrdinalCounter, 1);
+#else
+  return BlockOrdinalCounter++;
+#endif
+}
+
+Block::Block(const char *CodeInit, const char *BranchVarInit, bool Copy) : Parent(NULL), Id(-1), Ordinal(NextBlockOrdinal()), Index(0), Siblings(NULL), Owned(Copy), IsCheckedMultipleEntry(false) {
+  if (Owned) {
+    Code = strdup(CodeInit);
+    BranchVar = BranchVarInit ? strdup(BranchVarInit) : NULL;
+  } else {
+    Code = CodeInit;
+    BranchVar = BranchVarInit;
+  }
 }
 
 Block::~Block() {
-  if (Code) free((void*)Code);
-  if (BranchVar) free((void*)BranchVar);
+  if (Owned) {
+    if (Code) free((void*)Code);
+    if (BranchVar) free((void*)BranchVar);
+  }
   for (BlockBranchMap::iterator iter = ProcessedBranchesOut.begin(); iter != ProcessedBranchesOut.end(); iter++) {
     delete iter->second;
   }
@@ -168,19 +274,21 @@ void Block::AddBranchTo(Block *Target, const char *Condition, const char *Code)
   BranchesOut[Target] = new Branch(Condition, Code);
 }
 
-void Block::Render(bool InLoop) {
+void Block::Render(OutputBuffer &Out, bool InLoop) {
   if (IsCheckedMultipleEntry && InLoop) {
-    PrintIndented("label = 0;\n");
+    Out.PrintIndented("label = 0;\n");
   }
 
   if (Code) {
     // Print code in an indented manner, even over multiple lines
-    char *Start = const_cast<char*>(Code);
+    const char *Start = Code;
     while (*Start) {
-      char *End = strchr(Start, '\n');
-      if (End) *End = 0;
-      PutIndented(Start);
-      if (End) *End = '\n'; else break;
+      const char *End = strchr(Start, '\n');
+      if (!End) {
+        Out.PutIndented(Start);
+        break;
+      }
+      Out.PutIndented(Start, End - Start);
       Start = End+1;
     }
   }
@@ -218,7 +326,7 @@ void Block::Render(bool InLoop) {
     PrintDebug("Fusing Multiple to Simple\n");
     Parent->Next = Parent->Next->Next;
     Fused->UseSwitch = false; // TODO: emit switches here
-    Fused->RenderLoopPrefix();
+    Fused->RenderLoopPrefix(Out);
 
     // When the Multiple has the same number of groups as we have branches,
     // they will all be fused, so it is safe to not set the label at all
@@ -241,7 +349,7 @@ void Block::Render(bool InLoop) {
   bool useSwitch = BranchVar != NULL;
 
   if (useSwitch) {
-    PrintIndented("switch (%s) {\n", BranchVar);
+    Out.PrintIndented("switch (%s) {\n", BranchVar);
   }
 
   ministring RemainingConditions;
@@ -264,10 +372,10 @@ void Block::Render(bool InLoop) {
     if (iter != ProcessedBranchesOut.end()) {
       // If there is nothing to show in this branch, omit the condition
       if (useSwitch) {
-        PrintIndented("%s {\n", Details->Condition);
+        Out.PrintIndented("%s {\n", Details->Condition);
       } else {
         if (HasContent) {
-          PrintIndented("%sif (%s) {\n", First ? "" : "} else ", Details->Condition);
+          Out.PrintIndented("%sif (%s) {\n", First ? "" : "} else ", Details->Condition);
           First = false;
         } else {
           if (RemainingConditions.size() > 0) RemainingConditions += " && ";
@@ -283,156 +391,156 @@ void Block::Render(bool InLoop) {
     } else {
       // this is the default
       if (useSwitch) {
-        PrintIndented("default: {\n");
+        Out.PrintIndented("default: {\n");
       } else {
         if (HasContent) {
           if (RemainingConditions.size() > 0) {
             if (First) {
-              PrintIndented("if (%s) {\n", RemainingConditions.c_str());
+              Out.PrintIndented("if (%s) {\n", RemainingConditions.c_str());
               First = false;
             } else {
-              PrintIndented("} else if (%s) {\n", RemainingConditions.c_str());
+              Out.PrintIndented("} else if (%s) {\n", RemainingConditions.c_str());
             }
           } else if (!First) {
-            PrintIndented("} else {\n");
+            Out.PrintIndented("} else {\n");
           }
         }
       }
     }
-    if (!First) Indenter::Indent();
-    Details->Render(Target, SetCurrLabel);
+    if (!First) Out.Indent();
+    Details->Render(Out, Target, SetCurrLabel);
     if (HasFusedContent) {
-      Fused->InnerMap.find(Target->Id)->second->Render(InLoop);
+      Fused->InnerMap.find(Target->Id)->second->Render(Out, InLoop);
     } else if (Details->Type == Branch::Nested) {
       // Nest the parent content here, and remove it from showing up afterwards as Next
       assert(Parent->Next);
-      Parent->Next->Render(InLoop);
+      Parent->Next->Render(Out, InLoop);
       Parent->Next = NULL;
     }
     if (useSwitch && iter != ProcessedBranchesOut.end()) {
-      PrintIndented("break;\n");
+      Out.PrintIndented("break;\n");
     }
-    if (!First) Indenter::Unindent();
+    if (!First) Out.Unindent();
     if (useSwitch) {
-      PrintIndented("}\n");
+      Out.PrintIndented("}\n");
     }
     if (iter == ProcessedBranchesOut.end()) break;
   }
-  if (!First) PrintIndented("}\n");
+  if (!First) Out.PrintIndented("}\n");
 
   if (Fused) {
-    Fused->RenderLoopPostfix();
+    Fused->RenderLoopPostfix(Out);
   }
 }
 
 // MultipleShape
 
-void MultipleShape::RenderLoopPrefix() {
+void MultipleShape::RenderLoopPrefix(OutputBuffer &Out) {
   if (Breaks) {
     if (UseSwitch) {
       if (Labeled) {
-        PrintIndented("L%d: ", Id);
+        Out.PrintIndented("L%d: ", Id);
       }
     } else {
       if (Labeled) {
-        PrintIndented("L%d: do {\n", Id);
+        Out.PrintIndented("L%d: do {\n", Id);
       } else {
-        PrintIndented("do {\n");
+        Out.PrintIndented("do {\n");
       }
-      Indenter::Indent();
+      Out.Indent();
     }
   }
 }
 
-void MultipleShape::RenderLoopPostfix() {
+void MultipleShape::RenderLoopPostfix(OutputBuffer &Out) {
   if (Breaks && !UseSwitch) {
-    Indenter::Unindent();
-    PrintIndented("} while(0);\n");
+    Out.Unindent();
+    Out.PrintIndented("} while(0);\n");
   }
 }
 
-void MultipleShape::Render(bool InLoop) {
-  RenderLoopPrefix();
+void MultipleShape::Render(OutputBuffer &Out, bool InLoop) {
+  RenderLoopPrefix(Out);
 
   if (!UseSwitch) {
     // emit an if-else chain
     bool First = true;
     for (IdShapeMap::iterator iter = InnerMap.begin(); iter != InnerMap.end(); iter++) {
-      if (AsmJS) {
-        PrintIndented("%sif ((label|0) == %d) {\n", First ? "" : "else ", iter->first);
+      if (Out.AsmJS) {
+        Out.PrintIndented("%sif ((label|0) == %d) {\n", First ? "" : "else ", iter->first);
       } else {
-        PrintIndented("%sif (label == %d) {\n", First ? "" : "else ", iter->first);
+        Out.PrintIndented("%sif (label == %d) {\n", First ? "" : "else ", iter->first);
       }
       First = false;
-      Indenter::Indent();
-      iter->second->Render(InLoop);
-      Indenter::Unindent();
-      PrintIndented("}\n");
+      Out.Indent();
+      iter->second->Render(Out, InLoop);
+      Out.Unindent();
+      Out.PrintIndented("}\n");
     }
   } else {
     // emit a switch
-    if (AsmJS) {
-      PrintIndented("switch (label|0) {\n");
+    if (Out.AsmJS) {
+      Out.PrintIndented("switch (label|0) {\n");
     } else {
-      PrintIndented("switch (label) {\n");
+      Out.PrintIndented("switch (label) {\n");
     }
-    Indenter::Indent();
+    Out.Indent();
     for (IdShapeMap::iterator iter = InnerMap.begin(); iter != InnerMap.end(); iter++) {
-      PrintIndented("case %d: {\n", iter->first);
-      Indenter::Indent();
-      iter->second->Render(InLoop);
-      PrintIndented("break;\n");
-      Indenter::Unindent();
-      PrintIndented("}\n");
+      Out.PrintIndented("case %d: {\n", iter->first);
+      Out.Indent();
+      iter->second->Render(Out, InLoop);
+      Out.PrintIndented("break;\n");
+      Out.Unindent();
+      Out.PrintIndented("}\n");
     }
-    Indenter::Unindent();
-    PrintIndented("}\n");
+    Out.Unindent();
+    Out.PrintIndented("}\n");
   }
 
-  RenderLoopPostfix();
-  if (Next) Next->Render(InLoop);
+  RenderLoopPostfix(Out);
+  if (Next) Next->Render(Out, InLoop);
 }
 
 // LoopShape
 
-void LoopShape::Render(bool InLoop) {
+void LoopShape::Render(OutputBuffer &Out, bool InLoop) {
   if (Labeled) {
-    PrintIndented("L%d: while(1) {\n", Id);
+    Out.PrintIndented("L%d: while(1) {\n", Id);
   } else {
-    PrintIndented("while(1) {\n");
+    Out.PrintIndented("while(1) {\n");
   }
-  Indenter::Indent();
-  Inner->Render(true);
-  Indenter::Unindent();
-  PrintIndented("}\n");
-  if (Next) Next->Render(InLoop);
+  Out.Indent();
+  Inner->Render(Out, true);
+  Out.Unindent();
+  Out.PrintIndented("}\n");
+  if (Next) Next->Render(Out, InLoop);
 }
 
 // EmulatedShape
 
-void EmulatedShape::Render(bool InLoop) {
-  PrintIndented("label = %d;\n", Entry->Id);
+void EmulatedShape::Render(OutputBuffer &Out, bool InLoop) {
+  Out.PrintIndented("label = %d;\n", Entry->Id);
   if (Labeled) {
-    PrintIndented("L%d: ", Id);
+    Out.PrintIndented("L%d: ", Id);
   }
-  PrintIndented("while(1) {\n");
-  Indenter::Indent();
-  PrintIndented("switch(label|0) {\n");
-  Indenter::Indent();
+  Out.PrintIndented("while(1) {\n");
+  Out.Indent();
+  Out.PrintIndented("switch(label|0) {\n");
+  Out.Indent();
   for (BlockSet::iterator iter = Blocks.begin(); iter != Blocks.end(); iter++) {
     Block *Curr = *iter;
-    PrintIndented("case %d: {\n", Curr->Id);
-    Indenter::Indent();
-    Curr->Render(InLoop);
-    PrintIndented("break;\n");
-    Indenter::Unindent();
-    PrintIndented("}\n");
+    Out.PrintIndented("case %d: {\n", Curr->Id);
+    Out.Indent();
+    Curr->Render(Out, InLoop);
+    Out.PrintIndented("break;\n");
+    Out.Unindent();
+    Out.PrintIndented("}\n");
   }
-  Indenter::Unindent();
-  PrintIndented("}\n");
-  Indenter::Unindent();
-  PrintIndented("}\n");
-  if (Next) Next->Render(InLoop);
+  Out.Unindent();
+  Out.PrintIndented("}\n");
+  Out.Unindent();
+  Out.PrintIndented("}\n");
+  if (Next) Next->Render(Out, InLoop);
 }
 
 // Relooper
@@ -447,6 +555,8 @@ Relooper::~Relooper() {
 
 void Relooper::AddBlock(Block *New, int Id) {
   New->Id = Id == -1 ? BlockIdCounter++ : Id;
+  New->Index = Blocks.size();
+  New->Siblings = &Blocks;
   Blocks.push_back(New);
 }
 
@@ -455,9 +565,18 @@ struct RelooperRecursor {
   RelooperRecursor(Relooper *ParentInit) : Parent(ParentInit) {}
 };
 
-typedef std::list<Block*> BlockList;
+typedef std::deque<Block*> BlockList;
 
 void Relooper::Calculate(Block *Entry) {
+  // Blocks may have been added in any order. Number them in the order they
+  // were created, which is the order BlockSets iterate in, like everything
+  // else that is sorted by BlockOrder. Blocks split below are created and
+  // added last, so they keep to that order.
+  std::sort(Blocks.begin(), Blocks.end(), BlockOrder());
+  for (unsigned i = 0; i < Blocks.size(); i++) {
+    Blocks[i]->Index = i;
+  }
+
   // Scan and optimize the input
   struct PreOptimizer : public RelooperRecursor {
     PreOptimizer(Relooper *Parent) : RelooperRecursor(Parent) {}
@@ -497,9 +616,9 @@ void Relooper::Calculate(Block *Entry) {
         if (strlen(Original->Code)*(Original->BranchesIn.size()-1) > TotalCodeSize/5) continue; // if splitting increases raw code size by a significant amount, abort
         // Split the node (for simplicity, we replace all the blocks, even though we could have reused the original)
         PrintDebug("Splitting block %d\n", Original->Id);
-        for (BlockSet::iterator iter = Original->BranchesIn.begin(); iter != Original->BranchesIn.end(); iter++) {
+        for (BlockVectorSet::iterator iter = Original->BranchesIn.begin(); iter != Original->BranchesIn.end(); iter++) {
           Block *Prior = *iter;
-          Block *Split = new Block(Original->Code, Original->BranchVar);
+          Block *Split = new Block(Original->Code, Original->BranchVar, Original->Owned);
           Parent->AddBlock(Split, Original->Id);
           Split->BranchesIn.insert(Prior);
           Branch *Details = Prior->BranchesOut[Original];
@@ -546,7 +665,12 @@ void Relooper::Calculate(Block *Entry) {
   // Recursively process the graph
 
   struct Analyzer : public RelooperRecursor {
-    Analyzer(Relooper *Parent) : RelooperRecursor(Parent) {}
+    // For FindIndependentGroups, indexed by Block::Index. Kept between calls,
+    // which put it back to all NULL when done, so that each call takes time
+    // proportional to the blocks it visits rather than to the function.
+    std::vector<Block*> Ownership;
+
+    Analyzer(Relooper *Parent) : RelooperRecursor(Parent), Ownership(Parent->Blocks.size(), (Block*)NULL) {}
 
     // Add a shape to the list of shapes in this Relooper calculation
     void Notice(Shape *New) {
@@ -568,7 +692,7 @@ void Relooper::Calculate(Block *Entry) {
     void Solipsize(Block *Target, Branch::FlowType Type, Shape *Ancestor, BlockSet &From) {
       PrintDebug("Solipsizing branches into %d\n", Target->Id);
       DebugDump(From, "  relevant to solipsize: ");
-      for (BlockSet::iterator iter = Target->BranchesIn.begin(); iter != Target->BranchesIn.end();) {
+      for (BlockVectorSet::iterator iter = Target->BranchesIn.begin(); iter != Target->BranchesIn.end();) {
         Block *Prior = *iter;
         if (!contains(From, Prior)) {
           iter++;
@@ -580,8 +704,7 @@ void Relooper::Calculate(Block *Entry) {
         if (MultipleShape *Multiple = Shape::IsMultiple(Ancestor)) {
           Multiple->Breaks++; // We are breaking out of this Multiple, so need a loop
         }
-        iter++; // carefully increment iter before erasing
-        Target->BranchesIn.erase(Prior);
+        iter = Target->BranchesIn.erase(iter);
         Target->ProcessedBranchesIn.insert(Prior);
         Prior->BranchesOut.erase(Target);
         Prior->ProcessedBranchesOut[Target] = PriorOut;
@@ -626,17 +749,19 @@ void Relooper::Calculate(Block *Entry) {
       // Find the inner blocks in this loop. Proceed backwards from the entries until
       // you reach a seen block, collecting as you go.
       BlockSet InnerBlocks;
-      BlockSet Queue = Entries;
+      BlockList Queue;
+      for (BlockSet::iterator iter = Entries.begin(); iter != Entries.end(); iter++) {
+        Queue.push_back(*iter);
+      }
       while (Queue.size() > 0) {
-        Block *Curr = *(Queue.begin());
-        Queue.erase(Queue.begin());
-        if (!contains(InnerBlocks, Curr)) {
+        Block *Curr = Queue.front();
+        Queue.pop_front();
+        if (InnerBlocks.insert(Curr)) {
           // This element is new, mark it as inner and remove from outer
-          InnerBlocks.insert(Curr);
           Blocks.erase(Curr);
           // Add the elements prior to it
-          for (BlockSet::iterator iter = Curr->BranchesIn.begin(); iter != Curr->BranchesIn.end(); iter++) {
-            Queue.insert(*iter);
+          for (BlockVectorSet::iterator iter = Curr->BranchesIn.begin(); iter != Curr->BranchesIn.end(); iter++) {
+            if (!contains(InnerBlocks, *iter)) Queue.push_back(*iter);
           }
 #if 0
           // Add elements it leads to, if they are dead ends. There is no reason not to hoist dead ends
@@ -644,7 +769,7 @@ void Relooper::Calculate(Block *Entry) {
           for (BlockBranchMap::iterator iter = Curr->BranchesOut.begin(); iter != Curr->BranchesOut.end(); iter++) {
             Block *Target = iter->first;
             if (Target->BranchesIn.size() <= 1 && Target->BranchesOut.size() == 0) {
-              Queue.insert(Target);
+              Queue.push_back(Target);
             }
           }
 #endif
@@ -739,40 +864,40 @@ void Relooper::Calculate(Block *Entry) {
     // ignore directly reaching the entry itself by another entry.
     //   @param Ignore - previous blocks that are irrelevant
     void FindIndependentGroups(BlockSet &Entries, BlockBlockSetMap& IndependentGroups, BlockSet *Ignore=NULL) {
-      typedef std::map<Block*, Block*> BlockBlockMap;
-
       struct HelperClass {
         BlockBlockSetMap& IndependentGroups;
-        BlockBlockMap Ownership; // For each block, which entry it belongs to. We have reached it from there.
+        std::vector<Block*> &Ownership; // For each block, which entry it belongs to. We have reached it from there. NULL if not reached, or invalidated
+        BlockSet Reached; // The blocks we have reached, invalidated or not
 
-        HelperClass(BlockBlockSetMap& IndependentGroupsInit) : IndependentGroups(IndependentGroupsInit) {}
+        HelperClass(BlockBlockSetMap& IndependentGroupsInit, std::vector<Block*> &OwnershipInit) : IndependentGroups(IndependentGroupsInit), Ownership(OwnershipInit) {}
+        ~HelperClass() {
+          for (BlockSet::iterator iter = Reached.begin(); iter != Reached.end(); iter++) {
+            Ownership[(*iter)->Index] = NULL;
+          }
+        }
         void InvalidateWithChildren(Block *New) { // TODO: rename New
           BlockList ToInvalidate; // Being in the list means you need to be invalidated
           ToInvalidate.push_back(New);
           while (ToInvalidate.size() > 0) {
             Block *Invalidatee = ToInvalidate.front();
             ToInvalidate.pop_front();
-            Block *Owner = Ownership[Invalidatee];
+            Block *Owner = Ownership[Invalidatee->Index];
             if (contains(IndependentGroups, Owner)) { // Owner may have been invalidated, do not add to IndependentGroups!
               IndependentGroups[Owner].erase(Invalidatee);
             }
-            if (Ownership[Invalidatee]) { // may have been seen before and invalidated already
-              Ownership[Invalidatee] = NULL;
+            if (Owner) { // may have been seen before and invalidated already
+              Ownership[Invalidatee->Index] = NULL;
               for (BlockBranchMap::iterator iter = Invalidatee->BranchesOut.begin(); iter != Invalidatee->BranchesOut.end(); iter++) {
                 Block *Target = iter->first;
-                BlockBlockMap::iterator Known = Ownership.find(Target);
-                if (Known != Ownership.end()) {
-                  Block *TargetOwner = Known->second;
-                  if (TargetOwner) {
-                    ToInvalidate.push_back(Target);
-                  }
+                if (Ownership[Target->Index]) {
+                  ToInvalidate.push_back(Target);
                 }
               }
             }
           }
         }
       };
-      HelperClass Helper(IndependentGroups);
+      HelperClass Helper(IndependentGroups, Ownership);
 
       // We flow out from each of the entries, simultaneously.
       // When we reach a new block, we add it as belonging to the one we got to it from.
@@ -783,27 +908,27 @@ void Relooper::Calculate(Block *Entry) {
       BlockList Queue; // Being in the queue means we just added this item, and we need to add its children
       for (BlockSet::iterator iter = Entries.begin(); iter != Entries.end(); iter++) {
         Block *Entry = *iter;
-        Helper.Ownership[Entry] = Entry;
+        Helper.Ownership[Entry->Index] = Entry;
+        Helper.Reached.insert(Entry);
         IndependentGroups[Entry].insert(Entry);
         Queue.push_back(Entry);
       }
       while (Queue.size() > 0) {
         Block *Curr = Queue.front();
         Queue.pop_front();
-        Block *Owner = Helper.Ownership[Curr]; // Curr must be in the ownership map if we are in the queue
+        Block *Owner = Helper.Ownership[Curr->Index]; // Curr must have been reached if we are in the queue
         if (!Owner) continue; // we have been invalidated meanwhile after being reached from two entries
         // Add all children
         for (BlockBranchMap::iterator iter = Curr->BranchesOut.begin(); iter != Curr->BranchesOut.end(); iter++) {
           Block *New = iter->first;
-          BlockBlockMap::iterator Known = Helper.Ownership.find(New);
-          if (Known == Helper.Ownership.end()) {
+          if (Helper.Reached.insert(New)) {
             // New node. Add it, and put it in the queue
-            Helper.Ownership[New] = Owner;
+            Helper.Ownership[New->Index] = Owner;
             IndependentGroups[Owner].insert(New);
             Queue.push_back(New);
             continue;
           }
-          Block *NewOwner = Known->second;
+          Block *NewOwner = Helper.Ownership[New->Index];
           if (!NewOwner) continue; // We reached an invalidated node
           if (NewOwner != Owner) {
             // Invalidate this and all reachable that we have seen - we reached this from two locations
@@ -824,10 +949,10 @@ void Relooper::Calculate(Block *Entry) {
         BlockList ToInvalidate;
         for (BlockSet::iterator iter = CurrGroup.begin(); iter != CurrGroup.end(); iter++) {
           Block *Child = *iter;
-          for (BlockSet::iterator iter = Child->BranchesIn.begin(); iter != Child->BranchesIn.end(); iter++) {
+          for (BlockVectorSet::iterator iter = Child->BranchesIn.begin(); iter != Child->BranchesIn.end(); iter++) {
             Block *Parent = *iter;
             if (Ignore && contains(*Ignore, Parent)) continue;
-            if (Helper.Ownership[Parent] != Helper.Ownership[Child]) {
+            if (Helper.Ownership[Parent->Index] != Helper.Ownership[Child->Index]) {
               ToInvalidate.push_back(Child);
             }
           }
@@ -875,13 +1000,13 @@ void Relooper::Calculate(Block *Entry) {
           // Find new next entries and fix branches to them
           for (BlockBranchMap::iterator iter = CurrInner->BranchesOut.begin(); iter != CurrInner->BranchesOut.end();) {
             Block *CurrTarget = iter->first;
-            BlockBranchMap::iterator Next = iter;
-            Next++;
-            if (!contains(CurrBlocks, CurrTarget)) {
-              NextEntries.insert(CurrTarget);
-              Solipsize(CurrTarget, Branch::Break, Multiple, CurrBlocks); 
+            if (contains(CurrBlocks, CurrTarget)) {
+              iter++;
+              continue;
             }
-            iter = Next; // increment carefully because Solipsize can remove us
+            NextEntries.insert(CurrTarget);
+            Solipsize(CurrTarget, Branch::Break, Multiple, CurrBlocks);
+            iter = CurrInner->BranchesOut.lower_bound(CurrTarget); // Solipsize removed the branch, so this is the next one
           }
         }
         Multiple->InnerMap[CurrEntry->Id] = Process(CurrBlocks, CurrEntries, NULL);
@@ -965,7 +1090,7 @@ void Relooper::Calculate(Block *Entry) {
             Block *Entry = iter->first;
             BlockSet &Group = iter->second;
             BlockBlockSetMap::iterator curr = iter++; // iterate carefully, we may delete
-            for (BlockSet::iterator iterBranch = Entry->BranchesIn.begin(); iterBranch != Entry->BranchesIn.end(); iterBranch++) {
+            for (BlockVectorSet::iterator iterBranch = Entry->BranchesIn.begin(); iterBranch != Entry->BranchesIn.end(); iterBranch++) {
               Block *Origin = *iterBranch;
               if (!contains(Group, Origin)) {
                 // Reached from outside the group, so we cannot handle this
@@ -1279,31 +1404,34 @@ void Relooper::Calculate(Block *Entry) {
   PostOptimizer(this).Process(Root);
 }
 
-void Relooper::Render() {
-  OutputBuffer = OutputBufferRoot;
+void Relooper::Render(OutputBuffer &Out) {
+  Out.Reset();
   assert(Root);
-  Root->Render(false);
+  Root->Render(Out, false);
+}
+
+// The buffer behind the legacy static API, which is shared by all relooper
+// instances that render through it.
+static OutputBuffer DefaultOutput;
+
+void Relooper::Render() {
+  Render(DefaultOutput);
 }
 
 void Relooper::SetOutputBuffer(char *Buffer, int Size) {
-  OutputBufferRoot = OutputBuffer = Buffer;
-  OutputBufferSize = Size;
-  OutputBufferOwned = false;
+  DefaultOutput.Set(Buffer, Size);
 }
 
 void Relooper::MakeOutputBuffer(int Size) {
-  if (OutputBufferRoot && OutputBufferSize >= Size && OutputBufferOwned) return;
-  OutputBufferRoot = OutputBuffer = (char*)malloc(Size);
-  OutputBufferSize = Size;
-  OutputBufferOwned = true;
+  DefaultOutput.Reserve(Size);
 }
 
 char *Relooper::GetOutputBuffer() {
-  return OutputBufferRoot;
+  return DefaultOutput.Get();
 }
 
 void Relooper::SetAsmJSMode(int On) {
-  AsmJS = On;
+  DefaultOutput.AsmJS = On;
 }
 
 #if DEBUG
@@ -1434,5 +1562,27 @@ RELOOPERDLL_API void rl_relooper_render(void *relooper) {
   ((Relooper*)relooper)->Render();
 }
 
+RELOOPERDLL_API void *rl_new_output_buffer(int size) {
+  OutputBuffer *ret = new OutputBuffer;
+  ret->Reserve(size);
+  return ret;
+}
+
+RELOOPERDLL_API void rl_delete_output_buffer(void *buffer) {
+  delete (OutputBuffer*)buffer;
+}
+
+RELOOPERDLL_API void rl_output_buffer_set_asm_js_mode(void *buffer, int on) {
+  ((OutputBuffer*)buffer)->AsmJS = on;
+}
+
+RELOOPERDLL_API const char *rl_output_buffer_get(void *buffer) {
+  return ((OutputBuffer*)buffer)->Get();
+}
+
+RELOOPERDLL_API void rl_relooper_render_to(void *relooper, void *buffer) {
+  ((Relooper*)relooper)->Render(*(OutputBuffer*)buffer);
+}
+
 }
 
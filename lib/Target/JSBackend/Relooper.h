@@ -16,11 +16,55 @@ LLVM.
 
 #include <map>
 #include <deque>
-#include <set>
+#include <vector>
 
 struct Block;
 struct Shape;
 
+// A buffer that rendered code is printed into, together with the rest of the
+// state of a render (indentation and asm.js mode). Nothing about rendering is
+// global, so separate relooper instances can render at the same time, each
+// into its own buffer.
+struct OutputBuffer {
+  char *Root; // Start of the buffer
+  char *Curr; // Where the next output is written
+  int Size;
+  bool Owned; // Whether we allocated the buffer, and so can resize and free it
+  int CurrIndent;
+  bool AsmJS; // Whether to emit asm.js-specific code (default is off)
+
+  OutputBuffer();
+  ~OutputBuffer();
+
+  // Prints into a buffer the caller owns. It is never resized, so it must be
+  // large enough for the output.
+  void Set(char *Buffer, int Size);
+
+  // Makes sure we have our own buffer of at least Size bytes. This is reused
+  // across renders, and grows on demand.
+  void Reserve(int Size);
+
+  // Starts over at the beginning of the buffer.
+  void Reset();
+
+  void Indent() { CurrIndent++; }
+  void Unindent() { CurrIndent--; }
+
+  char *Get() { return Root; }
+  int Length() { return Curr - Root; }
+
+  void PrintIndented(const char *Format, ...);
+  void PutIndented(const char *String);
+  void PutIndented(const char *String, int Length); // String need not be null-terminated
+
+private:
+  int Left();
+  bool Ensure(int Needed);
+
+  OutputBuffer(const OutputBuffer&); // not copyable
+  void operator=(const OutputBuffer&);
+};
+
 // Info about a branching from one block to another
 struct Branch {
   enum FlowType {
@@ -40,11 +84,131 @@ struct Branch {
   ~Branch();
 
   // Prints out the branch
-  void Render(Block *Target, bool SetLabel);
+  void Render(OutputBuffer &Out, Block *Target, bool SetLabel);
 };
 
-typedef std::set<Block*> BlockSet;
-typedef std::map<Block*, Branch*> BlockBranchMap;
+// Orders blocks by when they were created rather than by address, so that
+// iterating over the containers below, and therefore the output, does not
+// depend on the allocator.
+struct BlockOrder {
+  bool operator()(const Block *A, const Block *B) const;
+};
+
+// The branches into or out of a single block, kept in a vector sorted by
+// BlockOrder. Blocks usually have only a few branches, so this is smaller
+// and faster than a tree. Entries are either blocks or (block, value) pairs.
+template<typename T>
+struct SortedBlockVector {
+  typedef T value_type;
+  typedef typename std::vector<T>::iterator iterator;
+  typedef typename std::vector<T>::const_iterator const_iterator;
+
+  iterator begin() { return Entries.begin(); }
+  iterator end() { return Entries.end(); }
+  size_t size() const { return Entries.size(); }
+  bool empty() const { return Entries.empty(); }
+
+  iterator lower_bound(const Block *B) { return LowerBound(Entries.begin(), Entries.end(), B); }
+  iterator find(const Block *B) {
+    iterator iter = lower_bound(B);
+    return iter != Entries.end() && KeyOf(*iter) == B ? iter : Entries.end();
+  }
+  size_t count(const Block *B) const {
+    const_iterator iter = LowerBound(Entries.begin(), Entries.end(), B);
+    return iter != Entries.end() && KeyOf(*iter) == B;
+  }
+  void erase(const Block *B) {
+    iterator iter = find(B);
+    if (iter != Entries.end()) Entries.erase(iter);
+  }
+  iterator erase(iterator Iter) { return Entries.erase(Iter); }
+
+protected:
+  std::vector<T> Entries;
+
+  static const Block *KeyOf(const Block *B) { return B; }
+  template<typename V> static const Block *KeyOf(const std::pair<Block*, V> &P) { return P.first; }
+
+  template<typename Iter> static Iter LowerBound(Iter First, Iter Last, const Block *B) {
+    // Binary search by hand, as the entries may be blocks or pairs
+    size_t Count = Last - First;
+    while (Count > 0) {
+      size_t Half = Count / 2;
+      Iter Middle = First + Half;
+      if (BlockOrder()(KeyOf(*Middle), B)) {
+        First = Middle + 1;
+        Count -= Half + 1;
+      } else {
+        Count = Half;
+      }
+    }
+    return First;
+  }
+};
+
+struct BlockVectorSet : public SortedBlockVector<Block*> {
+  void insert(Block *B) {
+    iterator iter = lower_bound(B);
+    if (iter == Entries.end() || *iter != B) Entries.insert(iter, B);
+  }
+};
+
+struct BlockBranchMap : public SortedBlockVector<std::pair<Block*, Branch*> > {
+  Branch *&operator[](Block *B) {
+    iterator iter = lower_bound(B);
+    if (iter == Entries.end() || iter->first != B) iter = Entries.insert(iter, value_type(B, (Branch*)NULL));
+    return iter->second;
+  }
+};
+
+// A set of blocks of one relooper, as a bit vector over Block::Index, which
+// Calculate assigns in BlockOrder. The sets the relooper works on while
+// calculating can hold most of the blocks of a function, so they need cheap
+// membership tests, insertions and removals. Only the words between the
+// lowest and highest blocks inserted are allocated, so sets of a few nearby
+// blocks stay small even in very large functions.
+struct BlockSet {
+  struct iterator {
+    iterator() : Set(NULL), Index(0) {}
+    Block *operator*() const { return (*Set->Blocks)[Index]; }
+    iterator &operator++() { Index = Set->FindFrom(Index + 1); return *this; }
+    iterator operator++(int) { iterator Old = *this; ++*this; return Old; }
+    bool operator==(const iterator &Other) const { return Index == Other.Index; }
+    bool operator!=(const iterator &Other) const { return Index != Other.Index; }
+
+  private:
+    friend struct BlockSet;
+    const BlockSet *Set;
+    unsigned Index;
+    iterator(const BlockSet *SetInit, unsigned IndexInit) : Set(SetInit), Index(IndexInit) {}
+  };
+
+  BlockSet() : Blocks(NULL), Base(0), Count(0) {}
+
+  iterator begin() const { return iterator(this, FindFrom(Base)); }
+  iterator end() const { return iterator(this, Limit()); }
+  size_t size() const { return Count; }
+  bool empty() const { return Count == 0; }
+
+  size_t count(const Block *B) const;
+  bool insert(Block *B); // Returns whether B was not already a member
+  void erase(const Block *B);
+  void erase(iterator Iter) { erase(*Iter); }
+  void clear() { Words.clear(); Base = 0; Count = 0; }
+
+private:
+  friend struct iterator;
+  typedef unsigned Word;
+  enum { WordBits = 32 };
+
+  const std::deque<Block*> *Blocks; // Our relooper's blocks, by index. Taken from the first block inserted
+  std::vector<Word> Words;
+  unsigned Base; // The index the first bit of Words is for; a multiple of WordBits
+  unsigned Count;
+
+  unsigned Limit() const { return Base + Words.size() * WordBits; }
+  unsigned FindFrom(unsigned Index) const; // The first member at or after Index, or Limit() if none
+};
 
 // Represents a basic block of code - some instructions that end with a
 // control flow modifier (a branch, return or throw).
@@ -55,24 +219,36 @@ struct Block {
   // processed branches.
   // Blocks own the Branch objects they use, and destroy them when done.
   BlockBranchMap BranchesOut;
-  BlockSet BranchesIn;
+  BlockVectorSet BranchesIn;
   BlockBranchMap ProcessedBranchesOut;
-  BlockSet ProcessedBranchesIn;
+  BlockVectorSet ProcessedBranchesIn;
   Shape *Parent; // The shape we are directly inside
   int Id; // A unique identifier, defined when added to relooper. Note that this uniquely identifies a *logical* block - if we split it, the two instances have the same content *and* the same Id
-  const char *Code; // The string representation of the code in this block. Owning pointer (we copy the input)
+  unsigned Ordinal; // Increases with each block created, see BlockOrder
+  unsigned Index; // Our position in the relooper's Blocks, which Calculate sorts in BlockOrder. See BlockSet
+  const std::deque<Block*> *Siblings; // The relooper's Blocks, once we are added to one
+  const char *Code; // The string representation of the code in this block. Owning pointer unless Owned is false
   const char *BranchVar; // A variable whose value determines where we go; if this is not NULL, emit a switch on that variable
+  bool Owned; // Whether we copied Code and BranchVar, and so must free them
   bool IsCheckedMultipleEntry; // If true, we are a multiple entry, so reaching us requires setting the label variable
 
-  Block(const char *CodeInit, const char *BranchVarInit);
+  // By default the code and branch variable are copied. If Copy is false they
+  // are only referenced, which saves a copy of each block's code, and must
+  // then stay alive until the relooper is destroyed.
+  Block(const char *CodeInit, const char *BranchVarInit, bool Copy=true);
   ~Block();
 
   void AddBranchTo(Block *Target, const char *Condition, const char *Code=NULL);
 
   // Prints out the instructions code and branchings
-  void Render(bool InLoop);
+  void Render(OutputBuffer &Out, bool InLoop);
 };
 
+inline bool BlockOrder::operator()(const Block *A, const Block *B) const {
+  if (!A || !B) return !A && B; // NULL is used as a marker in some maps, and sorts first
+  return A->Ordinal < B->Ordinal;
+}
+
 // Represents a structured control flow shape, one of
 //
 //  Simple: No control flow at all, just instructions. If several
@@ -113,7 +289,7 @@ struct Shape {
   Shape(ShapeType TypeInit) : Id(-1), Next(NULL), Type(TypeInit) {}
   virtual ~Shape() {}
 
-  virtual void Render(bool InLoop) = 0;
+  virtual void Render(OutputBuffer &Out, bool InLoop) = 0;
 
   static SimpleShape *IsSimple(Shape *It) { return It && It->Type == Simple ? (SimpleShape*)It : NULL; }
   static MultipleShape *IsMultiple(Shape *It) { return It && It->Type == Multiple ? (MultipleShape*)It : NULL; }
@@ -126,9 +302,9 @@ struct SimpleShape : public Shape {
   Block *Inner;
 
   SimpleShape() : Shape(Simple), Inner(NULL) {}
-  void Render(bool InLoop) {
-    Inner->Render(InLoop);
-    if (Next) Next->Render(InLoop);
+  void Render(OutputBuffer &Out, bool InLoop) {
+    Inner->Render(Out, InLoop);
+    if (Next) Next->Render(Out, InLoop);
   }
 };
 
@@ -150,17 +326,17 @@ struct MultipleShape : public LabeledShape {
 
   MultipleShape() : LabeledShape(Multiple), Breaks(0), UseSwitch(false) {}
 
-  void RenderLoopPrefix();
-  void RenderLoopPostfix();
+  void RenderLoopPrefix(OutputBuffer &Out);
+  void RenderLoopPostfix(OutputBuffer &Out);
 
-  void Render(bool InLoop);
+  void Render(OutputBuffer &Out, bool InLoop);
 };
 
 struct LoopShape : public LabeledShape {
   Shape *Inner;
 
   LoopShape() : LabeledShape(Loop), Inner(NULL) {}
-  void Render(bool InLoop);
+  void Render(OutputBuffer &Out, bool InLoop);
 };
 
 // TODO EmulatedShape is only partially functional. Currently it can be used for the
@@ -170,7 +346,7 @@ struct EmulatedShape : public LabeledShape {
   BlockSet Blocks;
 
   EmulatedShape() : LabeledShape(Emulated) { Labeled = true; }
-  void Render(bool InLoop);
+  void Render(OutputBuffer &Out, bool InLoop);
 };
 
 // Implements the relooper algorithm for a function's blocks.
@@ -180,7 +356,7 @@ struct EmulatedShape : public LabeledShape {
 //  2. Call AddBlock with the blocks you have. Each should already
 //     have its branchings in specified (the branchings out will
 //     be calculated by the relooper).
-//  3. Call Render().
+//  3. Call Render(), passing the buffer to render into.
 //
 // Implementation details: The Relooper instance has
 // ownership of the blocks and shapes, and frees them when done.
@@ -200,7 +376,11 @@ struct Relooper {
   // Calculates the shapes
   void Calculate(Block *Entry);
 
-  // Renders the result.
+  // Renders the result into Out, replacing what it held before.
+  void Render(OutputBuffer &Out);
+
+  // Renders the result into the global buffer set up by the static methods
+  // below. This is not reentrant; prefer Render(OutputBuffer&).
   void Render();
 
   // Sets the global buffer all printing goes to. Must call this or MakeOutputBuffer.
@@ -221,7 +401,7 @@ struct Relooper {
   void SetEmulate(int E) { Emulate = E; }
 };
 
-typedef std::map<Block*, BlockSet> BlockBlockSetMap;
+typedef std::map<Block*, BlockSet, BlockOrder> BlockBlockSetMap;
 
 #if DEBUG
 struct Debugging {
@@ -260,6 +440,13 @@ RELOOPERDLL_API void  rl_relooper_add_block(void *relooper, void *block);
 RELOOPERDLL_API void  rl_relooper_calculate(void *relooper, void *entry);
 RELOOPERDLL_API void  rl_relooper_render(void *relooper);
 
+// Handle-based rendering, which does not touch the global buffer above
+RELOOPERDLL_API void *rl_new_output_buffer(int size);
+RELOOPERDLL_API void  rl_delete_output_buffer(void *buffer);
+RELOOPERDLL_API void  rl_output_buffer_set_asm_js_mode(void *buffer, int on);
+RELOOPERDLL_API const char *rl_output_buffer_get(void *buffer);
+RELOOPERDLL_API void  rl_relooper_render_to(void *relooper, void *buffer);
+
 #ifdef __cplusplus
 }
 #endif
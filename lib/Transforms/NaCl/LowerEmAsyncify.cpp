@@ -17,10 +17,14 @@
 //
 //===----------------------------------------------------------------------===//
 
+#define DEBUG_TYPE "loweremasyncify"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/Dominators.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
@@ -34,8 +38,11 @@
 #include "llvm/Transforms/Utils/Local.h" // for DemoteRegToStack, removeUnreachableBlocks
 #include "llvm/Transforms/Utils/PromoteMemToReg.h" // for PromoteMemToReg
 #include "llvm/Transforms/Utils/ValueMapper.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Pass.h"
+#include "ReachingFunctions.h"
 
+#include <map>
 #include <vector>
 
 #ifdef NDEBUG
@@ -45,6 +52,10 @@
 
 using namespace llvm;
 
+STATISTIC(NumContextVariables, "Number of values saved in async contexts");
+STATISTIC(NumRematerialized, "Number of values recomputed after an async call instead of saved");
+STATISTIC(NumTailCalls, "Number of async calls in tail position, which need no context");
+
 static cl::list<std::string>
 AsyncifyFunctions("emscripten-asyncify-functions",
                   cl::desc("Functions that call one of these functions, directly or indirectly, will be asyncified"),
@@ -55,6 +66,16 @@ AsyncifyWhiteList("emscripten-asyncify-whitelist",
                   cl::desc("Functions that should not be asyncified"),
                   cl::CommaSeparated);
 
+static cl::opt<bool>
+AsyncifyPointsTo("emscripten-asyncify-points-to",
+                 cl::desc("Resolves function pointers loaded from constant tables, and through phis and selects, to the functions they can be, instead of every function of their signature"),
+                 cl::init(false));
+
+static cl::opt<bool>
+AsyncifyReport("emscripten-asyncify-report",
+               cl::desc("Reports why each function is asyncified"),
+               cl::init(false));
+
 namespace {
   class LowerEmAsyncify: public ModulePass {
     Module *TheModule;
@@ -98,7 +119,10 @@ namespace {
       BasicBlock *AfterCallBlock; // the block we should continue on after getting the return value of AsynCallInst
       CallInst *AllocAsyncCtxInst;  // where we allocate the async ctx before the async call, in the original function
       Values ContextVariables; // those need to be saved and restored for the async call
-      StructType *ContextStructType; // The structure constructing all the context variables
+      Values RematVariables; // those that are recomputed from the context variables, or from constants, instead, operands first
+      std::vector<unsigned> ContextSlots; // where each of ContextVariables is in ContextStructType
+      StructType *ContextStructType; // The structure constructing all the context variables, shared by all the async calls in the function
+      bool IsTailCall; // nothing but returning its value follows the call, so the original function needs no context
       BasicBlock *SaveAsyncCtxBlock; // the block in which we save all the variables
       Function *CallbackFunc; // the callback function for this async call, which is converted from the original function
     };
@@ -106,14 +130,22 @@ namespace {
     BasicBlockSet FindReachableBlocksFrom(BasicBlock *src);
 
     // Find everything that we should save and restore for the async call
-    // save them to Entry.ContextVariables
+    // save them to Entry.ContextVariables, or to Entry.RematVariables
     void FindContextVariables(AsyncCallEntry & Entry);
 
+    // Lay out the context variables of all the async calls in F in one
+    // struct, and set the size of each context allocation
+    void LayoutContextStruct(std::vector<AsyncCallEntry> &Entries);
+
     // The essential function
     // F is now in the sync form, transform it into an async form that is valid in JS
     void transformAsyncFunction(Function &F, Instructions const& AsyncCalls);
 
     bool IsFunctionPointerCall(const Instruction *I);
+
+    // Walk through the call graph and find all the async functions, with
+    // the async calls each makes
+    void FindAsyncFunctions(std::vector<Function*> &AsyncFunctionsPending, const std::set<std::string> &WhiteList, FunctionInstructionsMap &AsyncFunctionCalls);
   };
 }
 
@@ -143,45 +175,8 @@ bool LowerEmAsyncify::runOnModule(Module &M) {
   // No function needed to transform
   if (AsyncFunctionsPending.empty()) return false;
 
-  // Walk through the call graph and find all the async functions
   FunctionInstructionsMap AsyncFunctionCalls;
-  {
-    // pessimistic: consider all indirect calls as possibly async
-    // TODO: deduce based on function types
-    for (Module::iterator FI = TheModule->begin(), FE = TheModule->end(); FI != FE; ++FI) {
-      if (WhiteList.count(FI->getName())) continue;
-
-      bool has_indirect_call = false;
-      for (inst_iterator I = inst_begin(FI), E = inst_end(FI); I != E; ++I) {
-        if (IsFunctionPointerCall(&*I)) {
-          has_indirect_call = true;
-          AsyncFunctionCalls[FI].push_back(&*I);
-        }
-      }
-
-      if (has_indirect_call) AsyncFunctionsPending.push_back(FI);
-    }
-
-    while (!AsyncFunctionsPending.empty()) {
-      Function *CurFunction = AsyncFunctionsPending.back();
-      AsyncFunctionsPending.pop_back();
-
-      for (Value::use_iterator UI = CurFunction->use_begin(), E = CurFunction->use_end(); UI != E; ++UI) {
-        ImmutableCallSite ICS(*UI);
-        if (!ICS) continue;
-        // we only need those instructions calling the function
-        // if the function address is used for other purpose, we don't care
-        if (CurFunction != ICS.getCalledValue()->stripPointerCasts()) continue;
-        // Now I is either CallInst or InvokeInst
-        Instruction *I = cast<Instruction>(*UI);
-        Function *F = I->getParent()->getParent();
-        if (AsyncFunctionCalls.count(F) == 0) {
-          AsyncFunctionsPending.push_back(F);
-        }
-        AsyncFunctionCalls[F].push_back(I);
-      }
-    }
-  }
+  FindAsyncFunctions(AsyncFunctionsPending, WhiteList, AsyncFunctionCalls);
 
   // exit if no async function is found at all
   if (AsyncFunctionCalls.empty()) return false;
@@ -290,6 +285,28 @@ LowerEmAsyncify::BasicBlockSet LowerEmAsyncify::FindReachableBlocksFrom(BasicBlo
   return ReachableBlockSet;
 }
 
+// Order values so that each comes after those of its operands that are also
+// in the list
+static void SortRematVariables(std::vector<Value*> &Vars) {
+  SmallPtrSet<Value*, 16> Pending(Vars.begin(), Vars.end());
+  std::vector<Value*> Sorted;
+  while (!Pending.empty()) {
+    for (unsigned i = 0; i < Vars.size(); ++i) {
+      Instruction *I = cast<Instruction>(Vars[i]);
+      if (!Pending.count(I)) continue;
+      bool Ready = true;
+      for (unsigned j = 0; j < I->getNumOperands() && Ready; ++j) {
+        Ready = !Pending.count(I->getOperand(j));
+      }
+      if (Ready) {
+        Sorted.push_back(I);
+        Pending.erase(I);
+      }
+    }
+  }
+  Vars.swap(Sorted);
+}
+
 void LowerEmAsyncify::FindContextVariables(AsyncCallEntry & Entry) {
   BasicBlock *AfterCallBlock = Entry.AfterCallBlock;
 
@@ -306,27 +323,28 @@ void LowerEmAsyncify::FindContextVariables(AsyncCallEntry & Entry) {
   // These blocks may be using some values defined at or before AsyncCallBlock
   BasicBlockSet Ramifications = FindReachableBlocksFrom(AfterCallBlock); 
 
-  SmallPtrSet<Value*, 256> ContextVariables;
-  Values Pending;
+  // Everything live right after the call
+  SmallPtrSet<Value*, 256> LiveVariables;
+  Values Live;
 
   // Examine the instructions, find all variables that we need to store in the context
-  for (BasicBlockSet::iterator RI = Ramifications.begin(), RE = Ramifications.end(); RI != RE; ++RI) {
-    for (BasicBlock::iterator I = (*RI)->begin(), E = (*RI)->end(); I != E; ++I) {
+  for (Function::iterator BB = F.begin(), BE = F.end(); BB != BE; ++BB) {
+    if (!Ramifications.count(BB)) continue;
+    for (BasicBlock::iterator I = BB->begin(), E = BB->end(); I != E; ++I) {
       for (unsigned i = 0, NumOperands = I->getNumOperands(); i < NumOperands; ++i) {
         Value *O = I->getOperand(i);
         if (Instruction *Inst = dyn_cast<Instruction>(O)) {
           if (Inst == Entry.AsyncCallInst) continue; // for the original async call, we will load directly from async return value
-          if (ContextVariables.count(Inst) != 0)  continue; // already examined 
+          if (LiveVariables.count(Inst) != 0)  continue; // already examined 
 
           if (!DT.dominates(Inst, I->getOperandUse(i))) {
             // `I` is using `Inst`, yet `Inst` does not dominate `I` if we arrive directly at AfterCallBlock
             // so we need to save `Inst` in the context
-            ContextVariables.insert(Inst);
-            Pending.push_back(Inst);
+            LiveVariables.insert(Inst);
+            Live.push_back(Inst);
           }
         } else if (Argument *Arg = dyn_cast<Argument>(O)) {
-          // count() should be as fast/slow as insert, so just insert here 
-          ContextVariables.insert(Arg);
+          if (LiveVariables.insert(Arg)) Live.push_back(Arg);
         }
       }
     }
@@ -335,10 +353,104 @@ void LowerEmAsyncify::FindContextVariables(AsyncCallEntry & Entry) {
   // restore F
   EntryBlock->eraseFromParent();  
 
+  // Casts and GEPs of values that are live anyway, or of constants, are
+  // cheaper to recompute than to save.
   Entry.ContextVariables.clear();
-  Entry.ContextVariables.reserve(ContextVariables.size());
-  for (SmallPtrSet<Value*, 256>::iterator I = ContextVariables.begin(), E = ContextVariables.end(); I != E; ++I) {
-    Entry.ContextVariables.push_back(*I);
+  Entry.RematVariables.clear();
+  for (Values::iterator I = Live.begin(), E = Live.end(); I != E; ++I) {
+    Instruction *Inst = dyn_cast<Instruction>(*I);
+    bool Remat = Inst && (isa<CastInst>(Inst) || isa<GetElementPtrInst>(Inst));
+    for (unsigned i = 0; Remat && i < Inst->getNumOperands(); ++i) {
+      Value *O = Inst->getOperand(i);
+      Remat = isa<Constant>(O) || LiveVariables.count(O);
+    }
+    if (Remat) {
+      Entry.RematVariables.push_back(Inst);
+    } else {
+      Entry.ContextVariables.push_back(*I);
+    }
+  }
+  SortRematVariables(Entry.RematVariables);
+
+  // Nothing to save, and all that is left is to return what the call returns:
+  // the original function can just return when the call is async, and let its
+  // caller pick up the return value (see Pass 4).
+  ReturnInst *RI = dyn_cast<ReturnInst>(&AfterCallBlock->front());
+  Entry.IsTailCall = Live.empty() && RI &&
+                     (!RI->getReturnValue() || RI->getReturnValue() == Entry.AsyncCallInst);
+
+  NumContextVariables += Entry.ContextVariables.size();
+  NumRematerialized += Entry.RematVariables.size();
+  if (Entry.IsTailCall) NumTailCalls++;
+}
+
+// A value is saved in the same slot at every async call it is live across.
+// Values of the same type that are never live across the same call share a
+// slot. The largest come first, so that the struct is compact.
+void LowerEmAsyncify::LayoutContextStruct(std::vector<AsyncCallEntry> &Entries) {
+  Values Variables;
+  DenseMap<Value*, std::vector<unsigned> > VariableEntries; // variable -> the async calls it is saved at
+  for (unsigned i = 0; i < Entries.size(); ++i) {
+    Values &ContextVariables = Entries[i].ContextVariables;
+    for (unsigned j = 0; j < ContextVariables.size(); ++j) {
+      std::vector<unsigned> &VEntries = VariableEntries[ContextVariables[j]];
+      if (VEntries.empty()) Variables.push_back(ContextVariables[j]);
+      VEntries.push_back(i);
+    }
+  }
+  for (unsigned i = 1; i < Variables.size(); ++i) {
+    // insertion sort by size, stable to keep the order of F otherwise
+    Value *V = Variables[i];
+    uint64_t Size = DL->getTypeAllocSize(V->getType());
+    unsigned j = i;
+    for (; j > 0 && DL->getTypeAllocSize(Variables[j - 1]->getType()) < Size; --j) {
+      Variables[j] = Variables[j - 1];
+    }
+    Variables[j] = V;
+  }
+
+  SmallVector<Type*, 8> Types;
+  std::vector<std::vector<bool> > SlotEntries; // slot -> which async calls use it
+  Types.push_back(CallbackFunctionType->getPointerTo());
+  SlotEntries.push_back(std::vector<bool>(Entries.size(), true));
+  DenseMap<Value*, unsigned> Slots;
+  for (unsigned i = 0; i < Variables.size(); ++i) {
+    Value *V = Variables[i];
+    std::vector<unsigned> &VEntries = VariableEntries[V];
+    unsigned Slot = 1;
+    for (; Slot < Types.size(); ++Slot) {
+      if (Types[Slot] != V->getType()) continue;
+      bool Free = true;
+      for (unsigned j = 0; j < VEntries.size() && Free; ++j) {
+        Free = !SlotEntries[Slot][VEntries[j]];
+      }
+      if (Free) break;
+    }
+    if (Slot == Types.size()) {
+      Types.push_back(V->getType());
+      SlotEntries.push_back(std::vector<bool>(Entries.size(), false));
+    }
+    for (unsigned j = 0; j < VEntries.size(); ++j) {
+      SlotEntries[Slot][VEntries[j]] = true;
+    }
+    Slots[V] = Slot;
+  }
+
+  StructType *ContextStructType = StructType::get(TheModule->getContext(), Types);
+  const StructLayout *Layout = DL->getStructLayout(ContextStructType);
+  for (unsigned i = 0; i < Entries.size(); ++i) {
+    AsyncCallEntry &Entry = Entries[i];
+    Entry.ContextStructType = ContextStructType;
+    Entry.ContextSlots.clear();
+    unsigned LastSlot = 0;
+    for (unsigned j = 0; j < Entry.ContextVariables.size(); ++j) {
+      unsigned Slot = Slots[Entry.ContextVariables[j]];
+      Entry.ContextSlots.push_back(Slot);
+      LastSlot = std::max(LastSlot, Slot);
+    }
+    // only allocate up to the last slot this call uses
+    Entry.AllocAsyncCtxInst->setOperand(0,
+        ConstantInt::get(I32, Layout->getElementOffset(LastSlot) + DL->getTypeStoreSize(Types[LastSlot])));
   }
 }
 
@@ -475,28 +587,21 @@ void LowerEmAsyncify::transformAsyncFunction(Function &F, Instructions const& As
 
 
   // Pass 2
-  // analyze the context variables and construct SaveAsyncCtxBlock for each async call
+  // analyze the context variables of each async call, lay them out in a struct
+  // shared by all of them, and construct SaveAsyncCtxBlock for each async call
   // also calculate the size of the context and allocate the async context accordingly
+  // what each SaveAsyncCtxBlock stores is live at its call, and so is either
+  // live at any call it is reachable from, or defined after it; so we don't
+  // need to fill them in before finding the context variables of other calls
   for (std::vector<AsyncCallEntry>::iterator EI = AsyncCallEntries.begin(), EE = AsyncCallEntries.end();  EI != EE; ++EI) {
-    AsyncCallEntry & CurEntry = *EI;
-
     // Collect everything to be saved
-    FindContextVariables(CurEntry);
+    FindContextVariables(*EI);
+  }
 
-    // Pack the variables as a struct
-    {
-      // TODO: sort them from large memeber to small ones, in order to make the struct compact even when aligned
-      SmallVector<Type*, 8> Types;
-      Types.push_back(CallbackFunctionType->getPointerTo());
-      for (Values::iterator VI = CurEntry.ContextVariables.begin(), VE = CurEntry.ContextVariables.end(); VI != VE; ++VI) {
-        Types.push_back((*VI)->getType());
-      }
-      CurEntry.ContextStructType = StructType::get(TheModule->getContext(), Types);
-    }
+  LayoutContextStruct(AsyncCallEntries);
 
-    // fix the size of allocation
-    CurEntry.AllocAsyncCtxInst->setOperand(0, 
-        ConstantInt::get(I32, DL->getTypeStoreSize(CurEntry.ContextStructType)));
+  for (std::vector<AsyncCallEntry>::iterator EI = AsyncCallEntries.begin(), EE = AsyncCallEntries.end();  EI != EE; ++EI) {
+    AsyncCallEntry & CurEntry = *EI;
 
     // construct SaveAsyncCtxBlock
     {
@@ -518,7 +623,7 @@ void LowerEmAsyncify::transformAsyncFunction(Function &F, Instructions const& As
       for (size_t i = 0; i < CurEntry.ContextVariables.size(); ++i) {
         Indices.clear();
         Indices.push_back(ConstantInt::get(I32, 0));
-        Indices.push_back(ConstantInt::get(I32, i + 1)); // the 0th element is the callback function
+        Indices.push_back(ConstantInt::get(I32, CurEntry.ContextSlots[i])); // the 0th element is the callback function
         GetElementPtrInst *AsyncVarAddr = GetElementPtrInst::Create(AsyncCtxAddr, Indices, "", CurEntry.SaveAsyncCtxBlock);
         new StoreInst(CurEntry.ContextVariables[i], AsyncVarAddr, CurEntry.SaveAsyncCtxBlock);
       }
@@ -544,19 +649,33 @@ void LowerEmAsyncify::transformAsyncFunction(Function &F, Instructions const& As
     // load variables from the context
     // also update VMap for CloneFunction
     BasicBlock *EntryBlock = BasicBlock::Create(TheModule->getContext(), "AsyncCallbackEntry", CurCallbackFunc);
-    std::vector<LoadInst *> LoadedAsyncVars;
+    Values RestoredVars; // what the context variables and then the rematerialized ones are in the callback
     {
       BitCastInst *AsyncCtxAddr = new BitCastInst(CurCallbackFunc->arg_begin(), CurEntry.ContextStructType->getPointerTo(), "AsyncCtx", EntryBlock);
       SmallVector<Value*, 2> Indices;
+      DenseMap<Value*, Value*> Restored;
       for (size_t i = 0; i < CurEntry.ContextVariables.size(); ++i) {
         Indices.clear();
         Indices.push_back(ConstantInt::get(I32, 0));
-        Indices.push_back(ConstantInt::get(I32, i + 1)); // the 0th element of AsyncCtx is the callback function
+        Indices.push_back(ConstantInt::get(I32, CurEntry.ContextSlots[i])); // the 0th element of AsyncCtx is the callback function
         GetElementPtrInst *AsyncVarAddr = GetElementPtrInst::Create(AsyncCtxAddr, Indices, "", EntryBlock);
-        LoadedAsyncVars.push_back(new LoadInst(AsyncVarAddr, "", EntryBlock));
+        RestoredVars.push_back(new LoadInst(AsyncVarAddr, "", EntryBlock));
+        Restored[CurEntry.ContextVariables[i]] = RestoredVars.back();
         // we want the argument to be replaced by the loaded value
         if (isa<Argument>(CurEntry.ContextVariables[i]))
-          VMap[CurEntry.ContextVariables[i]] = LoadedAsyncVars.back();
+          VMap[CurEntry.ContextVariables[i]] = RestoredVars.back();
+      }
+      // recompute the rest from what we loaded
+      for (size_t i = 0; i < CurEntry.RematVariables.size(); ++i) {
+        Instruction *Orig = cast<Instruction>(CurEntry.RematVariables[i]);
+        Instruction *Remat = Orig->clone();
+        for (unsigned j = 0; j < Remat->getNumOperands(); ++j) {
+          if (Value *R = Restored.lookup(Remat->getOperand(j))) Remat->setOperand(j, R);
+        }
+        Remat->setName(Orig->getName());
+        EntryBlock->getInstList().push_back(Remat);
+        RestoredVars.push_back(Remat);
+        Restored[Orig] = Remat;
       }
     }
 
@@ -645,8 +764,8 @@ void LowerEmAsyncify::transformAsyncFunction(Function &F, Instructions const& As
     // applying loaded variables in the entry block
     {
       BasicBlockSet ReachableBlocks = FindReachableBlocksFrom(ResumeBlock);
-      for (size_t i = 0; i < CurEntry.ContextVariables.size(); ++i) {
-        Value *OrigVar = CurEntry.ContextVariables[i];
+      for (size_t i = 0; i < RestoredVars.size(); ++i) {
+        Value *OrigVar = i < CurEntry.ContextVariables.size() ? CurEntry.ContextVariables[i] : CurEntry.RematVariables[i - CurEntry.ContextVariables.size()];
         if (isa<Argument>(OrigVar)) continue; // already processed
         Value *CurVar = VMap[OrigVar];
         assert(CurVar != MappedAsyncCall);
@@ -657,13 +776,13 @@ void LowerEmAsyncify::transformAsyncFunction(Function &F, Instructions const& As
             // TODO: might need to check the safety first
             // TODO: can we create phi directly?
             AllocaInst *Addr = DemoteRegToStack(*Inst, false);
-            new StoreInst(LoadedAsyncVars[i], Addr, EntryBlock);
+            new StoreInst(RestoredVars[i], Addr, EntryBlock);
             ToPromote.push_back(Addr);
           } else {
             // The parent block is not reachable, which means there is no confliction
             // it's safe to replace Inst with the loaded value
-            assert(Inst != LoadedAsyncVars[i]); // this should only happen when OrigVar is an Argument
-            Inst->replaceAllUsesWith(LoadedAsyncVars[i]); 
+            assert(Inst != RestoredVars[i]); // this should only happen when OrigVar is an Argument
+            Inst->replaceAllUsesWith(RestoredVars[i]); 
           }
         }
       }
@@ -710,11 +829,189 @@ void LowerEmAsyncify::transformAsyncFunction(Function &F, Instructions const& As
   // Here are modifications to the original function, which we won't want to be cloned into the callback functions
   for (std::vector<AsyncCallEntry>::iterator EI = AsyncCallEntries.begin(), EE = AsyncCallEntries.end();  EI != EE; ++EI) {
     AsyncCallEntry & CurEntry = *EI;
+    if (CurEntry.IsTailCall) {
+      // no context, if the call is async just return without unwinding the
+      // stack frame, and our caller will get the return value of the call
+      // when it resumes
+      // this is not possible in the callbacks, where the current async frame
+      // is ours and must get a new callback
+      BasicBlock *AsyncReturnBlock = BasicBlock::Create(TheModule->getContext(), "AsyncReturn", &F, CurEntry.SaveAsyncCtxBlock);
+      CallInst::Create(DoNotUnwindFunction, "", AsyncReturnBlock);
+      ReturnInst::Create(TheModule->getContext(),
+          (F.getReturnType()->isVoidTy() ? 0 : Constant::getNullValue(F.getReturnType())),
+          AsyncReturnBlock);
+      CurEntry.AsyncCallInst->getParent()->getTerminator()->setSuccessor(0, AsyncReturnBlock);
+      CurEntry.SaveAsyncCtxBlock->eraseFromParent();
+      CurEntry.AllocAsyncCtxInst->eraseFromParent();
+      continue;
+    }
     // remove the frame if no async functinon has been called
     CallInst::Create(FreeAsyncCtxFunction, CurEntry.AllocAsyncCtxInst, "", CurEntry.AfterCallBlock->getFirstNonPHI());
   }
 }
 
+typedef SmallPtrSet<Function*, 8> FunctionSet;
+
+// Adds every function in C, such as the initializer of a table
+static void findFunctionsIn(Constant *C, FunctionSet &Functions) {
+  C = cast<Constant>(C->stripPointerCasts());
+  if (Function *F = dyn_cast<Function>(C)) {
+    Functions.insert(F);
+  } else if (isa<ConstantArray>(C) || isa<ConstantStruct>(C) || isa<ConstantExpr>(C)) {
+    for (unsigned i = 0; i < C->getNumOperands(); ++i) {
+      findFunctionsIn(cast<Constant>(C->getOperand(i)), Functions);
+    }
+  }
+}
+
+// Finds the functions V can be, looking through casts, phis, selects and
+// loads from anywhere in a constant global. Returns false if V can be
+// something else.
+static bool findPointees(Value *V, FunctionSet &Pointees, SmallPtrSet<Value*, 8> &Visited) {
+  V = V->stripPointerCasts();
+  if (!Visited.insert(V)) return true;
+  if (Function *F = dyn_cast<Function>(V)) {
+    Pointees.insert(F);
+    return true;
+  }
+  if (isa<ConstantPointerNull>(V) || isa<UndefValue>(V)) return true;
+  if (PHINode *PN = dyn_cast<PHINode>(V)) {
+    for (unsigned i = 0; i < PN->getNumIncomingValues(); ++i) {
+      if (!findPointees(PN->getIncomingValue(i), Pointees, Visited)) return false;
+    }
+    return true;
+  }
+  if (SelectInst *SI = dyn_cast<SelectInst>(V)) {
+    return findPointees(SI->getTrueValue(), Pointees, Visited) &&
+           findPointees(SI->getFalseValue(), Pointees, Visited);
+  }
+  if (LoadInst *LI = dyn_cast<LoadInst>(V)) {
+    Value *P = LI->getPointerOperand()->stripPointerCasts();
+    if (GEPOperator *GEP = dyn_cast<GEPOperator>(P)) P = GEP->getPointerOperand()->stripPointerCasts();
+    GlobalVariable *GV = dyn_cast<GlobalVariable>(P);
+    if (!GV || !GV->isConstant() || !GV->hasDefinitiveInitializer()) return false;
+    findFunctionsIn(GV->getInitializer(), Pointees);
+    return true;
+  }
+  return false;
+}
+
+// Finds all the async functions: those listed, and those that can call them,
+// directly or through a pointer, unless they are whitelisted.
+//
+// A call through a pointer can reach any function of its signature whose
+// address is taken, since those are what the function table holds. With
+// AsyncifyPointsTo we first try to find exactly which functions the pointer
+// can be (see findPointees).
+void LowerEmAsyncify::FindAsyncFunctions(std::vector<Function*> &AsyncFunctionsPending, const std::set<std::string> &WhiteList, FunctionInstructionsMap &AsyncFunctionCalls) {
+  std::map<std::string, Instructions> SigCalls; // signature -> calls through a pointer of it
+  DenseMap<Function*, Instructions> PointeeCalls; // function -> calls through a pointer that can only be it or a few others
+  for (Module::iterator FI = TheModule->begin(), FE = TheModule->end(); FI != FE; ++FI) {
+    if (WhiteList.count(FI->getName())) continue;
+
+    for (inst_iterator I = inst_begin(FI), E = inst_end(FI); I != E; ++I) {
+      if (!IsFunctionPointerCall(&*I)) continue;
+      CallSite CS(&*I);
+      if (AsyncifyPointsTo) {
+        FunctionSet Pointees;
+        SmallPtrSet<Value*, 8> Visited;
+        if (findPointees(CS.getCalledValue(), Pointees, Visited)) {
+          for (FunctionSet::iterator PI = Pointees.begin(), PE = Pointees.end(); PI != PE; ++PI) {
+            PointeeCalls[*PI].push_back(&*I);
+          }
+          continue;
+        }
+      }
+      FunctionType *FT = cast<FunctionType>(cast<PointerType>(CS.getCalledValue()->getType())->getElementType());
+      SigCalls[getTableSignature(FT)].push_back(&*I);
+    }
+  }
+
+  SmallPtrSet<Instruction*, 16> AsyncCalls;
+  std::set<std::string> AsyncSigs;
+
+  for (unsigned i = 0; i < AsyncFunctionsPending.size(); ++i) {
+    if (AsyncifyReport) {
+      errs() << "asyncify: " << AsyncFunctionsPending[i]->getName() << " is async because it is listed\n";
+    }
+  }
+
+  // We can't tell which functions a pointer of unknown signature can be, so a
+  // call through one may reach anything that is async
+  if (!AsyncFunctionsPending.empty()) {
+    Instructions &UnknownCalls = SigCalls[""];
+    for (unsigned i = 0; i < UnknownCalls.size(); ++i) {
+      Instruction *I = UnknownCalls[i];
+      Function *F = I->getParent()->getParent();
+      if (!AsyncCalls.insert(I)) continue;
+      if (AsyncFunctionCalls.count(F) == 0) {
+        AsyncFunctionsPending.push_back(F);
+        if (AsyncifyReport) {
+          errs() << "asyncify: " << F->getName() << " is async because it calls through a pointer of unknown signature\n";
+        }
+      }
+      AsyncFunctionCalls[F].push_back(I);
+    }
+  }
+
+  while (!AsyncFunctionsPending.empty()) {
+    Function *CurFunction = AsyncFunctionsPending.back();
+    AsyncFunctionsPending.pop_back();
+
+    Instructions Calls;
+    for (Value::use_iterator UI = CurFunction->use_begin(), E = CurFunction->use_end(); UI != E; ++UI) {
+      ImmutableCallSite ICS(*UI);
+      if (!ICS) continue;
+      // we only need those instructions calling the function
+      // if the function address is used for other purpose, we handle it below
+      if (CurFunction != ICS.getCalledValue()->stripPointerCasts()) continue;
+      // Now I is either CallInst or InvokeInst
+      Calls.push_back(cast<Instruction>(*UI));
+    }
+    unsigned NumDirectCalls = Calls.size();
+
+    // Calls through a pointer that can be CurFunction
+    std::string Sig;
+    unsigned NumPointeeCalls = 0;
+    if (CurFunction->hasAddressTaken()) {
+      Instructions &Pointees = PointeeCalls[CurFunction];
+      Calls.insert(Calls.end(), Pointees.begin(), Pointees.end());
+      NumPointeeCalls = Pointees.size();
+      Sig = getTableSignature(CurFunction->getFunctionType());
+      if (AsyncSigs.insert(Sig).second) {
+        if (Sig.empty()) {
+          // we can't tell its table, so any pointer can be it
+          for (std::map<std::string, Instructions>::iterator SI = SigCalls.begin(), SE = SigCalls.end(); SI != SE; ++SI) {
+            Calls.insert(Calls.end(), SI->second.begin(), SI->second.end());
+          }
+        } else {
+          Instructions &SCalls = SigCalls[Sig];
+          Calls.insert(Calls.end(), SCalls.begin(), SCalls.end());
+        }
+      }
+    }
+
+    for (unsigned i = 0; i < Calls.size(); ++i) {
+      Instruction *I = Calls[i];
+      Function *F = I->getParent()->getParent();
+      if (WhiteList.count(F->getName()) || !AsyncCalls.insert(I)) continue;
+      if (AsyncFunctionCalls.count(F) == 0) {
+        AsyncFunctionsPending.push_back(F);
+        if (AsyncifyReport) {
+          errs() << "asyncify: " << F->getName() << " is async because it calls " << CurFunction->getName();
+          if (i >= NumDirectCalls + NumPointeeCalls) {
+            errs() << " through a pointer of signature " << (Sig.empty() ? "?" : Sig);
+          } else if (i >= NumDirectCalls) {
+            errs() << " through a pointer";
+          }
+          errs() << "\n";
+        }
+      }
+      AsyncFunctionCalls[F].push_back(I);
+    }
+  }
+}
+
 bool LowerEmAsyncify::IsFunctionPointerCall(const Instruction *I) {
   // mostly from CallHandler.h
   ImmutableCallSite CS(I);
@@ -25,8 +25,13 @@
 //
 //  3) Lower resume to emscripten_resume which receives non-aggregate inputs
 //
+// An invoke only needs 1) when its callee can throw. Which functions can is
+// worked out over the whole module first (see findThrowingFunctions), and
+// other invokes become plain calls, which avoids the invoke_* trampoline.
+//
 //===----------------------------------------------------------------------===//
 
+#define DEBUG_TYPE "loweremexceptions"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
@@ -43,6 +48,7 @@
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/NaCl.h"
 #include "llvm/Support/raw_ostream.h"
+#include "ReachingFunctions.h"
 
 #include <vector>
 #include <set>
@@ -54,22 +60,34 @@
 
 using namespace llvm;
 
+STATISTIC(NumInvokesRemoved, "Number of invokes lowered to plain calls because their callee cannot throw");
+
 static cl::list<std::string>
 Whitelist("emscripten-cxx-exceptions-whitelist",
           cl::desc("Enables C++ exceptions in emscripten (see emscripten EXCEPTION_CATCHING_WHITELIST option)"),
           cl::CommaSeparated);
 
+static cl::opt<bool>
+NoThrowIndirect("emscripten-nothrow-indirect-calls",
+                cl::desc("Assumes a function pointer can only point to a function in the module whose address is taken, so that invokes through it cannot throw if none of those can (not valid with RESERVED_FUNCTION_POINTERS)"),
+                cl::init(false));
+
 namespace {
   class LowerEmExceptions : public ModulePass {
     Function *GetHigh, *PreInvoke, *PostInvoke, *LandingPad, *Resume;
     Module *TheModule;
+    ReachingFunctions Throwing; // functions that can throw, see findThrowingFunctions
 
   public:
     static char ID; // Pass identification, replacement for typeid
-    explicit LowerEmExceptions() : ModulePass(ID), GetHigh(NULL), PreInvoke(NULL), PostInvoke(NULL), LandingPad(NULL), Resume(NULL), TheModule(NULL) {
+    explicit LowerEmExceptions() : ModulePass(ID), GetHigh(NULL), PreInvoke(NULL), PostInvoke(NULL), LandingPad(NULL), Resume(NULL), TheModule(NULL), Throwing(NoThrowIndirect) {
       initializeLowerEmExceptionsPass(*PassRegistry::getPassRegistry());
     }
     bool runOnModule(Module &M);
+
+  private:
+    void findThrowingFunctions(const std::set<std::string> &WhitelistSet);
+    bool canThrow(const Value *V) { return Throwing.canReach(V); }
   };
 }
 
@@ -78,16 +96,55 @@ INITIALIZE_PASS(LowerEmExceptions, "loweremexceptions",
                 "Lower invoke and unwind for js/emscripten",
                 false, false)
 
-bool canThrow(Value *V) {
-  if (Function *F = dyn_cast<Function>(V)) {
-    // intrinsics and some emscripten builtins cannot throw
-    if (F->isIntrinsic()) return false;
-    StringRef Name = F->getName();
-    if (Name.startswith("emscripten_asm_")) return false;
-    if (Name == "setjmp" || Name == "longjmp") return false; // leave setjmp and longjmp (mostly) alone, we process them properly later
-    return true;
+// Library functions that neither throw nor call back into code that could.
+static const char *const NoThrowLibraryFunctions[] = {
+  "__cxa_allocate_exception", "__cxa_begin_catch", "__cxa_free_exception",
+  "abs", "acos", "asin", "atan", "atan2", "atof", "atoi", "atol", "calloc",
+  "ceil", "cos", "exp", "fabs", "floor", "fmod", "free", "isalnum",
+  "isalpha", "isdigit", "isspace", "labs", "log", "malloc", "memchr",
+  "memcmp", "memcpy", "memmove", "memset", "pow", "printf", "putchar",
+  "puts", "realloc", "sin", "sqrt", "strcat", "strchr", "strcmp",
+  "strcpy", "strdup", "strlen", "strncmp", "strncpy", "strrchr", "strstr",
+  "tan", "tolower", "toupper",
+};
+
+// Functions we know cannot throw without looking at them
+static bool isNoThrowBuiltin(const Function *F) {
+  // intrinsics and some emscripten builtins cannot throw
+  if (F->isIntrinsic()) return true;
+  StringRef Name = F->getName();
+  if (Name.startswith("emscripten_asm_")) return true;
+  if (Name == "setjmp" || Name == "longjmp") return true; // leave setjmp and longjmp (mostly) alone, we process them properly later
+  return false;
+}
+
+// Works out which functions can throw. A function can if it resumes, or calls
+// (rather than invokes, in a function where we lower invokes) something that
+// can throw. Declarations can throw unless they are marked nounwind or known
+// not to (see ReachingFunctions for the rest).
+void LowerEmExceptions::findThrowingFunctions(const std::set<std::string> &WhitelistSet) {
+  Throwing.Library.insert(NoThrowLibraryFunctions,
+                          NoThrowLibraryFunctions + array_lengthof(NoThrowLibraryFunctions));
+
+  for (Module::const_iterator F = TheModule->begin(), E = TheModule->end(); F != E; ++F) {
+    if (F->doesNotThrow() || isNoThrowBuiltin(F)) {
+      Throwing.Unreaching.insert(F);
+      continue;
+    }
+    bool LowersInvokes = WhitelistSet.empty() || WhitelistSet.count("_" + F->getName().str());
+    for (Function::const_iterator BB = F->begin(), BE = F->end(); BB != BE; ++BB) {
+      const TerminatorInst *T = BB->getTerminator();
+      if (isa<ResumeInst>(T)) {
+        Throwing.Seeds.insert(F);
+      } else if (isa<InvokeInst>(T) && LowersInvokes) {
+        // An exception from an invoke goes to its landing pad, which is
+        // scanned like any other code.
+        Throwing.IgnoredCalls.insert(T);
+      }
+    }
   }
-  return true; // not a function, so an indirect call - can throw, we can't tell
+
+  Throwing.compute(*TheModule);
 }
 
 bool LowerEmExceptions::runOnModule(Module &M) {
@@ -127,6 +184,8 @@ bool LowerEmExceptions::runOnModule(Module &M) {
 
   std::set<std::string> WhitelistSet(Whitelist.begin(), Whitelist.end());
 
+  findThrowingFunctions(WhitelistSet);
+
   bool Changed = false;
 
   for (Module::iterator Iter = M.begin(), E = M.end(); Iter != E; ) {
@@ -175,6 +234,10 @@ bool LowerEmExceptions::runOnModule(Module &M) {
           BranchInst::Create(II->getUnwindDest(), II->getNormalDest(), Post1, II);
         } else {
           // This can't throw, and we don't need this invoke, just replace it with a call+branch
+          if (AllowExceptionsInFunc) {
+            const Function *Callee = dyn_cast<Function>(II->getCalledValue()->stripPointerCasts());
+            if (!Callee || !isNoThrowBuiltin(Callee)) NumInvokesRemoved++;
+          }
           SmallVector<Value*,16> CallArgs(II->op_begin(), II->op_end() - 3);
           CallInst *NewCall = CallInst::Create(II->getCalledValue(),
                                                CallArgs, "", II);
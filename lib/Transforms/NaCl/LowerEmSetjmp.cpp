@@ -11,11 +11,14 @@
 // is that each block with a setjmp is broken up into the part right after
 // the setjmp, and a new basic block is added which is either reached from
 // the setjmp, or later from a longjmp. To handle the longjmp, all calls that
-// might longjmp are checked immediately afterwards.
+// might longjmp are checked immediately afterwards. Which calls might is
+// worked out over the whole module first (see findLongjmpingFunctions).
 //
 //===----------------------------------------------------------------------===//
 
+#define DEBUG_TYPE "loweremsetjmp"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Constants.h"
@@ -32,6 +35,8 @@
 #include "llvm/Transforms/NaCl.h"
 #include "llvm/Analysis/Dominators.h"
 #include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "ReachingFunctions.h"
+#include <map>
 #include <vector>
 #include <set>
 #include <list>
@@ -45,6 +50,13 @@
 
 using namespace llvm;
 
+STATISTIC(NumChecksRemoved, "Number of calls in setjmping functions not checked for a longjmp because their callee cannot longjmp");
+
+static cl::opt<bool>
+NoLongjmpIndirect("emscripten-nolongjmp-indirect-calls",
+                  cl::desc("Assumes a function pointer can only point to a function in the module whose address is taken, so that calls through it cannot longjmp if none of those can (not valid with RESERVED_FUNCTION_POINTERS)"),
+                  cl::init(false));
+
 // Utilities for mem/reg: based on Reg2Mem and MemToReg
 
 bool valueEscapes(const Instruction *Inst) {
@@ -138,13 +150,18 @@ void doMemToReg(Function &F) {
 namespace {
   class LowerEmSetjmp : public ModulePass {
     Module *TheModule;
+    ReachingFunctions Longjmping; // functions that can longjmp, see findLongjmpingFunctions
 
   public:
     static char ID; // Pass identification, replacement for typeid
-    explicit LowerEmSetjmp() : ModulePass(ID), TheModule(NULL) {
+    explicit LowerEmSetjmp() : ModulePass(ID), TheModule(NULL), Longjmping(NoLongjmpIndirect) {
       initializeLowerEmSetjmpPass(*PassRegistry::getPassRegistry());
     }
     bool runOnModule(Module &M);
+
+  private:
+    void findLongjmpingFunctions();
+    bool canLongjmp(const CallInst *CI) { return Longjmping.canReach(CI->getCalledValue()); }
   };
 }
 
@@ -153,6 +170,49 @@ INITIALIZE_PASS(LowerEmSetjmp, "loweremsetjmp",
                 "Lower setjmp and longjmp for js/emscripten",
                 false, false)
 
+// Library functions that neither longjmp nor call back into code that could.
+static const char *const NoLongjmpLibraryFunctions[] = {
+  "abs", "acos", "asin", "atan", "atan2", "atof", "atoi", "atol", "calloc",
+  "ceil", "cos", "exp", "fabs", "floor", "fmod", "free", "isalnum",
+  "isalpha", "isdigit", "isspace", "labs", "log", "malloc", "memchr",
+  "memcmp", "memcpy", "memmove", "memset", "pow", "printf", "putchar",
+  "puts", "realloc", "sin", "sqrt", "strcat", "strchr", "strcmp",
+  "strcpy", "strdup", "strlen", "strncmp", "strncpy", "strrchr", "strstr",
+  "tan", "tolower", "toupper",
+  // The runtime support for this pass and for exceptions, emscripten_longjmp
+  // aside
+  "emscripten_setjmp", "emscripten_check_longjmp",
+  "emscripten_get_longjmp_result", "emscripten_prep_setjmp",
+  "emscripten_preinvoke", "emscripten_postinvoke", "emscripten_landingpad",
+  "emscripten_resume", "getHigh32",
+};
+
+// Works out which functions can longjmp: those that call something that can.
+// Declarations can unless they are intrinsics or known not to (nounwind says
+// nothing about longjmp); see ReachingFunctions for the rest.
+void LowerEmSetjmp::findLongjmpingFunctions() {
+  Longjmping.Library.insert(NoLongjmpLibraryFunctions,
+                            NoLongjmpLibraryFunctions + array_lengthof(NoLongjmpLibraryFunctions));
+  for (Module::const_iterator F = TheModule->begin(), E = TheModule->end(); F != E; ++F) {
+    if (F->isIntrinsic() || F->getName().startswith("emscripten_asm_")) Longjmping.Unreaching.insert(F);
+  }
+  Longjmping.compute(*TheModule);
+}
+
+// Whether any of Targets can be reached from From, itself included
+static bool canReachAny(BasicBlock *From, const SmallPtrSet<BasicBlock*, 8> &Targets) {
+  SmallPtrSet<BasicBlock*, 32> Seen;
+  SmallVector<BasicBlock*, 32> Worklist;
+  Worklist.push_back(From);
+  while (!Worklist.empty()) {
+    BasicBlock *Curr = Worklist.pop_back_val();
+    if (Targets.count(Curr)) return true;
+    if (!Seen.insert(Curr)) continue;
+    Worklist.append(succ_begin(Curr), succ_end(Curr));
+  }
+  return false;
+}
+
 bool LowerEmSetjmp::runOnModule(Module &M) {
   TheModule = &M;
 
@@ -186,7 +246,8 @@ bool LowerEmSetjmp::runOnModule(Module &M) {
   Function *GetLongjmpResult = Function::Create(IntIntFunc, GlobalValue::ExternalLinkage, "emscripten_get_longjmp_result", TheModule); // gets int value longjmp'd
 
   FunctionType *VoidFunc = FunctionType::get(Void, false);
-  Function *PrepSetjmp = Function::Create(VoidFunc, GlobalValue::ExternalLinkage, "emscripten_prep_setjmp", TheModule);
+  FunctionType *VoidIntFunc = FunctionType::get(Void, IntArgTypes, false);
+  Function *PrepSetjmp = Function::Create(VoidIntFunc, GlobalValue::ExternalLinkage, "emscripten_prep_setjmp", TheModule); // gets the size of the setjmp table, or 0 for the default
 
   Function *PreInvoke = TheModule->getFunction("emscripten_preinvoke");
   if (!PreInvoke) PreInvoke = Function::Create(VoidFunc, GlobalValue::ExternalLinkage, "emscripten_preinvoke", TheModule);
@@ -235,13 +296,31 @@ bool LowerEmSetjmp::runOnModule(Module &M) {
 
   if (Longjmp) Longjmp->replaceAllUsesWith(EmLongjmp);
 
+  findLongjmpingFunctions();
+
   // Update all setjmping functions
 
   for (FunctionPhisMap::iterator I = SetjmpOutputPhis.begin(); I != SetjmpOutputPhis.end(); I++) {
     Function *F = I->first;
     Phis& P = I->second;
 
-    CallInst::Create(PrepSetjmp, "", F->begin()->begin()); // FIXME: adding after other allocas might be better
+    // The setjmp table gets an entry each time a setjmp is called. A longjmp
+    // back goes to the tail of its setjmp, and from there any setjmp it can
+    // reach may be called again, as may one reached from a tail by a loop. If
+    // no tail can reach a setjmp, each is called at most once, so the table
+    // only needs as many entries as there are setjmps.
+    SmallPtrSet<BasicBlock*, 8> SetjmpBlocks;
+    for (unsigned i = 0; i < P.size(); i++) {
+      SetjmpBlocks.insert(P[i]->getIncomingBlock(0));
+    }
+    unsigned TableSize = P.size();
+    for (unsigned i = 0; i < P.size(); i++) {
+      if (canReachAny(P[i]->getParent(), SetjmpBlocks)) {
+        TableSize = 0;
+        break;
+      }
+    }
+    CallInst::Create(PrepSetjmp, ConstantInt::get(i32, TableSize), "", F->begin()->begin()); // FIXME: adding after other allocas might be better
 
     // Update each call that can longjmp so it can return to a setjmp where relevant
 
@@ -252,9 +331,12 @@ bool LowerEmSetjmp::runOnModule(Module &M) {
         CallInst *CI;
         if ((CI = dyn_cast<CallInst>(I))) {
           Value *V = CI->getCalledValue();
-          if (V == PrepSetjmp || V == EmSetjmp || V == CheckLongjmp || V == GetLongjmpResult || V == PreInvoke || V == PostInvoke) continue;
+          if (V == Setjmp || V == PrepSetjmp || V == EmSetjmp || V == CheckLongjmp || V == GetLongjmpResult || V == PreInvoke || V == PostInvoke) continue;
           if (Function *CF = dyn_cast<Function>(V)) if (CF->isIntrinsic()) continue;
-          // TODO: proper analysis of what can actually longjmp. Currently we assume anything but setjmp can.
+          if (!canLongjmp(CI)) {
+            NumChecksRemoved++;
+            continue;
+          }
           // This may longjmp, so we need to check if it did. Split at that point, and
           // envelop the call in pre/post invoke, if we need to
           CallInst *After;
@@ -0,0 +1,128 @@
+//===-- ReachingFunctions.cpp - Which functions can reach others ----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// For the Emscripten lowering passes that need to know which calls can end up
+// somewhere, such as an exception being thrown.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ReachingFunctions.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CallSite.h"
+#include <map>
+#include <vector>
+
+using namespace llvm;
+
+std::string llvm::getTableSignature(const FunctionType *FT) {
+  std::string Sig;
+  Type *RT = FT->getReturnType();
+  if (RT->isVoidTy()) Sig += 'v';
+  else if (RT->isIntegerTy() || RT->isPointerTy()) Sig += 'i';
+  else if (RT->isFloatingPointTy()) Sig += 'd';
+  else if (RT->isVectorTy()) Sig += 'V';
+  else return "";
+  for (FunctionType::param_iterator I = FT->param_begin(), E = FT->param_end(); I != E; ++I) {
+    Type *T = *I;
+    if (T->isIntegerTy(64)) Sig += "ii";
+    else if (T->isIntegerTy() || T->isPointerTy()) Sig += 'i';
+    else if (T->isFloatingPointTy()) Sig += 'd';
+    else if (T->isVectorTy()) Sig += 'V';
+    else return "";
+  }
+  if (FT->isVarArg()) Sig += 'i';
+  return Sig;
+}
+
+static const FunctionType *getCalleeType(const Value *Callee) {
+  return cast<FunctionType>(cast<PointerType>(Callee->getType())->getElementType());
+}
+
+void ReachingFunctions::compute(const Module &M) {
+  std::map<const Function*, std::vector<const Function*> > Callers; // callee -> functions that call it
+  std::map<std::string, std::vector<const Function*> > IndirectCallers; // signature -> functions that call through it
+  std::map<const Function*, std::string> AddressTaken; // function -> signature of the table it is in
+  std::vector<const Function*> Worklist;
+
+  for (Module::const_iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (F->hasAddressTaken()) AddressTaken[F] = getTableSignature(F->getFunctionType());
+
+    if (Unreaching.count(F)) continue;
+    if (Seeds.count(F) || (F->isDeclaration() ? !Library.count(F->getName()) : F->mayBeOverridden())) {
+      Functions.insert(F);
+      Worklist.push_back(F);
+      continue;
+    }
+    if (F->isDeclaration()) continue;
+
+    bool Reaches = false;
+    for (Function::const_iterator BB = F->begin(), BE = F->end(); BB != BE && !Reaches; ++BB) {
+      for (BasicBlock::const_iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+        ImmutableCallSite CS(I);
+        if (!CS || IgnoredCalls.count(I)) continue;
+        const Value *Callee = CS.getCalledValue()->stripPointerCasts();
+        if (const Function *Target = dyn_cast<Function>(Callee)) {
+          Callers[Target].push_back(F);
+        } else if (isa<InlineAsm>(Callee)) {
+          Reaches = true;
+          break;
+        } else {
+          std::string Sig = getTableSignature(getCalleeType(CS.getCalledValue()));
+          if (!KnownIndirectCallees || Sig.empty()) {
+            Reaches = true;
+            break;
+          }
+          IndirectCallers[Sig].push_back(F);
+        }
+      }
+    }
+    if (Reaches) {
+      Functions.insert(F);
+      Worklist.push_back(F);
+    }
+  }
+
+  while (!Worklist.empty()) {
+    const Function *F = Worklist.back();
+    Worklist.pop_back();
+    std::vector<const Function*> &FCallers = Callers[F];
+    std::map<const Function*, std::string>::iterator Taken = AddressTaken.find(F);
+    if (Taken != AddressTaken.end()) {
+      // Everything calling through F's table can now reach too
+      const std::string &Sig = Taken->second;
+      if (Sig.empty()) {
+        if (!AnyIndirect) {
+          AnyIndirect = true;
+          for (std::map<std::string, std::vector<const Function*> >::iterator I = IndirectCallers.begin(), E = IndirectCallers.end(); I != E; ++I) {
+            FCallers.insert(FCallers.end(), I->second.begin(), I->second.end());
+          }
+        }
+      } else if (Sigs.insert(Sig).second) {
+        std::vector<const Function*> &SigCallers = IndirectCallers[Sig];
+        FCallers.insert(FCallers.end(), SigCallers.begin(), SigCallers.end());
+      }
+    }
+    for (unsigned i = 0; i < FCallers.size(); i++) {
+      if (Functions.insert(FCallers[i]).second) Worklist.push_back(FCallers[i]);
+    }
+  }
+}
+
+bool ReachingFunctions::canReach(const Value *V) const {
+  const Value *Callee = V->stripPointerCasts();
+  if (const Function *F = dyn_cast<Function>(Callee)) {
+    return Functions.count(F);
+  }
+  if (isa<InlineAsm>(Callee) || !KnownIndirectCallees || AnyIndirect) return true;
+  // an indirect call - can reach if anything in its table can
+  std::string Sig = getTableSignature(getCalleeType(V));
+  return Sig.empty() || Sigs.count(Sig);
+}
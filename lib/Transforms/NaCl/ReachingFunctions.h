@@ -0,0 +1,65 @@
+//===-- ReachingFunctions.h - Which functions can reach others --*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef TRANSFORMS_NACL_REACHINGFUNCTIONS_H
+#define TRANSFORMS_NACL_REACHINGFUNCTIONS_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Module.h"
+#include <set>
+#include <string>
+
+namespace llvm {
+
+// The function table a pointer to a function of type FT is looked up in,
+// coarsened so that types sharing a table always share a signature: every
+// integer or pointer is i (i64 is legalized into two), every floating-point
+// value is d, and varargs are one more pointer. Returns an empty string for
+// types we can't tell.
+std::string getTableSignature(const FunctionType *FT);
+
+// Works out which functions in a module can reach something, such as a throw
+// or a longjmp, through the calls they make. The seeds reach it themselves.
+// Declarations do too unless they are in the library list; so do definitions
+// that may be replaced at link time, and those that call inline asm. The rest
+// follows the call graph backwards from those.
+//
+// A call through a pointer reaches if any function in its table can. We only
+// know what those are with KnownIndirectCallees, which assumes a pointer can
+// only be a function in the module whose address is taken; otherwise such a
+// call is assumed to reach.
+class ReachingFunctions {
+public:
+  // Filled in before compute()
+  std::set<const Function*> Seeds; // reach by themselves
+  std::set<const Function*> Unreaching; // known not to reach, and not looked into
+  std::set<StringRef> Library; // declarations that neither reach nor call back into code that could
+  std::set<const Instruction*> IgnoredCalls; // calls whose callee doesn't matter
+
+  explicit ReachingFunctions(bool KnownIndirectCallees)
+      : KnownIndirectCallees(KnownIndirectCallees), AnyIndirect(false) {}
+
+  void compute(const Module &M);
+
+  // Whether a call of V, the called value of a call or invoke, can reach
+  bool canReach(const Value *V) const;
+
+  bool contains(const Function *F) const { return Functions.count(F); }
+
+private:
+  bool KnownIndirectCallees;
+  std::set<const Function*> Functions; // the functions that can reach
+  std::set<std::string> Sigs; // signatures of function pointers that can reach
+  bool AnyIndirect; // whether an address-taken function with an unknown signature can reach
+};
+
+}
+
+#endif
@@ -0,0 +1,100 @@
+; RUN: opt < %s -cost-model -analyze | FileCheck %s
+
+; Vectors that map onto SIMD.js types are cheap, operations SIMD.js lacks are
+; priced as unrolled lanes, and anything the backend can't emit is prohibitive.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+define void @arith() {
+  ; CHECK: cost of 1 {{.*}} add <4 x i32>
+  %A = add <4 x i32> undef, undef
+  ; CHECK: cost of 1 {{.*}} add <16 x i8>
+  %B = add <16 x i8> undef, undef
+  ; CHECK: cost of 1 {{.*}} mul <8 x i16>
+  %C = mul <8 x i16> undef, undef
+  ; CHECK: cost of 1 {{.*}} fadd <2 x double>
+  %D = fadd <2 x double> undef, undef
+  ; CHECK: cost of 65536 {{.*}} add <8 x i32>
+  %E = add <8 x i32> undef, undef
+  ; CHECK: cost of 65536 {{.*}} add <2 x i64>
+  %F = add <2 x i64> undef, undef
+  ; CHECK: cost of 13 {{.*}} sdiv <4 x i32>
+  %G = sdiv <4 x i32> undef, undef
+  ; CHECK: cost of 49 {{.*}} udiv <16 x i8>
+  %H = udiv <16 x i8> undef, undef
+  ; CHECK: cost of 65536 {{.*}} frem <4 x float>
+  %I = frem <4 x float> undef, undef
+  ; CHECK: cost of 1 {{.*}} shl <4 x i32>
+  %J = shl <4 x i32> undef, <i32 2, i32 2, i32 2, i32 2>
+  ; CHECK: cost of 13 {{.*}} shl <4 x i32>
+  %K = shl <4 x i32> undef, <i32 1, i32 2, i32 3, i32 4>
+  ret void
+}
+
+define void @casts() {
+  ; CHECK: cost of 0 {{.*}} sext <4 x i1>
+  %A = sext <4 x i1> undef to <4 x i32>
+  ; CHECK: cost of 65536 {{.*}} zext <4 x i1>
+  %B = zext <4 x i1> undef to <4 x i32>
+  ; CHECK: cost of 1 {{.*}} sitofp <4 x i32>
+  %C = sitofp <4 x i32> undef to <4 x float>
+  ; CHECK: cost of 9 {{.*}} uitofp <4 x i32>
+  %D = uitofp <4 x i32> undef to <4 x float>
+  ; CHECK: cost of 1 {{.*}} fpext <2 x float>
+  %E = fpext <2 x float> undef to <2 x double>
+  ; CHECK: cost of 1 {{.*}} bitcast <4 x i32>
+  %F = bitcast <4 x i32> undef to <16 x i8>
+  ; CHECK: cost of 65536 {{.*}} trunc <4 x i32>
+  %G = trunc <4 x i32> undef to <4 x i8>
+  ; CHECK: cost of 65536 {{.*}} sitofp <4 x i32>
+  %H = sitofp <4 x i32> undef to <4 x double>
+  ret void
+}
+
+define void @cmpsel() {
+  ; CHECK: cost of 1 {{.*}} icmp slt <16 x i8>
+  %A = icmp slt <16 x i8> undef, undef
+  ; CHECK: cost of 2 {{.*}} fcmp olt <2 x double>
+  %B = fcmp olt <2 x double> undef, undef
+  ; CHECK: cost of 1 {{.*}} select <4 x i1>
+  %C = select <4 x i1> undef, <4 x float> undef, <4 x float> undef
+  ; CHECK: cost of 2 {{.*}} select <2 x i1>
+  %D = select <2 x i1> undef, <2 x double> undef, <2 x double> undef
+  ret void
+}
+
+define void @memory(<4 x float>* %p, <2 x float>* %q, <8 x float>* %r, i32* %s) {
+  ; CHECK: cost of 1 {{.*}} load <4 x float>* %p, align 4
+  %A = load <4 x float>* %p, align 4
+  ; CHECK: cost of 1 {{.*}} load <2 x float>
+  %B = load <2 x float>* %q
+  ; CHECK: cost of 65536 {{.*}} load <8 x float>
+  %C = load <8 x float>* %r
+  ; CHECK: cost of 5 {{.*}} load i32* %s, align 1
+  %D = load i32* %s, align 1
+  ; CHECK: cost of 1 {{.*}} load i32* %s, align 4
+  %E = load i32* %s, align 4
+  ret void
+}
+
+define void @vector_ops(<4 x i32> %v, i32 %i) {
+  ; CHECK: cost of 1 {{.*}} extractelement <4 x i32> %v, i32 1
+  %A = extractelement <4 x i32> %v, i32 1
+  ; CHECK: cost of 101 {{.*}} extractelement <4 x i32> %v, i32 %i
+  %B = extractelement <4 x i32> %v, i32 %i
+  ; CHECK: cost of 1 {{.*}} shufflevector <4 x i32>
+  %C = shufflevector <4 x i32> %v, <4 x i32> undef, <4 x i32> <i32 3, i32 2, i32 1, i32 0>
+  ret void
+}
+
+define void @intrinsics(<4 x float> %v, float %f) {
+  ; CHECK: cost of 1 {{.*}} call float @llvm.sqrt.f32
+  %A = call float @llvm.sqrt.f32(float %f)
+  ; CHECK: cost of 65536 {{.*}} call <4 x float> @llvm.sqrt.v4f32
+  %B = call <4 x float> @llvm.sqrt.v4f32(<4 x float> %v)
+  ret void
+}
+
+declare float @llvm.sqrt.f32(float)
+declare <4 x float> @llvm.sqrt.v4f32(<4 x float>)
@@ -0,0 +1,57 @@
+# Alloca liveness over many blocks: hundreds of allocas with lifetime markers
+# that stay live across a long chain of blocks. Every block they are live into
+# makes them conflict again, which used to take time and memory in the number
+# of blocks times the square of the allocas live. Run it with a larger block
+# count and compare the "Compute intra-block liveness" line of llc -time-passes.
+# RUN: python %s > %t.ll
+# RUN: llc -emscripten-report-frame-sizes < %t.ll -o /dev/null 2>&1 | FileCheck %s
+
+# CHECK: emcc: frame size of together: 3200 bytes (3200 without sharing)
+# CHECK: emcc: frame size of halves: 1600 bytes (3200 without sharing)
+
+from __future__ import print_function
+import sys
+
+BLOCKS = int(sys.argv[1]) if len(sys.argv) > 1 else 1500
+ALLOCAS = 400
+
+def function(name, groups):
+    # The allocas are split into groups, each live over its share of the blocks
+    per_group = ALLOCAS // groups
+    span = BLOCKS // groups
+    print('define void @%s(i32* %%p) {' % name)
+    print('entry:')
+    for i in range(ALLOCAS):
+        print('  %%a%d = alloca [8 x i8], align 8' % i)
+        print('  %%a%dp = getelementptr [8 x i8]* %%a%d, i32 0, i32 0' % (i, i))
+    print('  br label %b0')
+    for b in range(BLOCKS):
+        group = b // span
+        print('b%d:' % b)
+        if b % span == 0 and group < groups:
+            for i in range(group * per_group, (group + 1) * per_group):
+                print('  call void @llvm.lifetime.start(i64 8, i8* %%a%dp)' % i)
+        live = min(group, groups - 1) * per_group + b % per_group
+        print('  call void @use(i8* %%a%dp)' % live)
+        next = 'b%d' % (b + 1) if b + 1 < BLOCKS else 'done'
+        if (b + 1) % span == 0 and group < groups:
+            for i in range(group * per_group, (group + 1) * per_group):
+                print('  call void @llvm.lifetime.end(i64 8, i8* %%a%dp)' % i)
+            print('  br label %%%s' % next)
+        else:
+            # A branch around the next block, so the chain isn't a straight line
+            print('  %%v%d = load i32* %%p' % b)
+            print('  %%c%d = icmp eq i32 %%v%d, 0' % (b, b))
+            skip = 'b%d' % (b + 2) if b + 2 < BLOCKS and (b + 2) % span != 0 else next
+            print('  br i1 %%c%d, label %%%s, label %%%s' % (b, next, skip))
+    print('done:')
+    print('  ret void')
+    print('}')
+
+print('target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"')
+print('target triple = "asmjs-unknown-emscripten"')
+print('declare void @use(i8*)')
+print('declare void @llvm.lifetime.start(i64, i8* nocapture)')
+print('declare void @llvm.lifetime.end(i64, i8* nocapture)')
+function('together', 1)
+function('halves', 2)
@@ -0,0 +1,56 @@
+# Name, variable and address lookup benchmark: many functions full of values
+# with long names, calls to a handful of externals and uses of globals. Run
+# it with a larger function count (1500 is the size used to measure the hash
+# map lookups) and compare the "JavaScript backend" line of llc -time-passes.
+# Locals are declared in sorted order, so the output must not depend on how
+# the lookup tables are laid out.
+# RUN: python %s > %t.ll
+# RUN: llc < %t.ll > %t.serial
+# RUN: llc -emscripten-codegen-threads=4 < %t.ll > %t.threaded
+# RUN: diff %t.serial %t.threaded
+# RUN: FileCheck %s < %t.serial
+
+# CHECK: function _function_with_a_rather_long_name_0(
+# CHECK: var $value_with_a_long_descriptive_name_0 = 0, $value_with_a_long_descriptive_name_1 = 0,
+# CHECK: _external_callee_number_
+# CHECK: function _function_with_a_rather_long_name_199(
+# CHECK: "implementedFunctions":
+
+from __future__ import print_function
+import sys
+
+FUNCTIONS = int(sys.argv[1]) if len(sys.argv) > 1 else 200
+INSTRUCTIONS = 250
+EXTERNALS = 30
+GLOBALS = 30
+
+# A fixed generator, so the module is the same on every Python version
+seed = 1
+def rand(n):
+    global seed
+    seed = (seed * 1103515245 + 12345) % 2147483648
+    return (seed >> 16) % n
+
+print('target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"')
+print('target triple = "asmjs-unknown-emscripten"')
+for i in range(EXTERNALS):
+    print('declare i32 @external_callee_number_%d(i32)' % i)
+for i in range(GLOBALS):
+    print('@global_variable_with_a_long_name_%d = global i32 %d' % (i, i))
+
+for f in range(FUNCTIONS):
+    print('define i32 @function_with_a_rather_long_name_%d(i32 %%argument) {' % f)
+    last = '%argument'
+    for i in range(INSTRUCTIONS):
+        name = '%%value_with_a_long_descriptive_name_%d' % i
+        r = rand(100)
+        if r < 30:
+            print('  %s = call i32 @external_callee_number_%d(i32 %s)' % (name, rand(EXTERNALS), last))
+        elif r < 45:
+            print('  %s = load i32* @global_variable_with_a_long_name_%d' % (name, rand(GLOBALS)))
+        else:
+            other = '%%value_with_a_long_descriptive_name_%d' % rand(i) if i > 0 else '%argument'
+            print('  %s = add i32 %s, %s' % (name, last, other))
+        last = name
+    print('  ret i32 %s' % last)
+    print('}')
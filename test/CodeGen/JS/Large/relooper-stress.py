@@ -0,0 +1,63 @@
+# Relooper stress test over large synthetic control flow graphs: chains of
+# forward branches, loops with backedges from anywhere in them, and the big
+# switch-in-a-loop dispatch of generated parsers. These used to take time
+# superlinear in the number of blocks. The output must not depend on how
+# or where the relooper's blocks were allocated.
+# RUN: python %s > %t.ll
+# RUN: llc < %t.ll > %t.serial
+# RUN: llc -emscripten-codegen-threads=4 < %t.ll > %t.threaded
+# RUN: diff %t.serial %t.threaded
+# RUN: FileCheck %s < %t.serial
+
+# CHECK: function _forward(
+# CHECK: function _loops(
+# CHECK: while(1) {
+# CHECK: function _dispatch(
+# CHECK: switch (
+# CHECK: function _mixed(
+
+from __future__ import print_function
+
+BLOCKS = 1500
+
+# A fixed generator, so the graphs are the same on every Python version
+seed = 1
+def rand(n):
+    global seed
+    seed = (seed * 1103515245 + 12345) % 2147483648
+    return (seed >> 16) % n
+
+def target(i, back):
+    if back and rand(100) < back:
+        return 'b%d' % max(0, i - 1 - rand(30))
+    j = i + 1 + rand(8)
+    return 'b%d' % j if j < BLOCKS else 'done'
+
+def function(name, back, switches):
+    print('define void @%s(i32* %%p) {' % name)
+    print('entry:')
+    print('  br label %b0')
+    for i in range(BLOCKS):
+        print('b%d:' % i)
+        print('  call void @work(i32 %d)' % i)
+        print('  %%v%d = load i32* %%p' % i)
+        r = rand(100)
+        if r < switches:
+            cases = ' '.join('i32 %d, label %%%s' % (k, target(i, back)) for k in range(2 + rand(10)))
+            print('  switch i32 %%v%d, label %%%s [ %s ]' % (i, target(i, 0), cases))
+        elif r < 70:
+            print('  %%c%d = icmp eq i32 %%v%d, 0' % (i, i))
+            print('  br i1 %%c%d, label %%%s, label %%%s' % (i, target(i, back), target(i, 0)))
+        else:
+            print('  br label %%%s' % ('b%d' % (i + 1) if i + 1 < BLOCKS else 'done'))
+    print('done:')
+    print('  ret void')
+    print('}')
+
+print('target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"')
+print('target triple = "asmjs-unknown-emscripten"')
+print('declare void @work(i32)')
+function('forward', 0, 10)
+function('loops', 35, 10)
+function('dispatch', 20, 100)
+function('mixed', 15, 10)
@@ -0,0 +1,42 @@
+; RUN: llc < %s | FileCheck %s
+; RUN: llc -emscripten-report-frame-sizes < %s -o /dev/null 2>&1 | FileCheck %s -check-prefix=REPORT
+
+; AllocaManager packs allocas by offset, so an alloca can share memory with
+; part of a larger one. Here %x and %y are live at the same time, and %z is
+; live at neither, so %z can cover both of them.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: function _foo() {
+; CHECK: STACKTOP = STACKTOP + 16|0;
+; CHECK-NEXT: $x = sp;
+; CHECK-NEXT: $y = sp + 8|0;
+; CHECK-NOT: $z =
+; CHECK: _use(($x|0),($y|0))
+; CHECK: _use(($x|0),($x|0))
+
+; REPORT: emcc: frame size of foo: 16 bytes (32 without sharing)
+
+define void @foo() {
+entry:
+  %x = alloca [8 x i8], align 8
+  %y = alloca [8 x i8], align 8
+  %z = alloca [16 x i8], align 8
+  %xp = getelementptr [8 x i8]* %x, i32 0, i32 0
+  %yp = getelementptr [8 x i8]* %y, i32 0, i32 0
+  %zp = getelementptr [16 x i8]* %z, i32 0, i32 0
+  call void @llvm.lifetime.start(i64 8, i8* %xp)
+  call void @llvm.lifetime.start(i64 8, i8* %yp)
+  call void @use(i8* %xp, i8* %yp)
+  call void @llvm.lifetime.end(i64 8, i8* %yp)
+  call void @llvm.lifetime.end(i64 8, i8* %xp)
+  call void @llvm.lifetime.start(i64 16, i8* %zp)
+  call void @use(i8* %zp, i8* %zp)
+  call void @llvm.lifetime.end(i64 16, i8* %zp)
+  ret void
+}
+
+declare void @use(i8*, i8*)
+declare void @llvm.lifetime.start(i64, i8* nocapture)
+declare void @llvm.lifetime.end(i64, i8* nocapture)
@@ -1,7 +1,10 @@
-; RUN: llc < %s
+; RUN: llc < %s | FileCheck %s
 
 ; regression check for emscripten #3088 - we were not clearing BlockChanges in i64 lowering
 
+; The unused chunks of i64 shifts must not be left behind as statements.
+; CHECK-NOT: {{^ +\$[0-9]+ (>>>|<<|>>) [0-9]+;}}
+
 ; ModuleID = 'waka.bc'
 target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
 target triple = "asmjs-unknown-emscripten"
@@ -0,0 +1,38 @@
+; RUN: rm -rf %t.cache
+; RUN: llc -emscripten-codegen-cache=%t.cache < %s | FileCheck %s
+; RUN: ls %t.cache | count 2
+
+; Tamper with the cached code, so that we can tell when it is replayed.
+; RUN: sed -i -e 's/+ 1)/+ 7)/' -e 's/- 1)/- 7)/' %t.cache/*
+; RUN: llc -emscripten-codegen-cache=%t.cache < %s | FileCheck %s -check-prefix=HIT
+; RUN: ls %t.cache | count 2
+
+; Changing a function only misses the cache for that function.
+; RUN: sed -e 's/sub i32 %x, 1/sub i32 %x, 2/' %s | llc -emscripten-codegen-cache=%t.cache | FileCheck %s -check-prefix=CHANGED
+; RUN: ls %t.cache | count 3
+
+; Changing an option that affects codegen misses it for all of them.
+; RUN: llc -emscripten-codegen-cache=%t.cache -emscripten-precise-f32 < %s | FileCheck %s
+; RUN: ls %t.cache | count 5
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: $y = (($x) + 1)|0;
+; CHECK: $y = (($x) - 1)|0;
+
+; HIT: $y = (($x) + 7)|0;
+; HIT: $y = (($x) - 7)|0;
+
+; CHANGED: $y = (($x) + 7)|0;
+; CHANGED: $y = (($x) - 2)|0;
+
+define i32 @inc(i32 %x) {
+  %y = add i32 %x, 1
+  ret i32 %y
+}
+
+define i32 @dec(i32 %x) {
+  %y = sub i32 %x, 1
+  ret i32 %y
+}
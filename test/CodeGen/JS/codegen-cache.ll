@@ -0,0 +1,71 @@
+; RUN: rm -rf %t.cache
+; RUN: llc < %s > %t.uncached
+; RUN: llc -emscripten-codegen-cache=%t.cache < %s > %t.cold
+; RUN: llc -emscripten-codegen-cache=%t.cache < %s > %t.warm
+; RUN: llc -emscripten-codegen-cache=%t.cache -emscripten-codegen-threads=4 < %s > %t.threaded
+; RUN: diff %t.uncached %t.cold
+; RUN: diff %t.uncached %t.warm
+; RUN: diff %t.uncached %t.threaded
+; RUN: FileCheck %s < %t.warm
+
+; Functions replayed from the cache must give exactly the output of emitting
+; them, including the function table indices and externs they asked for.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+@table = global [4 x i8] zeroinitializer, align 4
+
+; CHECK: function _first(
+; CHECK: _take(((1)|0))
+; CHECK: function _second(
+; CHECK: _take(((2)|0))
+; CHECK: _take(((1)|0))
+; CHECK: "externs": ["_external_global"]
+; CHECK: "ii": "var FUNCTION_TABLE_ii = [0,_a];"
+; CHECK: "vi": "var FUNCTION_TABLE_vi = [0,_b,_c,0];"
+
+define void @first(i32 %x) {
+  %r = call i32 @take(i32 ptrtoint (void (i32)* @b to i32))
+  %p = inttoptr i32 %x to void (i32)*
+  call void %p(i32 %x)
+  ret void
+}
+
+define void @second(i32 %x) {
+  %r = call i32 @take(i32 ptrtoint (void (i32)* @c to i32))
+  %s = call i32 @take(i32 ptrtoint (void (i32)* @b to i32))
+  %t = call i32 @take(i32 ptrtoint (i32 (i32)* @a to i32))
+  %v = call i32 @take(i32 ptrtoint (i32* @external_global to i32))
+  ret void
+}
+
+define i32 @a(i32 %x) {
+  %y = add i32 %x, 1
+  ret i32 %y
+}
+
+define void @b(i32 %x) {
+  store i32 %x, i32* bitcast ([4 x i8]* @table to i32*)
+  ret void
+}
+
+define void @c(i32 %x) {
+  %p = getelementptr [4 x i8]* @table, i32 0, i32 %x
+  store i8 0, i8* %p
+  ret void
+}
+
+define i32 @indirect(i32 %x) {
+entry:
+  %b = select i1 true, i8* blockaddress(@indirect, %one), i8* blockaddress(@indirect, %two)
+  indirectbr i8* %b, [label %one, label %two]
+one:
+  ret i32 1
+two:
+  ret i32 2
+}
+
+declare i32 @take(i32)
+
+@external_global = external global i32
@@ -0,0 +1,72 @@
+; RUN: llc -emscripten-devirtualize < %s | FileCheck %s
+; RUN: llc < %s | FileCheck %s -check-prefix=DEFAULT
+
+; A call through a function pointer can only reach functions of its signature
+; whose address is taken. When there are one or two of those, and they are
+; defined in the module, they are called directly.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+@one = global i32 ptrtoint (i32 (i32)* @only to i32)
+@two = global <{ i32, i32 }> <{ i32 ptrtoint (void (i32)* @first to i32), i32 ptrtoint (void (i32)* @second to i32) }>
+@ext = global <{ i32, i32 }> <{ i32 ptrtoint (double (double)* @d to i32), i32 ptrtoint (double (double)* @external to i32) }>
+
+; CHECK: function _callone(
+; CHECK: $r = (_only($x)|0);
+; CHECK: function _calltwo(
+; CHECK: if (($f|0) == 1) _first($x); else _second($x);
+; CHECK: function _callext(
+; CHECK: $r = (+FUNCTION_TABLE_dd[$f & #FM_dd#]($x));
+; CHECK: function _direct(
+; CHECK: _cast();
+; CHECK: "ii": "var FUNCTION_TABLE_ii = [0,_only];"
+; CHECK: "vi": "var FUNCTION_TABLE_vi = [0,_first,_second,0];"
+
+; DEFAULT: $r = (FUNCTION_TABLE_ii[$f & #FM_ii#]($x)|0);
+; DEFAULT: FUNCTION_TABLE_vi[$f & #FM_vi#]($x);
+
+define i32 @callone(i32 (i32)** %p, i32 %x) {
+  %f = load i32 (i32)** %p
+  %r = call i32 %f(i32 %x)
+  ret i32 %r
+}
+
+define void @calltwo(void (i32)** %p, i32 %x) {
+  %f = load void (i32)** %p
+  call void %f(i32 %x)
+  ret void
+}
+
+define double @callext(double (double)* %f, double %x) {
+  %r = call double %f(double %x)
+  ret double %r
+}
+
+; a function that is only called directly, through a cast, stays out of the tables
+define void @direct() {
+  call void bitcast (void (i32)* @cast to void ()*)()
+  ret void
+}
+
+define i32 @only(i32 %x) {
+  ret i32 %x
+}
+
+define void @first(i32 %x) {
+  ret void
+}
+
+define void @second(i32 %x) {
+  ret void
+}
+
+define double @d(double %x) {
+  ret double %x
+}
+
+define void @cast(i32 %x) {
+  ret void
+}
+
+declare double @external(double)
@@ -0,0 +1,43 @@
+; RUN: llc < %s | FileCheck %s
+
+; The selector of a landing pad is the typeinfo of the clause that matched,
+; so llvm.eh.typeid.for is just the address of its typeinfo, and telling
+; catch clauses apart needs no call out of asm.js.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+@_ZTIi = external constant i8*
+@_ZTIc = external constant i8*
+
+; CHECK: function _dispatch(
+; CHECK: ___cxa_find_matching_catch(__ZTIi|0,__ZTIc|0)|0
+; CHECK-NOT: _llvm_eh_typeid_for
+; CHECK: = __ZTIi|0;
+; CHECK: = __ZTIc|0;
+; CHECK: }
+define i32 @dispatch() {
+  %lp = call i8* (...)* @emscripten_landingpad(i32 (...)* @__gxx_personality_v0, i8* bitcast (i8** @_ZTIi to i8*), i8* bitcast (i8** @_ZTIc to i8*), i1 false)
+  %sel = call i32 @getHigh32()
+  %int = call i32 @llvm.eh.typeid.for(i8* bitcast (i8** @_ZTIi to i8*))
+  %is_int = icmp eq i32 %sel, %int
+  br i1 %is_int, label %caught_int, label %not_int
+
+caught_int:
+  ret i32 1
+
+not_int:
+  %char = call i32 @llvm.eh.typeid.for(i8* bitcast (i8** @_ZTIc to i8*))
+  %is_char = icmp eq i32 %sel, %char
+  %r = select i1 %is_char, i32 2, i32 0
+  ret i32 %r
+}
+
+; CHECK: "declares": [
+; CHECK-NOT: llvm.eh.typeid.for
+; CHECK: "redirects"
+
+declare i8* @emscripten_landingpad(...)
+declare i32 @getHigh32()
+declare i32 @__gxx_personality_v0(...)
+declare i32 @llvm.eh.typeid.for(i8*) nounwind readnone
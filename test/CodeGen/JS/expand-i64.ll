@@ -3,9 +3,12 @@
 target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
 
 ; CHECK: define i32 @add(i32, i32, i32, i32) {
-; CHECK:   %5 = call i32 @i64Add(i32 %0, i32 %1, i32 %2, i32 %3)
-; CHECK:   %6 = call i32 @getHigh32()
-; CHECK:   call void @setHigh32(i32 %6)
+; CHECK:   %5 = add i32 %0, %2
+; CHECK:   %6 = icmp ult i32 %5, %0
+; CHECK:   %7 = zext i1 %6 to i32
+; CHECK:   %8 = add i32 %1, %3
+; CHECK:   %9 = add i32 %8, %7
+; CHECK:   call void @setHigh32(i32 %9)
 ; CHECK:   ret i32 %5
 ; CHECK: }
 define i64 @add(i64 %a, i64 %b) {
@@ -14,9 +17,12 @@ define i64 @add(i64 %a, i64 %b) {
 }
 
 ; CHECK: define i32 @sub(i32, i32, i32, i32) {
-; CHECK:   %5 = call i32 @i64Subtract(i32 %0, i32 %1, i32 %2, i32 %3)
-; CHECK:   %6 = call i32 @getHigh32()
-; CHECK:   call void @setHigh32(i32 %6)
+; CHECK:   %5 = sub i32 %0, %2
+; CHECK:   %6 = icmp ult i32 %0, %2
+; CHECK:   %7 = zext i1 %6 to i32
+; CHECK:   %8 = sub i32 %1, %3
+; CHECK:   %9 = sub i32 %8, %7
+; CHECK:   call void @setHigh32(i32 %9)
 ; CHECK:   ret i32 %5
 ; CHECK: }
 define i64 @sub(i64 %a, i64 %b) {
@@ -25,10 +31,15 @@ define i64 @sub(i64 %a, i64 %b) {
 }
 
 ; CHECK: define i32 @mul(i32, i32, i32, i32) {
-; CHECK:   %5 = call i32 @__muldi3(i32 %0, i32 %1, i32 %2, i32 %3)
-; CHECK:   %6 = call i32 @getHigh32()
-; CHECK:   call void @setHigh32(i32 %6)
-; CHECK:   ret i32 %5
+; CHECK-NOT: __muldi3
+; CHECK:   %9 = mul i32 %5, %7
+; CHECK:   %10 = mul i32 %5, %8
+; CHECK:   %11 = mul i32 %6, %7
+; CHECK:   %12 = mul i32 %6, %8
+; CHECK:   %27 = mul i32 %1, %2
+; CHECK:   %28 = mul i32 %0, %3
+; CHECK:   call void @setHigh32(i32 %30)
+; CHECK:   ret i32 %26
 ; CHECK: }
 define i64 @mul(i64 %a, i64 %b) {
   %c = mul i64 %a, %b
@@ -38,7 +49,7 @@ define i64 @mul(i64 %a, i64 %b) {
 ; CHECK: define i32 @sdiv(i32, i32, i32, i32) {
 ; CHECK:   %5 = call i32 @__divdi3(i32 %0, i32 %1, i32 %2, i32 %3)
 ; CHECK:   %6 = call i32 @getHigh32()
-; CHECK:   call void @setHigh32(i32 %6)
+; CHECK-NOT: setHigh32
 ; CHECK:   ret i32 %5
 ; CHECK: }
 define i64 @sdiv(i64 %a, i64 %b) {
@@ -49,7 +60,7 @@ define i64 @sdiv(i64 %a, i64 %b) {
 ; CHECK: define i32 @udiv(i32, i32, i32, i32) {
 ; CHECK:   %5 = call i32 @__udivdi3(i32 %0, i32 %1, i32 %2, i32 %3)
 ; CHECK:   %6 = call i32 @getHigh32()
-; CHECK:   call void @setHigh32(i32 %6)
+; CHECK-NOT: setHigh32
 ; CHECK:   ret i32 %5
 ; CHECK: }
 define i64 @udiv(i64 %a, i64 %b) {
@@ -60,7 +71,7 @@ define i64 @udiv(i64 %a, i64 %b) {
 ; CHECK: define i32 @srem(i32, i32, i32, i32) {
 ; CHECK:   %5 = call i32 @__remdi3(i32 %0, i32 %1, i32 %2, i32 %3)
 ; CHECK:   %6 = call i32 @getHigh32()
-; CHECK:   call void @setHigh32(i32 %6)
+; CHECK-NOT: setHigh32
 ; CHECK:   ret i32 %5
 ; CHECK: }
 define i64 @srem(i64 %a, i64 %b) {
@@ -71,7 +82,7 @@ define i64 @srem(i64 %a, i64 %b) {
 ; CHECK: define i32 @urem(i32, i32, i32, i32) {
 ; CHECK:   %5 = call i32 @__uremdi3(i32 %0, i32 %1, i32 %2, i32 %3)
 ; CHECK:   %6 = call i32 @getHigh32()
-; CHECK:   call void @setHigh32(i32 %6)
+; CHECK-NOT: setHigh32
 ; CHECK:   ret i32 %5
 ; CHECK: }
 define i64 @urem(i64 %a, i64 %b) {
@@ -115,7 +126,7 @@ define i64 @xor(i64 %a, i64 %b) {
 ; CHECK: define i32 @lshr(i32, i32, i32, i32) {
 ; CHECK:   %5 = call i32 @bitshift64Lshr(i32 %0, i32 %1, i32 %2, i32 %3)
 ; CHECK:   %6 = call i32 @getHigh32()
-; CHECK:   call void @setHigh32(i32 %6)
+; CHECK-NOT: setHigh32
 ; CHECK:   ret i32 %5
 ; CHECK: }
 define i64 @lshr(i64 %a, i64 %b) {
@@ -126,7 +137,7 @@ define i64 @lshr(i64 %a, i64 %b) {
 ; CHECK: define i32 @ashr(i32, i32, i32, i32) {
 ; CHECK:   %5 = call i32 @bitshift64Ashr(i32 %0, i32 %1, i32 %2, i32 %3)
 ; CHECK:   %6 = call i32 @getHigh32()
-; CHECK:   call void @setHigh32(i32 %6)
+; CHECK-NOT: setHigh32
 ; CHECK:   ret i32 %5
 ; CHECK: }
 define i64 @ashr(i64 %a, i64 %b) {
@@ -137,7 +148,7 @@ define i64 @ashr(i64 %a, i64 %b) {
 ; CHECK: define i32 @shl(i32, i32, i32, i32) {
 ; CHECK:   %5 = call i32 @bitshift64Shl(i32 %0, i32 %1, i32 %2, i32 %3)
 ; CHECK:   %6 = call i32 @getHigh32()
-; CHECK:   call void @setHigh32(i32 %6)
+; CHECK-NOT: setHigh32
 ; CHECK:   ret i32 %5
 ; CHECK: }
 define i64 @shl(i64 %a, i64 %b) {
@@ -145,6 +156,68 @@ define i64 @shl(i64 %a, i64 %b) {
   ret i64 %c
 }
 
+; CHECK: define i32 @lshr_const(i32, i32) {
+; CHECK:   %3 = lshr i32 %1, 8
+; CHECK:   call void @setHigh32(i32 0)
+; CHECK:   ret i32 %3
+; CHECK: }
+define i64 @lshr_const(i64 %a) {
+  %c = lshr i64 %a, 40
+  ret i64 %c
+}
+
+; Only the chunks of a shift that are used are computed.
+; CHECK: define i32 @lshr_trunc(i32, i32) {
+; CHECK:   %3 = lshr i32 %0, 24
+; CHECK:   %4 = shl i32 %1, 8
+; CHECK:   %5 = or i32 %3, %4
+; CHECK-NOT: lshr
+; CHECK:   ret i32 %5
+; CHECK: }
+define i32 @lshr_trunc(i64 %a) {
+  %c = lshr i64 %a, 24
+  %d = trunc i64 %c to i32
+  ret i32 %d
+}
+
+; CHECK: define i32 @ashr_trunc(i32, i32) {
+; CHECK:   %3 = icmp slt i32 %1, 0
+; CHECK:   %4 = select i1 %3, i32 -1, i32 0
+; CHECK:   %5 = lshr i32 %1, 8
+; CHECK:   %6 = shl i32 %4, 24
+; CHECK:   %7 = or i32 %5, %6
+; CHECK-NOT: shl
+; CHECK:   ret i32 %7
+; CHECK: }
+define i32 @ashr_trunc(i64 %a) {
+  %c = ashr i64 %a, 40
+  %d = trunc i64 %c to i32
+  ret i32 %d
+}
+
+; CHECK: define i32 @udiv_pow2(i32, i32) {
+; CHECK:   %3 = lshr i32 %0, 3
+; CHECK:   %4 = shl i32 %1, 29
+; CHECK:   %5 = or i32 %3, %4
+; CHECK:   %6 = lshr i32 %1, 3
+; CHECK:   call void @setHigh32(i32 %6)
+; CHECK:   ret i32 %5
+; CHECK: }
+define i64 @udiv_pow2(i64 %a) {
+  %c = udiv i64 %a, 8
+  ret i64 %c
+}
+
+; CHECK: define i32 @urem_pow2(i32, i32) {
+; CHECK:   %3 = and i32 %1, 255
+; CHECK:   call void @setHigh32(i32 %3)
+; CHECK:   ret i32 %0
+; CHECK: }
+define i64 @urem_pow2(i64 %a) {
+  %c = urem i64 %a, 1099511627776
+  ret i64 %c
+}
+
 
 ; CHECK: define i32 @icmp_eq(i32, i32, i32, i32) {
 ; CHECK:   %5 = icmp eq i32 %0, %2
@@ -263,7 +336,7 @@ define void @aligned_store(i64 *%a, i64 %b) {
 ; CHECK: define i32 @call(i32, i32) {
 ; CHECK:   %3 = call i32 @foo(i32 %0, i32 %1)
 ; CHECK:   %4 = call i32 @getHigh32()
-; CHECK:   call void @setHigh32(i32 %4)
+; CHECK-NOT: setHigh32
 ; CHECK:   ret i32 %3
 ; CHECK: }
 declare i64 @foo(i64 %arg)
@@ -0,0 +1,65 @@
+; RUN: llc -emscripten-fold-expressions < %s | FileCheck %s
+
+; Single-use expressions are emitted inside their user in the same block,
+; except when that would move a load past a store.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: function _chain(
+; CHECK-NOT: var $
+; CHECK: return (((((($x) + ($y))|0) << 2) ^ $y)|0);
+define i32 @chain(i32 %x, i32 %y) {
+  %a = add i32 %x, %y
+  %b = shl i32 %a, 2
+  %c = xor i32 %b, %y
+  ret i32 %c
+}
+
+; CHECK: function _load_no_store(
+; CHECK: return (((((HEAP32[$p>>2]|0)) + ($y))|0)|0);
+define i32 @load_no_store(i32* %p, i32 %y) {
+  %v = load i32* %p, align 4
+  %s = add i32 %v, %y
+  ret i32 %s
+}
+
+; CHECK: function _load_across_store(
+; CHECK: $v = HEAP32[$p>>2]|0;
+; CHECK-NEXT: HEAP32[$q>>2] = $y;
+; CHECK-NEXT: return (((($v) + ($y))|0)|0);
+define i32 @load_across_store(i32* %p, i32* %q, i32 %y) {
+  %v = load i32* %p, align 4
+  store i32 %y, i32* %q, align 4
+  %s = add i32 %v, %y
+  ret i32 %s
+}
+
+; CHECK: function _two_uses(
+; CHECK: $a = (($x) + ($y))|0;
+; CHECK: return ((Math_imul($a, $a)|0)|0);
+define i32 @two_uses(i32 %x, i32 %y) {
+  %a = add i32 %x, %y
+  %b = mul i32 %a, %a
+  ret i32 %b
+}
+
+; CHECK: function _branch(
+; CHECK: if ((($x|0)<($y|0))) {
+define i32 @branch(i32 %x, i32 %y) {
+entry:
+  %c = icmp slt i32 %x, %y
+  br i1 %c, label %a, label %b
+a:
+  ret i32 1
+b:
+  ret i32 2
+}
+
+; CHECK: function _store(
+; CHECK: HEAP32[$p>>2] = ((($x) + 1)|0);
+define void @store(i32* %p, i32 %x) {
+  %a = add i32 %x, 1
+  store i32 %a, i32* %p, align 4
+  ret void
+}
@@ -0,0 +1,54 @@
+; RUN: llc < %s | FileCheck %s
+; RUN: llc -emscripten-reserved-function-pointers=2 < %s | FileCheck %s -check-prefix=RESERVED
+; RUN: llc -emscripten-no-aliasing-function-pointers < %s | FileCheck %s -check-prefix=NOALIAS
+; RUN: llc -emscripten-no-aliasing-function-pointers -emscripten-codegen-threads=4 < %s | FileCheck %s -check-prefix=NOALIAS
+; RUN: llc -emscripten-no-aliasing-function-pointers -emscripten-reserved-function-pointers=2 < %s | FileCheck %s -check-prefix=BOTH
+; RUN: llc -emscripten-compact-function-tables -emscripten-no-aliasing-function-pointers < %s | FileCheck %s -check-prefix=COMPACT
+
+; Functions fill the odd slots between reserved ones before the tables grow.
+; Without aliasing, each signature gets its own range of indices, the
+; signatures with the fewest functions first, so their tables stay small.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: "ii": "var FUNCTION_TABLE_ii = [0,_a];"
+; CHECK: "vi": "var FUNCTION_TABLE_vi = [0,_b,_c,_d];"
+
+; RESERVED: "ii": "var FUNCTION_TABLE_ii = [0,_a,0,0,0,0,0,0];"
+; RESERVED: "vi": "var FUNCTION_TABLE_vi = [0,_b,0,_c,0,_d,0,0];"
+
+; NOALIAS: "ii": "var FUNCTION_TABLE_ii = [0,_a];"
+; NOALIAS: "vi": "var FUNCTION_TABLE_vi = [0,0,_b,_c,_d,0,0,0];"
+
+; BOTH: "ii": "var FUNCTION_TABLE_ii = [0,_a,0,0,0,0,0,0];"
+; BOTH: "vi": "var FUNCTION_TABLE_vi = [0,0,0,_b,0,_c,_d,0];"
+
+; COMPACT: "tables": {  "ii": [2, [1, "_a"]],
+; COMPACT: "vi": [8, [2, "_b", "_c", "_d"]]
+
+define void @use() {
+  %1 = call i32 @take(i32 ptrtoint (void (i32)* @b to i32))
+  %2 = call i32 @take(i32 ptrtoint (void (i32)* @c to i32))
+  %3 = call i32 @take(i32 ptrtoint (i32 (i32)* @a to i32))
+  %4 = call i32 @take(i32 ptrtoint (void (i32)* @d to i32))
+  ret void
+}
+
+define i32 @a(i32 %x) {
+  ret i32 %x
+}
+
+define void @b(i32 %x) {
+  ret void
+}
+
+define void @c(i32 %x) {
+  ret void
+}
+
+define void @d(i32 %x) {
+  ret void
+}
+
+declare i32 @take(i32)
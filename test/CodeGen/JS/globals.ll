@@ -6,9 +6,9 @@ target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64
 target triple = "asmjs-unknown-emscripten"
 
 ; CHECK: function _loads() {
-; CHECK:  [[VAR_t:\$[a-z]+]] = HEAP32[2]|0;
-; CHECK:  [[VAR_s:\$[a-z]+]] = +HEAPF64[2];
-; CHECK:  [[VAR_u:\$[a-z]+]] = HEAP8[24]|0;
+; CHECK:  [[VAR_t:\$[a-z]+]] = HEAP32[4]|0;
+; CHECK:  [[VAR_s:\$[a-z]+]] = +HEAPF64[1];
+; CHECK:  [[VAR_u:\$[a-z]+]] = HEAP8[20]|0;
 ; CHECK:  [[VAR_a:\$[a-z]+]] = (~~(([[VAR_s:\$[a-z]+]]))>>>0);
 ; CHECK:  [[VAR_b:\$[a-z]+]] = [[VAR_u:\$[a-z]+]] << 24 >> 24;
 ; CHECK:  [[VAR_c:\$[a-z]+]] = (([[VAR_t:\$[a-z]+]]) + ([[VAR_a:\$[a-z]+]]))|0;
@@ -29,9 +29,9 @@ define i32 @loads() {
 ; CHECK:  [[VAR_m:\$[a-z]+]] = [[VAR_m:\$[a-z]+]]|0;
 ; CHECK:  [[VAR_n:\$[a-z]+]] = [[VAR_n:\$[a-z]+]]|0;
 ; CHECK:  [[VAR_o:\$[a-z]+]] = +[[VAR_o:\$[a-z]+]];
-; CHECK:  HEAP32[2] = [[VAR_n:\$[a-z]+]];
-; CHECK:  HEAPF64[2] = [[VAR_o:\$[a-z]+]];
-; CHECK:  HEAP8[24] = [[VAR_m:\$[a-z]+]];
+; CHECK:  HEAP32[4] = [[VAR_n:\$[a-z]+]];
+; CHECK:  HEAPF64[1] = [[VAR_o:\$[a-z]+]];
+; CHECK:  HEAP8[20] = [[VAR_m:\$[a-z]+]];
 define void @stores(i8 %m, i32 %n, double %o) {
   store i32 %n, i32* @A
   store double %o, double* @B
@@ -39,7 +39,7 @@ define void @stores(i8 %m, i32 %n, double %o) {
   ret void
 }
 
-; CHECK: allocate([133,26,0,0,0,0,0,0,205,204,204,204,204,76,55,64,2,0,0,0,0,0,0,0], "i8", ALLOC_NONE, Runtime.GLOBAL_BASE);
+; CHECK: allocate([205,204,204,204,204,76,55,64,133,26,0,0,2], "i8", ALLOC_NONE, Runtime.GLOBAL_BASE);
 @A = global i32 6789
 @B = global double 23.3
 @C = global i8 2
@@ -1,6 +1,7 @@
 ; RUN: llc < %s | FileCheck %s
 
-; llc should emit small aligned memcpy and memset inline.
+; llc should emit small aligned memcpy and memset inline, and memmove too when
+; it knows which way the two sides overlap. Large copies use a native copy.
 
 target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
 target triple = "asmjs-unknown-emscripten"
@@ -20,7 +21,7 @@ define void @test_loop_memcpy(i8* %d, i8* %s) {
 }
 
 ; CHECK: test_call_memcpy
-; CHECK: memcpy(($d|0),($s|0),65536)
+; CHECK: _emscripten_memcpy_big(($d|0),($s|0),65536)|0
 define void @test_call_memcpy(i8* %d, i8* %s) {
   call void @llvm.memcpy.p0i8.p0i8.i32(i8* %d, i8* %s, i32 65536, i32 4, i1 false)
   ret void
@@ -47,10 +48,48 @@ define void @test_call_memset(i8* %d, i8* %s) {
   ret void
 }
 
+; CHECK: test_call_memcpy_unknown
+; CHECK: _memcpy(($d|0),($s|0),1024)|0
+define void @test_call_memcpy_unknown(i8* %d, i8* %s) {
+  call void @llvm.memcpy.p0i8.p0i8.i32(i8* %d, i8* %s, i32 1024, i32 4, i1 false)
+  ret void
+}
+
+; CHECK: test_memmove_forward
+; CHECK: HEAP32[$d+0>>2]=HEAP32[$s+0>>2]|0;HEAP32[$d+4>>2]=HEAP32[$s+4>>2]|0;HEAP16[$d+8>>1]=HEAP16[$s+8>>1]|0;
+define void @test_memmove_forward(i8* %d) {
+  %s = getelementptr i8* %d, i32 4
+  call void @llvm.memmove.p0i8.p0i8.i32(i8* %d, i8* %s, i32 10, i32 4, i1 false)
+  ret void
+}
+
+; CHECK: test_memmove_backward
+; CHECK: HEAP16[$t+8>>1]=HEAP16[$d+8>>1]|0;HEAP32[$t+4>>2]=HEAP32[$d+4>>2]|0;HEAP32[$t+0>>2]=HEAP32[$d+0>>2]|0;
+define void @test_memmove_backward(i8* %d) {
+  %t = getelementptr i8* %d, i32 4
+  call void @llvm.memmove.p0i8.p0i8.i32(i8* %t, i8* %d, i32 10, i32 4, i1 false)
+  ret void
+}
+
+; CHECK: test_call_memmove
+; CHECK: _memmove(($d|0),($s|0),16)|0
+define void @test_call_memmove(i8* %d, i8* %s) {
+  call void @llvm.memmove.p0i8.p0i8.i32(i8* %d, i8* %s, i32 16, i32 4, i1 false)
+  ret void
+}
+
+; CHECK: test_big_memmove
+; CHECK: _emscripten_memcpy_big(($d|0),($s|0),65536)|0
+define void @test_big_memmove(i8* %d, i8* %s) {
+  call void @llvm.memmove.p0i8.p0i8.i32(i8* %d, i8* %s, i32 65536, i32 4, i1 false)
+  ret void
+}
+
 ; Also, don't emit declarations for the intrinsic functions.
 ; CHECK-NOT: p0i8
 
 declare void @llvm.memcpy.p0i8.p0i8.i32(i8* nocapture, i8* nocapture, i32, i32, i1) #0
+declare void @llvm.memmove.p0i8.p0i8.i32(i8* nocapture, i8* nocapture, i32, i32, i1) #0
 declare void @llvm.memset.p0i8.i32(i8* nocapture, i8, i32, i32, i1) #0
 
 attributes #0 = { nounwind }
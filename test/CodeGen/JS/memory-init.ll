@@ -0,0 +1,34 @@
+; RUN: llc -emscripten-memory-init=base64 < %s | FileCheck %s -check-prefix=BASE64
+; RUN: llc -emscripten-memory-init=base64 -emscripten-memory-init-gap=16 < %s | FileCheck %s -check-prefix=GAP
+; RUN: llc -emscripten-memory-init=file -emscripten-memory-init-file=%t.mem -emscripten-memory-init-gap=16 < %s | FileCheck %s -check-prefix=FILE
+; RUN: FileCheck %s -check-prefix=MEM < %t.mem
+; RUN: rm -rf %t.dir && mkdir %t.dir
+; RUN: llc -emscripten-memory-init=file '-emscripten-memory-init-file=%t.dir/a"b\c.mem' < %s | FileCheck %s -check-prefix=QUOTED
+
+; The memory initializer can go in the metadata or a binary file instead of
+; the code. Zeros at the end are left out, and long runs of zeros in between
+; can be too, splitting the initializer into segments.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; BASE64-NOT: allocate(
+; BASE64: "memoryInitializer": {"segments": {{\[\[8, 51\]\]}}, "base64": "aGVsbG8AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAHdvcmxk"}
+
+; GAP: "memoryInitializer": {"segments": {{\[\[8, 5\], \[54, 5\]\]}}, "base64": "aGVsbG93b3JsZA=="}
+
+; FILE-NOT: allocate(
+; FILE: "memoryInitializer": {"segments": {{\[\[8, 5\], \[54, 5\]\]}}, "file": "{{.*}}.mem"}
+
+; MEM: {{^helloworld$}}
+
+; QUOTED: "file": "a\"b\\c.mem"}
+
+@hello = global [6 x i8] c"hello\00", align 1
+@zeros = global [40 x i8] zeroinitializer, align 1
+@world = global [6 x i8] c"world\00", align 1
+@tail = global [16 x i8] zeroinitializer, align 1
+
+define i8* @get() {
+  ret i8* getelementptr ([6 x i8]* @world, i32 0, i32 0)
+}
@@ -0,0 +1,43 @@
+; RUN: llc < %s | FileCheck %s
+
+; Constant unnamed_addr globals with the same contents share a single copy.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+@.str = private unnamed_addr constant [6 x i8] c"hello\00", align 1
+@.str1 = private unnamed_addr constant [6 x i8] c"world\00", align 1
+@.str2 = private unnamed_addr constant [6 x i8] c"hello\00", align 1
+@named = constant [6 x i8] c"hello\00", align 1
+@mutable = unnamed_addr global [6 x i8] c"hello\00", align 1
+@pi = private unnamed_addr constant double 3.140000e+00, align 8
+@pi2 = private unnamed_addr constant double 3.140000e+00, align 8
+@int = private unnamed_addr constant i32 3, align 4
+@int2 = private unnamed_addr constant i32 3, align 1
+
+; CHECK: function _addresses() {
+; CHECK: _use(((20)|0))
+; CHECK-NEXT: _use(((26)|0))
+; CHECK-NEXT: _use(((20)|0))
+; CHECK-NEXT: _use(((32)|0))
+; CHECK-NEXT: _use(((38)|0))
+; CHECK-NEXT: _use(((8)|0))
+; CHECK-NEXT: _use(((8)|0))
+; CHECK-NEXT: _use(((16)|0))
+; CHECK-NEXT: _use(((44)|0))
+; CHECK: allocate([31,133,235,81,184,30,9,64,3,0,0,0,104,101,108,108,111,0,119,111,114,108,100,0,104,101,108,108,111,0,104,101,108,108,111,0,3,0,0,0], "i8", ALLOC_NONE, Runtime.GLOBAL_BASE);
+
+define void @addresses() {
+  call void @use(i32 ptrtoint ([6 x i8]* @.str to i32))
+  call void @use(i32 ptrtoint ([6 x i8]* @.str1 to i32))
+  call void @use(i32 ptrtoint ([6 x i8]* @.str2 to i32))
+  call void @use(i32 ptrtoint ([6 x i8]* @named to i32))
+  call void @use(i32 ptrtoint ([6 x i8]* @mutable to i32))
+  call void @use(i32 ptrtoint (double* @pi to i32))
+  call void @use(i32 ptrtoint (double* @pi2 to i32))
+  call void @use(i32 ptrtoint (i32* @int to i32))
+  call void @use(i32 ptrtoint (i32* @int2 to i32))
+  ret void
+}
+
+declare void @use(i32)
@@ -7,7 +7,7 @@ target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64
 target triple = "asmjs-unknown-emscripten"
 
 ; CHECK: while(1) {
-; CHECK:   $k$phi = $j;$j$phi = $k;$k = $k$phi;$j = $j$phi;
+; CHECK:   $j$phi = $j;$j = $k;$k = $j$phi;
 ; CHECK: }
 define void @foo(float* nocapture %p, i32* %j.init, i32* %k.init) {
 entry:
@@ -0,0 +1,103 @@
+; RUN: llc -emscripten-registerize < %s | FileCheck %s
+
+; Values of the same type that are never live at the same time share a local.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; Each value dies where the next is computed, so they all share one local.
+
+; CHECK: function _chain($x,$y) {
+; CHECK: var $a = 0, label = 0, sp = 0;
+; CHECK: $a = (($x) + ($y))|0;
+; CHECK-NEXT: $a = $a << 2;
+; CHECK-NEXT: $a = $a ^ $y;
+; CHECK-NEXT: STACKTOP = sp;return ($a|0);
+
+define i32 @chain(i32 %x, i32 %y) {
+  %a = add i32 %x, %y
+  %b = shl i32 %a, 2
+  %c = xor i32 %b, %y
+  ret i32 %c
+}
+
+; %a is live across the call, so %b and %c need locals of their own, and the
+; call does not reuse the locals of its arguments, but %d can reuse %a's.
+
+; CHECK: function _live($x,$y) {
+; CHECK: var $a = 0, $b = 0, $c = 0, label = 0, sp = 0;
+; CHECK: $c = (_f(($a|0),($b|0))|0);
+; CHECK-NEXT: $a = Math_imul($c, $a)|0;
+
+define i32 @live(i32 %x, i32 %y) {
+  %a = add i32 %x, 1
+  %b = add i32 %y, 2
+  %c = call i32 @f(i32 %a, i32 %b)
+  %d = mul i32 %c, %a
+  ret i32 %d
+}
+
+; Ints and doubles never share a local.
+
+; CHECK: function _types($x) {
+; CHECK: var $a = 0, $d = +0, label = 0, sp = 0;
+; CHECK: $a = (($x) + 1)|0;
+; CHECK-NEXT: $d = (+($a|0));
+; CHECK-NEXT: $d = $d * +2;
+; CHECK-NEXT: $a = (~~(($d)));
+; CHECK-NEXT: $a = (($a) + 3)|0;
+; CHECK-NEXT: $d = (+($a|0));
+
+define double @types(i32 %x) {
+  %a = add i32 %x, 1
+  %d = sitofp i32 %a to double
+  %e = fmul double %d, 2.0
+  %i = fptosi double %e to i32
+  %j = add i32 %i, 3
+  %r = sitofp i32 %j to double
+  ret double %r
+}
+
+; A phi can share a local with its incoming value, leaving nothing to copy.
+
+; CHECK: function _loop($n) {
+; CHECK: var $c = 0, $i = 0, $s = 0, label = 0, sp = 0;
+; CHECK: $i = 0;$s = 0;
+; CHECK-NEXT: while(1) {
+; CHECK-NEXT: $s = (($s) + ($i))|0;
+; CHECK-NEXT: $i = (($i) + 1)|0;
+
+define i32 @loop(i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i1, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s1, %loop ]
+  %s1 = add i32 %s, %i
+  %i1 = add i32 %i, 1
+  %c = icmp slt i32 %i1, %n
+  br i1 %c, label %loop, label %exit
+exit:
+  ret i32 %s1
+}
+
+; Phis that swap values still go through a temporary.
+
+; CHECK: function _swap($n) {
+; CHECK: $a$phi = $a;$a = $b;$b = $a$phi;
+
+define i32 @swap(i32 %n) {
+entry:
+  br label %loop
+loop:
+  %a = phi i32 [ 0, %entry ], [ %b, %loop ]
+  %b = phi i32 [ 1, %entry ], [ %a, %loop ]
+  %i = phi i32 [ 0, %entry ], [ %i1, %loop ]
+  %i1 = add i32 %i, 1
+  %c = icmp slt i32 %i1, %n
+  br i1 %c, label %loop, label %exit
+exit:
+  ret i32 %a
+}
+
+declare i32 @f(i32, i32)
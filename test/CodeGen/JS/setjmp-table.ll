@@ -0,0 +1,60 @@
+; RUN: opt -loweremsetjmp < %s | llc | FileCheck %s
+
+; The setjmp table has room for as many setjmps as LowerEmSetjmp found, plus
+; an end marker, or for -emscripten-max-setjmps if one of them may be called
+; more than once: from a loop, or after a longjmp back to a setjmp before it.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+%struct.__jmp_buf_tag = type { [6 x i32], i32, [32 x i32] }
+
+@a = global [1 x %struct.__jmp_buf_tag] zeroinitializer, align 16
+@b = global [1 x %struct.__jmp_buf_tag] zeroinitializer, align 16
+
+; CHECK: function _known_size($c) {
+; CHECK: _setjmpTable = STACKTOP; STACKTOP = STACKTOP + 24|0;HEAP32[_setjmpTable>>2]=0;
+define i32 @known_size(i1 %c) {
+entry:
+  br i1 %c, label %left, label %right
+left:
+  %l = call i32 @setjmp(%struct.__jmp_buf_tag* getelementptr inbounds ([1 x %struct.__jmp_buf_tag]* @a, i32 0, i32 0)) returns_twice
+  call void @external()
+  br label %done
+right:
+  %r = call i32 @setjmp(%struct.__jmp_buf_tag* getelementptr inbounds ([1 x %struct.__jmp_buf_tag]* @b, i32 0, i32 0)) returns_twice
+  call void @external()
+  br label %done
+done:
+  %x = phi i32 [ %l, %left ], [ %r, %right ]
+  ret i32 %x
+}
+
+; CHECK: function _looped($n) {
+; CHECK: _setjmpTable = STACKTOP; STACKTOP = STACKTOP + 168|0;HEAP32[_setjmpTable>>2]=0;
+define void @looped(i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i1, %loop ]
+  %r = call i32 @setjmp(%struct.__jmp_buf_tag* getelementptr inbounds ([1 x %struct.__jmp_buf_tag]* @a, i32 0, i32 0)) returns_twice
+  call void @external()
+  %i1 = add i32 %i, 1
+  %c = icmp slt i32 %i1, %n
+  br i1 %c, label %loop, label %out
+out:
+  ret void
+}
+
+; A longjmp from external() to @a calls the setjmp to @b again.
+; CHECK: function _two_setjmps() {
+; CHECK: _setjmpTable = STACKTOP; STACKTOP = STACKTOP + 168|0;HEAP32[_setjmpTable>>2]=0;
+define void @two_setjmps() {
+  %x = call i32 @setjmp(%struct.__jmp_buf_tag* getelementptr inbounds ([1 x %struct.__jmp_buf_tag]* @a, i32 0, i32 0)) returns_twice
+  %y = call i32 @setjmp(%struct.__jmp_buf_tag* getelementptr inbounds ([1 x %struct.__jmp_buf_tag]* @b, i32 0, i32 0)) returns_twice
+  call void @external()
+  ret void
+}
+
+declare i32 @setjmp(%struct.__jmp_buf_tag*) returns_twice
+declare void @external()
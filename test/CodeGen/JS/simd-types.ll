@@ -0,0 +1,103 @@
+; RUN: llc < %s | FileCheck %s
+
+; Vectors of i8, i16 and double map onto SIMD.js int8x16, int16x8 and
+; float64x2. Lanes beyond the fourth are read and written with extractLane and
+; replaceLane, and masks compared from float64x2 are narrowed to int32x4.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: function _add_i8($p,$q) {
+; CHECK: var $a = SIMD_int8x16(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0)
+; CHECK: $a = SIMD_int8x16_load(HEAPU8, $p);
+; CHECK: $c = SIMD_int8x16_add($a,$b);
+; CHECK: SIMD_int8x16_store(HEAPU8, $p, $c);
+define void @add_i8(<16 x i8>* %p, <16 x i8>* %q) {
+  %a = load <16 x i8>* %p, align 16
+  %b = load <16 x i8>* %q, align 16
+  %c = add <16 x i8> %a, %b
+  store <16 x i8> %c, <16 x i8>* %p, align 16
+  ret void
+}
+
+; CHECK: function _select_i16($a,$b) {
+; CHECK: $m = SIMD_int16x8_lessThan($a, $b);
+; CHECK: $r = SIMD_int16x8_select($m,$a,$b);
+define <8 x i16> @select_i16(<8 x i16> %a, <8 x i16> %b) {
+  %m = icmp slt <8 x i16> %a, %b
+  %r = select <8 x i1> %m, <8 x i16> %a, <8 x i16> %b
+  ret <8 x i16> %r
+}
+
+; CHECK: function _swizzle_i16($a) {
+; CHECK: $r = SIMD_int16x8_swizzle($a, 7, 6, 5, 4, 3, 2, 1, 0);
+define <8 x i16> @swizzle_i16(<8 x i16> %a) {
+  %r = shufflevector <8 x i16> %a, <8 x i16> undef, <8 x i32> <i32 7, i32 6, i32 5, i32 4, i32 3, i32 2, i32 1, i32 0>
+  ret <8 x i16> %r
+}
+
+; CHECK: function _extract_i16($a) {
+; CHECK: $r = SIMD_int16x8_extractLane($a, 5)<<16>>16;
+define i16 @extract_i16(<8 x i16> %a) {
+  %r = extractelement <8 x i16> %a, i32 5
+  ret i16 %r
+}
+
+; CHECK: function _insert_i8($a,$x) {
+; CHECK: $r = SIMD_int8x16_replaceLane($a, 9, $x);
+define <16 x i8> @insert_i8(<16 x i8> %a, i8 %x) {
+  %r = insertelement <16 x i8> %a, i8 %x, i32 9
+  ret <16 x i8> %r
+}
+
+; Unsigned lanes are masked rather than read with >>>0.
+; CHECK: function _udiv_i8($a,$b) {
+; CHECK: $r = SIMD_int8x16((SIMD_int8x16_extractLane($a, 0)&255) / (SIMD_int8x16_extractLane($b, 0)&255)>>>0,
+; CHECK: (SIMD_int8x16_extractLane($a, 15)&255) / (SIMD_int8x16_extractLane($b, 15)&255)>>>0);
+define <16 x i8> @udiv_i8(<16 x i8> %a, <16 x i8> %b) {
+  %r = udiv <16 x i8> %a, %b
+  ret <16 x i8> %r
+}
+
+; CHECK: function _fadd_f64($a,$b) {
+; CHECK: var $r = SIMD_float64x2(0,0)
+; CHECK: $r = SIMD_float64x2_add($a,$b);
+define <2 x double> @fadd_f64(<2 x double> %a, <2 x double> %b) {
+  %r = fadd <2 x double> %a, %b
+  ret <2 x double> %r
+}
+
+; CHECK: function _max_f64($a,$b) {
+; CHECK: $m = SIMD_int32x4_swizzle(SIMD_float64x2_greaterThan($a, $b), 0, 2, 0, 0);
+; CHECK: $r = SIMD_float64x2_select(SIMD_int32x4_swizzle($m, 0, 0, 1, 1),$a,$b);
+define <2 x double> @max_f64(<2 x double> %a, <2 x double> %b) {
+  %m = fcmp ogt <2 x double> %a, %b
+  %r = select <2 x i1> %m, <2 x double> %a, <2 x double> %b
+  ret <2 x double> %r
+}
+
+; CHECK: function _ext_f64($a) {
+; CHECK: $r = SIMD_float64x2_fromFloat32x4($s);
+define <2 x double> @ext_f64(<4 x float> %a) {
+  %s = shufflevector <4 x float> %a, <4 x float> undef, <2 x i32> <i32 0, i32 1>
+  %r = fpext <2 x float> %s to <2 x double>
+  ret <2 x double> %r
+}
+
+; CHECK: function _bits_i8($a) {
+; CHECK: $r = SIMD_int8x16_fromInt32x4Bits($a);
+define <16 x i8> @bits_i8(<4 x i32> %a) {
+  %r = bitcast <4 x i32> %a to <16 x i8>
+  ret <16 x i8> %r
+}
+
+; CHECK: function _sat_i8($a,$b) {
+; CHECK: SIMD_int8x16_addSaturate(
+define <16 x i8> @sat_i8(<16 x i8> %a, <16 x i8> %b) {
+  %r = call <16 x i8> @emscripten_int8x16_addSaturate(<16 x i8> %a, <16 x i8> %b)
+  ret <16 x i8> %r
+}
+
+declare <16 x i8> @emscripten_int8x16_addSaturate(<16 x i8>, <16 x i8>)
+
+; CHECK: "simdTypes": ["int32x4", "float32x4", "int8x16", "int16x8", "float64x2"]
@@ -0,0 +1,44 @@
+; RUN: llc < %s | FileCheck %s -check-prefix=DEFAULT
+; RUN: llc -emscripten-zero-section < %s | FileCheck %s
+; RUN: llc -emscripten-zero-section -emscripten-memory-init=base64 < %s | FileCheck %s -check-prefix=BASE64
+
+; With -emscripten-zero-section, globals that are all zeros are placed after
+; the rest of static data and never emitted; the metadata reports where that
+; region starts and how large it is.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; DEFAULT-NOT: "zeroSection"
+
+; CHECK: function _addresses() {
+; CHECK: _use((8|0))
+; CHECK-NEXT: _use((24|0))
+; CHECK-NEXT: _use((4024|0))
+; CHECK-NEXT: _use((14|0))
+; CHECK-NEXT: _use((4032|0))
+; CHECK-NEXT: _use((4040|0))
+; CHECK: /* memory initializer */ allocate([104,101,108,108,111,0,119,111,114,108,100,0], "i8", ALLOC_NONE, Runtime.GLOBAL_BASE);
+; CHECK: "zeroSection": [24, 4020]
+
+; BASE64-NOT: allocate(
+; BASE64: "zeroSection": [24, 4020],"memoryInitializer": {"segments": {{\[\[8, 11\]\]}}, "base64": "aGVsbG8Ad29ybGQ="}
+
+@hello = global [6 x i8] c"hello\00", align 1
+@zeros = global [4000 x i8] zeroinitializer, align 1
+@int = global i32 0, align 4
+@world = global [6 x i8] c"world\00", align 1
+@double = global double 0.000000e+00, align 8
+@string = global [4 x i8] c"\00\00\00\00", align 1
+
+define void @addresses() {
+  call void @use(i8* getelementptr ([6 x i8]* @hello, i32 0, i32 0))
+  call void @use(i8* getelementptr ([4000 x i8]* @zeros, i32 0, i32 0))
+  call void @use(i8* bitcast (i32* @int to i8*))
+  call void @use(i8* getelementptr ([6 x i8]* @world, i32 0, i32 0))
+  call void @use(i8* bitcast (double* @double to i8*))
+  call void @use(i8* getelementptr ([4 x i8]* @string, i32 0, i32 0))
+  ret void
+}
+
+declare void @use(i8*)
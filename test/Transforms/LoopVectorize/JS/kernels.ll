@@ -0,0 +1,177 @@
+; RUN: opt < %s -loop-vectorize -instcombine -S | FileCheck %s
+; RUN: opt < %s -loop-vectorize -instcombine -S | llc | FileCheck %s -check-prefix=JS
+; RUN: llc < %s | FileCheck %s -check-prefix=SCALAR
+
+; Typical kernels, vectorized by the JS cost model. The vectorized output must
+; use only SIMD.js types and compile, while the scalar output stays free of
+; SIMD. Loops that would need operations the backend can't emit stay scalar.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK-LABEL: @saxpy(
+; CHECK: load <4 x float>
+; CHECK: fmul <4 x float>
+; CHECK: store <4 x float>
+; JS: function _saxpy(
+; JS: SIMD_float32x4_load(HEAPU8,
+; JS: SIMD_float32x4_mul(
+; JS: SIMD_float32x4_store(HEAPU8,
+; SCALAR: function _saxpy(
+; SCALAR-NOT: SIMD
+; SCALAR: HEAPF32[
+define void @saxpy(float* noalias %x, float* noalias %y, float %a, i32 %n) {
+entry:
+  %cmp = icmp sgt i32 %n, 0
+  br i1 %cmp, label %loop, label %exit
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %px = getelementptr inbounds float* %x, i32 %i
+  %vx = load float* %px, align 4
+  %py = getelementptr inbounds float* %y, i32 %i
+  %vy = load float* %py, align 4
+  %m = fmul float %vx, %a
+  %s = fadd float %m, %vy
+  store float %s, float* %py, align 4
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+exit:
+  ret void
+}
+
+; CHECK-LABEL: @add_bytes(
+; CHECK: add <16 x i8>
+; JS: function _add_bytes(
+; JS: SIMD_int8x16_add(
+define void @add_bytes(i8* noalias %a, i8* noalias %b, i32 %n) {
+entry:
+  %cmp = icmp sgt i32 %n, 0
+  br i1 %cmp, label %loop, label %exit
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %pa = getelementptr inbounds i8* %a, i32 %i
+  %va = load i8* %pa, align 1
+  %pb = getelementptr inbounds i8* %b, i32 %i
+  %vb = load i8* %pb, align 1
+  %s = add i8 %va, %vb
+  store i8 %s, i8* %pa, align 1
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+exit:
+  ret void
+}
+
+; CHECK-LABEL: @scale_doubles(
+; CHECK: fmul <2 x double>
+; JS: function _scale_doubles(
+; JS: SIMD_float64x2_mul(
+define void @scale_doubles(double* noalias %a, double %s, i32 %n) {
+entry:
+  %cmp = icmp sgt i32 %n, 0
+  br i1 %cmp, label %loop, label %exit
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %pa = getelementptr inbounds double* %a, i32 %i
+  %va = load double* %pa, align 8
+  %m = fmul double %va, %s
+  store double %m, double* %pa, align 8
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+exit:
+  ret void
+}
+
+; Vectors of i1 can't be zero-extended, so this stays scalar.
+; CHECK-LABEL: @count_positive(
+; CHECK-NOT: x i1>
+; CHECK: ret void
+define void @count_positive(float* noalias %a, i32* noalias %b, i32 %n) {
+entry:
+  %cmp = icmp sgt i32 %n, 0
+  br i1 %cmp, label %loop, label %exit
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %pa = getelementptr inbounds float* %a, i32 %i
+  %va = load float* %pa, align 4
+  %c = fcmp ogt float %va, 0.0
+  %z = zext i1 %c to i32
+  %pb = getelementptr inbounds i32* %b, i32 %i
+  store i32 %z, i32* %pb, align 4
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+exit:
+  ret void
+}
+
+; There are no SIMD.js versions of the math intrinsics.
+; CHECK-LABEL: @roots(
+; CHECK-NOT: @llvm.sqrt.v
+; CHECK: ret void
+define void @roots(float* noalias %a, i32 %n) {
+entry:
+  %cmp = icmp sgt i32 %n, 0
+  br i1 %cmp, label %loop, label %exit
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %pa = getelementptr inbounds float* %a, i32 %i
+  %va = load float* %pa, align 4
+  %r = call float @llvm.sqrt.f32(float %va)
+  store float %r, float* %pa, align 4
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+exit:
+  ret void
+}
+
+; <2 x i32> is a partial int32x4, and converts directly to float64x2.
+; CHECK-LABEL: @widen(
+; CHECK: sitofp <2 x i32> {{.*}} to <2 x double>
+; JS: function _widen(
+; JS: SIMD_int32x4_loadXY(HEAPU8,
+; JS: SIMD_float64x2_fromInt32x4(
+define void @widen(i32* noalias %a, double* noalias %b, i32 %n) {
+entry:
+  %cmp = icmp sgt i32 %n, 0
+  br i1 %cmp, label %loop, label %exit
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %pa = getelementptr inbounds i32* %a, i32 %i
+  %va = load i32* %pa, align 4
+  %d = sitofp i32 %va to double
+  %pb = getelementptr inbounds double* %b, i32 %i
+  store double %d, double* %pb, align 8
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+exit:
+  ret void
+}
+
+; CHECK-LABEL: @sum(
+; CHECK: fadd <4 x float>
+; JS: function _sum(
+; JS: SIMD_float32x4_add(
+define float @sum(float* noalias %a, i32 %n) {
+entry:
+  %cmp = icmp sgt i32 %n, 0
+  br i1 %cmp, label %loop, label %exit
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi float [ 0.0, %entry ], [ %acc.next, %loop ]
+  %pa = getelementptr inbounds float* %a, i32 %i
+  %va = load float* %pa, align 4
+  %acc.next = fadd fast float %acc, %va
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+exit:
+  %r = phi float [ 0.0, %entry ], [ %acc.next, %loop ]
+  ret float %r
+}
+
+declare float @llvm.sqrt.f32(float)
@@ -0,0 +1,75 @@
+; RUN: opt %s -loweremasyncify -emscripten-asyncify-functions=emscripten_sleep -S | FileCheck %s
+
+; Only what is live across an async call is saved in its context. Casts and
+; GEPs of saved values are recomputed instead, the async calls in a function
+; share one context struct whose slots are reused, and a call whose result is
+; just returned needs no context at all.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+declare void @emscripten_sleep(i32)
+declare void @use_ptr(i8*, i32*, [4 x i32]*)
+
+; CHECK-LABEL: define void @remat(
+; CHECK: call i32* @emscripten_alloc_async_context(i32 12)
+; CHECK: SaveAsyncCtx:
+; CHECK: bitcast i32* %AsyncCtx to { void (i32*)*, i32, [4 x i32]* }*
+; CHECK-NOT: %p
+; CHECK-NOT: %q
+; CHECK: call void @emscripten_do_not_unwind()
+define void @remat(i32 %n) {
+  %arr = alloca [4 x i32]
+  %p = getelementptr [4 x i32]* %arr, i32 0, i32 1
+  %q = bitcast [4 x i32]* %arr to i8*
+  call void @emscripten_sleep(i32 %n)
+  store i32 %n, i32* %p
+  call void @use_ptr(i8* %q, i32* %p, [4 x i32]* %arr)
+  ret void
+}
+
+; %s takes the slot of %a, and the second call only allocates up to it.
+; CHECK-LABEL: define i32 @shared(
+; CHECK: call i32* @emscripten_alloc_async_context(i32 12)
+; CHECK: bitcast i32* %{{.*}} to { void (i32*)*, i32, i32 }*
+; CHECK: getelementptr { void (i32*)*, i32, i32 }* %{{.*}}, i32 0, i32 1
+; CHECK-NEXT: store i32 %a
+; CHECK: getelementptr { void (i32*)*, i32, i32 }* %{{.*}}, i32 0, i32 2
+; CHECK-NEXT: store i32 %b
+; CHECK: call i32* @emscripten_alloc_async_context(i32 8)
+; CHECK: bitcast i32* %{{.*}} to { void (i32*)*, i32, i32 }*
+; CHECK: getelementptr { void (i32*)*, i32, i32 }* %{{.*}}, i32 0, i32 1
+; CHECK-NEXT: store i32 %s
+define i32 @shared(i32 %a, i32 %b) {
+  call void @emscripten_sleep(i32 1)
+  %s = add i32 %a, %b
+  call void @emscripten_sleep(i32 2)
+  %t = mul i32 %s, 3
+  ret i32 %t
+}
+
+define i32 @get(i32 %x) {
+  call void @emscripten_sleep(i32 %x)
+  ret i32 %x
+}
+
+; CHECK-LABEL: define i32 @tail(
+; CHECK-NOT: async_context
+; CHECK: %r = call i32 @get(i32 %y)
+; CHECK-NEXT: %IsAsync = call i1 @emscripten_check_async()
+; CHECK-NEXT: br i1 %IsAsync, label %AsyncReturn, label %.split
+; CHECK: AsyncReturn:
+; CHECK-NEXT: call void @emscripten_do_not_unwind()
+; CHECK-NEXT: ret i32 0
+; CHECK-NOT: async_context
+; CHECK: ret i32 %r
+define i32 @tail(i32 %x) {
+  %y = add i32 %x, 1
+  %r = call i32 @get(i32 %y)
+  ret i32 %r
+}
+
+; CHECK-LABEL: define void @remat__async_cb(
+; CHECK: %[[ARR:.*]] = load [4 x i32]**
+; CHECK-NEXT: %p = getelementptr [4 x i32]* %[[ARR]], i32 0, i32 1
+; CHECK-NEXT: %q = bitcast [4 x i32]* %[[ARR]] to i8*
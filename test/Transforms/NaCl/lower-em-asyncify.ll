@@ -0,0 +1,97 @@
+; RUN: opt %s -loweremasyncify -emscripten-asyncify-functions=emscripten_sleep -emscripten-asyncify-report -S 2>%t | FileCheck %s
+; RUN: FileCheck %s -check-prefix=REPORT < %t
+; RUN: opt %s -loweremasyncify -emscripten-asyncify-functions=emscripten_sleep -emscripten-asyncify-points-to -S | FileCheck %s -check-prefix=POINTSTO
+
+; A call through a function pointer is only async if an async function of its
+; signature has its address taken, or if we can't tell its signature. With -emscripten-asyncify-points-to, a
+; pointer loaded from a constant table can only be what is in the table.
+
+; REPORT-DAG: asyncify: emscripten_sleep is async because it is listed
+; REPORT-DAG: asyncify: wait is async because it calls emscripten_sleep
+; REPORT-DAG: asyncify: calls_wait is async because it calls wait
+; REPORT-DAG: asyncify: calls_callback is async because it calls wait through a pointer of signature vi
+; REPORT-DAG: asyncify: calls_handler is async because it calls wait through a pointer of signature vi
+; REPORT-DAG: asyncify: calls_pair is async because it calls through a pointer of unknown signature
+; REPORT-NOT: calls_math
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+declare void @emscripten_sleep(i32)
+
+@callbacks = global [2 x void (i32)*] [void (i32)* @wait, void (i32)* @log]
+@handlers = constant [2 x void (i32)*] [void (i32)* @log, void (i32)* @count]
+@math = global double (double)* @half
+
+@counter = global i32 0
+
+; CHECK-LABEL: define void @wait(
+; CHECK: @emscripten_check_async
+define void @wait(i32 %ms) {
+  call void @emscripten_sleep(i32 %ms)
+  ret void
+}
+
+; CHECK-LABEL: define void @log(
+; CHECK-NOT: @emscripten_check_async
+define void @log(i32 %x) {
+  store i32 %x, i32* @counter
+  ret void
+}
+
+define void @count(i32 %x) {
+  %c = load i32* @counter
+  %d = add i32 %c, %x
+  store i32 %d, i32* @counter
+  ret void
+}
+
+define double @half(double %x) {
+  %y = fmul double %x, 5.000000e-01
+  ret double %y
+}
+
+; CHECK-LABEL: define void @calls_wait(
+; CHECK: @emscripten_check_async
+define void @calls_wait(i32 %x) {
+  call void @wait(i32 %x)
+  ret void
+}
+
+; CHECK-LABEL: define void @calls_callback(
+; CHECK: @emscripten_check_async
+; POINTSTO-LABEL: define void @calls_callback(
+; POINTSTO: @emscripten_check_async
+define void @calls_callback(void (i32)* %f, i32 %x) {
+  call void %f(i32 %x)
+  ret void
+}
+
+; No async function takes a double.
+; CHECK-LABEL: define double @calls_math(
+; CHECK-NOT: @emscripten_check_async
+define double @calls_math(double (double)* %f, double %x) {
+  %y = call double %f(double %x)
+  ret double %y
+}
+
+; CHECK-LABEL: define void @calls_handler(
+; CHECK: @emscripten_check_async
+; POINTSTO-LABEL: define void @calls_handler(
+; POINTSTO-NOT: @emscripten_check_async
+; POINTSTO: ret void
+define void @calls_handler(i32 %i, i32 %x) {
+  %p = getelementptr [2 x void (i32)*]* @handlers, i32 0, i32 %i
+  %f = load void (i32)** %p
+  call void %f(i32 %x)
+  ret void
+}
+
+; The table of a function returning a struct is unknown.
+; CHECK-LABEL: define i32 @calls_pair(
+; CHECK: @emscripten_check_async
+define i32 @calls_pair({ i32, i32 } ()* %f) {
+  %p = call { i32, i32 } %f()
+  %x = extractvalue { i32, i32 } %p, 0
+  ret i32 %x
+}
@@ -0,0 +1,132 @@
+; RUN: opt %s -loweremexceptions -S | FileCheck %s
+; RUN: opt %s -loweremexceptions -emscripten-nothrow-indirect-calls -S | FileCheck %s -check-prefix=INDIRECT
+
+; Invokes of functions that cannot throw are lowered to plain calls, without
+; emscripten_preinvoke and emscripten_postinvoke around them.
+
+declare void @__cxa_throw(i8*, i8*, i8*)
+declare i8* @malloc(i32)
+declare void @external()
+declare void @external_nounwind() nounwind
+declare i32 @__gxx_personality_v0(...)
+
+@table = global [2 x i32] [i32 ptrtoint (double (double)* @half to i32), i32 ptrtoint (void (i32)* @thrower to i32)]
+
+define double @half(double %x) {
+  %y = fmul double %x, 5.000000e-01
+  ret double %y
+}
+
+define i32 @leaf(i32 %x) {
+  %y = add i32 %x, 1
+  ret i32 %y
+}
+
+define i32 @calls_leaf(i32 %x) {
+  %y = call i32 @leaf(i32 %x)
+  ret i32 %y
+}
+
+define void @thrower(i32 %x) {
+  call void @__cxa_throw(i8* null, i8* null, i8* null)
+  unreachable
+}
+
+define void @calls_thrower(i32 %x) {
+  call void @thrower(i32 %x)
+  ret void
+}
+
+; Exceptions from an invoke end up in its landing pad, so only a resume there
+; makes this throw.
+define void @catches(i32 %x) {
+  invoke void @thrower(i32 %x)
+      to label %cont unwind label %lpad
+cont:
+  ret void
+lpad:
+  %lp = landingpad { i8*, i32 } personality i32 (...)* @__gxx_personality_v0
+      catch i8* null
+  ret void
+}
+
+define void @rethrows(i32 %x) {
+  invoke void @thrower(i32 %x)
+      to label %cont unwind label %lpad
+cont:
+  ret void
+lpad:
+  %lp = landingpad { i8*, i32 } personality i32 (...)* @__gxx_personality_v0
+      cleanup
+  resume { i8*, i32 } %lp
+}
+
+; CHECK-LABEL: define void @test(
+; CHECK: %a = call i32 @calls_leaf(i32 %x)
+; CHECK-NEXT: br label %b
+; CHECK: call void @emscripten_preinvoke()
+; CHECK-NEXT: call void @calls_thrower(i32 %x)
+; CHECK: call void @catches(i32 %x)
+; CHECK-NEXT: br label %d
+; CHECK: call void @emscripten_preinvoke()
+; CHECK-NEXT: call void @rethrows(i32 %x)
+; CHECK: %m = call i8* @malloc(i32 %x)
+; CHECK-NEXT: br label %f
+; CHECK: call void @external_nounwind()
+; CHECK-NEXT: br label %g
+; CHECK: call void @emscripten_preinvoke()
+; CHECK-NEXT: call void @external()
+define void @test(i32 %x) {
+  %a = invoke i32 @calls_leaf(i32 %x)
+      to label %b unwind label %lpad
+b:
+  invoke void @calls_thrower(i32 %x)
+      to label %c unwind label %lpad
+c:
+  invoke void @catches(i32 %x)
+      to label %d unwind label %lpad
+d:
+  invoke void @rethrows(i32 %x)
+      to label %e unwind label %lpad
+e:
+  %m = invoke i8* @malloc(i32 %x)
+      to label %f unwind label %lpad
+f:
+  invoke void @external_nounwind()
+      to label %g unwind label %lpad
+g:
+  invoke void @external()
+      to label %done unwind label %lpad
+done:
+  ret void
+lpad:
+  %lp = landingpad { i8*, i32 } personality i32 (...)* @__gxx_personality_v0
+      catch i8* null
+  ret void
+}
+
+; A function pointer can only reach functions of its signature whose address
+; is taken, which for double (double) is only @half.
+; CHECK-LABEL: define void @test_indirect(
+; CHECK: call void @emscripten_preinvoke()
+; CHECK-NEXT: %a = call double %f(double %d)
+; CHECK: call void @emscripten_preinvoke()
+; CHECK-NEXT: call void %g(i32 %x)
+; INDIRECT-LABEL: define void @test_indirect(
+; INDIRECT: %a = call double %f(double %d)
+; INDIRECT-NEXT: br label %b
+; INDIRECT: call void @emscripten_preinvoke()
+; INDIRECT-NEXT: call void %g(i32 %x)
+define void @test_indirect(double (double)* %f, void (i32)* %g, double %d, i32 %x) {
+  %a = invoke double %f(double %d)
+      to label %b unwind label %lpad
+b:
+  invoke void %g(i32 %x)
+      to label %done unwind label %lpad
+done:
+  ret void
+lpad:
+  %lp = landingpad { i8*, i32 } personality i32 (...)* @__gxx_personality_v0
+      catch i8* null
+  ret void
+}
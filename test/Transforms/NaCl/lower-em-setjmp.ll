@@ -0,0 +1,118 @@
+; RUN: opt %s -loweremsetjmp -S | FileCheck %s
+; RUN: opt %s -loweremsetjmp -emscripten-nolongjmp-indirect-calls -S | FileCheck %s -check-prefix=INDIRECT
+
+; Calls in a function that calls setjmp are only checked for a longjmp if
+; they can reach one; the runtime functions that lowering setjmp and exceptions
+; call don't. The setjmp table is sized from the number of setjmps,
+; unless one of them can be called more than once.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+%struct.__jmp_buf_tag = type { [6 x i32], i32, [32 x i32] }
+
+@buf = global [1 x %struct.__jmp_buf_tag] zeroinitializer, align 16
+@counter = global i32 0
+
+declare i32 @setjmp(%struct.__jmp_buf_tag*) returns_twice
+declare void @longjmp(%struct.__jmp_buf_tag*, i32) noreturn
+declare i32 @strlen(i8*)
+declare void @external()
+declare void @emscripten_preinvoke()
+declare i32 @emscripten_postinvoke()
+declare i8* @emscripten_landingpad(...)
+declare void @emscripten_resume(...)
+
+define internal void @bump() {
+  %c = load i32* @counter
+  %d = add i32 %c, 1
+  store i32 %d, i32* @counter
+  ret void
+}
+
+define internal void @jump() {
+  call void @longjmp(%struct.__jmp_buf_tag* getelementptr inbounds ([1 x %struct.__jmp_buf_tag]* @buf, i32 0, i32 0), i32 1)
+  unreachable
+}
+
+; An invoke of bump, as lowered for exceptions
+define internal void @lowered() {
+entry:
+  call void @emscripten_preinvoke()
+  call void @bump()
+  %t = call i32 @emscripten_postinvoke()
+  %c = icmp eq i32 %t, 0
+  br i1 %c, label %ok, label %lpad
+ok:
+  ret void
+lpad:
+  %e = call i8* (...)* @emscripten_landingpad()
+  call void (...)* @emscripten_resume(i8* %e)
+  unreachable
+}
+
+define internal void @bump_then_jump() {
+  call void @bump()
+  call void @jump()
+  ret void
+}
+
+; CHECK-LABEL: define i32 @dispatch(
+; CHECK: call void @emscripten_prep_setjmp(i32 1)
+; CHECK: call i32 @emscripten_setjmp(
+; CHECK-NOT: @emscripten_postinvoke
+; CHECK: call void @bump()
+; CHECK-NEXT: call void @lowered()
+; CHECK-NEXT: %n = call i32 @strlen(i8* %s)
+; CHECK-NEXT: call void @emscripten_preinvoke()
+; CHECK-NEXT: call void @bump_then_jump()
+; CHECK-NEXT: call i32 @emscripten_postinvoke()
+; CHECK: call void @emscripten_preinvoke()
+; CHECK-NEXT: call void @external()
+; CHECK-NEXT: call i32 @emscripten_postinvoke()
+; CHECK: call void @emscripten_preinvoke()
+; CHECK-NEXT: call void %f()
+; CHECK-NEXT: call i32 @emscripten_postinvoke()
+
+; INDIRECT-LABEL: define i32 @dispatch(
+; INDIRECT: call void @bump_then_jump()
+; INDIRECT: call void @emscripten_preinvoke()
+; INDIRECT-NEXT: call void @external()
+; INDIRECT-NOT: @emscripten_preinvoke
+; INDIRECT: call void %f()
+; INDIRECT-NEXT: br label
+define i32 @dispatch(i8* %s, void ()* %f) {
+entry:
+  %r = call i32 @setjmp(%struct.__jmp_buf_tag* getelementptr inbounds ([1 x %struct.__jmp_buf_tag]* @buf, i32 0, i32 0)) returns_twice
+  %z = icmp eq i32 %r, 0
+  br i1 %z, label %body, label %done
+body:
+  call void @bump()
+  call void @lowered()
+  %n = call i32 @strlen(i8* %s)
+  call void @bump_then_jump()
+  call void @external()
+  call void %f()
+  br label %done
+done:
+  %x = phi i32 [ %r, %entry ], [ %n, %body ]
+  ret i32 %x
+}
+
+; CHECK-LABEL: define void @looped(
+; CHECK: call void @emscripten_prep_setjmp(i32 0)
+; CHECK-NOT: @emscripten_postinvoke
+; CHECK: ret void
+define void @looped(i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i1, %loop ]
+  %r = call i32 @setjmp(%struct.__jmp_buf_tag* getelementptr inbounds ([1 x %struct.__jmp_buf_tag]* @buf, i32 0, i32 0)) returns_twice
+  call void @bump()
+  %i1 = add i32 %i, 1
+  %c = icmp slt i32 %i1, %n
+  br i1 %c, label %loop, label %out
+out:
+  ret void
+}
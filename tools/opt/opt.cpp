@@ -657,6 +657,9 @@ int main(int argc, char **argv) {
   initializeStripAttributesPass(Registry);
   initializeStripMetadataPass(Registry);
   initializeExpandI64Pass(Registry);
+  initializeLowerEmExceptionsPass(Registry);
+  initializeLowerEmAsyncifyPass(Registry);
+  initializeLowerEmSetjmpPass(Registry);
   initializeNoExitRuntimePass(Registry);
   // @LOCALMOD-END
 